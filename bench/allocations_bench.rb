@@ -0,0 +1,6 @@
+require 'bench_helper'
+
+# Read twice per layer
+ScoutApm::Bench.measure("allocations/count") do
+  ScoutApm::Instruments::Allocations.count
+end
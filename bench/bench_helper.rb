@@ -0,0 +1,231 @@
+# Loaded by each benchmark file. Sets up a quiet agent and the fixed traces
+# the benchmarks run against. See bench/run.rb.
+ENV['SCOUT_LOG_LEVEL'] ||= 'error'
+ENV['SCOUT_MONITOR'] ||= 'false'
+
+require 'scout_apm'
+require 'runner'
+
+module ScoutApm
+  module Bench
+    Benchmark = Struct.new(:name, :block)
+
+    def self.benchmarks
+      @benchmarks ||= []
+    end
+
+    # Registers a benchmark. The block is one operation, and is called many
+    # times, so do setup outside of it.
+    def self.measure(name, &block)
+      benchmarks << Benchmark.new(name, block)
+    end
+
+    def self.context
+      ScoutApm::Agent.instance.context
+    end
+
+    # A context whose config is the values given, over the defaults
+    def self.context_with(values)
+      context = ScoutApm::AgentContext.new
+      context.config = ScoutApm::Config.new(context, [
+        ConfigOverlay.new(values),
+        ScoutApm::Config::ConfigDefaults.new,
+        ScoutApm::Config::ConfigNull.new,
+      ])
+      context
+    end
+
+    class ConfigOverlay
+      def initialize(values)
+        @values = values
+      end
+
+      def value(key)
+        @values[key]
+      end
+
+      def has_key?(key)
+        @values.has_key?(key)
+      end
+
+      def any_keys_found?
+        true
+      end
+
+      def name
+        "bench"
+      end
+    end
+
+    # Finished requests are left alone, instead of being recorded, for the
+    # benchmarks to run the converters on as they will.
+    class NullRecorder
+      def record!(request)
+      end
+    end
+
+    # A store that absorbs everything into a single reporting period, as the
+    # real Store does by the time periods are written out.
+    class PeriodStore < ScoutApm::FakeStore
+      attr_reader :period
+
+      def initialize(context)
+        @period = ScoutApm::StoreReportingPeriod.new(current_timestamp, context)
+      end
+
+      def track!(metrics, options = {})
+        @period.absorb_metrics!(metrics)
+      end
+
+      def track_histograms!(histograms, options = {})
+        @period.merge_histograms!(histograms)
+      end
+
+      def track_db_query_metrics!(db_query_metric_set, options = {})
+        @period.merge_db_query_metrics!(db_query_metric_set)
+      end
+
+      def track_slow_transaction!(slow_transaction)
+        @period.merge_slow_transactions!(slow_transaction) if slow_transaction
+      end
+
+      def track_job!(job)
+        @period.merge_jobs!(job) if job
+      end
+
+      def track_slow_job!(job)
+        @period.merge_slow_jobs!(job) if job
+      end
+    end
+
+    # The traces benchmarks run against. Each is a fixed shape, close to what
+    # the instruments record for a typical Rails action or background job.
+    module Fixtures
+      MODELS = %w(User Account Project Invoice Comment)
+
+      SQL = [
+        %q{SELECT "users".* FROM "users" WHERE "users"."id" = $1 LIMIT 1},
+        %q{SELECT "accounts".* FROM "accounts" WHERE "accounts"."id" IN (1, 2, 3, 4, 5) AND "accounts"."state" = 'active'},
+        %q{SELECT COUNT(*) FROM "projects" WHERE "projects"."account_id" = 44 AND (created_at > '2018-01-01 00:00:00')},
+        %q{SELECT "invoices".* FROM "invoices" INNER JOIN "accounts" ON "accounts"."id" = "invoices"."account_id" WHERE "accounts"."name" = 'Acme, Inc.' ORDER BY "invoices"."created_at" DESC LIMIT 25 OFFSET 50},
+        %q{UPDATE "comments" SET "body" = 'Looks good to me', "updated_at" = '2018-03-01 10:11:12.123456' WHERE "comments"."id" = 991},
+      ]
+
+      # A web request: Controller/users/index with 12 queries (an N+1 among
+      # them), a layout with partials that query, and an outgoing HTTP call.
+      def self.web_request(context = Bench.context, endpoint = "users/index", store = ScoutApm::FakeStore.new)
+        req = ScoutApm::TrackedRequest.new(context, store)
+        req.annotate_request(:uri => "/#{endpoint}")
+        req.set_headers("X-Request-Start" => "t=#{(Time.now.to_f * 1000).to_i - 5}")
+
+        layer(req, "Controller", endpoint) do
+          4.times { |i| query(req, i) }
+          6.times { query(req, 0) }
+          layer(req, "View", "users/index") do
+            layer(req, "View", "users/_row") { query(req, 1) }
+            layer(req, "View", "users/_sidebar") { query(req, 2) }
+          end
+          layer(req, "HTTP", "GET") { |l| l.desc = "api.example.com/v1/status" }
+        end
+        req
+      end
+
+      # A background job: Queue/default, Job/InvoiceMailer, with a few queries
+      # and a view.
+      def self.job_request(context = Bench.context, store = ScoutApm::FakeStore.new)
+        req = ScoutApm::TrackedRequest.new(context, store)
+        req.annotate_request(:queue_latency => 2.5)
+
+        layer(req, "Queue", "default") do
+          layer(req, "Job", "InvoiceMailer") do
+            3.times { |i| query(req, i + 1) }
+            layer(req, "View", "invoice_mailer/invoice") { query(req, 3) }
+          end
+        end
+        req
+      end
+
+      # A finished web request, and job, for the converters to run on again
+      # and again.
+      def self.finished_web_request
+        @finished_web_request ||= web_request
+      end
+
+      def self.finished_job_request
+        @finished_job_request ||= job_request
+      end
+
+      # A reporting period with the metrics, traces and histograms of 200
+      # requests to 20 endpoints and 20 jobs, as they'd be reported.
+      def self.period
+        @period ||= begin
+          store = PeriodStore.new(Bench.context)
+          200.times { |i| record(web_request(Bench.context, "users/action_#{i % 20}"), store) }
+          20.times { record(job_request, store) }
+          store.period
+        end
+      end
+
+      def self.payload
+        {
+          :metadata => {
+            :app_root => "/srv/app",
+            :unique_id => "bench",
+            :agent_version => ScoutApm::VERSION,
+            :agent_time => period.timestamp.to_s,
+            :agent_pid => 1,
+            :platform => "ruby",
+          },
+          :metrics => period.metrics_payload,
+          :slow_transactions => period.slow_transactions_payload,
+          :jobs => period.jobs,
+          :slow_jobs => period.slow_jobs_payload,
+          :histograms => period.histograms,
+          :db_query_metrics => period.db_query_metrics_payload,
+        }
+      end
+
+      # Runs every converter on the request, as TrackedRequest#record! does.
+      def self.record(req, store)
+        walker = ScoutApm::LayerConverters::DepthFirstWalker.new(req.root_layer)
+        converters = CONVERTERS.map { |klass| converter(klass, req, store).tap { |c| c.register_hooks(walker) } }
+        walker.walk
+        converters.each(&:record!)
+      end
+
+      def self.converter(klass, req, store = ScoutApm::FakeStore.new)
+        klass.new(Bench.context, req, req.layer_finder, store)
+      end
+
+      CONVERTERS = [
+        ScoutApm::LayerConverters::Histograms,
+        ScoutApm::LayerConverters::MetricConverter,
+        ScoutApm::LayerConverters::ErrorConverter,
+        ScoutApm::LayerConverters::AllocationMetricConverter,
+        ScoutApm::LayerConverters::RequestQueueTimeConverter,
+        ScoutApm::LayerConverters::JobConverter,
+        ScoutApm::LayerConverters::DatabaseConverter,
+        ScoutApm::LayerConverters::SlowJobConverter,
+        ScoutApm::LayerConverters::SlowRequestConverter,
+      ]
+
+      def self.layer(req, type, name)
+        l = ScoutApm::Layer.new(type, name)
+        req.start_layer(l)
+        yield l if block_given?
+      ensure
+        req.stop_layer
+      end
+
+      def self.query(req, i)
+        sql = SQL[i % SQL.length]
+        l = ScoutApm::Layer.new("ActiveRecord", ScoutApm::Utils::ActiveRecordMetricName.new(sql, "#{MODELS[i % MODELS.length]} Load"))
+        l.desc = ScoutApm::SqlList.new(sql)
+        req.start_layer(l)
+        req.stop_layer
+      end
+    end
+  end
+end
+
+ScoutApm::Bench.context.recorder = ScoutApm::Bench::NullRecorder.new
@@ -0,0 +1,22 @@
+require 'bench_helper'
+
+# Response times in seconds, skewed the way they are in practice.
+values = (0...1000).map { |i| (Math.exp((i * 7919 % 1000) / 200.0) - 1) / 50.0 }
+
+[ScoutApm::NumericHistogram, ScoutApm::NativeNumericHistogram].each do |klass|
+  name = klass.name.split("::").last
+
+  # Adds past max_bins, so most adds merge the closest bins (a trim)
+  histogram = klass.new(50)
+  i = 0
+  ScoutApm::Bench.measure("histogram/#{name}#add") do
+    histogram.add(values[i % values.length])
+    i += 1
+  end
+
+  full = klass.new(50)
+  values.each { |v| full.add(v) }
+  ScoutApm::Bench.measure("histogram/#{name}#quantile") do
+    full.quantile(95)
+  end
+end
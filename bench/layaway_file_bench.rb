@@ -0,0 +1,22 @@
+require 'bench_helper'
+require 'tmpdir'
+
+dir = Dir.mktmpdir("scout_apm_bench")
+at_exit { FileUtils.rm_rf(dir) }
+
+period = ScoutApm::Bench::Fixtures.period
+
+# One minute's period of 200 requests & 20 jobs, in each format
+%w(marshal binary).each do |format|
+  context = ScoutApm::Bench.context_with('layaway_format' => format)
+  file = ScoutApm::LayawayFile.new(context, File.join(dir, "period_#{format}"))
+  file.write(period)
+
+  ScoutApm::Bench.measure("layaway_file/write (#{format})") do
+    file.write(period)
+  end
+
+  ScoutApm::Bench.measure("layaway_file/load (#{format})") do
+    file.load
+  end
+end
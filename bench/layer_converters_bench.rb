@@ -0,0 +1,23 @@
+require 'bench_helper'
+
+# Each converter, walking a finished request and recording into a store that
+# throws the results away.
+ScoutApm::Bench::Fixtures::CONVERTERS.each do |klass|
+  name = klass.name.split("::").last
+  req = [ScoutApm::LayerConverters::JobConverter, ScoutApm::LayerConverters::SlowJobConverter].include?(klass) ?
+    ScoutApm::Bench::Fixtures.finished_job_request :
+    ScoutApm::Bench::Fixtures.finished_web_request
+
+  ScoutApm::Bench.measure("layer_converters/#{name}") do
+    walker = ScoutApm::LayerConverters::DepthFirstWalker.new(req.root_layer)
+    converter = ScoutApm::Bench::Fixtures.converter(klass, req)
+    converter.register_hooks(walker)
+    walker.walk
+    converter.record!
+  end
+end
+
+# All of them together, as TrackedRequest#record! runs them
+ScoutApm::Bench.measure("layer_converters/all (web request)") do
+  ScoutApm::Bench::Fixtures.record(ScoutApm::Bench::Fixtures.finished_web_request, ScoutApm::FakeStore.new)
+end
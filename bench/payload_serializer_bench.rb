@@ -0,0 +1,9 @@
+require 'bench_helper'
+
+payload = ScoutApm::Bench::Fixtures.payload
+args = payload.values_at(:metadata, :metrics, :slow_transactions, :jobs, :slow_jobs, :histograms, :db_query_metrics)
+
+# One minute's payload of 200 requests & 20 jobs
+ScoutApm::Bench.measure("payload_serializer/serialize") do
+  ScoutApm::Serializers::PayloadSerializerToJson.serialize(*args)
+end
@@ -0,0 +1,30 @@
+# Runs the benchmarks in bench/*_bench.rb. Use `rake bench`, which builds the
+# extensions first.
+#
+#   BENCH=pattern         only runs benchmarks whose names match
+#   BENCH_TIME=0.2        seconds per round
+#   BENCH_OUTPUT=path     where to write the JSON results (bench/results.json)
+#   BENCH_BASELINE=path   results to compare against (bench/baseline.json)
+#   BENCH_TOLERANCE=25    percent slower than the baseline that fails the run
+#
+# With --save-baseline, the results are written to the baseline instead.
+# Keep one from the last release to compare a change against:
+#
+#   git checkout v2.4.5 && rake bench:baseline && git checkout - && rake bench
+$LOAD_PATH.unshift(File.dirname(__FILE__))
+
+require 'bench_helper'
+
+Dir[File.expand_path("../*_bench.rb", __FILE__)].sort.each { |file| require file }
+
+baseline = ENV['BENCH_BASELINE'] || File.join(File.dirname(__FILE__), "baseline.json")
+save_baseline = ARGV.include?("--save-baseline")
+
+runner = ScoutApm::Bench::Runner.new(ScoutApm::Bench.benchmarks,
+  :filter => ENV['BENCH'] && Regexp.new(ENV['BENCH']),
+  :time => Float(ENV['BENCH_TIME'] || ScoutApm::Bench::Runner::DEFAULTS[:time]),
+  :output => save_baseline ? baseline : (ENV['BENCH_OUTPUT'] || File.join(File.dirname(__FILE__), "results.json")),
+  :baseline => save_baseline ? nil : baseline,
+  :tolerance => Float(ENV['BENCH_TOLERANCE'] || 25) / 100)
+
+exit(runner.run ? 0 : 1)
@@ -0,0 +1,175 @@
+require 'json'
+
+# Times each benchmark, reports it, and compares it against a baseline.
+#
+# A benchmark's block is one operation. It's run for a short warmup, which
+# also sizes the rounds so each takes about :time seconds, then for :rounds
+# rounds. The median round gives ns/op, less the cost of the loop calling the
+# block. Allocations are counted over the fastest round.
+#
+# Results are written as JSON to :output. Given a :baseline file written the
+# same way, each result is compared against it, and the run fails if a
+# benchmark got more than :tolerance slower, or allocates more per op.
+module ScoutApm
+  module Bench
+    class Runner
+      DEFAULTS = {
+        :filter => nil,
+        :time => 0.2,
+        :rounds => 5,
+        :output => nil,
+        :baseline => nil,
+        :tolerance => 0.25,
+      }
+
+      # How many more objects per op than the baseline to allow. Allocations
+      # are deterministic, but rounded counts can be a hair over.
+      ALLOCATION_SLACK = 0.05
+
+      Result = Struct.new(:name, :ns_per_op, :allocations_per_op, :iterations) do
+        def ops_per_sec
+          ns_per_op > 0 ? 1_000_000_000.0 / ns_per_op : nil
+        end
+
+        def to_h
+          {
+            "name" => name,
+            "ns_per_op" => ns_per_op.round(1),
+            "allocations_per_op" => allocations_per_op.round(2),
+            "ops_per_sec" => ops_per_sec && ops_per_sec.round,
+            "iterations" => iterations,
+          }
+        end
+      end
+
+      attr_reader :options
+      attr_reader :results
+      attr_reader :regressions
+
+      def initialize(benchmarks, options = {})
+        @options = DEFAULTS.merge(options)
+        @benchmarks = benchmarks.select { |b| @options[:filter].nil? || b.name =~ @options[:filter] }
+        @results = []
+        @regressions = []
+      end
+
+      # Runs every benchmark. Returns false if any regressed against the
+      # baseline.
+      def run(out = $stdout)
+        baseline = load_baseline
+        @loop_cost = loop_cost
+
+        out.puts header
+        @benchmarks.each do |benchmark|
+          result = measure(benchmark)
+          @results << result
+          out.puts row(result, baseline[result.name])
+        end
+
+        write_results if options[:output]
+        report_regressions(out)
+        regressions.empty?
+      end
+
+      private
+
+      def measure(benchmark)
+        block = benchmark.block
+        iterations = warmup(block)
+
+        rounds = Array.new(options[:rounds]) do
+          GC.start
+          allocated = GC.stat(:total_allocated_objects)
+          started = now
+          iterations.times { block.call }
+          elapsed = now - started
+          [elapsed, GC.stat(:total_allocated_objects) - allocated]
+        end
+
+        times = rounds.map(&:first).sort
+        median = times[times.length / 2]
+        ns = [(median * 1_000_000_000.0 / iterations) - @loop_cost, 0.0].max
+        allocations = rounds.min_by(&:first).last.to_f / iterations
+
+        Result.new(benchmark.name, ns, allocations, iterations)
+      end
+
+      # Runs the block for a tenth of the round time, and returns how many
+      # iterations a round should take.
+      def warmup(block)
+        count = 0
+        started = now
+        budget = options[:time] / 10.0
+        while now - started < budget
+          block.call
+          count += 1
+        end
+        per_op = (now - started) / count
+        [(options[:time] / per_op).ceil, 1].max
+      end
+
+      def loop_cost
+        block = lambda {}
+        iterations = 1_000_000
+        started = now
+        iterations.times { block.call }
+        (now - started) * 1_000_000_000.0 / iterations
+      end
+
+      def now
+        Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      end
+
+      def header
+        format("%-48s %12s %12s %14s  %s", "benchmark", "ns/op", "allocs/op", "ops/sec", "vs baseline")
+      end
+
+      def row(result, base)
+        format("%-48s %12.1f %12.2f %14s  %s",
+               result.name, result.ns_per_op, result.allocations_per_op,
+               result.ops_per_sec ? result.ops_per_sec.round : "-",
+               compare(result, base))
+      end
+
+      def compare(result, base)
+        return "" unless base
+
+        change = base["ns_per_op"] > 0 ? (result.ns_per_op / base["ns_per_op"]) - 1 : 0.0
+        slower = change > options[:tolerance]
+        more_allocations = result.allocations_per_op > base["allocations_per_op"] + ALLOCATION_SLACK
+        @regressions << result.name if slower || more_allocations
+
+        notes = [format("%+.1f%%", change * 100)]
+        notes << "SLOWER" if slower
+        notes << format("ALLOCATES MORE (was %.2f)", base["allocations_per_op"]) if more_allocations
+        notes.join(" ")
+      end
+
+      def load_baseline
+        path = options[:baseline]
+        return {} unless path && File.exist?(path)
+
+        JSON.parse(File.read(path))["results"].each_with_object({}) { |r, h| h[r["name"]] = r }
+      end
+
+      def write_results
+        File.open(options[:output], "w") do |f|
+          f.write(JSON.pretty_generate(
+            "ruby" => RUBY_DESCRIPTION,
+            "agent_version" => ScoutApm::VERSION,
+            "time" => Time.now.utc.iso8601,
+            "results" => results.map(&:to_h),
+          ))
+        end
+      end
+
+      def report_regressions(out)
+        return if regressions.empty?
+
+        out.puts
+        out.puts "#{regressions.length} benchmark(s) regressed beyond #{(options[:tolerance] * 100).round}% " \
+          "or allocate more than the baseline: #{regressions.join(', ')}"
+      end
+    end
+  end
+end
@@ -0,0 +1,30 @@
+require 'bench_helper'
+
+sqls = ScoutApm::Bench::Fixtures::SQL
+sql_cache = ScoutApm::Bench.context.sql_cache
+
+[:postgres, :mysql].each do |engine|
+  i = 0
+  # As the agent runs it: the same statements over and over, mostly cached
+  ScoutApm::Bench.measure("sql_sanitizer/to_s (#{engine})") do
+    sanitizer = ScoutApm::Utils::SqlSanitizer.new(sqls[i % sqls.length])
+    sanitizer.database_engine = engine
+    sanitizer.to_s
+    i += 1
+  end
+
+  j = 0
+  ScoutApm::Bench.measure("sql_sanitizer/to_s uncached (#{engine})") do
+    sql_cache.clear
+    sanitizer = ScoutApm::Utils::SqlSanitizer.new(sqls[j % sqls.length])
+    sanitizer.database_engine = engine
+    sanitizer.to_s
+    j += 1
+  end
+end
+
+k = 0
+ScoutApm::Bench.measure("sql_sanitizer/ActiveRecordMetricName#to_s") do
+  ScoutApm::Utils::ActiveRecordMetricName.new(sqls[k % sqls.length], "User Load").to_s
+  k += 1
+end
@@ -0,0 +1,10 @@
+require 'bench_helper'
+
+# A whole web request's worth of start_layer & stop_layer, 16 layers.
+ScoutApm::Bench.measure("tracked_request/start_stop_layer (web request)") do
+  ScoutApm::Bench::Fixtures.web_request
+end
+
+ScoutApm::Bench.measure("tracked_request/start_stop_layer (job)") do
+  ScoutApm::Bench::Fixtures.job_request
+end
@@ -7,47 +7,664 @@
 VALUE mScoutApm;
 VALUE mInstruments;
 VALUE cAllocations;
+VALUE cGarbageCollection;
 
 #if defined(RUBY_INTERNAL_EVENT_NEWOBJ) && !defined(_WIN32)
 
 #include <sys/resource.h> // is this needed?
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <ruby/debug.h>
 
-static __thread uint64_t endpoint_allocations;
-void increment_allocations() {
-  endpoint_allocations++;
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_ADD(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_CLAIM(ptr) __atomic_compare_exchange_n((ptr), &(int){0}, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#else
+#define ATOMIC_LOAD(ptr) (*(volatile __typeof__(*(ptr)) *)(ptr))
+#define ATOMIC_STORE(ptr, val) (*(volatile __typeof__(*(ptr)) *)(ptr) = (val))
+#define ATOMIC_ADD(ptr, val) (*(volatile __typeof__(*(ptr)) *)(ptr) += (val))
+#define ATOMIC_LOAD_ACQUIRE(ptr) ATOMIC_LOAD(ptr)
+#define ATOMIC_STORE_RELEASE(ptr, val) ATOMIC_STORE(ptr, val)
+#define ATOMIC_CLAIM(ptr) (*(ptr) == 0 ? (*(ptr) = 1) : 0)
+#endif
+
+// Each thread counts its allocations in its own slot. A slot is only ever
+// written by the thread that owns it, and is padded out to a full cache line
+// so request threads never share a line with each other. Any thread may read
+// every slot without taking a lock, which is how the process total is built.
+//
+// Slots are handed out in chunks that are never freed, so a reader walking the
+// registry can never touch released memory. A slot is claimed the first time
+// its thread allocates, and given back when the native thread exits (or when a
+// cached native thread starts running a different Ruby Thread).
+#define CACHE_LINE_SIZE 64
+#define SLOTS_PER_CHUNK 64
+#define MAX_CHUNKS 256
+
+// Optional allocation site attribution. Each thread aggregates its sampled
+// allocations by (path, line, class) into a fixed-size open addressing table.
+// Sites that don't fit are only counted as dropped. An entry is empty while
+// its count is 0.
+#define SITE_TABLE_SIZE 1024 // Must be a power of 2
+#define SITE_TABLE_PROBES 16
+
+typedef struct {
+  VALUE path;
+  VALUE klass;
+  int line;
+  uint64_t count;
+} allocation_site_t;
+
+typedef struct {
+  allocation_site_t entries[SITE_TABLE_SIZE];
+  uint64_t dropped;
+} site_table_t;
+
+typedef struct {
+  uint64_t count;
+  VALUE thread;
+  int in_use;
+  site_table_t *sites;
+} allocation_counter_t;
+
+typedef union {
+  allocation_counter_t counter;
+  char padding[CACHE_LINE_SIZE];
+} allocation_slot_t;
+
+static allocation_slot_t *slot_chunks[MAX_CHUNKS];
+static int chunk_count;
+static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocations made by threads that have since given their slot back
+static uint64_t retired_allocations;
+
+// Shared by every thread past the last chunk. Counts are approximate there.
+static allocation_slot_t overflow_slot;
+
+static pthread_key_t slot_key;
+static __thread allocation_slot_t *current_slot;
+
+// Hidden object whose mark function marks the Threads named by the slots
+static VALUE slot_registry;
+
+static allocation_slot_t *
+add_chunk(void)
+{
+  allocation_slot_t *chunk = NULL;
+  int i;
+
+  if (chunk_count >= MAX_CHUNKS) {
+    return NULL;
+  }
+  if (posix_memalign((void **)&chunk, CACHE_LINE_SIZE, SLOTS_PER_CHUNK * sizeof(allocation_slot_t)) != 0) {
+    return NULL;
+  }
+  memset(chunk, 0, SLOTS_PER_CHUNK * sizeof(allocation_slot_t));
+  for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+    chunk[i].counter.thread = Qnil;
+  }
+
+  slot_chunks[chunk_count] = chunk;
+  ATOMIC_STORE_RELEASE(&chunk_count, chunk_count + 1);
+  return chunk;
+}
+
+static allocation_slot_t *
+find_free_slot(void)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  int c, i;
+
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      allocation_slot_t *slot = &slot_chunks[c][i];
+      if (!ATOMIC_LOAD(&slot->counter.in_use) && ATOMIC_CLAIM(&slot->counter.in_use)) {
+        return slot;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Folds a slot's counts into the retired totals, and empties it.
+static void
+retire_slot_count(allocation_slot_t *slot)
+{
+  uint64_t count = ATOMIC_LOAD(&slot->counter.count);
+
+  ATOMIC_STORE(&slot->counter.count, 0);
+  ATOMIC_ADD(&retired_allocations, count);
+}
+
+static void
+release_slot(allocation_slot_t *slot)
+{
+  if (slot == NULL || slot == &overflow_slot) {
+    return;
+  }
+  retire_slot_count(slot);
+  ATOMIC_STORE(&slot->counter.thread, Qnil);
+  ATOMIC_STORE_RELEASE(&slot->counter.in_use, 0);
+}
+
+// pthread key destructor: runs as the native thread exits
+static void
+release_thread_slot(void *slot)
+{
+  release_slot((allocation_slot_t *)slot);
+}
+
+// Only the forking thread survives in the child. Give back every other slot.
+static void
+release_slots_after_fork(void)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  int c, i;
+
+  pthread_mutex_init(&chunk_mutex, NULL);
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      allocation_slot_t *slot = &slot_chunks[c][i];
+      if (slot != current_slot && ATOMIC_LOAD(&slot->counter.in_use)) {
+        release_slot(slot);
+      }
+    }
+  }
+}
+
+static void
+reset_sites(allocation_slot_t *slot)
+{
+  if (slot->counter.sites) {
+    memset(slot->counter.sites, 0, sizeof(site_table_t));
+  }
+}
+
+// Called from inside the NEWOBJ hook, where no Ruby objects may be allocated.
+// Only plain malloc is used here.
+static allocation_slot_t *
+claim_slot(VALUE thread)
+{
+  allocation_slot_t *slot = current_slot;
+
+  if (slot != NULL) {
+    // This native thread was reused for a new Ruby Thread. Start over.
+    retire_slot_count(slot);
+    reset_sites(slot);
+    ATOMIC_STORE(&slot->counter.thread, thread);
+    return slot;
+  }
+
+  slot = find_free_slot();
+  if (slot == NULL) {
+    pthread_mutex_lock(&chunk_mutex);
+    slot = find_free_slot();
+    if (slot == NULL) {
+      allocation_slot_t *chunk = add_chunk();
+      if (chunk) {
+        slot = &chunk[0];
+        ATOMIC_STORE(&slot->counter.in_use, 1);
+      }
+    }
+    pthread_mutex_unlock(&chunk_mutex);
+  }
+
+  if (slot == NULL) {
+    slot = &overflow_slot;
+  } else {
+    reset_sites(slot);
+    ATOMIC_STORE(&slot->counter.thread, thread);
+    pthread_setspecific(slot_key, slot);
+  }
+
+  current_slot = slot;
+  return slot;
+}
+
+// The current thread's slot, or NULL if it hasn't claimed one yet
+static allocation_slot_t *
+owned_slot(void)
+{
+  allocation_slot_t *slot = current_slot;
+
+  if (slot == NULL || (slot != &overflow_slot && slot->counter.thread != rb_thread_current())) {
+    return NULL;
+  }
+  return slot;
+}
+
+// The current thread's slot, claimed if needed. Safe to call from the hooks.
+static allocation_slot_t *
+thread_slot(void)
+{
+  allocation_slot_t *slot = owned_slot();
+
+  if (slot == NULL) {
+    slot = claim_slot(rb_thread_current());
+  }
+  return slot;
+}
+
+void increment_allocations(uint64_t by) {
+  allocation_slot_t *slot = thread_slot();
+  ATOMIC_STORE(&slot->counter.count, slot->counter.count + by);
+}
+
+static VALUE
+get_allocation_count(VALUE klass) {
+  allocation_slot_t *slot = owned_slot();
+
+  if (slot == NULL) {
+    return ULL2NUM(0);
+  }
+  return ULL2NUM(slot->counter.count);
+}
+
+// The allocation count of another thread, read without stopping it.
+static VALUE
+get_allocation_count_for(VALUE klass, VALUE thread)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  int c, i;
+
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      allocation_slot_t *slot = &slot_chunks[c][i];
+      if (ATOMIC_LOAD(&slot->counter.thread) == thread) {
+        return ULL2NUM(ATOMIC_LOAD(&slot->counter.count));
+      }
+    }
+  }
+  return ULL2NUM(0);
+}
+
+// Every allocation this process has counted: live threads plus exited ones.
+// Sums the slots without locks, so a thread exiting mid-sum may be missed by
+// this one read.
+static VALUE
+get_process_total(VALUE klass)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  uint64_t total = ATOMIC_LOAD(&retired_allocations) + ATOMIC_LOAD(&overflow_slot.counter.count);
+  int c, i;
+
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      total += ATOMIC_LOAD(&slot_chunks[c][i].counter.count);
+    }
+  }
+  return ULL2NUM(total);
+}
+
+// { Thread => allocation count } for every thread currently holding a slot
+static VALUE
+get_thread_counts(VALUE klass)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  VALUE result = rb_hash_new();
+  int c, i;
+
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      allocation_slot_t *slot = &slot_chunks[c][i];
+      VALUE thread = ATOMIC_LOAD(&slot->counter.thread);
+      if (ATOMIC_LOAD(&slot->counter.in_use) && !NIL_P(thread)) {
+        rb_hash_aset(result, thread, ULL2NUM(ATOMIC_LOAD(&slot->counter.count)));
+      }
+    }
+  }
+  return result;
+}
+
+// Keeps the Threads owning a slot alive, so a slot's Thread can't be collected
+// and have its address reused by a new Thread while the slot still names it.
+// Also pins the paths and classes held in the allocation site tables.
+static void
+mark_slot_threads(void *ptr)
+{
+  int chunks = ATOMIC_LOAD_ACQUIRE(&chunk_count);
+  int c, i, e;
+
+  for (c = 0; c < chunks; c++) {
+    for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+      site_table_t *sites = slot_chunks[c][i].counter.sites;
+
+      rb_gc_mark(ATOMIC_LOAD(&slot_chunks[c][i].counter.thread));
+      if (sites == NULL) {
+        continue;
+      }
+      for (e = 0; e < SITE_TABLE_SIZE; e++) {
+        if (sites->entries[e].count > 0) {
+          rb_gc_mark(sites->entries[e].path);
+          rb_gc_mark(sites->entries[e].klass);
+        }
+      }
+    }
+  }
+}
+
+static int track_sites = 0;
+
+// Internal objects (like T_IMEMO) reuse the class field for other data, and
+// are never interesting to attribute anyway.
+static VALUE
+site_class(VALUE obj)
+{
+  switch (BUILTIN_TYPE(obj)) {
+#ifdef T_IMEMO
+    case T_IMEMO:
+#endif
+#ifdef T_NODE
+    case T_NODE:
+#endif
+    case T_ICLASS:
+      return 0;
+    default:
+      return RBASIC_CLASS(obj);
+  }
+}
+
+// From inside the NEWOBJ hook: no Ruby allocations, so the table is calloc'd.
+static void
+record_site(rb_trace_arg_t *tparg, uint64_t by)
+{
+  allocation_slot_t *slot = current_slot;
+  site_table_t *sites;
+  VALUE path, klass;
+  int line, probe;
+  uintptr_t hash;
+
+  if (slot == NULL || slot == &overflow_slot) {
+    return;
+  }
+  if (slot->counter.sites == NULL) {
+    slot->counter.sites = calloc(1, sizeof(site_table_t));
+    if (slot->counter.sites == NULL) {
+      return;
+    }
+  }
+  sites = slot->counter.sites;
+
+  path = rb_tracearg_path(tparg);
+  line = FIX2INT(rb_tracearg_lineno(tparg));
+  klass = site_class(rb_tracearg_object(tparg));
+
+  hash = ((uintptr_t)path >> 3) * 31 + (uintptr_t)line * 17 + ((uintptr_t)klass >> 3);
+  for (probe = 0; probe < SITE_TABLE_PROBES; probe++) {
+    allocation_site_t *entry = &sites->entries[(hash + probe) & (SITE_TABLE_SIZE - 1)];
+
+    if (entry->count == 0) {
+      entry->path = path;
+      entry->klass = klass;
+      entry->line = line;
+      entry->count = by;
+      return;
+    }
+    if (entry->path == path && entry->line == line && entry->klass == klass) {
+      entry->count += by;
+      return;
+    }
+  }
+  sites->dropped += by;
+}
+
+static VALUE
+get_track_sites(VALUE klass)
+{
+  return track_sites ? Qtrue : Qfalse;
+}
+
+static VALUE
+set_track_sites(VALUE klass, VALUE enabled)
+{
+  track_sites = RTEST(enabled);
+  return get_track_sites(klass);
 }
 
+// Forget the current thread's allocation sites. Called as a request starts.
 static VALUE
-get_allocation_count() {
-  return ULL2NUM(endpoint_allocations);
+reset_current_sites(VALUE klass)
+{
+  if (current_slot != NULL && current_slot != &overflow_slot) {
+    reset_sites(current_slot);
+  }
+  return Qnil;
+}
+
+static int
+compare_sites_by_count(const void *a, const void *b)
+{
+  uint64_t x = ((const allocation_site_t *)a)->count;
+  uint64_t y = ((const allocation_site_t *)b)->count;
+  return (x < y) - (x > y);
+}
+
+// The current thread's busiest allocation sites since the last reset, as
+// [[path, line, class name, count], ...], most allocations first.
+static VALUE
+get_top_sites(VALUE klass, VALUE limit_value)
+{
+  long limit = NUM2LONG(limit_value);
+  allocation_site_t *copy;
+  site_table_t *sites;
+  VALUE result;
+  long len = 0;
+  long i;
+
+  if (current_slot == NULL || current_slot == &overflow_slot || current_slot->counter.sites == NULL) {
+    return rb_ary_new();
+  }
+  sites = current_slot->counter.sites;
+
+  // Building the result allocates, which writes to the table. Work off a copy.
+  copy = malloc(sizeof(sites->entries));
+  if (copy == NULL) {
+    return rb_ary_new();
+  }
+  for (i = 0; i < SITE_TABLE_SIZE; i++) {
+    if (sites->entries[i].count > 0) {
+      copy[len++] = sites->entries[i];
+    }
+  }
+  qsort(copy, len, sizeof(allocation_site_t), compare_sites_by_count);
+
+  if (limit < len) {
+    len = limit < 0 ? 0 : limit;
+  }
+  result = rb_ary_new2(len);
+  for (i = 0; i < len; i++) {
+    VALUE real_klass = copy[i].klass ? rb_class_real(copy[i].klass) : 0;
+    VALUE klass_name = real_klass ? rb_class_name(real_klass) : Qnil;
+    VALUE site = rb_ary_new2(4);
+    rb_ary_push(site, copy[i].path);
+    rb_ary_push(site, INT2NUM(copy[i].line));
+    rb_ary_push(site, klass_name);
+    rb_ary_push(site, ULL2NUM(copy[i].count));
+    rb_ary_push(result, site);
+  }
+  free(copy);
+  return result;
+}
+
+// Sampling: only every Nth allocation on a thread does any real work, and
+// counts for all N of them. Counts move in steps of N, which is plenty for the
+// per-layer deltas. An interval of 1 counts every allocation exactly.
+static int sample_interval = 1;
+static __thread int sample_countdown;
+
+static VALUE
+get_sample_interval(VALUE klass)
+{
+    return INT2NUM(sample_interval);
+}
+
+static VALUE
+set_sample_interval(VALUE klass, VALUE interval)
+{
+    int n = NUM2INT(interval);
+    sample_interval = n < 1 ? 1 : n;
+    return INT2NUM(sample_interval);
 }
 
 static void
 tracepoint_handler(VALUE tpval, void *data)
 {
-    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    rb_trace_arg_t *tparg;
+
+    if (--sample_countdown > 0) {
+        return;
+    }
+    sample_countdown = sample_interval;
+
+    tparg = rb_tracearg_from_tracepoint(tpval);
     if (rb_tracearg_event_flag(tparg) == RUBY_INTERNAL_EVENT_NEWOBJ) {
-        increment_allocations();
+        increment_allocations(sample_interval);
+        if (track_sites) {
+            record_site(tparg, sample_interval);
+        }
     }
 }
 
+// The NEWOBJ tracepoint. Created once, then enabled and disabled as asked, so
+// the hook is never attached more than once.
+static VALUE allocation_tracepoint = Qnil;
+
 static VALUE
 set_gc_hook(rb_event_flag_t event)
 {
-    VALUE tpval;
-    // TODO - need to prevent applying the same tracepoint multiple times?
-    tpval = rb_tracepoint_new(0, event, tracepoint_handler, 0);
-    rb_tracepoint_enable(tpval);
+    if (NIL_P(allocation_tracepoint)) {
+        allocation_tracepoint = rb_tracepoint_new(0, event, tracepoint_handler, 0);
+    }
+    if (!RTEST(rb_tracepoint_enabled_p(allocation_tracepoint))) {
+        rb_tracepoint_enable(allocation_tracepoint);
+    }
+
+    return allocation_tracepoint;
+}
+
+static VALUE
+enable_allocations(VALUE klass)
+{
+    set_gc_hook(RUBY_INTERNAL_EVENT_NEWOBJ);
+    return Qtrue;
+}
+
+// While disabled, allocations cost nothing, and every thread's count stands
+// still until tracking is enabled again.
+static VALUE
+disable_allocations(VALUE klass)
+{
+    if (!NIL_P(allocation_tracepoint) && RTEST(rb_tracepoint_enabled_p(allocation_tracepoint))) {
+        rb_tracepoint_disable(allocation_tracepoint);
+    }
+    return Qfalse;
+}
+
+static VALUE
+allocations_enabled_p(VALUE klass)
+{
+    if (NIL_P(allocation_tracepoint)) {
+        return Qfalse;
+    }
+    return rb_tracepoint_enabled_p(allocation_tracepoint);
+}
+
+// GC pauses. GC_ENTER and GC_EXIT wrap every stretch of time Ruby spends in
+// the collector, including the incremental marking and lazy sweeping steps
+// run from inside later allocations. Before Ruby 2.4, a pause is timed from
+// GC_START to GC_END_MARK, which leaves out lazy sweeping.
+//
+// A pause stops every Ruby thread, not just the one that triggered it, so
+// the totals are kept for the whole process. Ruby code only ever reads them
+// between pauses, so the difference between two reads is how much of that
+// stretch of wall time was spent paused: a layer reading them as it starts
+// and stops gets the overlap of its own interval with the pauses.
+enum {
+  GC_COUNT,
+  GC_MAJOR_COUNT,
+  GC_TIME, // nanoseconds
+  GC_STATS
+};
+
+static uint64_t gc_totals[GC_STATS];
+#ifdef RUBY_INTERNAL_EVENT_GC_ENTER
+#define GC_PAUSE_BEGIN RUBY_INTERNAL_EVENT_GC_ENTER
+#define GC_PAUSE_END RUBY_INTERNAL_EVENT_GC_EXIT
+#else
+#define GC_PAUSE_BEGIN RUBY_INTERNAL_EVENT_GC_START
+#define GC_PAUSE_END RUBY_INTERNAL_EVENT_GC_END_MARK
+#endif
+
+static VALUE gc_tracepoint = Qnil;
+static VALUE sym_major_by;
+static uint64_t gc_paused_at;
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Runs inside the collector: nothing here may allocate Ruby objects.
+static void
+gc_tracepoint_handler(VALUE tpval, void *data)
+{
+    rb_event_flag_t flag = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval));
 
-    return tpval;
+    if (flag & GC_PAUSE_BEGIN) {
+        gc_paused_at = monotonic_ns();
+    }
+    if (flag & RUBY_INTERNAL_EVENT_GC_START) {
+        ATOMIC_ADD(&gc_totals[GC_COUNT], 1);
+        // major_by is nil for minor GCs. Reading it by Symbol doesn't allocate.
+        if (!NIL_P(rb_gc_latest_gc_info(sym_major_by))) {
+            ATOMIC_ADD(&gc_totals[GC_MAJOR_COUNT], 1);
+        }
+    }
+    if ((flag & GC_PAUSE_END) && gc_paused_at) {
+        ATOMIC_ADD(&gc_totals[GC_TIME], monotonic_ns() - gc_paused_at);
+        gc_paused_at = 0;
+    }
 }
 
+static VALUE get_gc_count(VALUE klass) { return ULL2NUM(ATOMIC_LOAD(&gc_totals[GC_COUNT])); }
+static VALUE get_gc_major_count(VALUE klass) { return ULL2NUM(ATOMIC_LOAD(&gc_totals[GC_MAJOR_COUNT])); }
+static VALUE get_gc_time(VALUE klass) { return ULL2NUM(ATOMIC_LOAD(&gc_totals[GC_TIME])); }
+
 void
 Init_hooks(VALUE module)
 {
+    rb_gc_register_address(&allocation_tracepoint);
     set_gc_hook(RUBY_INTERNAL_EVENT_NEWOBJ);
+
+    // GC events are rare next to allocations, so this one always stays on.
+    // The first read interns the keys it knows about, which allocates. Do
+    // that now, outside of any GC.
+    sym_major_by = ID2SYM(rb_intern("major_by"));
+    rb_gc_latest_gc_info(sym_major_by);
+    rb_gc_register_address(&gc_tracepoint);
+    gc_tracepoint = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START | GC_PAUSE_BEGIN | GC_PAUSE_END, gc_tracepoint_handler, 0);
+    rb_tracepoint_enable(gc_tracepoint);
+}
+
+void
+Init_slots(VALUE module)
+{
+    overflow_slot.counter.thread = Qnil;
+    pthread_key_create(&slot_key, release_thread_slot);
+    pthread_atfork(NULL, NULL, release_slots_after_fork);
+    slot_registry = Data_Wrap_Struct(0, mark_slot_threads, 0, slot_chunks);
+    rb_gc_register_address(&slot_registry);
 }
 
 void Init_allocations()
@@ -56,15 +673,104 @@ void Init_allocations()
     mInstruments = rb_define_module_under(mScoutApm, "Instruments");
     cAllocations = rb_define_class_under(mInstruments, "Allocations", rb_cObject);
     rb_define_singleton_method(cAllocations, "count", get_allocation_count, 0);
-    rb_define_singleton_method(cAllocations, "count", get_allocation_count, 0);
+    rb_define_singleton_method(cAllocations, "count_for", get_allocation_count_for, 1);
+    rb_define_singleton_method(cAllocations, "process_total", get_process_total, 0);
+    rb_define_singleton_method(cAllocations, "thread_counts", get_thread_counts, 0);
+    rb_define_singleton_method(cAllocations, "enable!", enable_allocations, 0);
+    rb_define_singleton_method(cAllocations, "disable!", disable_allocations, 0);
+    rb_define_singleton_method(cAllocations, "enabled?", allocations_enabled_p, 0);
+    rb_define_singleton_method(cAllocations, "sample_interval", get_sample_interval, 0);
+    rb_define_singleton_method(cAllocations, "sample_interval=", set_sample_interval, 1);
+    rb_define_singleton_method(cAllocations, "track_sites?", get_track_sites, 0);
+    rb_define_singleton_method(cAllocations, "track_sites=", set_track_sites, 1);
+    rb_define_singleton_method(cAllocations, "reset_sites!", reset_current_sites, 0);
+    rb_define_singleton_method(cAllocations, "top_sites", get_top_sites, 1);
     rb_define_const(cAllocations, "ENABLED", Qtrue);
+
+    // Times are in nanoseconds. Every reader is for the whole process, the
+    // process_ ones are kept as aliases.
+    cGarbageCollection = rb_define_class_under(mInstruments, "GarbageCollection", rb_cObject);
+    rb_define_singleton_method(cGarbageCollection, "count", get_gc_count, 0);
+    rb_define_singleton_method(cGarbageCollection, "major_count", get_gc_major_count, 0);
+    rb_define_singleton_method(cGarbageCollection, "time", get_gc_time, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_count", get_gc_count, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_major_count", get_gc_major_count, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_time", get_gc_time, 0);
+    rb_define_const(cGarbageCollection, "ENABLED", Qtrue);
+
+    Init_slots(cAllocations);
     Init_hooks(mScoutApm);
 }
 
 #else
 
 static VALUE
-get_allocation_count() {
+get_allocation_count(VALUE klass) {
+  return ULL2NUM(0);
+}
+
+static VALUE
+get_allocation_count_for(VALUE klass, VALUE thread) {
+  return ULL2NUM(0);
+}
+
+static VALUE
+get_process_total(VALUE klass) {
+  return ULL2NUM(0);
+}
+
+static VALUE
+get_thread_counts(VALUE klass) {
+  return rb_hash_new();
+}
+
+static VALUE
+enable_allocations(VALUE klass) {
+  return Qfalse;
+}
+
+static VALUE
+disable_allocations(VALUE klass) {
+  return Qfalse;
+}
+
+static VALUE
+allocations_enabled_p(VALUE klass) {
+  return Qfalse;
+}
+
+static VALUE
+get_sample_interval(VALUE klass) {
+  return INT2NUM(1);
+}
+
+static VALUE
+set_sample_interval(VALUE klass, VALUE interval) {
+  return INT2NUM(1);
+}
+
+static VALUE
+get_track_sites(VALUE klass) {
+  return Qfalse;
+}
+
+static VALUE
+set_track_sites(VALUE klass, VALUE enabled) {
+  return Qfalse;
+}
+
+static VALUE
+reset_current_sites(VALUE klass) {
+  return Qnil;
+}
+
+static VALUE
+get_top_sites(VALUE klass, VALUE limit) {
+  return rb_ary_new();
+}
+
+static VALUE
+get_gc_stat(VALUE klass) {
   return ULL2NUM(0);
 }
 
@@ -79,10 +785,30 @@ void Init_allocations()
     mInstruments = rb_define_module_under(mScoutApm, "Instruments");
     cAllocations = rb_define_class_under(mInstruments, "Allocations", rb_cObject);
     rb_define_singleton_method(cAllocations, "count", get_allocation_count, 0);
-    rb_define_singleton_method(cAllocations, "count", get_allocation_count, 0);
+    rb_define_singleton_method(cAllocations, "count_for", get_allocation_count_for, 1);
+    rb_define_singleton_method(cAllocations, "process_total", get_process_total, 0);
+    rb_define_singleton_method(cAllocations, "thread_counts", get_thread_counts, 0);
+    rb_define_singleton_method(cAllocations, "enable!", enable_allocations, 0);
+    rb_define_singleton_method(cAllocations, "disable!", disable_allocations, 0);
+    rb_define_singleton_method(cAllocations, "enabled?", allocations_enabled_p, 0);
+    rb_define_singleton_method(cAllocations, "sample_interval", get_sample_interval, 0);
+    rb_define_singleton_method(cAllocations, "sample_interval=", set_sample_interval, 1);
+    rb_define_singleton_method(cAllocations, "track_sites?", get_track_sites, 0);
+    rb_define_singleton_method(cAllocations, "track_sites=", set_track_sites, 1);
+    rb_define_singleton_method(cAllocations, "reset_sites!", reset_current_sites, 0);
+    rb_define_singleton_method(cAllocations, "top_sites", get_top_sites, 1);
     rb_define_const(cAllocations, "ENABLED", Qfalse);
+
+    cGarbageCollection = rb_define_class_under(mInstruments, "GarbageCollection", rb_cObject);
+    rb_define_singleton_method(cGarbageCollection, "count", get_gc_stat, 0);
+    rb_define_singleton_method(cGarbageCollection, "major_count", get_gc_stat, 0);
+    rb_define_singleton_method(cGarbageCollection, "time", get_gc_stat, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_count", get_gc_stat, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_major_count", get_gc_stat, 0);
+    rb_define_singleton_method(cGarbageCollection, "process_time", get_gc_stat, 0);
+    rb_define_const(cGarbageCollection, "ENABLED", Qfalse);
+
     Init_hooks(mScoutApm);
 }
 
 #endif //#ifdef RUBY_INTERNAL_EVENT_NEWOBJ
-
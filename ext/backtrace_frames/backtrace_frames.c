@@ -0,0 +1,260 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#ifdef HAVE_RB_PROFILE_FRAMES
+#include <ruby/debug.h>
+#include <ruby/version.h>
+#include <string.h>
+#endif
+
+// Finds the app frames of the current call stack, for BacktraceParser.
+//
+// Layer#capture_backtrace! would otherwise call caller, building a
+// "path:line:in `label'" string for every frame, only for BacktraceParser to
+// run a regex over each and keep the few under the app root. Here the stack
+// is walked with rb_profile_frames, which hands back the frames themselves
+// (iseqs & cfunc method entries), and strings are only made for the app
+// frames that get returned.
+//
+// What's learned about a frame is cached, keyed by the frame: whether its
+// path is under root/app/, root/lib/ or root/config/, and the finished
+// string for each line of it seen so far. Capturing from a call site that's
+// been seen before then only costs the walk and a few hash lookups. The
+// strings returned are frozen and shared between captures.
+//
+// C functions (Array#each, say) have no path of their own. Like caller, they
+// are reported at the path & line of the Ruby frame that called them.
+//
+// rb_profile_frames gives a block the frame of the method it's in, so where
+// caller would say "in `block in index'", this says "in `index'".
+
+#ifdef HAVE_RB_PROFILE_FRAMES
+
+VALUE mScoutApm;
+VALUE mNativeBacktraceFrames;
+
+#define MAX_STACK_FRAMES 256
+
+// Clear the cache if it grows past this many frames. An app only has so many
+// call sites, but code reloading in development makes new iseqs each time.
+#define MAX_CACHED_FRAMES 10000
+
+static const char *APP_DIRS[] = { "app/", "lib/", "config/" };
+
+// frame => false, if it isn't an app frame
+// iseq frame => [relative path, label, { line => string }]
+// cfunc frame => [nil, label, { calling frame => { line => string } }]
+static VALUE frame_cache = Qnil;
+
+// The root the cached paths were made relative to
+static VALUE cached_root = Qnil;
+
+// Ruby 3.4 qualifies labels with the class ("Foo#bar"), and quotes with '.
+// Before that, C functions only have a method name.
+static VALUE
+frame_label(VALUE frame)
+{
+#if RUBY_API_VERSION_MAJOR > 3 || (RUBY_API_VERSION_MAJOR == 3 && RUBY_API_VERSION_MINOR >= 4)
+  return rb_profile_frame_full_label(frame);
+#else
+  VALUE label = rb_profile_frame_label(frame);
+  return NIL_P(label) ? rb_profile_frame_method_name(frame) : label;
+#endif
+}
+
+static VALUE
+frame_string(VALUE path, int line, VALUE label)
+{
+  VALUE str;
+#if RUBY_API_VERSION_MAJOR > 3 || (RUBY_API_VERSION_MAJOR == 3 && RUBY_API_VERSION_MINOR >= 4)
+  str = rb_sprintf("%"PRIsVALUE":%d:in '%"PRIsVALUE"'", path, line, label);
+#else
+  str = rb_sprintf("%"PRIsVALUE":%d:in `%"PRIsVALUE"'", path, line, label);
+#endif
+  return rb_obj_freeze(str);
+}
+
+// The part of path under root, if it's in one of the APP_DIRS, or nil.
+// Compares bytes rather than matching a regex.
+static VALUE
+app_relative_path(VALUE path, VALUE root)
+{
+  const char *p;
+  long len, root_len;
+  size_t i;
+
+  if (!RB_TYPE_P(path, T_STRING)) {
+    return Qnil;
+  }
+
+  p = RSTRING_PTR(path);
+  len = RSTRING_LEN(path);
+  root_len = RSTRING_LEN(root);
+
+  if (len <= root_len + 1 || memcmp(p, RSTRING_PTR(root), root_len) != 0 || p[root_len] != '/') {
+    return Qnil;
+  }
+
+  p += root_len + 1;
+  len -= root_len + 1;
+  for (i = 0; i < sizeof(APP_DIRS) / sizeof(APP_DIRS[0]); i++) {
+    long dir_len = (long)strlen(APP_DIRS[i]);
+    if (len > dir_len && memcmp(p, APP_DIRS[i], dir_len) == 0) {
+      return rb_obj_freeze(rb_str_new(p, len));
+    }
+  }
+  return Qnil;
+}
+
+static VALUE
+ident_hash_new(void)
+{
+  return rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0);
+}
+
+static VALUE
+cached_entry(VALUE frame, VALUE root)
+{
+  VALUE entry = rb_hash_lookup2(frame_cache, frame, Qundef);
+  VALUE path;
+
+  if (entry != Qundef) {
+    return entry;
+  }
+
+  path = rb_profile_frame_path(frame);
+  if (NIL_P(path)) { // A C function
+    entry = rb_ary_new_from_args(3, Qnil, frame_label(frame), ident_hash_new());
+  } else {
+    VALUE relative = app_relative_path(path, root);
+    entry = NIL_P(relative) ? Qfalse : rb_ary_new_from_args(3, relative, frame_label(frame), rb_hash_new());
+  }
+
+  rb_hash_aset(frame_cache, frame, entry);
+  return entry;
+}
+
+// The string for line of an entry, made once then reused
+static VALUE
+line_string(VALUE lines, VALUE path, int line, VALUE label)
+{
+  VALUE key = INT2FIX(line);
+  VALUE str = rb_hash_lookup2(lines, key, Qnil);
+
+  if (NIL_P(str)) {
+    str = frame_string(path, line, label);
+    rb_hash_aset(lines, key, str);
+  }
+  return str;
+}
+
+// Returns up to max_app_frames strings, "app/path.rb:line:in `label'", for
+// the app frames among limit frames of the stack, after skipping skip of
+// them. Frames are skipped from the caller of capture, like caller(skip).
+static VALUE
+native_capture(VALUE self, VALUE root, VALUE rb_skip, VALUE rb_limit, VALUE rb_max_app_frames)
+{
+  VALUE frames[MAX_STACK_FRAMES];
+  int lines[MAX_STACK_FRAMES];
+  VALUE entries[MAX_STACK_FRAMES];
+  VALUE result;
+  int skip = NUM2INT(rb_skip);
+  int limit = NUM2INT(rb_limit);
+  long max_app_frames = NUM2LONG(rb_max_app_frames);
+  int count, i;
+
+  Check_Type(root, T_STRING);
+
+  // Frame 0 is capture itself. The Ruby frame a C function is reported at
+  // may lie past the limit, so walk one further than asked. Frames are
+  // skipped here rather than with rb_profile_frames' start, which doesn't
+  // count C function frames on every Ruby version.
+  if (skip < 0) skip = 0;
+  if (limit < 0) limit = 0;
+  skip += 1;
+  if (skip > MAX_STACK_FRAMES - 1) skip = MAX_STACK_FRAMES - 1;
+  if (limit > MAX_STACK_FRAMES - 1 - skip) limit = MAX_STACK_FRAMES - 1 - skip;
+
+  if (NIL_P(cached_root) || !RTEST(rb_str_equal(cached_root, root)) || RHASH_SIZE(frame_cache) > MAX_CACHED_FRAMES) {
+    rb_hash_clear(frame_cache);
+    cached_root = rb_str_new_frozen(root);
+  }
+
+  count = rb_profile_frames(0, skip + limit + 1, frames, lines);
+
+  for (i = skip; i < count; i++) {
+    entries[i] = cached_entry(frames[i], cached_root);
+  }
+
+  result = rb_ary_new_capa(max_app_frames);
+  for (i = skip; i < count && i < skip + limit && RARRAY_LEN(result) < max_app_frames; i++) {
+    VALUE entry = entries[i];
+    VALUE str;
+
+    if (!RTEST(entry)) {
+      continue;
+    }
+
+    if (NIL_P(RARRAY_AREF(entry, 0))) {
+      // A C function. Find the Ruby frame that called it, and use its path
+      // if that's in the app.
+      VALUE caller, by_caller, lines_seen;
+      int j = i + 1;
+
+      while (j < count && RTEST(entries[j]) && NIL_P(RARRAY_AREF(entries[j], 0))) {
+        j++;
+      }
+      if (j >= count || !RTEST(entries[j])) {
+        continue;
+      }
+
+      caller = entries[j];
+      by_caller = RARRAY_AREF(entry, 2);
+      lines_seen = rb_hash_lookup2(by_caller, frames[j], Qnil);
+      if (NIL_P(lines_seen)) {
+        lines_seen = rb_hash_new();
+        rb_hash_aset(by_caller, frames[j], lines_seen);
+      }
+      str = line_string(lines_seen, RARRAY_AREF(caller, 0), lines[j], RARRAY_AREF(entry, 1));
+    } else {
+      str = line_string(RARRAY_AREF(entry, 2), RARRAY_AREF(entry, 0), lines[i], RARRAY_AREF(entry, 1));
+    }
+
+    rb_ary_push(result, str);
+  }
+
+  RB_GC_GUARD(root);
+  return result;
+}
+
+// Empties the frame cache
+static VALUE
+native_clear_cache(VALUE self)
+{
+  rb_hash_clear(frame_cache);
+  cached_root = Qnil;
+  return Qnil;
+}
+
+void Init_backtrace_frames()
+{
+  rb_gc_register_address(&frame_cache);
+  rb_gc_register_address(&cached_root);
+  frame_cache = ident_hash_new();
+
+  mScoutApm = rb_define_module("ScoutApm");
+  mNativeBacktraceFrames = rb_define_module_under(mScoutApm, "NativeBacktraceFrames");
+  rb_define_module_function(mNativeBacktraceFrames, "capture", native_capture, 4);
+  rb_define_module_function(mNativeBacktraceFrames, "clear_cache", native_clear_cache, 0);
+}
+
+#else // No rb_profile_frames (Ruby < 2.1), so BacktraceParser parses caller
+
+void Init_backtrace_frames()
+{
+}
+
+#endif
@@ -0,0 +1,6 @@
+require 'mkmf'
+
+have_header("ruby/ruby.h") # Needed to check for Ruby <= 1.8.7
+have_header("ruby/debug.h")
+have_func("rb_profile_frames", "ruby/debug.h")
+create_makefile('backtrace_frames')
@@ -0,0 +1,7 @@
+require 'mkmf'
+
+have_header("ruby/ruby.h") # Needed to check for Ruby <= 1.8.7
+have_header("ruby/encoding.h")
+have_header("sys/mman.h")
+have_func("rb_enc_interned_str", "ruby.h")
+create_makefile('layaway_format')
@@ -0,0 +1,1051 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The binary layaway file format. See lib/scout_apm/layaway_format.rb for how
+// a StoreReportingPeriod is split up to be written with it.
+//
+// A file is a header followed by length-prefixed records:
+//
+//   header:  "SCLY" version(u8)
+//   record:  tag(u8) length(u32) payload
+//
+//   TAG_STRINGS  count(u32), then count of: length(u32) bytes
+//   TAG_METRICS  count(u32), then count of METRIC_SIZE byte metrics:
+//                name(u32) scope(u32) desc(u32) scoped(u8) call_count(i64)
+//                total_call_time total_exclusive_time min_call_time
+//                max_call_time sum_of_squares (doubles)
+//   TAG_MARSHAL  the Marshal dump of everything else
+//
+// Metric names, scopes and descs are indexes into the one string table, or
+// NO_STRING for nil, so each distinct string is written and loaded once.
+// Numbers are in native byte order: layaway files never leave the host that
+// wrote them.
+//
+// Only plain metrics are packed: a MetricMeta with no metric_id, client_id or
+// extra, and a MetricStats with no queue or latency. dump yields the rest to
+// be kept in the Marshal record.
+
+VALUE mScoutApm;
+VALUE mNativeLayawayFormat;
+
+static ID id_metric_name;
+static ID id_metric_id;
+static ID id_scope;
+static ID id_desc;
+static ID id_extra;
+static ID id_client_id;
+static ID id_scoped;
+static ID id_call_count;
+static ID id_total_call_time;
+static ID id_total_exclusive_time;
+static ID id_min_call_time;
+static ID id_max_call_time;
+static ID id_sum_of_squares;
+static ID id_queue;
+static ID id_latency;
+
+#define MAGIC "SCLY"
+#define MAGIC_SIZE 4
+#define VERSION 1
+#define HEADER_SIZE (MAGIC_SIZE + 1)
+#define RECORD_HEADER_SIZE 5
+
+#define TAG_STRINGS 1
+#define TAG_METRICS 2
+#define TAG_MARSHAL 3
+
+#define NO_STRING 0xFFFFFFFFU
+#define STAT_DOUBLES 5
+#define METRIC_SIZE (3 * 4 + 1 + 8 + STAT_DOUBLES * 8)
+
+static const ID *stat_double_ids[STAT_DOUBLES] = {
+  &id_total_call_time,
+  &id_total_exclusive_time,
+  &id_min_call_time,
+  &id_max_call_time,
+  &id_sum_of_squares,
+};
+
+static VALUE
+ivar_or_nil(VALUE obj, ID id)
+{
+  return RTEST(rb_ivar_defined(obj, id)) ? rb_ivar_get(obj, id) : Qnil;
+}
+
+static void
+put_u32(VALUE buf, uint32_t value)
+{
+  rb_str_buf_cat(buf, (const char *)&value, 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encoding
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  VALUE cMetricMeta;
+  VALUE cMetricStats;
+  VALUE index;     // String => its position in strings
+  VALUE strings;
+  VALUE metrics;   // TAG_METRICS payload, after the count
+  uint32_t count;
+  VALUE leftovers; // what couldn't be packed
+} encoder_t;
+
+// Strings are loaded back as UTF-8, so only those that read the same that way
+// are packed.
+static int
+packable_string(VALUE str)
+{
+  if (TYPE(str) != T_STRING) {
+    return 0;
+  }
+#ifdef HAVE_RUBY_ENCODING_H
+  return rb_enc_get_index(str) == rb_utf8_encindex() || rb_enc_str_asciionly_p(str);
+#else
+  return 1;
+#endif
+}
+
+static int
+packable_meta(encoder_t *enc, VALUE meta)
+{
+  VALUE extra;
+  VALUE scope;
+  VALUE desc;
+
+  if (rb_obj_class(meta) != enc->cMetricMeta) {
+    return 0;
+  }
+  extra = ivar_or_nil(meta, id_extra);
+  scope = ivar_or_nil(meta, id_scope);
+  desc = ivar_or_nil(meta, id_desc);
+
+  return packable_string(ivar_or_nil(meta, id_metric_name)) &&
+    (NIL_P(scope) || packable_string(scope)) &&
+    (NIL_P(desc) || packable_string(desc)) &&
+    NIL_P(ivar_or_nil(meta, id_metric_id)) &&
+    NIL_P(ivar_or_nil(meta, id_client_id)) &&
+    TYPE(extra) == T_HASH && RHASH_SIZE(extra) == 0;
+}
+
+static int
+packable_stats(encoder_t *enc, VALUE stats)
+{
+  VALUE scoped;
+  int i;
+
+  if (rb_obj_class(stats) != enc->cMetricStats) {
+    return 0;
+  }
+  scoped = ivar_or_nil(stats, id_scoped);
+  if (scoped != Qtrue && scoped != Qfalse) {
+    return 0;
+  }
+  if (!FIXNUM_P(ivar_or_nil(stats, id_call_count))) {
+    return 0;
+  }
+  for (i = 0; i < STAT_DOUBLES; i++) {
+    if (TYPE(ivar_or_nil(stats, *stat_double_ids[i])) != T_FLOAT) {
+      return 0;
+    }
+  }
+  return NIL_P(ivar_or_nil(stats, id_queue)) && NIL_P(ivar_or_nil(stats, id_latency));
+}
+
+static uint32_t
+intern_string(encoder_t *enc, VALUE str)
+{
+  VALUE position;
+
+  if (NIL_P(str)) {
+    return NO_STRING;
+  }
+  position = rb_hash_aref(enc->index, str);
+  if (NIL_P(position)) {
+    position = LONG2FIX(RARRAY_LEN(enc->strings));
+    rb_hash_aset(enc->index, str, position);
+    rb_ary_push(enc->strings, str);
+  }
+  return (uint32_t)FIX2LONG(position);
+}
+
+static int
+encode_metric(VALUE meta, VALUE stats, VALUE arg)
+{
+  encoder_t *enc = (encoder_t *)arg;
+  char packed[METRIC_SIZE];
+  char *p = packed;
+  uint32_t strings[3];
+  int64_t call_count;
+  double value;
+  int i;
+
+  if (!packable_meta(enc, meta) || !packable_stats(enc, stats)) {
+    rb_hash_aset(enc->leftovers, meta, stats);
+    return ST_CONTINUE;
+  }
+
+  strings[0] = intern_string(enc, rb_ivar_get(meta, id_metric_name));
+  strings[1] = intern_string(enc, rb_ivar_get(meta, id_scope));
+  strings[2] = intern_string(enc, rb_ivar_get(meta, id_desc));
+  memcpy(p, strings, sizeof(strings));
+  p += sizeof(strings);
+
+  *p++ = rb_ivar_get(stats, id_scoped) == Qtrue;
+
+  call_count = FIX2LONG(rb_ivar_get(stats, id_call_count));
+  memcpy(p, &call_count, 8);
+  p += 8;
+
+  for (i = 0; i < STAT_DOUBLES; i++) {
+    value = RFLOAT_VALUE(rb_ivar_get(stats, *stat_double_ids[i]));
+    memcpy(p, &value, 8);
+    p += 8;
+  }
+
+  rb_str_buf_cat(enc->metrics, packed, METRIC_SIZE);
+  enc->count++;
+  return ST_CONTINUE;
+}
+
+static void
+put_record_header(VALUE buf, int tag, long length)
+{
+  char t = (char)tag;
+
+  if (length > (long)UINT32_MAX) {
+    rb_raise(rb_eArgError, "layaway record too large");
+  }
+  rb_str_buf_cat(buf, &t, 1);
+  put_u32(buf, (uint32_t)length);
+}
+
+// dump(metrics) { |leftovers| marshal_dump_of_the_rest }
+//
+// Packs a Hash of MetricMeta => MetricStats. The block is given a Hash of the
+// metrics that couldn't be packed, and returns the String for the Marshal
+// record. Returns the file's contents.
+static VALUE
+native_dump(VALUE self, VALUE metrics)
+{
+  encoder_t enc;
+  VALUE out;
+  VALUE rest;
+  VALUE str;
+  long strings_size = 4;
+  long i;
+  char version = VERSION;
+
+  Check_Type(metrics, T_HASH);
+
+  enc.cMetricMeta = rb_path2class("ScoutApm::MetricMeta");
+  enc.cMetricStats = rb_path2class("ScoutApm::MetricStats");
+  enc.index = rb_hash_new();
+  enc.strings = rb_ary_new();
+  enc.metrics = rb_str_buf_new(RHASH_SIZE(metrics) * METRIC_SIZE);
+  enc.count = 0;
+  enc.leftovers = rb_hash_new();
+
+  rb_hash_foreach(metrics, encode_metric, (VALUE)&enc);
+
+  rest = rb_yield(enc.leftovers);
+  StringValue(rest);
+
+  for (i = 0; i < RARRAY_LEN(enc.strings); i++) {
+    strings_size += 4 + RSTRING_LEN(rb_ary_entry(enc.strings, i));
+  }
+
+  out = rb_str_buf_new(HEADER_SIZE +
+                       RECORD_HEADER_SIZE + strings_size +
+                       RECORD_HEADER_SIZE + 4 + RSTRING_LEN(enc.metrics) +
+                       RECORD_HEADER_SIZE + RSTRING_LEN(rest));
+  rb_str_buf_cat(out, MAGIC, MAGIC_SIZE);
+  rb_str_buf_cat(out, &version, 1);
+
+  put_record_header(out, TAG_STRINGS, strings_size);
+  put_u32(out, (uint32_t)RARRAY_LEN(enc.strings));
+  for (i = 0; i < RARRAY_LEN(enc.strings); i++) {
+    str = rb_ary_entry(enc.strings, i);
+    put_u32(out, (uint32_t)RSTRING_LEN(str));
+    rb_str_buf_cat(out, RSTRING_PTR(str), RSTRING_LEN(str));
+  }
+
+  put_record_header(out, TAG_METRICS, 4 + RSTRING_LEN(enc.metrics));
+  put_u32(out, enc.count);
+  rb_str_buf_append(out, enc.metrics);
+
+  put_record_header(out, TAG_MARSHAL, RSTRING_LEN(rest));
+  rb_str_buf_append(out, rest);
+
+  return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoding
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  const char *ptr;
+  const char *end;
+} reader_t;
+
+static void
+truncated(void)
+{
+  rb_raise(rb_eArgError, "truncated layaway data");
+}
+
+static const char *
+take(reader_t *r, long length)
+{
+  const char *start = r->ptr;
+
+  if (length < 0 || r->end - r->ptr < length) {
+    truncated();
+  }
+  r->ptr += length;
+  return start;
+}
+
+static uint32_t
+take_u32(reader_t *r)
+{
+  uint32_t value;
+
+  memcpy(&value, take(r, 4), 4);
+  return value;
+}
+
+static VALUE
+decode_strings(reader_t *r)
+{
+  uint32_t count = take_u32(r);
+  uint32_t i;
+  uint32_t length;
+  VALUE strings;
+  VALUE str;
+
+  // Each string takes at least its length
+  if ((uint64_t)count * 4 > (uint64_t)(r->end - r->ptr)) {
+    truncated();
+  }
+  strings = rb_ary_new2(count);
+  for (i = 0; i < count; i++) {
+    length = take_u32(r);
+    str = rb_str_new(take(r, length), length);
+#ifdef HAVE_RUBY_ENCODING_H
+    rb_enc_associate(str, rb_utf8_encoding());
+#endif
+    // Shared by every metric naming it
+    rb_obj_freeze(str);
+    rb_ary_push(strings, str);
+  }
+  return strings;
+}
+
+static VALUE
+lookup_string(VALUE strings, uint32_t position)
+{
+  if (position == NO_STRING) {
+    return Qnil;
+  }
+  if (NIL_P(strings) || position >= (uint32_t)RARRAY_LEN(strings)) {
+    rb_raise(rb_eArgError, "bad string in layaway data");
+  }
+  return rb_ary_entry(strings, position);
+}
+
+typedef struct {
+  uint32_t strings[3]; // name, scope, desc
+  int scoped;
+  int64_t call_count;
+  double stats[STAT_DOUBLES]; // in stat_double_ids order
+} packed_metric_t;
+
+static void
+unpack_metric(const char *p, packed_metric_t *metric)
+{
+  memcpy(metric->strings, p, sizeof(metric->strings));
+  p += sizeof(metric->strings);
+  metric->scoped = *p++ != 0;
+  memcpy(&metric->call_count, p, 8);
+  p += 8;
+  memcpy(metric->stats, p, sizeof(metric->stats));
+}
+
+// These set the same instance variables, in the same order, as the
+// constructors.
+static VALUE
+new_meta(VALUE cMetricMeta, VALUE name, VALUE scope, VALUE desc)
+{
+  VALUE meta = rb_obj_alloc(cMetricMeta);
+
+  rb_ivar_set(meta, id_metric_name, name);
+  rb_ivar_set(meta, id_metric_id, Qnil);
+  rb_ivar_set(meta, id_scope, scope);
+  rb_ivar_set(meta, id_desc, desc);
+  rb_ivar_set(meta, id_extra, rb_hash_new());
+  return meta;
+}
+
+static VALUE
+new_stats(VALUE cMetricStats, int scoped, int64_t call_count, const double *values)
+{
+  VALUE stats = rb_obj_alloc(cMetricStats);
+  int i;
+
+  rb_ivar_set(stats, id_scoped, scoped ? Qtrue : Qfalse);
+  rb_ivar_set(stats, id_call_count, LONG2NUM((long)call_count));
+  for (i = 0; i < STAT_DOUBLES; i++) {
+    rb_ivar_set(stats, *stat_double_ids[i], rb_float_new(values[i]));
+  }
+  return stats;
+}
+
+static void
+decode_metrics(reader_t *r, VALUE strings, VALUE metrics)
+{
+  VALUE cMetricMeta = rb_path2class("ScoutApm::MetricMeta");
+  VALUE cMetricStats = rb_path2class("ScoutApm::MetricStats");
+  uint32_t count = take_u32(r);
+  uint32_t i;
+  packed_metric_t metric;
+  VALUE meta;
+
+  if ((uint64_t)count * METRIC_SIZE != (uint64_t)(r->end - r->ptr)) {
+    truncated();
+  }
+  for (i = 0; i < count; i++) {
+    unpack_metric(take(r, METRIC_SIZE), &metric);
+    meta = new_meta(cMetricMeta,
+                    lookup_string(strings, metric.strings[0]),
+                    lookup_string(strings, metric.strings[1]),
+                    lookup_string(strings, metric.strings[2]));
+    rb_hash_aset(metrics, meta, new_stats(cMetricStats, metric.scoped, metric.call_count, metric.stats));
+  }
+}
+
+// binary?(data)
+//
+// True if data starts like something dump returned.
+static VALUE
+native_binary_p(VALUE self, VALUE data)
+{
+  StringValue(data);
+  return (RSTRING_LEN(data) >= MAGIC_SIZE &&
+          memcmp(RSTRING_PTR(data), MAGIC, MAGIC_SIZE) == 0) ? Qtrue : Qfalse;
+}
+
+// load(data)
+//
+// The reverse of dump: returns [metrics, marshal_dump_of_the_rest]. Raises
+// ArgumentError for anything that isn't a complete file in this version.
+static VALUE
+native_load(VALUE self, VALUE data)
+{
+  reader_t r;
+  reader_t record;
+  VALUE strings = Qnil;
+  VALUE metrics;
+  VALUE rest = Qnil;
+  uint32_t length;
+  char tag;
+
+  StringValue(data);
+  r.ptr = RSTRING_PTR(data);
+  r.end = r.ptr + RSTRING_LEN(data);
+
+  if (memcmp(take(&r, MAGIC_SIZE), MAGIC, MAGIC_SIZE) != 0) {
+    rb_raise(rb_eArgError, "not binary layaway data");
+  }
+  if (*take(&r, 1) != VERSION) {
+    rb_raise(rb_eArgError, "unsupported layaway format version");
+  }
+
+  metrics = rb_hash_new();
+  while (r.ptr < r.end) {
+    tag = *take(&r, 1);
+    length = take_u32(&r);
+    record.ptr = take(&r, length);
+    record.end = record.ptr + length;
+
+    switch (tag) {
+    case TAG_STRINGS:
+      strings = decode_strings(&record);
+      break;
+    case TAG_METRICS:
+      decode_metrics(&record, strings, metrics);
+      break;
+    case TAG_MARSHAL:
+      rest = rb_str_new(record.ptr, length);
+      break;
+    default:
+      // Unknown records are skipped, so later versions can add them
+      break;
+    }
+  }
+
+  RB_GC_GUARD(data);
+  if (NIL_P(rest)) {
+    truncated();
+  }
+  return rb_assoc_new(metrics, rest);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+///////////////////////////////////////////////////////////////////////////////
+// Merging
+///////////////////////////////////////////////////////////////////////////////
+
+// Combines the packed metrics of many files without loading them: each file
+// is mapped, its metrics are summed into one table pointing into the mapped
+// strings, and Ruby objects are only made for what's in the table at the end.
+//
+// The result is what merging the loaded periods in order would give (see
+// MetricSet#combine!). The first file's metrics are kept as they are. A later
+// file's metric is combined under the same key if its type is one of
+// keep_types, or otherwise under "#{type}/all" with its scope. Keys match as
+// MetricMeta#eql? does, except that only ASCII letters are case folded.
+
+#define MAX_KEEP_TYPES 32
+#define MAX_KEEP_TYPE_SIZE 64
+
+typedef struct {
+  const char *ptr;
+  uint32_t length;
+} span_t;
+
+typedef struct {
+  char *base;     // the mapping
+  size_t size;
+  span_t *strings;
+  uint32_t string_count;
+  const char *metrics;
+  uint32_t metric_count;
+  const char *rest;
+  uint32_t rest_length;
+} mapped_file_t;
+
+typedef struct {
+  uint64_t hash;  // 0 for an empty slot
+  span_t name;
+  int has_scope;
+  span_t scope;
+  int has_desc;
+  span_t desc;
+  char *owned_name; // the name, when it's a "#{type}/all" made here
+  int scoped;
+  int64_t call_count;
+  double stats[STAT_DOUBLES];
+} merge_entry_t;
+
+typedef struct {
+  mapped_file_t *files;
+  long file_count;
+  merge_entry_t *entries;
+  size_t capacity; // a power of 2
+  size_t size;
+  char keep_types[MAX_KEEP_TYPES][MAX_KEEP_TYPE_SIZE];
+  size_t keep_type_sizes[MAX_KEEP_TYPES];
+  int keep_type_count;
+  VALUE paths;
+  VALUE merged; // paths of the files that were merged
+  VALUE rests;
+  VALUE metrics;
+} merger_t;
+
+static int
+read_span(reader_t *r, uint32_t length, const char **ptr)
+{
+  if (r->end - r->ptr < (long)length) {
+    return 0;
+  }
+  *ptr = r->ptr;
+  r->ptr += length;
+  return 1;
+}
+
+static int
+read_u32(reader_t *r, uint32_t *value)
+{
+  const char *ptr;
+
+  if (!read_span(r, 4, &ptr)) {
+    return 0;
+  }
+  memcpy(value, ptr, 4);
+  return 1;
+}
+
+// Checks over a whole file before any of it is merged, so that a bad file is
+// left out entirely rather than in part. Returns 0 if it can't be merged.
+static int
+parse_mapped(mapped_file_t *file)
+{
+  reader_t r;
+  reader_t record;
+  const char *ptr;
+  uint32_t length;
+  uint32_t i;
+  int have_strings = 0;
+  int have_metrics = 0;
+  packed_metric_t metric;
+  int j;
+
+  r.ptr = file->base;
+  r.end = file->base + file->size;
+
+  if (file->size < HEADER_SIZE || memcmp(r.ptr, MAGIC, MAGIC_SIZE) != 0 || r.ptr[MAGIC_SIZE] != VERSION) {
+    return 0;
+  }
+  r.ptr += HEADER_SIZE;
+
+  while (r.ptr < r.end) {
+    if (!read_span(&r, 1, &ptr) || !read_u32(&r, &length) || !read_span(&r, length, &record.ptr)) {
+      return 0;
+    }
+    record.end = record.ptr + length;
+
+    switch (*ptr) {
+    case TAG_STRINGS:
+      if (have_strings || !read_u32(&record, &file->string_count) ||
+          (uint64_t)file->string_count * 4 > (uint64_t)(record.end - record.ptr)) {
+        return 0;
+      }
+      have_strings = 1;
+      file->strings = ALLOC_N(span_t, file->string_count ? file->string_count : 1);
+      for (i = 0; i < file->string_count; i++) {
+        if (!read_u32(&record, &file->strings[i].length) ||
+            !read_span(&record, file->strings[i].length, &file->strings[i].ptr)) {
+          return 0;
+        }
+      }
+      break;
+    case TAG_METRICS:
+      if (have_metrics || !read_u32(&record, &file->metric_count) ||
+          (uint64_t)file->metric_count * METRIC_SIZE != (uint64_t)(record.end - record.ptr)) {
+        return 0;
+      }
+      have_metrics = 1;
+      file->metrics = record.ptr;
+      break;
+    case TAG_MARSHAL:
+      file->rest = record.ptr;
+      file->rest_length = length;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (!have_strings || !have_metrics || !file->rest) {
+    return 0;
+  }
+  for (i = 0; i < file->metric_count; i++) {
+    unpack_metric(file->metrics + (size_t)i * METRIC_SIZE, &metric);
+    for (j = 0; j < 3; j++) {
+      if (metric.strings[j] != NO_STRING && metric.strings[j] >= file->string_count) {
+        return 0;
+      }
+    }
+    if (metric.strings[0] == NO_STRING) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+map_file(const char *path, mapped_file_t *file)
+{
+  struct stat st;
+  void *base;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+  file->base = base;
+  file->size = (size_t)st.st_size;
+  return 1;
+}
+
+static char
+fold(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t
+hash_bytes(uint64_t hash, const char *ptr, uint32_t length, int folded)
+{
+  uint32_t i;
+
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)(folded ? fold(ptr[i]) : ptr[i])) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static uint64_t
+hash_key(const merge_entry_t *key)
+{
+  uint64_t hash = hash_bytes(FNV_OFFSET, key->name.ptr, key->name.length, 1);
+
+  hash = (hash ^ (uint64_t)key->has_scope) * FNV_PRIME;
+  hash = hash_bytes(hash, key->scope.ptr, key->scope.length, 0);
+  hash = (hash ^ (uint64_t)key->has_desc) * FNV_PRIME;
+  hash = hash_bytes(hash, key->desc.ptr, key->desc.length, 0);
+  return hash ? hash : 1;
+}
+
+static int
+same_span(span_t a, span_t b, int folded)
+{
+  uint32_t i;
+
+  if (a.length != b.length) {
+    return 0;
+  }
+  if (!folded) {
+    return memcmp(a.ptr, b.ptr, a.length) == 0;
+  }
+  for (i = 0; i < a.length; i++) {
+    if (fold(a.ptr[i]) != fold(b.ptr[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+same_key(const merge_entry_t *a, const merge_entry_t *b)
+{
+  return a->hash == b->hash &&
+    a->has_scope == b->has_scope &&
+    a->has_desc == b->has_desc &&
+    same_span(a->name, b->name, 1) &&
+    (!a->has_scope || same_span(a->scope, b->scope, 0)) &&
+    (!a->has_desc || same_span(a->desc, b->desc, 0));
+}
+
+static merge_entry_t *
+find_slot(merge_entry_t *entries, size_t capacity, const merge_entry_t *key)
+{
+  size_t i = (size_t)key->hash & (capacity - 1);
+
+  while (entries[i].hash && !same_key(&entries[i], key)) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &entries[i];
+}
+
+static void
+grow(merger_t *m)
+{
+  size_t capacity = m->capacity * 2;
+  merge_entry_t *entries = ALLOC_N(merge_entry_t, capacity);
+  size_t i;
+
+  memset(entries, 0, capacity * sizeof(merge_entry_t));
+  for (i = 0; i < m->capacity; i++) {
+    if (m->entries[i].hash) {
+      *find_slot(entries, capacity, &m->entries[i]) = m->entries[i];
+    }
+  }
+  xfree(m->entries);
+  m->entries = entries;
+  m->capacity = capacity;
+}
+
+static int
+kept_type(merger_t *m, span_t type)
+{
+  int i;
+
+  for (i = 0; i < m->keep_type_count; i++) {
+    if (m->keep_type_sizes[i] == type.length && memcmp(m->keep_types[i], type.ptr, type.length) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// MetricStats#combine!
+static void
+combine(merge_entry_t *entry, const packed_metric_t *metric)
+{
+  const double *other = metric->stats;
+  double *stats = entry->stats;
+
+  entry->call_count += metric->call_count;
+  stats[0] += other[0];
+  stats[1] += other[1];
+  if (stats[2] == 0.0 || other[2] < stats[2]) {
+    stats[2] = other[2];
+  }
+  if (other[3] > stats[3]) {
+    stats[3] = other[3];
+  }
+  stats[4] += other[4];
+}
+
+static void
+merge_metric(merger_t *m, const mapped_file_t *file, const packed_metric_t *metric, int first)
+{
+  merge_entry_t key;
+  merge_entry_t *slot;
+  const char *slash;
+  span_t type;
+  int i;
+
+  memset(&key, 0, sizeof(key));
+  key.name = file->strings[metric->strings[0]];
+  if (metric->strings[1] != NO_STRING) {
+    key.has_scope = 1;
+    key.scope = file->strings[metric->strings[1]];
+  }
+  if (metric->strings[2] != NO_STRING) {
+    key.has_desc = 1;
+    key.desc = file->strings[metric->strings[2]];
+  }
+
+  if (!first) {
+    slash = memchr(key.name.ptr, '/', key.name.length);
+    type.ptr = key.name.ptr;
+    type.length = slash ? (uint32_t)(slash - key.name.ptr) : key.name.length;
+
+    if (!kept_type(m, type)) {
+      key.owned_name = ALLOC_N(char, type.length + 4);
+      memcpy(key.owned_name, type.ptr, type.length);
+      memcpy(key.owned_name + type.length, "/all", 4);
+      key.name.ptr = key.owned_name;
+      key.name.length = type.length + 4;
+      key.has_desc = 0;
+      key.desc.length = 0;
+    }
+  }
+  key.hash = hash_key(&key);
+
+  slot = find_slot(m->entries, m->capacity, &key);
+  if (slot->hash) {
+    if (key.owned_name) {
+      xfree(key.owned_name);
+    }
+    combine(slot, metric);
+    return;
+  }
+
+  *slot = key;
+  if (first) {
+    // As loaded
+    slot->scoped = metric->scoped;
+    slot->call_count = metric->call_count;
+    for (i = 0; i < STAT_DOUBLES; i++) {
+      slot->stats[i] = metric->stats[i];
+    }
+  } else {
+    // Combined into a MetricStats.new, which key's zeros already are
+    combine(slot, metric);
+  }
+  if (++m->size * 2 > m->capacity) {
+    grow(m);
+  }
+}
+
+static VALUE
+span_str(const span_t *span)
+{
+#if defined(HAVE_RB_ENC_INTERNED_STR)
+  return rb_enc_interned_str(span->ptr, span->length, rb_utf8_encoding());
+#else
+  VALUE str = rb_str_new(span->ptr, span->length);
+#ifdef HAVE_RUBY_ENCODING_H
+  rb_enc_associate(str, rb_utf8_encoding());
+#endif
+  return rb_obj_freeze(str);
+#endif
+}
+
+static VALUE
+merge_files(VALUE arg)
+{
+  merger_t *m = (merger_t *)arg;
+  VALUE cMetricMeta = rb_path2class("ScoutApm::MetricMeta");
+  VALUE cMetricStats = rb_path2class("ScoutApm::MetricStats");
+  VALUE path;
+  mapped_file_t *file;
+  merge_entry_t *entry;
+  packed_metric_t metric;
+  uint32_t i;
+  long f;
+  size_t e;
+
+  for (f = 0; f < m->file_count; f++) {
+    path = rb_ary_entry(m->paths, f);
+    file = &m->files[f];
+
+    if (!map_file(StringValueCStr(path), file)) {
+      continue;
+    }
+    if (!parse_mapped(file)) {
+      munmap(file->base, file->size);
+      file->base = NULL;
+      continue;
+    }
+
+    for (i = 0; i < file->metric_count; i++) {
+      unpack_metric(file->metrics + (size_t)i * METRIC_SIZE, &metric);
+      merge_metric(m, file, &metric, RARRAY_LEN(m->merged) == 0);
+    }
+    rb_ary_push(m->merged, path);
+    rb_ary_push(m->rests, rb_str_new(file->rest, file->rest_length));
+  }
+
+  for (e = 0; e < m->capacity; e++) {
+    entry = &m->entries[e];
+    if (!entry->hash) {
+      continue;
+    }
+    rb_hash_aset(m->metrics,
+                 new_meta(cMetricMeta,
+                          span_str(&entry->name),
+                          entry->has_scope ? span_str(&entry->scope) : Qnil,
+                          entry->has_desc ? span_str(&entry->desc) : Qnil),
+                 new_stats(cMetricStats, entry->scoped, entry->call_count, entry->stats));
+  }
+
+  return rb_ary_new3(3, m->metrics, m->merged, m->rests);
+}
+
+static VALUE
+merge_cleanup(VALUE arg)
+{
+  merger_t *m = (merger_t *)arg;
+  size_t e;
+  long f;
+
+  for (e = 0; e < m->capacity; e++) {
+    if (m->entries[e].owned_name) {
+      xfree(m->entries[e].owned_name);
+    }
+  }
+  xfree(m->entries);
+
+  for (f = 0; f < m->file_count; f++) {
+    if (m->files[f].base) {
+      munmap(m->files[f].base, m->files[f].size);
+    }
+    if (m->files[f].strings) {
+      xfree(m->files[f].strings);
+    }
+  }
+  xfree(m->files);
+  return Qnil;
+}
+
+// merge(paths, keep_types)
+//
+// Merges the metrics of the binary layaway files at paths, as described
+// above. Returns [metrics, merged_paths, rests]: the merged Hash of
+// MetricMeta => MetricStats, the paths that were merged, and the Marshal
+// record of each of those, in order. Files that couldn't be read or aren't in
+// this format are left out, to be loaded some other way.
+static VALUE
+native_merge(VALUE self, VALUE paths, VALUE keep_types)
+{
+  merger_t m;
+  VALUE type;
+  long i;
+
+  Check_Type(paths, T_ARRAY);
+  Check_Type(keep_types, T_ARRAY);
+  memset(&m, 0, sizeof(m));
+
+  if (RARRAY_LEN(keep_types) > MAX_KEEP_TYPES) {
+    rb_raise(rb_eArgError, "too many keep_types");
+  }
+  for (i = 0; i < RARRAY_LEN(keep_types); i++) {
+    type = rb_ary_entry(keep_types, i);
+    StringValue(type);
+    if (RSTRING_LEN(type) > MAX_KEEP_TYPE_SIZE) {
+      rb_raise(rb_eArgError, "keep_type too long");
+    }
+    memcpy(m.keep_types[i], RSTRING_PTR(type), RSTRING_LEN(type));
+    m.keep_type_sizes[i] = RSTRING_LEN(type);
+  }
+  m.keep_type_count = (int)RARRAY_LEN(keep_types);
+
+  m.paths = paths;
+  m.file_count = RARRAY_LEN(paths);
+  m.merged = rb_ary_new();
+  m.rests = rb_ary_new();
+  m.metrics = rb_hash_new();
+
+  m.files = ALLOC_N(mapped_file_t, m.file_count ? m.file_count : 1);
+  memset(m.files, 0, (m.file_count ? m.file_count : 1) * sizeof(mapped_file_t));
+  m.capacity = 256;
+  m.entries = ALLOC_N(merge_entry_t, m.capacity);
+  memset(m.entries, 0, m.capacity * sizeof(merge_entry_t));
+
+  return rb_ensure(merge_files, (VALUE)&m, merge_cleanup, (VALUE)&m);
+}
+#endif
+
+void Init_layaway_format()
+{
+  id_metric_name = rb_intern("@metric_name");
+  id_metric_id = rb_intern("@metric_id");
+  id_scope = rb_intern("@scope");
+  id_desc = rb_intern("@desc");
+  id_extra = rb_intern("@extra");
+  id_client_id = rb_intern("@client_id");
+  id_scoped = rb_intern("@scoped");
+  id_call_count = rb_intern("@call_count");
+  id_total_call_time = rb_intern("@total_call_time");
+  id_total_exclusive_time = rb_intern("@total_exclusive_time");
+  id_min_call_time = rb_intern("@min_call_time");
+  id_max_call_time = rb_intern("@max_call_time");
+  id_sum_of_squares = rb_intern("@sum_of_squares");
+  id_queue = rb_intern("@queue");
+  id_latency = rb_intern("@latency");
+
+  mScoutApm = rb_define_module("ScoutApm");
+  mNativeLayawayFormat = rb_define_module_under(mScoutApm, "NativeLayawayFormat");
+  rb_define_module_function(mNativeLayawayFormat, "dump", native_dump, 1);
+  rb_define_module_function(mNativeLayawayFormat, "load", native_load, 1);
+  rb_define_module_function(mNativeLayawayFormat, "binary?", native_binary_p, 1);
+#ifdef HAVE_SYS_MMAN_H
+  rb_define_module_function(mNativeLayawayFormat, "merge", native_merge, 2);
+#endif
+}
@@ -0,0 +1,711 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A native implementation of ScoutApm::NumericHistogram (see
+// lib/scout_apm/histogram.rb). The Ruby class is the reference: this one must
+// pick the same bins to merge, in the same order, so both produce identical
+// histograms for identical input.
+//
+// Bins are kept sorted in a contiguous C array, so finding the insert point is
+// a binary search. Finding the closest pair of bins to merge uses a min-heap of
+// the gaps between adjacent bins, instead of rescanning every bin after each
+// insert. Heap entries are identified by the values of the two bins they sit
+// between, and are invalidated lazily: an entry whose bins are no longer
+// adjacent is discarded when it reaches the top of the heap.
+//
+// Every method runs while holding the GVL and never yields back to Ruby while
+// the bins are being modified, which is what makes this threadsafe without the
+// Mutex the Ruby version carries.
+
+VALUE mScoutApm;
+VALUE cNativeNumericHistogram;
+
+static ID id_to_f;
+static ID id_bins;
+static ID id_total;
+static ID id_value;
+static ID id_count;
+
+typedef struct {
+  double value;
+  uint64_t count;
+} histogram_bin_t;
+
+typedef struct {
+  double gap;
+  double left;
+  double right;
+} histogram_gap_t;
+
+typedef struct {
+  long max_bins;
+  long long total;
+
+  histogram_bin_t *bins;
+  long bins_len;
+  long bins_capa;
+
+  histogram_gap_t *heap;
+  long heap_len;
+  long heap_capa;
+} numeric_histogram_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory management
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+histogram_free(void *ptr)
+{
+  numeric_histogram_t *hist = (numeric_histogram_t *)ptr;
+  xfree(hist->bins);
+  xfree(hist->heap);
+  xfree(hist);
+}
+
+static VALUE
+histogram_alloc(VALUE klass)
+{
+  numeric_histogram_t *hist;
+  VALUE obj = Data_Make_Struct(klass, numeric_histogram_t, 0, histogram_free, hist);
+  hist->max_bins = 0;
+  hist->total = 0;
+  hist->bins = NULL;
+  hist->bins_len = 0;
+  hist->bins_capa = 0;
+  hist->heap = NULL;
+  hist->heap_len = 0;
+  hist->heap_capa = 0;
+  return obj;
+}
+
+static numeric_histogram_t *
+get_histogram(VALUE self)
+{
+  numeric_histogram_t *hist;
+  Data_Get_Struct(self, numeric_histogram_t, hist);
+  return hist;
+}
+
+static void
+reserve_bins(numeric_histogram_t *hist, long capa)
+{
+  if (capa <= hist->bins_capa) {
+    return;
+  }
+  REALLOC_N(hist->bins, histogram_bin_t, capa);
+  hist->bins_capa = capa;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Gap heap
+////////////////////////////////////////////////////////////////////////////////
+
+// Orders by gap, then by position. Bin values are sorted, so the lower left
+// value is the lower index - matching the "first smallest delta" the Ruby
+// trim_one picks.
+static int
+gap_less(const histogram_gap_t *a, const histogram_gap_t *b)
+{
+  if (a->gap != b->gap) {
+    return a->gap < b->gap;
+  }
+  return a->left < b->left;
+}
+
+static void
+heap_sift_up(numeric_histogram_t *hist, long i)
+{
+  histogram_gap_t entry = hist->heap[i];
+  while (i > 0) {
+    long parent = (i - 1) / 2;
+    if (!gap_less(&entry, &hist->heap[parent])) {
+      break;
+    }
+    hist->heap[i] = hist->heap[parent];
+    i = parent;
+  }
+  hist->heap[i] = entry;
+}
+
+static void
+heap_sift_down(numeric_histogram_t *hist, long i)
+{
+  histogram_gap_t entry = hist->heap[i];
+  long len = hist->heap_len;
+  for (;;) {
+    long child = 2 * i + 1;
+    if (child >= len) {
+      break;
+    }
+    if (child + 1 < len && gap_less(&hist->heap[child + 1], &hist->heap[child])) {
+      child++;
+    }
+    if (!gap_less(&hist->heap[child], &entry)) {
+      break;
+    }
+    hist->heap[i] = hist->heap[child];
+    i = child;
+  }
+  hist->heap[i] = entry;
+}
+
+static void
+heap_pop(numeric_histogram_t *hist)
+{
+  hist->heap_len--;
+  if (hist->heap_len > 0) {
+    hist->heap[0] = hist->heap[hist->heap_len];
+    heap_sift_down(hist, 0);
+  }
+}
+
+// Rebuild the heap from scratch out of the current bins. Drops every stale
+// entry, so the heap never grows beyond a small multiple of the bin count.
+static void
+heap_rebuild(numeric_histogram_t *hist)
+{
+  long i;
+  long pairs = hist->bins_len > 1 ? hist->bins_len - 1 : 0;
+
+  if (pairs > hist->heap_capa) {
+    REALLOC_N(hist->heap, histogram_gap_t, pairs);
+    hist->heap_capa = pairs;
+  }
+
+  for (i = 0; i < pairs; i++) {
+    hist->heap[i].left = hist->bins[i].value;
+    hist->heap[i].right = hist->bins[i + 1].value;
+    hist->heap[i].gap = hist->bins[i + 1].value - hist->bins[i].value;
+  }
+  hist->heap_len = pairs;
+
+  for (i = pairs / 2 - 1; i >= 0; i--) {
+    heap_sift_down(hist, i);
+  }
+}
+
+// Record the gap between bins[index] and bins[index + 1], if both exist.
+static void
+heap_push_pair(numeric_histogram_t *hist, long index)
+{
+  histogram_gap_t *entry;
+
+  if (index < 0 || index + 1 >= hist->bins_len) {
+    return;
+  }
+
+  if (hist->heap_len > 4 * hist->bins_len + 16) {
+    // Mostly stale entries. A rebuild already covers this pair.
+    heap_rebuild(hist);
+    return;
+  }
+
+  if (hist->heap_len == hist->heap_capa) {
+    hist->heap_capa = hist->heap_capa ? hist->heap_capa * 2 : 16;
+    REALLOC_N(hist->heap, histogram_gap_t, hist->heap_capa);
+  }
+
+  entry = &hist->heap[hist->heap_len];
+  entry->left = hist->bins[index].value;
+  entry->right = hist->bins[index + 1].value;
+  entry->gap = entry->right - entry->left;
+  hist->heap_len++;
+  heap_sift_up(hist, hist->heap_len - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Bin manipulation
+////////////////////////////////////////////////////////////////////////////////
+
+// Index of the first bin with a value >= the given value. NaN values are
+// never added (see histogram_add and read_ruby_bins).
+static long
+lower_bound(const numeric_histogram_t *hist, double value)
+{
+  long lo = 0;
+  long hi = hist->bins_len;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (hist->bins[mid].value < value) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// If we exactly match an existing bin, add to it, otherwise create a new bin
+// holding a count for the new value.
+static void
+create_new_bin(numeric_histogram_t *hist, double value, uint64_t count)
+{
+  long index = lower_bound(hist, value);
+
+  if (index < hist->bins_len && hist->bins[index].value == value) {
+    hist->bins[index].count += count;
+    return;
+  }
+
+  reserve_bins(hist, hist->bins_len + 1);
+  memmove(&hist->bins[index + 1], &hist->bins[index],
+      (hist->bins_len - index) * sizeof(histogram_bin_t));
+  hist->bins[index].value = value;
+  hist->bins[index].count = count;
+  hist->bins_len++;
+
+  heap_push_pair(hist, index - 1);
+  heap_push_pair(hist, index);
+}
+
+// Pops heap entries until one describes two bins that are still adjacent.
+// Returns the index of the left bin, or -1 when the heap ran dry.
+static long
+pop_closest_pair(numeric_histogram_t *hist)
+{
+  while (hist->heap_len > 0) {
+    histogram_gap_t top = hist->heap[0];
+    long index = lower_bound(hist, top.left);
+
+    heap_pop(hist);
+
+    if (index + 1 < hist->bins_len &&
+        hist->bins[index].value == top.left &&
+        hist->bins[index + 1].value == top.right) {
+      return index;
+    }
+  }
+  return -1;
+}
+
+// The left index of the first closest pair of bins, found the slow way. Only
+// for when the heap can't find one; returns 0 if no gap compares as smallest.
+static long
+scan_closest_pair(const numeric_histogram_t *hist)
+{
+  long i;
+  long index = 0;
+  double smallest = INFINITY;
+
+  for (i = 0; i + 1 < hist->bins_len; i++) {
+    double gap = hist->bins[i + 1].value - hist->bins[i].value;
+    if (gap < smallest) {
+      smallest = gap;
+      index = i;
+    }
+  }
+  return index;
+}
+
+static void
+trim_one(numeric_histogram_t *hist)
+{
+  histogram_bin_t *left;
+  histogram_bin_t *right;
+  uint64_t merged_count;
+  double merged_value;
+  long index = pop_closest_pair(hist);
+
+  if (index < 0) {
+    heap_rebuild(hist);
+    index = pop_closest_pair(hist);
+  }
+  if (index < 0) {
+    index = scan_closest_pair(hist);
+  }
+
+  left = &hist->bins[index];
+  right = &hist->bins[index + 1];
+
+  // Create the merged bin with summed count, and weighted value
+  merged_count = left->count + right->count;
+  merged_value = (left->value * (double)left->count + right->value * (double)right->count) / (double)merged_count;
+
+  left->value = merged_value;
+  left->count = merged_count;
+
+  memmove(&hist->bins[index + 1], &hist->bins[index + 2],
+      (hist->bins_len - index - 2) * sizeof(histogram_bin_t));
+  hist->bins_len--;
+
+  heap_push_pair(hist, index - 1);
+  heap_push_pair(hist, index);
+}
+
+static void
+trim(numeric_histogram_t *hist)
+{
+  while (hist->bins_len > hist->max_bins && hist->bins_len > 1) {
+    trim_one(hist);
+  }
+}
+
+static double
+value_to_double(VALUE value)
+{
+  if (!FIXNUM_P(value) && TYPE(value) != T_FLOAT && TYPE(value) != T_BIGNUM) {
+    value = rb_funcall(value, id_to_f, 0);
+  }
+  return NUM2DBL(value);
+}
+
+// Replaces the bins with the sorted union of `bins` and `other`, summing the
+// counts of bins with identical values.
+static void
+merge_bins(numeric_histogram_t *hist, const histogram_bin_t *other, long other_len)
+{
+  histogram_bin_t *merged = ALLOC_N(histogram_bin_t, hist->bins_len + other_len + 1);
+  long len = 0;
+  long i = 0;
+  long j = 0;
+
+  while (i < hist->bins_len || j < other_len) {
+    histogram_bin_t next;
+
+    if (j >= other_len || (i < hist->bins_len && hist->bins[i].value < other[j].value)) {
+      next = hist->bins[i++];
+    } else {
+      next = other[j++];
+    }
+
+    if (len > 0 && merged[len - 1].value == next.value) {
+      merged[len - 1].count += next.count;
+    } else {
+      merged[len++] = next;
+    }
+  }
+
+  xfree(hist->bins);
+  hist->bins = merged;
+  hist->bins_len = len;
+  hist->bins_capa = hist->bins_len + other_len + 1;
+}
+
+static int
+compare_bins(const void *a, const void *b)
+{
+  double x = ((const histogram_bin_t *)a)->value;
+  double y = ((const histogram_bin_t *)b)->value;
+  return (x > y) - (x < y);
+}
+
+// Reads an Array of HistogramBin-like objects (anything with #value and
+// #count) into a sorted C array, held in the returned String so it's freed
+// even if reading a bin raises. Keep the String alive while using the bins.
+// NaN bins are dropped, and their counts added to *dropped.
+static VALUE
+read_ruby_bins(VALUE ary, long *len, uint64_t *dropped)
+{
+  long i;
+  long read = 0;
+  long ary_len;
+  VALUE buffer;
+  histogram_bin_t *bins;
+
+  Check_Type(ary, T_ARRAY);
+  ary_len = RARRAY_LEN(ary);
+  buffer = rb_str_new(NULL, (ary_len + 1) * sizeof(histogram_bin_t));
+  *dropped = 0;
+
+  for (i = 0; i < ary_len; i++) {
+    VALUE bin = rb_ary_entry(ary, i);
+    double value = value_to_double(rb_funcall(bin, id_value, 0));
+    uint64_t count = NUM2ULL(rb_funcall(bin, id_count, 0));
+
+    if (isnan(value)) {
+      *dropped += count;
+      continue;
+    }
+    bins = (histogram_bin_t *)RSTRING_PTR(buffer);
+    bins[read].value = value;
+    bins[read].count = count;
+    read++;
+  }
+
+  bins = (histogram_bin_t *)RSTRING_PTR(buffer);
+  qsort(bins, read, sizeof(histogram_bin_t), compare_bins);
+  *len = read;
+  return buffer;
+}
+
+static VALUE
+bins_to_ruby(const numeric_histogram_t *hist)
+{
+  long i;
+  VALUE cHistogramBin = rb_path2class("ScoutApm::HistogramBin");
+  VALUE ary = rb_ary_new2(hist->bins_len);
+
+  for (i = 0; i < hist->bins_len; i++) {
+    rb_ary_push(ary, rb_struct_new(cHistogramBin,
+          rb_float_new(hist->bins[i].value),
+          ULL2NUM(hist->bins[i].count)));
+  }
+  return ary;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ruby API
+////////////////////////////////////////////////////////////////////////////////
+
+static VALUE
+histogram_initialize(VALUE self, VALUE max_bins)
+{
+  numeric_histogram_t *hist = get_histogram(self);
+  hist->max_bins = NUM2LONG(max_bins);
+  hist->total = 0;
+  hist->bins_len = 0;
+  hist->heap_len = 0;
+  reserve_bins(hist, hist->max_bins + 1);
+  return self;
+}
+
+// NaN is ignored, as it has no place among the sorted bins.
+static VALUE
+histogram_add(int argc, VALUE *argv, VALUE self)
+{
+  VALUE new_value;
+  VALUE times;
+  double value;
+  long long count;
+  numeric_histogram_t *hist = get_histogram(self);
+
+  rb_scan_args(argc, argv, "11", &new_value, &times);
+  value = value_to_double(new_value);
+  count = NIL_P(times) ? 1 : NUM2LL(times);
+
+  if (isnan(value) || count <= 0) {
+    return self;
+  }
+
+  hist->total += count;
+  create_new_bin(hist, value, (uint64_t)count);
+  trim(hist);
+  return self;
+}
+
+static VALUE
+histogram_quantile(VALUE self, VALUE q_value)
+{
+  long i;
+  double count;
+  double q = NUM2DBL(q_value);
+  numeric_histogram_t *hist = get_histogram(self);
+
+  if (hist->total == 0 || hist->bins_len == 0) {
+    return INT2FIX(0);
+  }
+
+  if (q > 1) {
+    q = q / 100.0;
+  }
+
+  count = q * (double)hist->total;
+
+  for (i = 0; i < hist->bins_len; i++) {
+    count -= (double)hist->bins[i].count;
+
+    if (count <= 0) {
+      return rb_float_new(hist->bins[i].value);
+    }
+  }
+
+  // If we fell through, we were asking for the last (max) value
+  return rb_float_new(hist->bins[hist->bins_len - 1].value);
+}
+
+// Given a value, where in this histogram does it fall?
+// Returns a float between 0 and 1
+static VALUE
+histogram_approximate_quantile_of_value(VALUE self, VALUE v_value)
+{
+  long i;
+  uint64_t count_examined = 0;
+  double v = NUM2DBL(v_value);
+  numeric_histogram_t *hist = get_histogram(self);
+
+  if (hist->total == 0) {
+    return INT2FIX(100);
+  }
+
+  for (i = 0; i < hist->bins_len; i++) {
+    if (v <= hist->bins[i].value) {
+      break;
+    }
+    count_examined += hist->bins[i].count;
+  }
+
+  return rb_float_new((double)count_examined / (double)hist->total);
+}
+
+static VALUE
+histogram_mean(VALUE self)
+{
+  long i;
+  double sum = 0;
+  numeric_histogram_t *hist = get_histogram(self);
+
+  if (hist->total == 0) {
+    return INT2FIX(0);
+  }
+
+  for (i = 0; i < hist->bins_len; i++) {
+    sum += hist->bins[i].value * (double)hist->bins[i].count;
+  }
+  return rb_float_new(sum / (double)hist->total);
+}
+
+// Merges `other` into self. Other may be a NativeNumericHistogram, or any
+// object with #bins and #total (the pure Ruby NumericHistogram, loaded from an
+// older layaway file).
+static VALUE
+histogram_combine(VALUE self, VALUE other)
+{
+  numeric_histogram_t *hist = get_histogram(self);
+  long long other_total;
+
+  if (rb_obj_is_kind_of(other, cNativeNumericHistogram)) {
+    numeric_histogram_t *other_hist = get_histogram(other);
+    long other_len = other_hist->bins_len;
+    histogram_bin_t *other_bins = ALLOC_N(histogram_bin_t, other_len + 1);
+
+    // Copy first, in case other is self
+    memcpy(other_bins, other_hist->bins, other_len * sizeof(histogram_bin_t));
+    other_total = other_hist->total;
+    merge_bins(hist, other_bins, other_len);
+    xfree(other_bins);
+  } else {
+    long other_len;
+    uint64_t dropped;
+    VALUE other_bins = read_ruby_bins(rb_funcall(other, id_bins, 0), &other_len, &dropped);
+    other_total = NUM2LL(rb_funcall(other, id_total, 0)) - (long long)dropped;
+    merge_bins(hist, (const histogram_bin_t *)RSTRING_PTR(other_bins), other_len);
+    RB_GC_GUARD(other_bins);
+  }
+
+  hist->total += other_total;
+  heap_rebuild(hist);
+  trim(hist);
+  return self;
+}
+
+static VALUE
+histogram_as_json(VALUE self)
+{
+  long i;
+  numeric_histogram_t *hist = get_histogram(self);
+  VALUE ary = rb_ary_new2(hist->bins_len);
+
+  for (i = 0; i < hist->bins_len; i++) {
+    // Same rounding as ScoutApm::Utils::Numbers.round(value, 4)
+    double rounded = round(hist->bins[i].value * 10000) / 10000.0;
+    rb_ary_push(ary, rb_assoc_new(rb_float_new(rounded), ULL2NUM(hist->bins[i].count)));
+  }
+  return ary;
+}
+
+static VALUE
+histogram_bins(VALUE self)
+{
+  return bins_to_ruby(get_histogram(self));
+}
+
+static VALUE
+histogram_max_bins(VALUE self)
+{
+  return LONG2NUM(get_histogram(self)->max_bins);
+}
+
+static VALUE
+histogram_total(VALUE self)
+{
+  return LL2NUM(get_histogram(self)->total);
+}
+
+static VALUE
+histogram_set_total(VALUE self, VALUE total)
+{
+  get_histogram(self)->total = NUM2LL(total);
+  return total;
+}
+
+// Dumps in the same shape as NumericHistogram#marshal_dump, so layaway files
+// hold the same data regardless of which implementation wrote them.
+static VALUE
+histogram_marshal_dump(VALUE self)
+{
+  numeric_histogram_t *hist = get_histogram(self);
+  VALUE ary = rb_ary_new2(3);
+  rb_ary_push(ary, LONG2NUM(hist->max_bins));
+  rb_ary_push(ary, bins_to_ruby(hist));
+  rb_ary_push(ary, LL2NUM(hist->total));
+  return ary;
+}
+
+static VALUE
+histogram_marshal_load(VALUE self, VALUE ary)
+{
+  long len;
+  long max_bins;
+  long long total;
+  uint64_t dropped;
+  VALUE read;
+  histogram_bin_t *bins;
+  numeric_histogram_t *hist = get_histogram(self);
+
+  Check_Type(ary, T_ARRAY);
+  read = read_ruby_bins(rb_ary_entry(ary, 1), &len, &dropped);
+  max_bins = NUM2LONG(rb_ary_entry(ary, 0));
+  total = NUM2LL(rb_ary_entry(ary, 2)) - (long long)dropped;
+
+  // Nothing below raises
+  bins = ALLOC_N(histogram_bin_t, len + 1);
+  memcpy(bins, RSTRING_PTR(read), len * sizeof(histogram_bin_t));
+  RB_GC_GUARD(read);
+
+  xfree(hist->bins);
+  hist->max_bins = max_bins;
+  hist->total = total;
+  hist->bins = bins;
+  hist->bins_len = len;
+  hist->bins_capa = len + 1;
+  reserve_bins(hist, hist->max_bins + 1);
+  heap_rebuild(hist);
+  return self;
+}
+
+void Init_numeric_histogram()
+{
+  id_to_f = rb_intern("to_f");
+  id_bins = rb_intern("bins");
+  id_total = rb_intern("total");
+  id_value = rb_intern("value");
+  id_count = rb_intern("count");
+
+  mScoutApm = rb_define_module("ScoutApm");
+  cNativeNumericHistogram = rb_define_class_under(mScoutApm, "NativeNumericHistogram", rb_cObject);
+  rb_define_alloc_func(cNativeNumericHistogram, histogram_alloc);
+
+  rb_define_method(cNativeNumericHistogram, "initialize", histogram_initialize, 1);
+  rb_define_method(cNativeNumericHistogram, "add", histogram_add, -1);
+  rb_define_method(cNativeNumericHistogram, "quantile", histogram_quantile, 1);
+  rb_define_method(cNativeNumericHistogram, "approximate_quantile_of_value", histogram_approximate_quantile_of_value, 1);
+  rb_define_method(cNativeNumericHistogram, "mean", histogram_mean, 0);
+  rb_define_method(cNativeNumericHistogram, "combine!", histogram_combine, 1);
+  rb_define_method(cNativeNumericHistogram, "as_json", histogram_as_json, 0);
+  rb_define_method(cNativeNumericHistogram, "bins", histogram_bins, 0);
+  rb_define_method(cNativeNumericHistogram, "max_bins", histogram_max_bins, 0);
+  rb_define_method(cNativeNumericHistogram, "total", histogram_total, 0);
+  rb_define_method(cNativeNumericHistogram, "total=", histogram_set_total, 1);
+  rb_define_method(cNativeNumericHistogram, "marshal_dump", histogram_marshal_dump, 0);
+  rb_define_method(cNativeNumericHistogram, "marshal_load", histogram_marshal_load, 1);
+}
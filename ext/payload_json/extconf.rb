@@ -0,0 +1,5 @@
+require 'mkmf'
+
+have_header("ruby/ruby.h") # Needed to check for Ruby <= 1.8.7
+have_header("ruby/encoding.h")
+create_makefile('payload_json')
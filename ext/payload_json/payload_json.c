@@ -0,0 +1,255 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A native implementation of PayloadSerializerToJson.jsonify_hash (see
+// lib/scout_apm/serializers/payload_serializer_to_json.rb). The Ruby version is
+// the reference: this one must produce the same bytes for the same input,
+// quirks included:
+//
+// * Numerics are written with to_s, unquoted. So Infinity and Rationals come
+//   out as they always have.
+// * Times are quoted iso8601 strings.
+// * Everything else that isn't a Hash, Array or nil (true and false included)
+//   is written as a quoted string of its to_s.
+// * Strings only have \b \t \n \f \r and " escaped. The Ruby version's
+//   backslash substitution is a no-op, so backslashes are copied as is.
+//
+// The payload is written into a single growing String, and strings are
+// escaped in one pass that copies runs of bytes needing no escape at once.
+// Given an IO, the String is instead handed to its #write every
+// FLUSH_SIZE bytes, so only one chunk of the payload is held at a time.
+
+VALUE mScoutApm;
+VALUE mSerializers;
+VALUE mNativePayloadJson;
+
+static ID id_iso8601;
+static ID id_write;
+
+#define FLUSH_SIZE 16384
+
+typedef struct {
+  VALUE buf;
+  VALUE io; // Qnil to collect everything in buf
+} payload_out_t;
+
+// The IO may keep what it was given, so each chunk gets a new String.
+static void
+flush_out(payload_out_t *out)
+{
+  if (RSTRING_LEN(out->buf) > 0) {
+    rb_funcall(out->io, id_write, 1, out->buf);
+    out->buf = rb_str_buf_new(FLUSH_SIZE);
+  }
+}
+
+static void
+write_bytes(payload_out_t *out, const char *ptr, long len)
+{
+  rb_str_buf_cat(out->buf, ptr, len);
+  if (!NIL_P(out->io) && RSTRING_LEN(out->buf) >= FLUSH_SIZE) {
+    flush_out(out);
+  }
+}
+
+// Indexed by byte: the escape to write instead, or NULL to copy the byte
+static const char *escapes[256];
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Nonzero if any of these 8 bytes might need escaping: every byte to escape is
+// either below 0x0E, or a '"'. May also flag bytes that don't; those are then
+// checked one at a time.
+static uint64_t
+maybe_escape(uint64_t bytes)
+{
+  uint64_t quotes = bytes ^ (ONES * '"');
+  return (((bytes - ONES * 0x0E) & ~bytes) | ((quotes - ONES) & ~quotes)) & HIGHS;
+}
+
+static void
+write_escaped(payload_out_t *out, const char *str, long len)
+{
+  const char *run = str;
+  const char *p = str;
+  const char *end = str + len;
+  const char *escape;
+  uint64_t bytes;
+
+  while (p < end) {
+    if (end - p >= 8) {
+      memcpy(&bytes, p, 8);
+      if (!maybe_escape(bytes)) {
+        p += 8;
+        continue;
+      }
+    }
+
+    escape = escapes[(unsigned char)*p];
+    if (escape) {
+      write_bytes(out, run, p - run);
+      write_bytes(out, escape, 2);
+      run = p + 1;
+    }
+    p++;
+  }
+  write_bytes(out, run, end - run);
+}
+
+static void
+write_string(payload_out_t *out, VALUE str)
+{
+  write_bytes(out, "\"", 1);
+  write_escaped(out, RSTRING_PTR(str), RSTRING_LEN(str));
+  write_bytes(out, "\"", 1);
+  RB_GC_GUARD(str); // a flush calls io.write, which can run GC
+}
+
+static void encode_value(payload_out_t *out, VALUE value);
+
+typedef struct {
+  payload_out_t *out;
+  int first;
+} encode_state_t;
+
+static int
+encode_pair(VALUE key, VALUE value, VALUE arg)
+{
+  encode_state_t *state = (encode_state_t *)arg;
+
+  if (!state->first) {
+    write_bytes(state->out, ",", 1);
+  }
+  state->first = 0;
+
+  encode_value(state->out, key);
+  write_bytes(state->out, ":", 1);
+  encode_value(state->out, value);
+  return ST_CONTINUE;
+}
+
+static void
+encode_hash(payload_out_t *out, VALUE hash)
+{
+  encode_state_t state;
+
+  state.out = out;
+  state.first = 1;
+  write_bytes(out, "{", 1);
+  rb_hash_foreach(hash, encode_pair, (VALUE)&state);
+  write_bytes(out, "}", 1);
+}
+
+static void
+encode_array(payload_out_t *out, VALUE array)
+{
+  long i;
+
+  write_bytes(out, "[", 1);
+  // Indexed each time: encoding an element may call back into Ruby.
+  for (i = 0; i < RARRAY_LEN(array); i++) {
+    if (i > 0) {
+      write_bytes(out, ",", 1);
+    }
+    encode_value(out, rb_ary_entry(array, i));
+  }
+  write_bytes(out, "]", 1);
+}
+
+// Decides the same way format_by_type does, with the most common types first
+static void
+encode_value(payload_out_t *out, VALUE value)
+{
+  char digits[32];
+  const char *name;
+  VALUE str;
+
+  if (FIXNUM_P(value)) {
+    int len = snprintf(digits, sizeof(digits), "%ld", FIX2LONG(value));
+    write_bytes(out, digits, len);
+  } else if (NIL_P(value)) {
+    write_bytes(out, "null", 4);
+  } else if (SYMBOL_P(value)) {
+    name = rb_id2name(SYM2ID(value));
+    write_bytes(out, "\"", 1);
+    write_escaped(out, name, strlen(name));
+    write_bytes(out, "\"", 1);
+  } else if (TYPE(value) == T_STRING) {
+    write_string(out, value);
+  } else if (TYPE(value) == T_HASH) {
+    encode_hash(out, value);
+  } else if (TYPE(value) == T_ARRAY) {
+    encode_array(out, value);
+  } else if (RTEST(rb_obj_is_kind_of(value, rb_cNumeric))) {
+    str = rb_obj_as_string(value);
+    write_bytes(out, RSTRING_PTR(str), RSTRING_LEN(str));
+    RB_GC_GUARD(str);
+  } else if (RTEST(rb_obj_is_kind_of(value, rb_cTime))) {
+    str = rb_obj_as_string(rb_funcall(value, id_iso8601, 0));
+    write_bytes(out, "\"", 1);
+    write_bytes(out, RSTRING_PTR(str), RSTRING_LEN(str));
+    write_bytes(out, "\"", 1);
+    RB_GC_GUARD(str);
+  } else {
+    str = rb_obj_as_string(value);
+    write_string(out, str);
+    RB_GC_GUARD(str);
+  }
+}
+
+// jsonify_hash(hash, io = nil)
+//
+// Encodes a Hash as jsonify_hash does. Returns the JSON, or writes it to io in
+// chunks and returns io.
+static VALUE
+native_jsonify_hash(int argc, VALUE *argv, VALUE self)
+{
+  payload_out_t out;
+  VALUE hash, io;
+
+  rb_scan_args(argc, argv, "11", &hash, &io);
+  Check_Type(hash, T_HASH);
+
+  out.io = io;
+  out.buf = rb_str_buf_new(NIL_P(io) ? 4096 : FLUSH_SIZE);
+  encode_hash(&out, hash);
+
+  if (!NIL_P(io)) {
+    flush_out(&out);
+    return io;
+  }
+#ifdef HAVE_RUBY_ENCODING_H
+  rb_enc_associate(out.buf, rb_utf8_encoding());
+#endif
+  return out.buf;
+}
+
+void Init_payload_json()
+{
+  id_iso8601 = rb_intern("iso8601");
+  id_write = rb_intern("write");
+
+  escapes['\b'] = "\\b";
+  escapes['\t'] = "\\t";
+  escapes['\n'] = "\\n";
+  escapes['\f'] = "\\f";
+  escapes['\r'] = "\\r";
+  escapes['"'] = "\\\"";
+
+  mScoutApm = rb_define_module("ScoutApm");
+  mSerializers = rb_define_module_under(mScoutApm, "Serializers");
+  mNativePayloadJson = rb_define_module_under(mSerializers, "NativePayloadJson");
+  rb_define_module_function(mNativePayloadJson, "jsonify_hash", native_jsonify_hash, -1);
+}
@@ -5,6 +5,17 @@
 #define RUSAGE_CHILDREN 0
 #else
 #include <sys/resource.h>
+#include <time.h>
+#endif
+#include <sys/time.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
 #endif
 
 VALUE v_usage_struct;
@@ -58,6 +69,171 @@ static VALUE do_rusage_get(int who){
 #endif // _WIN32
 }
 
+// The accessors below read single fields without building an RUsage, so they
+// don't allocate: Integers are Fixnums, and Floats are flonums on 64-bit.
+#define RUSAGE_FIELDS 16
+
+static void rusage_read(int who, VALUE *values){
+  int i;
+#ifdef _WIN32
+  for(i = 0; i < RUSAGE_FIELDS; i++)
+    values[i] = i < 2 ? rb_float_new(0) : LONG2NUM(0);
+#else // _WIN32
+  struct rusage r;
+
+  if(getrusage(who, &r) == -1)
+    rb_sys_fail("getrusage");
+
+  i = 0;
+  values[i++] = rb_float_new((double)r.ru_utime.tv_sec+(double)r.ru_utime.tv_usec/1e6);
+  values[i++] = rb_float_new((double)r.ru_stime.tv_sec+(double)r.ru_stime.tv_usec/1e6);
+  values[i++] = LONG2NUM(r.ru_maxrss);
+  values[i++] = LONG2NUM(r.ru_ixrss);
+  values[i++] = LONG2NUM(r.ru_idrss);
+  values[i++] = LONG2NUM(r.ru_isrss);
+  values[i++] = LONG2NUM(r.ru_minflt);
+  values[i++] = LONG2NUM(r.ru_majflt);
+  values[i++] = LONG2NUM(r.ru_nswap);
+  values[i++] = LONG2NUM(r.ru_inblock);
+  values[i++] = LONG2NUM(r.ru_oublock);
+  values[i++] = LONG2NUM(r.ru_msgsnd);
+  values[i++] = LONG2NUM(r.ru_msgrcv);
+  values[i++] = LONG2NUM(r.ru_nsignals);
+  values[i++] = LONG2NUM(r.ru_nvcsw);
+  values[i++] = LONG2NUM(r.ru_nivcsw);
+#endif // _WIN32
+}
+
+static VALUE rusage_maxrss(VALUE mod){
+#ifdef _WIN32
+  return LONG2NUM(0);
+#else // _WIN32
+  struct rusage r;
+
+  if(getrusage(RUSAGE_SELF, &r) == -1)
+    rb_sys_fail("getrusage");
+  return LONG2NUM(r.ru_maxrss);
+#endif // _WIN32
+}
+
+// [utime, stime]
+static VALUE rusage_cpu_times(VALUE mod){
+  VALUE values[RUSAGE_FIELDS];
+
+  rusage_read(RUSAGE_SELF, values);
+  return rb_assoc_new(values[0], values[1]);
+}
+
+// Overwrites every field of an existing RUsage, for callers that keep one
+// around instead of asking for a new one each time.
+static VALUE rusage_into(VALUE mod, VALUE buffer){
+  VALUE values[RUSAGE_FIELDS];
+  int i;
+
+  if(!RTEST(rb_obj_is_kind_of(buffer, v_usage_struct)))
+    rb_raise(rb_eTypeError, "expected a Struct::RUsage");
+
+  rusage_read(RUSAGE_SELF, values);
+  for(i = 0; i < RUSAGE_FIELDS; i++)
+    rb_struct_aset(buffer, INT2FIX(i), values[i]);
+  return buffer;
+}
+
+// CPU time of the calling thread only, for attributing CPU to requests in a
+// multi-threaded server. Seconds, as a Float. 0.0 where the platform can't
+// tell threads apart; see thread_cpu_time_supported?.
+static VALUE thread_cpu_time(VALUE mod){
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+
+  if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1)
+    rb_sys_fail("clock_gettime");
+  return rb_float_new((double)ts.tv_sec+(double)ts.tv_nsec/1e9);
+#elif defined(RUSAGE_THREAD)
+  VALUE values[RUSAGE_FIELDS];
+
+  rusage_read(RUSAGE_THREAD, values);
+  return rb_float_new(NUM2DBL(values[0])+NUM2DBL(values[1]));
+#else
+  return rb_float_new(0);
+#endif
+}
+
+// Nanoseconds from an arbitrary starting point, for measuring durations. Never
+// jumps when the wall clock is set, and stays a Fixnum on 64-bit.
+static VALUE monotonic_ns(VALUE mod){
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    rb_sys_fail("clock_gettime");
+  return LL2NUM((long long)ts.tv_sec*1000000000LL+(long long)ts.tv_nsec);
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return LL2NUM((long long)tv.tv_sec*1000000000LL+(long long)tv.tv_usec*1000LL);
+#endif
+}
+
+// Current resident set size in bytes, or nil where it can't be read. Unlike
+// maxrss, this goes down when memory is given back.
+#if defined(__linux__)
+// /proc/self/statm is opened once and re-read with pread. It names the process
+// that opened it, so a forked child opens its own.
+static int statm_fd = -1;
+static long page_size;
+
+static void forget_statm(){
+  if(statm_fd != -1)
+    close(statm_fd);
+  statm_fd = -1;
+}
+
+static VALUE current_rss(VALUE mod){
+  char buf[128];
+  ssize_t len;
+  char *resident;
+
+  if(statm_fd == -1){
+    statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if(statm_fd == -1)
+      return Qnil;
+  }
+  len = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+  if(len <= 0)
+    return Qnil;
+  buf[len] = '\0';
+
+  // "size resident shared text lib data dt", in pages
+  resident = strchr(buf, ' ');
+  if(resident == NULL)
+    return Qnil;
+  return LL2NUM(strtoll(resident + 1, NULL, 10) * page_size);
+}
+#elif defined(__APPLE__)
+static VALUE current_rss(VALUE mod){
+  struct mach_task_basic_info info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+
+  if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+    return Qnil;
+  return ULL2NUM(info.resident_size);
+}
+#else
+static VALUE current_rss(VALUE mod){
+  return Qnil;
+}
+#endif
+
+static VALUE thread_cpu_time_supported_p(VALUE mod){
+#if defined(CLOCK_THREAD_CPUTIME_ID) || defined(RUSAGE_THREAD)
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
 static VALUE rusage_get(int argc, VALUE* argv, VALUE mod){
   return do_rusage_get(RUSAGE_SELF);
 }
@@ -66,6 +242,12 @@ static VALUE crusage_get(int argc, VALUE* argv, VALUE mod){
   return do_rusage_get(RUSAGE_CHILDREN);
 }
 
+#ifdef RUSAGE_THREAD
+static VALUE thread_rusage_get(int argc, VALUE* argv, VALUE mod){
+  return do_rusage_get(RUSAGE_THREAD);
+}
+#endif
+
 void Init_rusage(){
   v_usage_struct =
      rb_struct_define("RUsage","utime","stime","maxrss","ixrss","idrss",
@@ -75,4 +257,19 @@ void Init_rusage(){
 
   rb_define_module_function(rb_mProcess, "rusage", rusage_get, -1);
   rb_define_module_function(rb_mProcess, "crusage", crusage_get, -1);
+  rb_define_module_function(rb_mProcess, "rusage_maxrss", rusage_maxrss, 0);
+  rb_define_module_function(rb_mProcess, "rusage_cpu_times", rusage_cpu_times, 0);
+  rb_define_module_function(rb_mProcess, "rusage_into", rusage_into, 1);
+  rb_define_module_function(rb_mProcess, "thread_cpu_time", thread_cpu_time, 0);
+  rb_define_module_function(rb_mProcess, "monotonic_ns", monotonic_ns, 0);
+  rb_define_module_function(rb_mProcess, "current_rss", current_rss, 0);
+#if defined(__linux__)
+  page_size = sysconf(_SC_PAGESIZE);
+  pthread_atfork(NULL, NULL, forget_statm);
+#endif
+  rb_define_module_function(rb_mProcess, "thread_cpu_time_supported?", thread_cpu_time_supported_p, 0);
+#ifdef RUSAGE_THREAD
+  // Linux only
+  rb_define_module_function(rb_mProcess, "thread_rusage", thread_rusage_get, -1);
+#endif
 }
@@ -0,0 +1,13 @@
+require 'mkmf'
+
+have_header("ruby/ruby.h") # Needed to check for Ruby <= 1.8.7
+have_header("ruby/encoding.h")
+have_header("sys/mman.h")
+have_func("rb_enc_interned_str", "ruby.h")
+
+# The table is updated with the GCC/Clang __atomic builtins
+if try_link("int main() { long x = 0; __atomic_fetch_add(&x, 1, __ATOMIC_SEQ_CST); return (int)x; }")
+  $defs << "-DHAVE_ATOMIC_BUILTINS"
+end
+
+create_makefile('shared_metrics')
@@ -0,0 +1,948 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
+// A table of metrics in memory shared by a process and all the children it
+// forks. See lib/scout_apm/shared_metrics.rb for how the Store uses it.
+//
+// The table is an anonymous MAP_SHARED mapping of fixed-size slots, each
+// holding one metric for one minute. It's open addressed and lock free:
+//
+// * A slot is claimed for a key with a compare-and-swap of its state from
+//   EMPTY (or HARVESTED) to CLAIMED. The claimer writes the key, then
+//   publishes it by setting the state to READY.
+// * Stats are combined into a READY slot as MetricStats#combine! would, with
+//   atomic adds, and compare-and-swap loops for the doubles and min/max.
+// * Harvesting takes a READY slot back to CLAIMED while it's read, then
+//   leaves it HARVESTED for reuse.
+// * A process adding to a slot counts itself in the slot's writers, then
+//   checks it's still READY for its key. Harvesting waits for the writers to
+//   leave before reading the slot, and a HARVESTED slot is only reused once
+//   none are left. So an add that races a harvest either lands before the
+//   slot is read, or backs off and looks for its key again, and never in
+//   a slot that's since been given to another key. Only past minutes are
+//   harvested, so such races are rare.
+// * Each process has a record in the header of the slot it's claiming,
+//   harvesting or adding to. A process waiting on a slot keeps waiting while
+//   a live process is recorded on it, however long the other has been
+//   descheduled, and only gives up on one that has died.
+//
+// Metrics that don't fit - a long key, a MetricMeta with extras, a name that
+// needs more than ASCII case folding, or no free slot within MAX_PROBE - are
+// handed back to be kept in the process. So are all of a process' metrics
+// while every one of the MAX_PROCESSES records is held by a live process.
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_ATOMIC_BUILTINS)
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+VALUE mScoutApm;
+VALUE cNativeSharedMetrics;
+
+static ID id_metric_name;
+static ID id_metric_id;
+static ID id_scope;
+static ID id_desc;
+static ID id_extra;
+static ID id_client_id;
+static ID id_scoped;
+static ID id_call_count;
+static ID id_total_call_time;
+static ID id_total_exclusive_time;
+static ID id_min_call_time;
+static ID id_max_call_time;
+static ID id_sum_of_squares;
+static ID id_queue;
+static ID id_latency;
+static ID id_combine;
+
+#define STATE_EMPTY 0
+#define STATE_CLAIMED 1
+#define STATE_READY 2
+#define STATE_HARVESTED 3
+
+#define STAT_DOUBLES 5
+#define KEY_SIZE 176
+#define MAX_PROBE 64
+
+#define MAX_PROCESSES 1024
+
+// How long to spin on a slot another process is writing, before checking
+// whether that process is still alive. Then it's waited for WAIT_NS at a time,
+// for up to MAX_WAIT_NS, in case its pid has since been reused.
+#define SPIN_LIMIT 1000
+#define WAIT_NS 50000L
+#define MAX_WAIT_NS 1000000000LL
+
+// In the order of stat_double_ids
+#define STAT_TOTAL_CALL_TIME 0
+#define STAT_TOTAL_EXCLUSIVE_TIME 1
+#define STAT_MIN_CALL_TIME 2
+#define STAT_MAX_CALL_TIME 3
+#define STAT_SUM_OF_SQUARES 4
+
+static const ID *stat_double_ids[STAT_DOUBLES] = {
+  &id_total_call_time,
+  &id_total_exclusive_time,
+  &id_min_call_time,
+  &id_max_call_time,
+  &id_sum_of_squares,
+};
+
+// 256 bytes
+typedef struct {
+  uint32_t state;
+  uint32_t hash;
+  int64_t minute;
+  int64_t call_count;
+  uint64_t stats[STAT_DOUBLES]; // bits of doubles
+  uint16_t name_length;
+  uint16_t scope_length;
+  uint16_t desc_length;
+  uint8_t has_scope;
+  uint8_t has_desc;
+  uint8_t scoped;
+  uint8_t padding[3];
+  uint32_t writers; // processes combining into the slot right now
+  char key[KEY_SIZE]; // name, scope, desc
+} shared_slot_t;
+
+// A process using the table. slot is 1 + the index of the slot it's
+// claiming, harvesting or adding to, or 0.
+typedef struct {
+  int32_t pid;
+  uint32_t slot;
+} shared_process_t;
+
+typedef struct {
+  uint64_t overflows;
+  uint64_t padding[7];
+  shared_process_t processes[MAX_PROCESSES];
+} shared_header_t;
+
+typedef struct {
+  void *base;
+  size_t size;
+  shared_header_t *header;
+  shared_slot_t *slots;
+  long slot_count; // a power of 2
+  long owner_pid;
+  shared_process_t *process; // this process' record, see own_record
+  long process_pid;
+} shared_metrics_t;
+
+// A key being looked up, made from a MetricMeta
+typedef struct {
+  uint32_t hash;
+  int64_t minute;
+  const char *name;
+  long name_length;
+  int has_scope;
+  const char *scope;
+  long scope_length;
+  int has_desc;
+  const char *desc;
+  long desc_length;
+} shared_key_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory management
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+shared_metrics_free(void *ptr)
+{
+  shared_metrics_t *table = (shared_metrics_t *)ptr;
+  if (table->base) {
+    munmap(table->base, table->size);
+  }
+  xfree(table);
+}
+
+static VALUE
+shared_metrics_alloc(VALUE klass)
+{
+  shared_metrics_t *table;
+  VALUE obj = Data_Make_Struct(klass, shared_metrics_t, 0, shared_metrics_free, table);
+  table->base = NULL;
+  table->size = 0;
+  table->header = NULL;
+  table->slots = NULL;
+  table->slot_count = 0;
+  table->owner_pid = 0;
+  table->process = NULL;
+  table->process_pid = 0;
+  return obj;
+}
+
+static shared_metrics_t *
+get_table(VALUE self)
+{
+  shared_metrics_t *table;
+  Data_Get_Struct(self, shared_metrics_t, table);
+  if (!table->base) {
+    rb_raise(rb_eRuntimeError, "shared metrics table not initialized");
+  }
+  return table;
+}
+
+// initialize(slots)
+//
+// Maps a table of at least this many slots, rounded up to a power of 2.
+static VALUE
+shared_metrics_initialize(VALUE self, VALUE slots)
+{
+  shared_metrics_t *table;
+  long requested = NUM2LONG(slots);
+  long count = 1;
+  void *base;
+
+  Data_Get_Struct(self, shared_metrics_t, table);
+  if (table->base) {
+    rb_raise(rb_eRuntimeError, "shared metrics table already initialized");
+  }
+  if (requested < 1 || requested > (1L << 24)) {
+    rb_raise(rb_eArgError, "slots must be between 1 and %ld", 1L << 24);
+  }
+  while (count < requested) {
+    count <<= 1;
+  }
+
+  table->size = sizeof(shared_header_t) + (size_t)count * sizeof(shared_slot_t);
+  base = mmap(NULL, table->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+  if (base == MAP_FAILED) {
+    rb_sys_fail("mmap");
+  }
+
+  // Anonymous mappings start zeroed: every slot EMPTY
+  table->base = base;
+  table->header = (shared_header_t *)base;
+  table->slots = (shared_slot_t *)((char *)base + sizeof(shared_header_t));
+  table->slot_count = count;
+  table->owner_pid = (long)getpid();
+  return self;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Atomic stats
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+bits_to_double(uint64_t bits)
+{
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint64_t
+double_to_bits(double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static void
+atomic_add_double(uint64_t *target, double value)
+{
+  uint64_t seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(target, &seen, double_to_bits(bits_to_double(seen) + value),
+                                      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// MetricStats#combine!'s min: replaces a zero, or a larger value
+static void
+atomic_min_double(uint64_t *target, double value)
+{
+  uint64_t seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+  double current = bits_to_double(seen);
+  while (current == 0.0 || value < current) {
+    if (__atomic_compare_exchange_n(target, &seen, double_to_bits(value),
+                                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+    current = bits_to_double(seen);
+  }
+}
+
+static void
+atomic_max_double(uint64_t *target, double value)
+{
+  uint64_t seen = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (value > bits_to_double(seen)) {
+    if (__atomic_compare_exchange_n(target, &seen, double_to_bits(value),
+                                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+static void
+combine_into(shared_slot_t *slot, int64_t call_count, const double *stats)
+{
+  __atomic_fetch_add(&slot->call_count, call_count, __ATOMIC_RELAXED);
+  atomic_add_double(&slot->stats[STAT_TOTAL_CALL_TIME], stats[STAT_TOTAL_CALL_TIME]);
+  atomic_add_double(&slot->stats[STAT_TOTAL_EXCLUSIVE_TIME], stats[STAT_TOTAL_EXCLUSIVE_TIME]);
+  atomic_min_double(&slot->stats[STAT_MIN_CALL_TIME], stats[STAT_MIN_CALL_TIME]);
+  atomic_max_double(&slot->stats[STAT_MAX_CALL_TIME], stats[STAT_MAX_CALL_TIME]);
+  atomic_add_double(&slot->stats[STAT_SUM_OF_SQUARES], stats[STAT_SUM_OF_SQUARES]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Keys
+////////////////////////////////////////////////////////////////////////////////
+
+static VALUE
+ivar_or_nil(VALUE obj, ID id)
+{
+  return RTEST(rb_ivar_defined(obj, id)) ? rb_ivar_get(obj, id) : Qnil;
+}
+
+static char
+fold(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// MetricMeta#eql? downcases names. Only ASCII ones are kept here, where
+// folding A-Z is the same thing.
+static int
+ascii_string(VALUE str)
+{
+  const char *ptr = RSTRING_PTR(str);
+  long i;
+
+  for (i = 0; i < RSTRING_LEN(str); i++) {
+    if ((unsigned char)ptr[i] >= 0x80) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Strings are read back as UTF-8, so only those that read the same that way
+// are kept.
+static int
+sharable_string(VALUE str)
+{
+  if (TYPE(str) != T_STRING) {
+    return 0;
+  }
+#ifdef HAVE_RUBY_ENCODING_H
+  return rb_enc_get_index(str) == rb_utf8_encindex() || rb_enc_str_asciionly_p(str);
+#else
+  return 1;
+#endif
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t
+hash_bytes(uint64_t hash, const char *ptr, long length, int folded)
+{
+  long i;
+
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)(folded ? fold(ptr[i]) : ptr[i])) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// Fills in key from meta. Returns 0 if it can't be kept in the table.
+static int
+make_key(int64_t minute, VALUE meta, VALUE cMetricMeta, shared_key_t *key)
+{
+  VALUE name, scope, desc, extra;
+  uint64_t hash;
+
+  if (rb_obj_class(meta) != cMetricMeta) {
+    return 0;
+  }
+  name = ivar_or_nil(meta, id_metric_name);
+  scope = ivar_or_nil(meta, id_scope);
+  desc = ivar_or_nil(meta, id_desc);
+  extra = ivar_or_nil(meta, id_extra);
+
+  if (!sharable_string(name) || !ascii_string(name) ||
+      !(NIL_P(scope) || sharable_string(scope)) ||
+      !(NIL_P(desc) || sharable_string(desc)) ||
+      !NIL_P(ivar_or_nil(meta, id_metric_id)) ||
+      !NIL_P(ivar_or_nil(meta, id_client_id)) ||
+      TYPE(extra) != T_HASH || RHASH_SIZE(extra) != 0) {
+    return 0;
+  }
+
+  key->minute = minute;
+  key->name = RSTRING_PTR(name);
+  key->name_length = RSTRING_LEN(name);
+  key->has_scope = !NIL_P(scope);
+  key->scope = key->has_scope ? RSTRING_PTR(scope) : NULL;
+  key->scope_length = key->has_scope ? RSTRING_LEN(scope) : 0;
+  key->has_desc = !NIL_P(desc);
+  key->desc = key->has_desc ? RSTRING_PTR(desc) : NULL;
+  key->desc_length = key->has_desc ? RSTRING_LEN(desc) : 0;
+
+  if (key->name_length + key->scope_length + key->desc_length > KEY_SIZE) {
+    return 0;
+  }
+
+  hash = hash_bytes(FNV_OFFSET, (const char *)&minute, sizeof(minute), 0);
+  hash = hash_bytes(hash, key->name, key->name_length, 1);
+  hash = (hash ^ (uint64_t)key->has_scope) * FNV_PRIME;
+  hash = hash_bytes(hash, key->scope, key->scope_length, 0);
+  hash = (hash ^ (uint64_t)key->has_desc) * FNV_PRIME;
+  hash = hash_bytes(hash, key->desc, key->desc_length, 0);
+  key->hash = (uint32_t)(hash ^ (hash >> 32));
+  return 1;
+}
+
+// Fills in stats from a MetricStats. Returns 0 if it can't be kept in the
+// table.
+static int
+read_stats(VALUE value, VALUE cMetricStats, int *scoped, int64_t *call_count, double *stats)
+{
+  VALUE scoped_value, count, stat;
+  int i;
+
+  if (rb_obj_class(value) != cMetricStats) {
+    return 0;
+  }
+  scoped_value = ivar_or_nil(value, id_scoped);
+  count = ivar_or_nil(value, id_call_count);
+  if ((scoped_value != Qtrue && scoped_value != Qfalse) || !FIXNUM_P(count) ||
+      !NIL_P(ivar_or_nil(value, id_queue)) || !NIL_P(ivar_or_nil(value, id_latency))) {
+    return 0;
+  }
+  for (i = 0; i < STAT_DOUBLES; i++) {
+    stat = ivar_or_nil(value, *stat_double_ids[i]);
+    if (TYPE(stat) != T_FLOAT) {
+      return 0;
+    }
+    stats[i] = RFLOAT_VALUE(stat);
+  }
+  *scoped = scoped_value == Qtrue;
+  *call_count = FIX2LONG(count);
+  return 1;
+}
+
+static int
+slot_matches(const shared_slot_t *slot, const shared_key_t *key)
+{
+  const char *p = slot->key;
+  long i;
+
+  if (slot->hash != key->hash || slot->minute != key->minute ||
+      slot->name_length != key->name_length ||
+      slot->has_scope != key->has_scope || slot->scope_length != key->scope_length ||
+      slot->has_desc != key->has_desc || slot->desc_length != key->desc_length) {
+    return 0;
+  }
+  for (i = 0; i < key->name_length; i++) {
+    if (fold(p[i]) != fold(key->name[i])) {
+      return 0;
+    }
+  }
+  p += key->name_length;
+  if (memcmp(p, key->scope, key->scope_length) != 0) {
+    return 0;
+  }
+  p += key->scope_length;
+  return memcmp(p, key->desc, key->desc_length) == 0;
+}
+
+static int
+process_alive(int32_t pid)
+{
+  return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+}
+
+// Takes this process' record, unless it has one already. A forked child takes
+// its own. NULL if every record belongs to a live process. Called as add and
+// harvest start, so one that found none tries again the next time.
+static shared_process_t *
+own_record(shared_metrics_t *table)
+{
+  int32_t pid = (int32_t)getpid();
+  shared_process_t *record;
+  int32_t seen;
+  long i;
+
+  if (table->process && table->process_pid == pid) {
+    return table->process;
+  }
+  table->process = NULL;
+  table->process_pid = pid;
+
+  for (i = 0; i < MAX_PROCESSES; i++) {
+    record = &table->header->processes[i];
+    seen = __atomic_load_n(&record->pid, __ATOMIC_ACQUIRE);
+    // One with this pid was left by a process that's gone
+    if (seen != 0 && seen != pid && process_alive(seen)) {
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&record->pid, &seen, pid,
+                                    0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&record->slot, 0, __ATOMIC_SEQ_CST);
+      table->process = record;
+      return record;
+    }
+  }
+  return NULL;
+}
+
+// Records that this process is on the slot, or on none with NULL. Set before
+// the slot is touched, and cleared after, so whoever sees the slot busy also
+// sees the record.
+static void
+hold(shared_metrics_t *table, shared_slot_t *slot)
+{
+  shared_process_t *record = table->process_pid == (long)getpid() ? table->process : NULL;
+  if (record) {
+    __atomic_store_n(&record->slot, slot ? (uint32_t)(slot - table->slots) + 1 : 0, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Is another live process on the slot?
+static int
+slot_held(shared_metrics_t *table, shared_slot_t *slot)
+{
+  uint32_t index = (uint32_t)(slot - table->slots) + 1;
+  int32_t self = (int32_t)getpid();
+  shared_process_t *record;
+  int32_t pid;
+  long i;
+
+  for (i = 0; i < MAX_PROCESSES; i++) {
+    record = &table->header->processes[i];
+    if (__atomic_load_n(&record->slot, __ATOMIC_SEQ_CST) != index) {
+      continue;
+    }
+    pid = __atomic_load_n(&record->pid, __ATOMIC_ACQUIRE);
+    if (pid != 0 && pid != self && process_alive(pid)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static long long
+monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Called while the slot is busy, after spins of waiting on it. Returns 0 once
+// it's no use waiting: no live process is on the slot, or MAX_WAIT_NS has
+// passed. *since is when the waiting began, or 0 before the first check.
+static int
+keep_waiting(shared_metrics_t *table, shared_slot_t *slot, int spins, long long *since)
+{
+  struct timespec pause;
+
+  if (spins < SPIN_LIMIT) {
+    if (spins % 100 == 0) {
+      sched_yield();
+    }
+    return 1;
+  }
+  if (!slot_held(table, slot)) {
+    return 0;
+  }
+  if (*since == 0) {
+    *since = monotonic_ns();
+  } else if (monotonic_ns() - *since > MAX_WAIT_NS) {
+    return 0;
+  }
+  pause.tv_sec = 0;
+  pause.tv_nsec = WAIT_NS;
+  nanosleep(&pause, NULL);
+  return 1;
+}
+
+// Waits out another process writing a slot. Returns its state after. One
+// that stays CLAIMED belonged to a process that died mid-write, and is
+// skipped.
+static uint32_t
+settled_state(shared_metrics_t *table, shared_slot_t *slot)
+{
+  uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  long long since = 0;
+  int spins = 0;
+
+  while (state == STATE_CLAIMED && keep_waiting(table, slot, ++spins, &since)) {
+    state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+  }
+  // The holder may have finished just as it was checked
+  return __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+}
+
+// Claims a slot in state from for key, and publishes it with zeroed stats.
+// A HARVESTED slot isn't taken while a writer from before its harvest is
+// still in it.
+static int
+claim_slot(shared_metrics_t *table, shared_slot_t *slot, uint32_t from, const shared_key_t *key, int scoped)
+{
+  char *p = slot->key;
+
+  hold(table, slot);
+  if (!__atomic_compare_exchange_n(&slot->state, &from, STATE_CLAIMED,
+                                   0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    hold(table, NULL);
+    return 0;
+  }
+  if (__atomic_load_n(&slot->writers, __ATOMIC_SEQ_CST) != 0) {
+    __atomic_store_n(&slot->state, from, __ATOMIC_RELEASE);
+    hold(table, NULL);
+    return 0;
+  }
+
+  slot->hash = key->hash;
+  slot->minute = key->minute;
+  slot->call_count = 0;
+  memset(slot->stats, 0, sizeof(slot->stats));
+  slot->name_length = (uint16_t)key->name_length;
+  slot->has_scope = (uint8_t)key->has_scope;
+  slot->scope_length = (uint16_t)key->scope_length;
+  slot->has_desc = (uint8_t)key->has_desc;
+  slot->desc_length = (uint16_t)key->desc_length;
+  slot->scoped = (uint8_t)scoped;
+  memcpy(p, key->name, key->name_length);
+  p += key->name_length;
+  memcpy(p, key->scope, key->scope_length);
+  p += key->scope_length;
+  memcpy(p, key->desc, key->desc_length);
+
+  __atomic_store_n(&slot->state, STATE_READY, __ATOMIC_RELEASE);
+  hold(table, NULL);
+  return 1;
+}
+
+// Finds or claims the slot for key. NULL if there's no room for it.
+//
+// Two processes racing to claim slots for the same key can each get one.
+// That's rare, and harmless: harvest combines them.
+static shared_slot_t *
+find_slot(shared_metrics_t *table, const shared_key_t *key, int scoped)
+{
+  long mask = table->slot_count - 1;
+  long start = (long)key->hash & mask;
+  long probes = table->slot_count < MAX_PROBE ? table->slot_count : MAX_PROBE;
+  shared_slot_t *slot;
+  shared_slot_t *reusable;
+  shared_slot_t *empty;
+  uint32_t state;
+  long i;
+  int attempts;
+
+  // A claim fails when another process takes the slot first, or a writer is
+  // still leaving it. Look again, since it may have been for this key.
+  for (attempts = 0; attempts < 4; attempts++) {
+    reusable = NULL;
+    empty = NULL;
+
+    for (i = 0; i < probes; i++) {
+      slot = &table->slots[(start + i) & mask];
+      state = settled_state(table, slot);
+
+      if (state == STATE_READY && slot_matches(slot, key)) {
+        return slot;
+      } else if (state == STATE_HARVESTED && !reusable) {
+        reusable = slot;
+      } else if (state == STATE_EMPTY) {
+        // The end of the chain: key isn't in the table
+        empty = slot;
+        break;
+      }
+    }
+
+    if (reusable) {
+      if (claim_slot(table, reusable, STATE_HARVESTED, key, scoped)) {
+        return reusable;
+      }
+    } else if (empty) {
+      if (claim_slot(table, empty, STATE_EMPTY, key, scoped)) {
+        return empty;
+      }
+    } else {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Adding and harvesting
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  shared_metrics_t *table;
+  int64_t minute;
+  VALUE cMetricMeta;
+  VALUE cMetricStats;
+  VALUE leftovers;
+  int recorded; // has this process a record? See own_record
+} add_state_t;
+
+// Combines the stats into the slot for key, counted as one of its writers
+// while it does. Returns 0 if key has no slot.
+static int
+add_to_slot(shared_metrics_t *table, const shared_key_t *key, int scoped, int64_t call_count, const double *stats)
+{
+  shared_slot_t *slot;
+  int attempts;
+
+  // Each retry means the slot found was harvested in the meantime
+  for (attempts = 0; attempts < 4; attempts++) {
+    if (!(slot = find_slot(table, key, scoped))) {
+      return 0;
+    }
+
+    // Pairs with the harvester's swap to CLAIMED then read of writers: one
+    // of the two sees the other.
+    hold(table, slot);
+    __atomic_fetch_add(&slot->writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) == STATE_READY && slot_matches(slot, key)) {
+      combine_into(slot, call_count, stats);
+      __atomic_fetch_sub(&slot->writers, 1, __ATOMIC_SEQ_CST);
+      hold(table, NULL);
+      return 1;
+    }
+    __atomic_fetch_sub(&slot->writers, 1, __ATOMIC_SEQ_CST);
+    hold(table, NULL);
+  }
+  return 0;
+}
+
+static int
+add_metric(VALUE meta, VALUE value, VALUE arg)
+{
+  add_state_t *state = (add_state_t *)arg;
+  shared_key_t key;
+  double stats[STAT_DOUBLES];
+  int64_t call_count;
+  int scoped;
+
+  if (!state->recorded ||
+      !make_key(state->minute, meta, state->cMetricMeta, &key) ||
+      !read_stats(value, state->cMetricStats, &scoped, &call_count, stats) ||
+      !add_to_slot(state->table, &key, scoped, call_count, stats)) {
+    __atomic_fetch_add(&state->table->header->overflows, 1, __ATOMIC_RELAXED);
+    rb_hash_aset(state->leftovers, meta, value);
+  }
+  return ST_CONTINUE;
+}
+
+// add(minute, metrics)
+//
+// Combines a Hash of MetricMeta => MetricStats into the table for the minute
+// (an Integer, as in StoreReportingPeriodTimestamp#timestamp). Returns a Hash
+// of those that couldn't be.
+static VALUE
+shared_metrics_add(VALUE self, VALUE minute, VALUE metrics)
+{
+  add_state_t state;
+
+  Check_Type(metrics, T_HASH);
+  state.table = get_table(self);
+  state.minute = (int64_t)NUM2LL(minute);
+  state.cMetricMeta = rb_path2class("ScoutApm::MetricMeta");
+  state.cMetricStats = rb_path2class("ScoutApm::MetricStats");
+  state.leftovers = rb_hash_new();
+  state.recorded = own_record(state.table) != NULL;
+
+  rb_hash_foreach(metrics, add_metric, (VALUE)&state);
+  return state.leftovers;
+}
+
+static VALUE
+slot_string(const char *ptr, long length)
+{
+#if defined(HAVE_RB_ENC_INTERNED_STR)
+  return rb_enc_interned_str(ptr, length, rb_utf8_encoding());
+#else
+  VALUE str = rb_str_new(ptr, length);
+#ifdef HAVE_RUBY_ENCODING_H
+  rb_enc_associate(str, rb_utf8_encoding());
+#endif
+  return rb_obj_freeze(str);
+#endif
+}
+
+// Sets the same instance variables, in the same order, as the constructors.
+static void
+add_harvested(VALUE metrics, const shared_slot_t *slot, VALUE cMetricMeta, VALUE cMetricStats)
+{
+  VALUE meta = rb_obj_alloc(cMetricMeta);
+  VALUE stats = rb_obj_alloc(cMetricStats);
+  const char *p = slot->key;
+  VALUE existing;
+  int i;
+
+  rb_ivar_set(meta, id_metric_name, slot_string(p, slot->name_length));
+  p += slot->name_length;
+  rb_ivar_set(meta, id_metric_id, Qnil);
+  rb_ivar_set(meta, id_scope, slot->has_scope ? slot_string(p, slot->scope_length) : Qnil);
+  p += slot->scope_length;
+  rb_ivar_set(meta, id_desc, slot->has_desc ? slot_string(p, slot->desc_length) : Qnil);
+  rb_ivar_set(meta, id_extra, rb_hash_new());
+
+  rb_ivar_set(stats, id_scoped, slot->scoped ? Qtrue : Qfalse);
+  rb_ivar_set(stats, id_call_count, LL2NUM(slot->call_count));
+  for (i = 0; i < STAT_DOUBLES; i++) {
+    rb_ivar_set(stats, *stat_double_ids[i], rb_float_new(bits_to_double(slot->stats[i])));
+  }
+
+  existing = rb_hash_aref(metrics, meta);
+  if (NIL_P(existing)) {
+    rb_hash_aset(metrics, meta, stats);
+  } else {
+    rb_funcall(existing, id_combine, 1, stats);
+  }
+}
+
+// Writers that got in before the slot was CLAIMED finish their combine.
+// No new ones get past the state check. One that never leaves died mid-add,
+// and only its stats for this slot are lost. The slot is then never reused.
+static void
+wait_for_writers(shared_metrics_t *table, shared_slot_t *slot)
+{
+  long long since = 0;
+  int spins = 0;
+
+  while (__atomic_load_n(&slot->writers, __ATOMIC_SEQ_CST) != 0 &&
+         keep_waiting(table, slot, ++spins, &since)) {
+  }
+}
+
+// harvest(before_minute)
+//
+// Takes every metric for minutes before before_minute out of the table.
+// Returns a Hash of minute => Hash of MetricMeta => MetricStats. Processes
+// harvesting at once each get some of the metrics, never the same one.
+static VALUE
+shared_metrics_harvest(VALUE self, VALUE before_minute)
+{
+  shared_metrics_t *table = get_table(self);
+  int64_t before = (int64_t)NUM2LL(before_minute);
+  VALUE cMetricMeta = rb_path2class("ScoutApm::MetricMeta");
+  VALUE cMetricStats = rb_path2class("ScoutApm::MetricStats");
+  VALUE by_minute = rb_hash_new();
+  VALUE minute;
+  VALUE metrics;
+  shared_slot_t *slot;
+  shared_slot_t copy;
+  uint32_t ready;
+  long i;
+
+  // Without a record, processes waiting on a slot this one is harvesting take
+  // it for a dead one, and claim another for their key. harvest combines them.
+  own_record(table);
+
+  for (i = 0; i < table->slot_count; i++) {
+    slot = &table->slots[i];
+    ready = STATE_READY;
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != STATE_READY || slot->minute >= before) {
+      continue;
+    }
+    hold(table, slot);
+    if (!__atomic_compare_exchange_n(&slot->state, &ready, STATE_CLAIMED,
+                                     0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      hold(table, NULL);
+      continue;
+    }
+    wait_for_writers(table, slot);
+
+    // Copied out so the slot is held only as long as that takes
+    memcpy(&copy, slot, sizeof(copy));
+    copy.call_count = __atomic_load_n(&slot->call_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->state, STATE_HARVESTED, __ATOMIC_RELEASE);
+    hold(table, NULL);
+
+    minute = LL2NUM(copy.minute);
+    metrics = rb_hash_aref(by_minute, minute);
+    if (NIL_P(metrics)) {
+      metrics = rb_hash_new();
+      rb_hash_aset(by_minute, minute, metrics);
+    }
+    add_harvested(metrics, &copy, cMetricMeta, cMetricStats);
+  }
+  return by_minute;
+}
+
+static VALUE
+shared_metrics_slots(VALUE self)
+{
+  return LONG2NUM(get_table(self)->slot_count);
+}
+
+// The pid of the process that made the table. Only processes forked from it
+// share it.
+static VALUE
+shared_metrics_owner_pid(VALUE self)
+{
+  return LONG2NUM(get_table(self)->owner_pid);
+}
+
+// How many metrics, across every process, have been handed back by add
+static VALUE
+shared_metrics_overflows(VALUE self)
+{
+  return ULL2NUM(__atomic_load_n(&get_table(self)->header->overflows, __ATOMIC_RELAXED));
+}
+
+void Init_shared_metrics()
+{
+  id_metric_name = rb_intern("@metric_name");
+  id_metric_id = rb_intern("@metric_id");
+  id_scope = rb_intern("@scope");
+  id_desc = rb_intern("@desc");
+  id_extra = rb_intern("@extra");
+  id_client_id = rb_intern("@client_id");
+  id_scoped = rb_intern("@scoped");
+  id_call_count = rb_intern("@call_count");
+  id_total_call_time = rb_intern("@total_call_time");
+  id_total_exclusive_time = rb_intern("@total_exclusive_time");
+  id_min_call_time = rb_intern("@min_call_time");
+  id_max_call_time = rb_intern("@max_call_time");
+  id_sum_of_squares = rb_intern("@sum_of_squares");
+  id_queue = rb_intern("@queue");
+  id_latency = rb_intern("@latency");
+  id_combine = rb_intern("combine!");
+
+  mScoutApm = rb_define_module("ScoutApm");
+  cNativeSharedMetrics = rb_define_class_under(mScoutApm, "NativeSharedMetrics", rb_cObject);
+  rb_define_alloc_func(cNativeSharedMetrics, shared_metrics_alloc);
+
+  rb_define_method(cNativeSharedMetrics, "initialize", shared_metrics_initialize, 1);
+  rb_define_method(cNativeSharedMetrics, "add", shared_metrics_add, 2);
+  rb_define_method(cNativeSharedMetrics, "harvest", shared_metrics_harvest, 1);
+  rb_define_method(cNativeSharedMetrics, "slots", shared_metrics_slots, 0);
+  rb_define_method(cNativeSharedMetrics, "owner_pid", shared_metrics_owner_pid, 0);
+  rb_define_method(cNativeSharedMetrics, "overflows", shared_metrics_overflows, 0);
+}
+
+#else // No shared anonymous mappings or atomics: the Store keeps to layaway files
+
+void Init_shared_metrics()
+{
+}
+
+#endif
@@ -0,0 +1,424 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
+#include <string.h>
+
+// Normalizes SQL as the regexes in lib/scout_apm/utils/sql_sanitizer_regex.rb
+// do, giving the same output as SqlSanitizer's chain of gsub! calls for each
+// engine, without the intermediate strings.
+//
+// The SQL is copied once into the result string, leaving out any trailing
+// [[binds]]. A single tokenizing scan then rewrites it in place, replacing
+// string literals, $n placeholders and integers with ?. As each regex pass
+// saw the output of the one before, the scan checks word boundaries and
+// "LIMIT " against what it has already written. Last, a cleanup sweep
+// collapses IN lists, and runs of whitespace (or ?,? lists for MySQL), then
+// strips the ends. Every replacement is no longer than what it replaces, so
+// writing never overtakes reading.
+//
+// Only strings that can be scanned a byte at a time are handled here (UTF-8
+// and single byte encodings). sanitize returns nil for anything else, and the
+// regexes are used instead.
+
+#ifdef HAVE_RUBY_ENCODING_H
+
+VALUE mScoutApm;
+VALUE mNativeSqlSanitizer;
+
+static ID id_postgres;
+static ID id_mysql;
+static ID id_sqlite;
+
+typedef enum {
+  ENGINE_POSTGRES,
+  ENGINE_MYSQL,
+  ENGINE_SQLITE
+} engine_t;
+
+typedef struct {
+  char *s;           // the SQL being rewritten, in the result's buffer
+  long len;
+  rb_encoding *enc;
+  long last_single;  // index of the last ' in the SQL, or -1
+  long last_double;  // index of the last " outside of '' strings (MySQL), or -1
+} sanitizer_t;
+
+// \s in Ruby regexes
+static inline int
+is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// \d in Ruby regexes
+static inline int
+is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// Whether the character starting at p is a word character for \b
+static int
+is_word_at(const char *p, const char *end, rb_encoding *enc)
+{
+  unsigned char c = (unsigned char)*p;
+  if (c < 0x80) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_';
+  }
+  return rb_enc_isctype(rb_enc_mbc_to_codepoint(p, end, enc), ONIGENC_CTYPE_WORD, enc);
+}
+
+static int
+word_before(sanitizer_t *z, long w)
+{
+  const char *head;
+  if (w == 0) return 0;
+  head = rb_enc_left_char_head(z->s, z->s + w - 1, z->s + w, z->enc);
+  return is_word_at(head, z->s + w, z->enc);
+}
+
+static int
+word_at(sanitizer_t *z, long r)
+{
+  return r < z->len && is_word_at(z->s + r, z->s + z->len, z->enc);
+}
+
+static long
+last_index_of(const char *s, long from, long to, char c)
+{
+  long i;
+  for (i = to - 1; i >= from; i--) {
+    if (s[i] == c) return i;
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// [[binds]]
+////////////////////////////////////////////////////////////////////////////////
+
+// VAR_INTERPOLATION, %r|\[\[.*\]\]\s*$|, tried at s[i] == "[[". Returns the
+// end of the match, or -1.
+//
+// .* can't cross a line, so the ]] is the last on the line that's followed
+// by whitespace up to the end of a line. \s* can cross lines, and takes as
+// much of the whitespace as still leaves $ matching.
+static long
+match_binds(const char *s, long len, long i)
+{
+  long line_end = i + 2;
+  long j, k, m, e;
+
+  while (line_end < len && s[line_end] != '\n') line_end++;
+
+  for (j = line_end - 2; j >= i + 2; j--) {
+    if (s[j] != ']' || s[j + 1] != ']') continue;
+
+    k = j + 2;
+    for (m = k; m < len && is_space(s[m]); m++);
+    if (m == len) return len;
+
+    e = last_index_of(s, k, m, '\n');
+    if (e >= 0) return e;
+  }
+  return -1;
+}
+
+// Copies the SQL to dst without its [[binds]], returning the copied length
+static long
+copy_without_binds(const char *src, long len, char *dst)
+{
+  const char *open;
+  long r = 0, w = 0, e, n;
+
+  while (r < len && (open = memchr(src + r, '[', len - r)) != NULL) {
+    n = open - (src + r);
+    memcpy(dst + w, src + r, n);
+    w += n;
+    r += n;
+
+    if (r + 1 < len && src[r + 1] == '[' && (e = match_binds(src, len, r)) >= 0) {
+      r = e;
+    } else {
+      dst[w++] = src[r++];
+    }
+  }
+
+  memcpy(dst + w, src + r, len - r);
+  return w + (len - r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// String literals
+////////////////////////////////////////////////////////////////////////////////
+
+static long match_quoted(sanitizer_t *z, long o, char q, long last_quote, int backslash, int skip_singles);
+
+// The string regexes are all of the form q(?:\\q|[^q]|qq)*q (no \\q outside
+// MySQL). Matched with backtracking, a string can be closed by any later q,
+// so the alternatives that continue it are only taken while another q is
+// still to come. That makes the regex's match a single forward scan.
+//
+// With skip_singles, this is the double quote pass, which ran on the output
+// of the single quote one. '' strings are stepped over whole, as the ? they
+// became, and last_quote is the last " outside of them.
+static long
+match_quoted(sanitizer_t *z, long o, char q, long last_quote, int backslash, int skip_singles)
+{
+  const char *s = z->s;
+  long p = o + 1;
+
+  if (p > last_quote) return -1;
+
+  for (;;) {
+    char c = s[p];
+    int more = p + 2 <= last_quote;
+
+    if (backslash && c == '\\' && s[p + 1] == q && more) {
+      p += 2;
+    } else if (c == q) {
+      if (more && s[p + 1] == q) {
+        p += 2;
+      } else {
+        return p + 1;
+      }
+    } else if (skip_singles && c == '\'' && p < z->last_single) {
+      p = match_quoted(z, p, '\'', z->last_single, 1, 0);
+    } else {
+      p++;
+    }
+  }
+}
+
+// For MySQL, finds the last " that the double quote pass could see: the ones
+// left after '' strings were replaced.
+static long
+last_double_outside_singles(sanitizer_t *z)
+{
+  const char *single;
+  long r = 0, last = -1, found, n;
+
+  for (;;) {
+    single = r < z->len ? memchr(z->s + r, '\'', z->len - r) : NULL;
+    n = single ? single - z->s : z->len;
+
+    if (!single || n >= z->last_single) {
+      found = last_index_of(z->s, r, z->len, '"');
+      return found >= 0 ? found : last;
+    }
+
+    found = last_index_of(z->s, r, n, '"');
+    if (found >= 0) last = found;
+    r = match_quoted(z, n, '\'', z->last_single, 1, 0);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tokenizing
+////////////////////////////////////////////////////////////////////////////////
+
+// REMOVE_INTEGERS, /(?<!LIMIT )\b\d+\b/, at the digits s[r...q], with
+// everything before them already written up to w
+static int
+replaces_integer(sanitizer_t *z, long w, long q)
+{
+  if (w >= 6 && memcmp(z->s + w - 6, "LIMIT ", 6) == 0) return 0;
+  return !word_before(z, w) && !word_at(z, q);
+}
+
+static long
+tokenize(sanitizer_t *z, engine_t engine)
+{
+  char *s = z->s;
+  long len = z->len;
+  long r = 0, w = 0, q;
+
+  while (r < len) {
+    char c = s[r];
+
+    // PSQL_PLACEHOLDER, the first postgres pass
+    if (engine == ENGINE_POSTGRES && c == '$' && r + 1 < len && is_digit(s[r + 1])) {
+      for (r += 2; r < len && is_digit(s[r]); r++);
+      s[w++] = '?';
+      continue;
+    }
+
+    if (c == '\'' && r < z->last_single) {
+      r = match_quoted(z, r, '\'', z->last_single, engine == ENGINE_MYSQL, 0);
+      s[w++] = '?';
+      continue;
+    }
+
+    if (engine == ENGINE_MYSQL && c == '"' && r < z->last_double) {
+      r = match_quoted(z, r, '"', z->last_double, 1, 1);
+      s[w++] = '?';
+      continue;
+    }
+
+    if (is_digit(c)) {
+      for (q = r + 1; q < len && is_digit(s[q]); q++);
+      if (replaces_integer(z, w, q)) {
+        s[w++] = '?';
+      } else {
+        memmove(s + w, s + r, q - r);
+        w += q - r;
+      }
+      r = q;
+      continue;
+    }
+
+    s[w++] = s[r++];
+  }
+
+  return w;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cleanup
+////////////////////////////////////////////////////////////////////////////////
+
+// IN_CLAUSE, /IN\s+\(\?[^\)]*\)/, at s[r] == "IN". Sets *no_close once there
+// are no more )s, so later INs don't search for one.
+static long
+match_in_list(const char *s, long len, long r, int *no_close)
+{
+  const char *close;
+  long j = r + 2;
+
+  while (j < len && is_space(s[j])) j++;
+  if (j == r + 2 || j + 1 >= len || s[j] != '(' || s[j + 1] != '?') return -1;
+  if (*no_close) return -1;
+
+  close = memchr(s + j + 2, ')', len - (j + 2));
+  if (!close) {
+    *no_close = 1;
+    return -1;
+  }
+  return close - s + 1;
+}
+
+static long
+cleanup(char *s, long len, engine_t engine)
+{
+  long r = 0, w = 0, e, start;
+  int no_close = 0;
+
+  while (r < len) {
+    char c = s[r];
+
+    if (c == 'I' && r + 1 < len && s[r + 1] == 'N' && engine != ENGINE_SQLITE &&
+        (e = match_in_list(s, len, r, &no_close)) >= 0) {
+      memcpy(s + w, "IN (?)", 6);
+      w += 6;
+      r = e;
+      continue;
+    }
+
+    // MULTIPLE_SPACES
+    if (engine != ENGINE_MYSQL && is_space(c)) {
+      while (r < len && is_space(s[r])) r++;
+      s[w++] = ' ';
+      continue;
+    }
+
+    // MULTIPLE_QUESTIONS
+    if (engine == ENGINE_MYSQL && c == '?') {
+      for (r++; r + 1 < len && s[r] == ',' && s[r + 1] == '?'; r += 2);
+      s[w++] = '?';
+      continue;
+    }
+
+    s[w++] = s[r++];
+  }
+
+  // strip!
+  start = 0;
+  while (start < w && (is_space(s[start]) || s[start] == '\0')) start++;
+  while (w > start && (is_space(s[w - 1]) || s[w - 1] == '\0')) w--;
+  if (start > 0) memmove(s, s + start, w - start);
+
+  return w - start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ruby API
+////////////////////////////////////////////////////////////////////////////////
+
+static int
+scannable_encoding(rb_encoding *enc)
+{
+  return rb_enc_asciicompat(enc) && (rb_enc_mbmaxlen(enc) == 1 || enc == rb_utf8_encoding());
+}
+
+// NativeSqlSanitizer.sanitize(sql, engine), engine one of :postgres, :mysql
+// or :sqlite. Returns a new String, or nil if sql needs the regexes.
+static VALUE
+native_sanitize(VALUE self, VALUE sql, VALUE engine_sym)
+{
+  sanitizer_t z;
+  engine_t engine;
+  VALUE out;
+  ID engine_id;
+  long len;
+
+  Check_Type(sql, T_STRING);
+  Check_Type(engine_sym, T_SYMBOL);
+
+  engine_id = SYM2ID(engine_sym);
+  if (engine_id == id_postgres) {
+    engine = ENGINE_POSTGRES;
+  } else if (engine_id == id_mysql) {
+    engine = ENGINE_MYSQL;
+  } else if (engine_id == id_sqlite) {
+    engine = ENGINE_SQLITE;
+  } else {
+    rb_raise(rb_eArgError, "unknown database engine");
+  }
+
+  z.enc = rb_enc_get(sql);
+  if (!scannable_encoding(z.enc) || rb_enc_str_coderange(sql) == ENC_CODERANGE_BROKEN) {
+    return Qnil;
+  }
+
+  len = RSTRING_LEN(sql);
+  out = rb_str_buf_new(len);
+
+  z.s = RSTRING_PTR(out);
+  z.len = copy_without_binds(RSTRING_PTR(sql), len, z.s);
+  z.last_single = last_index_of(z.s, 0, z.len, '\'');
+  z.last_double = engine == ENGINE_MYSQL ? last_double_outside_singles(&z) : -1;
+
+  len = tokenize(&z, engine);
+  len = cleanup(z.s, len, engine);
+
+  rb_str_set_len(out, len);
+  rb_enc_associate(out, z.enc);
+  RB_GC_GUARD(sql);
+  return out;
+}
+
+void Init_sql_sanitizer()
+{
+  id_postgres = rb_intern("postgres");
+  id_mysql = rb_intern("mysql");
+  id_sqlite = rb_intern("sqlite");
+
+  mScoutApm = rb_define_module("ScoutApm");
+  mNativeSqlSanitizer = rb_define_module_under(mScoutApm, "NativeSqlSanitizer");
+  rb_define_module_function(mNativeSqlSanitizer, "sanitize", native_sanitize, 2);
+}
+
+#else // Ruby <= 1.8.7, which keeps to the regexes
+
+void Init_sql_sanitizer()
+{
+}
+
+#endif
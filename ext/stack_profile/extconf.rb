@@ -0,0 +1,8 @@
+require 'mkmf'
+
+have_header("ruby/ruby.h") # Needed to check for Ruby <= 1.8.7
+have_header("ruby/debug.h")
+have_func("rb_profile_frames", "ruby/debug.h")
+have_func("rb_postponed_job_preregister", "ruby/debug.h")
+have_func("setitimer", "sys/time.h")
+create_makefile('stack_profile')
@@ -0,0 +1,429 @@
+#ifdef HAVE_RUBY_RUBY_H
+#include <ruby/ruby.h>
+#else // Ruby <= 1.8.7
+#include <ruby.h>
+#endif
+
+VALUE mScoutApm;
+VALUE cNativeStackProfile;
+
+// Samples the call stack of the threads running requests, for
+// ScoutApm::StackProfiling.
+//
+// A process-wide ITIMER_PROF timer raises SIGPROF every interval of CPU
+// time. The signal handler only asks Ruby to run sample_job at its next safe
+// point, which happens on whichever thread holds the GVL, i.e. the one that
+// was running Ruby code. If that thread has a profile started, sample_job
+// copies its frames from rb_profile_frames into the profile's ring buffer.
+//
+// A profile's buffer is allocated once, up front, for max_samples stacks of
+// up to max_depth frames. Once full, new samples replace the oldest. Samples
+// are only the frame objects and line numbers: nothing is turned into
+// strings until #stacks is called, which is only done for requests that are
+// kept as slow transactions.
+//
+// Everything but the signal handler runs with the GVL held, so the list of
+// started profiles needs no lock.
+
+#if defined(HAVE_RB_PROFILE_FRAMES) && defined(HAVE_SETITIMER) && !defined(_WIN32)
+
+#include <ruby/debug.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+// rb_profile_frames gives up past this
+#define MAX_DEPTH_LIMIT 1024
+
+// Requests that can be sampled at once. Past this, start returns false.
+#define MAX_STARTED 256
+
+typedef struct {
+  VALUE thread;     // the thread being sampled, or Qnil when not started
+  int max_samples;
+  int max_depth;
+  VALUE *frames;    // max_samples * max_depth
+  int *lines;       // max_samples * max_depth
+  int *depths;      // max_samples
+  long taken;       // samples taken since start. The latest is at (taken - 1) % max_samples
+  int started_at;   // this profile's index in started, or -1
+} stack_profile_t;
+
+static stack_profile_t *started[MAX_STARTED];
+static int started_count;
+
+static int handler_installed;
+static struct sigaction previous_action;
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t sample_job_handle;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Sampling
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+take_sample(stack_profile_t *profile)
+{
+  long slot = profile->taken % profile->max_samples;
+  long offset = slot * profile->max_depth;
+
+  // Frame 0 is this job's caller, whatever Ruby was running
+  profile->depths[slot] = rb_profile_frames(0, profile->max_depth, profile->frames + offset, profile->lines + offset);
+  profile->taken++;
+}
+
+static void
+sample_job(void *data)
+{
+  VALUE thread;
+  int i;
+
+  if (started_count == 0) {
+    return;
+  }
+
+  thread = rb_thread_current();
+  for (i = 0; i < started_count; i++) {
+    if (started[i]->thread == thread) {
+      take_sample(started[i]);
+      return;
+    }
+  }
+}
+
+static void
+sigprof_handler(int sig, siginfo_t *info, void *ucontext)
+{
+  int saved_errno = errno;
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+  rb_postponed_job_trigger(sample_job_handle);
+#else
+  rb_postponed_job_register_one(0, sample_job, 0);
+#endif
+  errno = saved_errno;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory management
+////////////////////////////////////////////////////////////////////////////////
+
+static long
+samples_kept(stack_profile_t *profile)
+{
+  return profile->taken < profile->max_samples ? profile->taken : profile->max_samples;
+}
+
+static void
+unlist(stack_profile_t *profile)
+{
+  int i = profile->started_at;
+
+  if (i < 0) {
+    return;
+  }
+
+  started_count--;
+  started[i] = started[started_count];
+  started[i]->started_at = i;
+  started[started_count] = NULL;
+  profile->started_at = -1;
+}
+
+static void
+profile_mark(void *ptr)
+{
+  stack_profile_t *profile = (stack_profile_t *)ptr;
+  long s, kept = samples_kept(profile);
+  int d;
+
+  rb_gc_mark(profile->thread);
+  for (s = 0; s < kept; s++) {
+    VALUE *frames = profile->frames + s * profile->max_depth;
+    for (d = 0; d < profile->depths[s]; d++) {
+      rb_gc_mark(frames[d]);
+    }
+  }
+}
+
+static void
+profile_free(void *ptr)
+{
+  stack_profile_t *profile = (stack_profile_t *)ptr;
+  unlist(profile);
+  xfree(profile->frames);
+  xfree(profile->lines);
+  xfree(profile->depths);
+  xfree(profile);
+}
+
+static VALUE
+profile_alloc(VALUE klass)
+{
+  stack_profile_t *profile;
+  VALUE obj = Data_Make_Struct(klass, stack_profile_t, profile_mark, profile_free, profile);
+  profile->thread = Qnil;
+  profile->max_samples = 0;
+  profile->max_depth = 0;
+  profile->frames = NULL;
+  profile->lines = NULL;
+  profile->depths = NULL;
+  profile->taken = 0;
+  profile->started_at = -1;
+  return obj;
+}
+
+static stack_profile_t *
+get_profile(VALUE self)
+{
+  stack_profile_t *profile;
+  Data_Get_Struct(self, stack_profile_t, profile);
+  return profile;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ruby API
+////////////////////////////////////////////////////////////////////////////////
+
+static VALUE
+profile_initialize(VALUE self, VALUE rb_max_samples, VALUE rb_max_depth)
+{
+  stack_profile_t *profile = get_profile(self);
+  int max_samples = NUM2INT(rb_max_samples);
+  int max_depth = NUM2INT(rb_max_depth);
+
+  if (profile->frames != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized");
+  }
+  if (max_samples < 1 || max_depth < 1 || max_depth > MAX_DEPTH_LIMIT) {
+    rb_raise(rb_eArgError, "max_samples must be positive, and max_depth between 1 and %d", MAX_DEPTH_LIMIT);
+  }
+
+  profile->frames = ALLOC_N(VALUE, (long)max_samples * max_depth);
+  profile->lines = ALLOC_N(int, (long)max_samples * max_depth);
+  profile->depths = ALLOC_N(int, max_samples);
+  memset(profile->depths, 0, sizeof(int) * max_samples);
+  profile->max_samples = max_samples;
+  profile->max_depth = max_depth;
+  return self;
+}
+
+// Starts sampling the current thread into this profile, dropping any samples
+// it had. A thread samples into one profile at a time, so any other profile
+// started on it is stopped. Returns false if too many profiles are already
+// started.
+static VALUE
+profile_start(VALUE self)
+{
+  stack_profile_t *profile = get_profile(self);
+  VALUE thread = rb_thread_current();
+  int i;
+
+  for (i = 0; i < started_count; i++) {
+    stack_profile_t *other = started[i];
+    if (other != profile && other->thread == thread) {
+      unlist(other);
+      other->thread = Qnil;
+      break;
+    }
+  }
+
+  if (profile->started_at < 0) {
+    if (started_count >= MAX_STARTED) {
+      return Qfalse;
+    }
+    profile->started_at = started_count;
+    started[started_count++] = profile;
+  }
+
+  profile->thread = thread;
+  profile->taken = 0;
+  return Qtrue;
+}
+
+// Stops sampling, keeping the samples taken
+static VALUE
+profile_stop(VALUE self)
+{
+  stack_profile_t *profile = get_profile(self);
+  unlist(profile);
+  profile->thread = Qnil;
+  return Qnil;
+}
+
+static VALUE
+profile_started_p(VALUE self)
+{
+  return get_profile(self)->started_at >= 0 ? Qtrue : Qfalse;
+}
+
+// Samples taken since start, including ones since replaced
+static VALUE
+profile_taken(VALUE self)
+{
+  return LONG2NUM(get_profile(self)->taken);
+}
+
+static VALUE
+profile_max_samples(VALUE self)
+{
+  return INT2NUM(get_profile(self)->max_samples);
+}
+
+// Labels are qualified with the class ("Foo#bar"), which reads better in a
+// flame graph than a bare method name.
+static VALUE
+frame_string(VALUE frame, int line)
+{
+  VALUE path = rb_profile_frame_path(frame);
+  VALUE label = rb_profile_frame_full_label(frame);
+
+  if (NIL_P(path)) {
+    path = rb_str_new_cstr("(native)");
+  }
+  if (NIL_P(label)) {
+    label = rb_str_new_cstr("(unknown)");
+  }
+  if (line > 0) {
+    return rb_obj_freeze(rb_sprintf("%"PRIsVALUE":%d:in `%"PRIsVALUE"'", path, line, label));
+  }
+  return rb_obj_freeze(rb_sprintf("%"PRIsVALUE":in `%"PRIsVALUE"'", path, label));
+}
+
+// The samples kept, as [[frame, ...], count] pairs, one per distinct stack.
+// Frames are "path:line:in `label'" strings, outermost
+// first, and a frame's string is shared between the stacks it's in.
+static VALUE
+profile_stacks(VALUE self)
+{
+  stack_profile_t *profile = get_profile(self);
+  long s, kept = samples_kept(profile);
+  VALUE strings = rb_hash_new(); // frame => { line => string }
+  VALUE counts = rb_hash_new();  // stack => count
+  VALUE result;
+
+  rb_funcall(strings, rb_intern("compare_by_identity"), 0);
+
+  for (s = 0; s < kept; s++) {
+    VALUE *frames = profile->frames + s * profile->max_depth;
+    int *lines = profile->lines + s * profile->max_depth;
+    int depth = profile->depths[s];
+    VALUE stack = rb_ary_new_capa(depth);
+    VALUE count;
+    int d;
+
+    for (d = depth - 1; d >= 0; d--) {
+      VALUE by_line = rb_hash_lookup2(strings, frames[d], Qnil);
+      VALUE str;
+
+      if (NIL_P(by_line)) {
+        by_line = rb_hash_new();
+        rb_hash_aset(strings, frames[d], by_line);
+      }
+      str = rb_hash_lookup2(by_line, INT2FIX(lines[d]), Qnil);
+      if (NIL_P(str)) {
+        str = frame_string(frames[d], lines[d]);
+        rb_hash_aset(by_line, INT2FIX(lines[d]), str);
+      }
+      rb_ary_push(stack, str);
+    }
+
+    count = rb_hash_lookup2(counts, stack, INT2FIX(0));
+    rb_hash_aset(counts, stack, LONG2FIX(FIX2LONG(count) + 1));
+  }
+
+  result = rb_funcall(counts, rb_intern("to_a"), 0);
+  RB_GC_GUARD(self);
+  return result;
+}
+
+// Starts (or retunes) the SIGPROF timer, firing every interval_usec of CPU
+// time. The timer doesn't survive a fork, so call this again in the child.
+static VALUE
+native_start_timer(VALUE klass, VALUE rb_interval_usec)
+{
+  long interval_usec = NUM2LONG(rb_interval_usec);
+  struct itimerval timer;
+
+  if (interval_usec < 1) {
+    rb_raise(rb_eArgError, "interval must be positive");
+  }
+
+  if (!handler_installed) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = sigprof_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+      rb_sys_fail("sigaction");
+    }
+    handler_installed = 1;
+  }
+
+  timer.it_interval.tv_sec = interval_usec / 1000000;
+  timer.it_interval.tv_usec = interval_usec % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    rb_sys_fail("setitimer");
+  }
+  return Qtrue;
+}
+
+// Stops the timer, and gives SIGPROF back to whoever had it before
+static VALUE
+native_stop_timer(VALUE klass)
+{
+  struct itimerval timer;
+
+  if (!handler_installed) {
+    return Qfalse;
+  }
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  sigaction(SIGPROF, &previous_action, NULL);
+  handler_installed = 0;
+  return Qtrue;
+}
+
+// Takes a sample now, as the timer would. For tests.
+static VALUE
+native_sample(VALUE klass)
+{
+  sample_job(0);
+  return Qnil;
+}
+
+void Init_stack_profile()
+{
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+  sample_job_handle = rb_postponed_job_preregister(0, sample_job, NULL);
+#endif
+
+  mScoutApm = rb_define_module("ScoutApm");
+  cNativeStackProfile = rb_define_class_under(mScoutApm, "NativeStackProfile", rb_cObject);
+  rb_define_alloc_func(cNativeStackProfile, profile_alloc);
+
+  rb_define_singleton_method(cNativeStackProfile, "start_timer", native_start_timer, 1);
+  rb_define_singleton_method(cNativeStackProfile, "stop_timer", native_stop_timer, 0);
+  rb_define_singleton_method(cNativeStackProfile, "sample", native_sample, 0);
+
+  rb_define_method(cNativeStackProfile, "initialize", profile_initialize, 2);
+  rb_define_method(cNativeStackProfile, "start", profile_start, 0);
+  rb_define_method(cNativeStackProfile, "stop", profile_stop, 0);
+  rb_define_method(cNativeStackProfile, "started?", profile_started_p, 0);
+  rb_define_method(cNativeStackProfile, "taken", profile_taken, 0);
+  rb_define_method(cNativeStackProfile, "max_samples", profile_max_samples, 0);
+  rb_define_method(cNativeStackProfile, "stacks", profile_stacks, 0);
+}
+
+#else // No rb_profile_frames or setitimer, so no profiling
+
+void Init_stack_profile()
+{
+}
+
+#endif
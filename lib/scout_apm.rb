@@ -68,6 +68,7 @@ require 'scout_apm/platform_integrations/cloud_foundry'
 require 'scout_apm/platform_integrations/server'
 
 require 'scout_apm/histogram'
+require 'numeric_histogram'
 
 require 'scout_apm/instruments/net_http'
 require 'scout_apm/instruments/http_client'
@@ -86,25 +87,38 @@ require 'scout_apm/instruments/rails_router'
 require 'scout_apm/instruments/grape'
 require 'scout_apm/instruments/sinatra'
 require 'allocations'
+require 'scout_apm/allocation_tracking'
+require 'stack_profile'
+require 'scout_apm/stack_profiling'
+require 'scout_apm/agent_overhead'
+require 'scout_apm/request_sampling'
 
 require 'scout_apm/instruments/process/process_cpu'
 require 'scout_apm/instruments/process/process_memory'
+require 'scout_apm/instruments/process/process_allocations'
+require 'scout_apm/instruments/process/process_gc'
 require 'scout_apm/instruments/percentile_sampler'
+require 'scout_apm/instruments/recorder_sampler'
+require 'scout_apm/instruments/agent_overhead_sampler'
 require 'scout_apm/instruments/samplers'
 
 require 'scout_apm/app_server_load'
 
 require 'scout_apm/ignored_uris.rb'
 require 'scout_apm/utils/active_record_metric_name'
+require 'backtrace_frames'
 require 'scout_apm/utils/backtrace_parser'
 require 'scout_apm/utils/installed_gems'
 require 'scout_apm/utils/klass_helper'
 require 'scout_apm/utils/scm'
+require 'sql_sanitizer'
 require 'scout_apm/utils/sql_sanitizer'
+require 'scout_apm/utils/sql_cache'
 require 'scout_apm/utils/time'
 require 'scout_apm/utils/unique_id'
 require 'scout_apm/utils/numbers'
 require 'scout_apm/utils/gzip_helper'
+require 'scout_apm/utils/gzip_stream'
 
 require 'scout_apm/config'
 require 'scout_apm/environment'
@@ -113,6 +127,10 @@ require 'scout_apm/logger'
 require 'scout_apm/reporting'
 require 'scout_apm/layaway'
 require 'scout_apm/layaway_file'
+require 'layaway_format'
+require 'scout_apm/layaway_format'
+require 'shared_metrics'
+require 'scout_apm/shared_metrics'
 require 'scout_apm/reporter'
 require 'scout_apm/background_worker'
 require 'scout_apm/bucket_name_splitter'
@@ -125,8 +143,10 @@ require 'scout_apm/tracer'
 require 'scout_apm/context'
 require 'scout_apm/instant_reporting'
 require 'scout_apm/background_recorder'
+require 'scout_apm/background_reporter'
 require 'scout_apm/synchronous_recorder'
 
+require 'scout_apm/metric_key'
 require 'scout_apm/metric_meta'
 require 'scout_apm/metric_stats'
 require 'scout_apm/db_query_metric_stats'
@@ -142,6 +162,7 @@ require 'scout_apm/attribute_arranger'
 require 'scout_apm/git_revision'
 
 require 'scout_apm/serializers/payload_serializer'
+require 'payload_json'
 require 'scout_apm/serializers/payload_serializer_to_json'
 require 'scout_apm/serializers/jobs_serializer_to_json'
 require 'scout_apm/serializers/slow_jobs_serializer_to_json'
@@ -37,10 +37,13 @@ module ScoutApm
 
       logger.info "Scout Agent [#{ScoutApm::VERSION}] Initialized"
 
+      context.allocation_tracking.install!
+
       instrument_manager.install! if should_load_instruments? || force
 
       install_background_job_integrations
       install_app_server_integration
+      install_shared_metrics
 
       logger.info "Scout Agent [#{ScoutApm::VERSION}] Installed"
 
@@ -114,6 +117,19 @@ module ScoutApm
       logger.info "Installed Application Server Integration [#{context.environment.app_server}]."
     end
 
+    # The shared metrics table has to be made before the app server forks its
+    # workers, so it's made here, in the process that will do the forking.
+    def install_shared_metrics
+      return unless context.config.value('shared_memory_aggregation')
+      return unless context.environment.forking? && SharedMetrics.available?
+      return if context.shared_metrics
+
+      context.shared_metrics = SharedMetrics.new(context.config.value('shared_memory_slots'))
+      logger.info "Installed Shared Memory Aggregation [#{context.shared_metrics.slots} slots]"
+    rescue => e
+      logger.warn "Unable to install Shared Memory Aggregation: #{e.message}"
+    end
+
     # If true, the agent will start regardless of safety checks.
     def force?
       @options[:force]
@@ -186,6 +202,7 @@ module ScoutApm
           @background_worker_thread.wakeup
           @background_worker_thread.join
         end
+        context.background_reporter.stop if context.config.value('async_reporting')
       end
     end
 
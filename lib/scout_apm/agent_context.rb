@@ -91,6 +91,24 @@ module ScoutApm
       @ignored_uris ||= ScoutApm::IgnoredUris.new(config.value('ignore'))
     end
 
+    def allocation_tracking
+      @allocation_tracking ||= ScoutApm::AllocationTracking.new(self)
+    end
+
+    def stack_profiling
+      @stack_profiling ||= ScoutApm::StackProfiling.new(self)
+    end
+
+    def request_sampling
+      @request_sampling ||= ScoutApm::RequestSampling.new(self)
+    end
+
+    # The agent's own time & allocations, see AgentOverhead. Not reset with
+    # the config, so the minute's measurements so far aren't lost.
+    def agent_overhead
+      @agent_overhead ||= ScoutApm::AgentOverhead.new
+    end
+
     def slow_request_policy
       @slow_request_policy ||= ScoutApm::SlowRequestPolicy.new(self)
     end
@@ -110,6 +128,11 @@ module ScoutApm
       @request_histograms_by_time ||= Hash.new { |h, k| h[k] = ScoutApm::RequestHistograms.new }
     end
 
+    # Sanitized SQL & metric names, shared across requests
+    def sql_cache
+      @sql_cache ||= ScoutApm::Utils::SqlCache.new(config.value('sql_cache_size'))
+    end
+
     def store
       return @store if @store
       self.store = ScoutApm::Store.new(self)
@@ -123,6 +146,12 @@ module ScoutApm
       @recorder ||= RecorderFactory.build(self)
     end
 
+    # Sends checkins with async_reporting. Not reset with the config, so
+    # payloads waiting to be sent aren't lost.
+    def background_reporter
+      @background_reporter ||= ScoutApm::BackgroundReporter.new(self)
+    end
+
     def dev_trace_enabled?
       config.value('dev_trace') && environment.env == "development"
     end
@@ -144,10 +173,15 @@ module ScoutApm
       log_configuration_settings
 
       @ignored_uris = nil
+      # Kept, since running requests hold the tracepoint on through it
+      @allocation_tracking.reconfigure! if @allocation_tracking
+      @stack_profiling = nil
+      @request_sampling = nil
       @slow_request_policy = nil
       @slow_job_policy = nil
       @request_histograms = nil
       @request_histograms_by_time = nil
+      @sql_cache = nil
       @store = nil
       @layaway = nil
       @recorder = nil
@@ -165,6 +199,11 @@ module ScoutApm
       @shutting_down = true
     end
 
+    # A SharedMetrics table, made before the app server forks. Unlike the
+    # store, it isn't reset along with the config: forked workers must keep
+    # the one they inherited.
+    attr_accessor :shared_metrics
+
     def store=(store)
       @store = store
 
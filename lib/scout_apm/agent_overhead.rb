@@ -0,0 +1,133 @@
+# Time and allocations the agent spends on its own work, so its overhead can
+# be watched, and kept within a budget across upgrades. AgentOverheadSampler
+# reports them each minute as Agent/Overhead/<section> (milliseconds) and
+# Agent/OverheadAllocations/<section> metrics, one call per measurement.
+#
+# Sections:
+#
+#   Layers         - TrackedRequest#start_layer & #stop_layer, per request
+#   Recorder       - handing a finished request to the recorder, on the
+#                    request's thread. With synchronous recording this
+#                    includes Converters
+#   Converters     - running the layer converters on a request (includes
+#                    StoreTrack)
+#   StoreTrack     - Store#track!
+#   WriteToLayaway - Store#write_to_layaway
+#   LayawayLoad    - loading (and natively merging) a minute's layaway files
+#   LayawayMerge   - merging the loaded reporting periods
+#   Serialize      - serializing the payload
+#   Gzip           - compressing it
+#   Post           - posting it. A streamed payload is serialized and
+#                    compressed as it's posted, so that's all counted here
+#
+# Allocations are counted by ext/allocations on the measuring thread, and
+# only while allocation tracking is on. Measurements taken with it off have
+# no allocation count, rather than a count of 0, so
+# Agent/OverheadAllocations only covers the measurements that counted them.
+#
+# Measurements are kept by the thread that took them, as Store keeps what it
+# tracks (see StoreThreadBuffer), so request threads don't share a lock. The
+# sampler drains them all each minute.
+module ScoutApm
+  class AgentOverhead
+    NANOSECONDS_PER_MS = 1_000_000.0
+
+    def initialize
+      @thread_sections = []
+      @thread_sections_mutex = Mutex.new
+      @thread_key = :"scout_apm_agent_overhead_#{object_id}"
+    end
+
+    # Measures the block as the section
+    def measure(section)
+      start_ns = ::Process.monotonic_ns
+      counting = ScoutApm::Instruments::Allocations.enabled?
+      start_allocations = ScoutApm::Instruments::Allocations.count if counting
+      yield
+    ensure
+      allocations = ScoutApm::Instruments::Allocations.count - start_allocations if counting && ScoutApm::Instruments::Allocations.enabled?
+      add(section, ::Process.monotonic_ns - start_ns, allocations)
+    end
+
+    # Adds a measurement taken elsewhere. allocations is nil if they weren't
+    # counted.
+    def add(section, ns, allocations)
+      thread_sections.add(section, ns / NANOSECONDS_PER_MS, allocations)
+    end
+
+    # { section => [time MetricStats, allocations MetricStats] } since the
+    # last call, from every thread. The allocations have no calls if none
+    # were counted. Sections of threads that had already died are dropped
+    # after.
+    def stats!
+      all = @thread_sections_mutex.synchronize { @thread_sections.dup }
+      dead = all.reject { |sections| sections.alive? }
+
+      merged = {}
+      all.each do |sections|
+        sections.drain!.each do |section, (time, allocated)|
+          if (existing = merged[section])
+            existing[0].combine!(time)
+            existing[1].combine!(allocated)
+          else
+            merged[section] = [time, allocated]
+          end
+        end
+      end
+
+      @thread_sections_mutex.synchronize { @thread_sections -= dead } if dead.any?
+      merged
+    end
+
+    private
+
+    def thread_sections
+      thread = Thread.current
+      sections = if thread.respond_to?(:thread_variable_get)
+                   thread.thread_variable_get(@thread_key)
+                 else
+                   thread[@thread_key]
+                 end
+      return sections if sections
+
+      sections = ThreadSections.new
+      @thread_sections_mutex.synchronize { @thread_sections << sections }
+      if thread.respond_to?(:thread_variable_set)
+        thread.thread_variable_set(@thread_key, sections)
+      else
+        thread[@thread_key] = sections
+      end
+      sections
+    end
+
+    # One thread's measurements. The lock is only contended while stats!
+    # drains them.
+    class ThreadSections
+      def initialize
+        @thread = Thread.current
+        @mutex = Mutex.new
+        @sections = {}
+      end
+
+      def alive?
+        @thread.alive?
+      end
+
+      def add(section, ms, allocations)
+        @mutex.synchronize do
+          time, allocated = (@sections[section] ||= [MetricStats.new(false), MetricStats.new(false)])
+          time.update!(ms)
+          allocated.update!(allocations) if allocations
+        end
+      end
+
+      def drain!
+        @mutex.synchronize do
+          sections = @sections
+          @sections = {}
+          sections
+        end
+      end
+    end
+  end
+end
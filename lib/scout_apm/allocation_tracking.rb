@@ -0,0 +1,144 @@
+# Decides when the NEWOBJ tracepoint in ext/allocations runs, based on the
+# `allocation_tracking` config setting:
+#
+#   enabled  - always on (default)
+#   disabled - always off. Allocating objects costs nothing extra, and no
+#              allocation metrics are reported.
+#   sampled  - 1 in `allocation_tracking_request_sample` requests record
+#              allocations. The tracepoint is only on while at least one of
+#              those requests is running.
+#
+# Independently of the mode, `allocation_sample_interval` makes the tracepoint
+# only count 1 in N allocations (scaled back up by N), trading precision for a
+# cheaper hook.
+#
+# With `allocation_sites` on, sampled allocations are also attributed to the
+# file, line and class that made them, and slow requests carry their top
+# ALLOCATION_HOTSPOTS_LIMIT sites as allocation hotspots.
+#
+# The tracepoint is process-wide, so in sampled mode other requests running at
+# the same time only see part of their allocations. They don't report them:
+# only requests that were chosen get allocation metrics.
+#
+# A config reload calls reconfigure!, which keeps the count of sampled
+# requests still running, so the tracepoint stays on until they're done.
+module ScoutApm
+  class AllocationTracking
+    MODES = %w(enabled disabled sampled)
+
+    ALLOCATION_HOTSPOTS_LIMIT = 10
+
+    attr_reader :context
+
+    def initialize(context)
+      @context = context
+      @mutex = Mutex.new
+      @sampled_requests = 0
+      @installed = false
+    end
+
+    def mode
+      @mode ||= begin
+                  configured = context.config.value('allocation_tracking').to_s
+                  MODES.include?(configured) ? configured : 'enabled'
+                end
+    end
+
+    def sample_interval
+      [context.config.value('allocation_sample_interval'), 1].max
+    end
+
+    def sites?
+      context.config.value('allocation_sites')
+    end
+
+    def request_sample
+      [context.config.value('allocation_tracking_request_sample'), 1].max
+    end
+
+    # Sets the tracepoint to match the configured mode. Called as the agent is installed.
+    def install!
+      return unless ScoutApm::Instruments::Allocations::ENABLED
+      @installed = true
+
+      ScoutApm::Instruments::Allocations.sample_interval = sample_interval
+      ScoutApm::Instruments::Allocations.track_sites = sites?
+
+      @mutex.synchronize do
+        if mode == 'enabled' || @sampled_requests > 0
+          ScoutApm::Instruments::Allocations.enable!
+        else
+          ScoutApm::Instruments::Allocations.disable!
+        end
+      end
+      context.logger.debug("Allocation tracking: #{mode}, counting 1 in #{sample_interval} allocations")
+    end
+
+    # Picks up a changed config. Once installed, the tracepoint is set to
+    # match it.
+    def reconfigure!
+      @mode = nil
+      install! if @installed
+    end
+
+    # Called as a request starts. Returns something truthy if the request
+    # should record allocations, in which case it must pass it to
+    # stop_request once it is done.
+    def start_request
+      return false unless ScoutApm::Instruments::Allocations::ENABLED
+
+      tracked = case mode
+                when 'enabled'
+                  true
+                when 'disabled'
+                  false
+                else
+                  start_sampled_request
+                end
+
+      ScoutApm::Instruments::Allocations.reset_sites! if tracked && sites?
+      tracked
+    end
+
+    def start_sampled_request
+      return false unless rand(request_sample) == 0
+
+      @mutex.synchronize do
+        @sampled_requests += 1
+        ScoutApm::Instruments::Allocations.enable! if @sampled_requests == 1
+      end
+      :sampled
+    end
+    private :start_sampled_request
+
+    # The busiest allocation sites on this thread since the request started.
+    # Must be called from the request's own thread. Paths under the
+    # application root are made relative to it.
+    def hotspots
+      return [] unless sites?
+
+      root = "#{context.environment.root}/"
+      ScoutApm::Instruments::Allocations.top_sites(ALLOCATION_HOTSPOTS_LIMIT).map do |path, line, class_name, count|
+        path = path.to_s
+        path = path[root.length..-1] if path.start_with?(root)
+        {
+          :file => path,
+          :line => line,
+          :class => class_name.to_s,
+          :allocations => count,
+        }
+      end
+    end
+
+    # Takes what start_request returned. Requests that were sampled count
+    # down, even if the mode has changed since they started.
+    def stop_request(started)
+      return unless started == :sampled
+
+      @mutex.synchronize do
+        @sampled_requests -= 1 if @sampled_requests > 0
+        ScoutApm::Instruments::Allocations.disable! if @sampled_requests == 0 && mode != 'enabled'
+      end
+    end
+  end
+end
@@ -1,17 +1,40 @@
 # Provide a background thread queue to do the processing of
 # TrackedRequest objects, to remove it from the hot-path of returning a
 # web response
+#
+# The queue is bounded by async_recording_queue_size. When it's full,
+# async_recording_drop_policy decides what happens to a new request:
+#
+# drop_newest - the new request isn't recorded (default)
+# drop_oldest - the longest waiting request is dropped to make room for it
+# block       - the request thread waits for room
+#
+# The recording thread takes up to async_recording_batch_size requests off
+# the queue at a time. See RecorderSampler for the metrics reported on it.
 
 module ScoutApm
   class BackgroundRecorder
+    DROP_POLICIES = ['drop_newest', 'drop_oldest', 'block']
+
     attr_reader :context
 
     attr_reader :queue
     attr_reader :thread
 
+    attr_reader :max_size
+    attr_reader :batch_size
+    attr_reader :drop_policy
+
     def initialize(context)
       @context = context
-      @queue = Queue.new
+      @max_size = [context.config.value('async_recording_queue_size').to_i, 1].max
+      @batch_size = [context.config.value('async_recording_batch_size').to_i, 1].max
+      @drop_policy = context.config.value('async_recording_drop_policy')
+      @drop_policy = DROP_POLICIES.first unless DROP_POLICIES.include?(@drop_policy)
+
+      @queue = SizedQueue.new(@max_size)
+      @stats_mutex = Mutex.new
+      reset_stats
     end
 
     def logger
@@ -29,20 +52,96 @@ module ScoutApm
     end
 
     def record!(request)
-      start unless @thread.alive?
-      @queue.push(request)
+      start unless @thread && @thread.alive?
+      enqueue([request, ::Process.monotonic_ns])
+    end
+
+    # Counters since the last call, for RecorderSampler:
+    #
+    # :max_depth - the most requests waiting at once
+    # :dropped   - requests dropped because the queue was full
+    # :latency   - MetricStats of ms from record! to being recorded
+    def stats!
+      @stats_mutex.synchronize {
+        stats = {
+          :max_depth => [@max_depth, queue.size].max,
+          :dropped => @dropped,
+          :latency => @latency,
+        }
+        reset_stats
+        stats
+      }
     end
 
     def thread_func
-      while req = queue.pop
+      while item = queue.pop
+        batch = [item]
+        while batch.size < batch_size
+          begin
+            batch << queue.pop(true)
+          rescue ThreadError # empty
+            break
+          end
+        end
+        record_batch(batch)
+      end
+    end
+
+    private
+
+    def enqueue(item)
+      case drop_policy
+      when 'block'
+        queue.push(item)
+      when 'drop_oldest'
+        begin
+          queue.push(item, true)
+        rescue ThreadError # full
+          begin
+            queue.pop(true)
+            count_drop
+          rescue ThreadError
+            # The recording thread emptied it first
+          end
+          retry
+        end
+      else
+        begin
+          queue.push(item, true)
+        rescue ThreadError # full
+          count_drop
+        end
+      end
+    end
+
+    def record_batch(batch)
+      depth = batch.size + queue.size
+      logger.debug("recording #{batch.size} in thread. Queue size: #{depth}")
+
+      latencies = batch.map do |req, queued_at|
         begin
-          logger.debug("recording in thread. Queue size: #{queue.size}")
           # For now, just proxy right back into the TrackedRequest object's record function
           req.record!
         rescue => e
           logger.warn("Error in BackgroundRecorder - #{e.message} : #{e.backtrace}")
         end
+        (::Process.monotonic_ns - queued_at) / 1_000_000.0
       end
+
+      @stats_mutex.synchronize {
+        @max_depth = depth if depth > @max_depth
+        latencies.each { |ms| @latency.update!(ms) }
+      }
+    end
+
+    def count_drop
+      @stats_mutex.synchronize { @dropped += 1 }
+    end
+
+    def reset_stats
+      @max_depth = 0
+      @dropped = 0
+      @latency = MetricStats.new(false)
     end
   end
 end
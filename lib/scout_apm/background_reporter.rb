@@ -0,0 +1,259 @@
+# With async_reporting, checkin payloads are sent on this thread rather than
+# inline on the background worker, so a slow or unreachable collector doesn't
+# hold up recording the next minute. It keeps its connection to each host
+# alive between checkins (see Reporter#keep_alive!).
+#
+# Up to async_reporting_queue_size payloads wait to be sent. A host that
+# fails is tried again with exponential backoff, waiting RETRY_DELAY seconds
+# and doubling up to MAX_RETRY_DELAY, for MAX_ATTEMPTS in all.
+#
+# A payload that still isn't delivered, or that doesn't fit in the queue, is
+# spilled to a file in the layaway directory. Spilled payloads are sent, oldest
+# first, after the next successful post, by whichever process gets there
+# first. At most async_reporting_spill_limit are kept, counting the ones
+# being sent. The oldest are deleted to make room. A payload that was being
+# sent by a process that has since died is spilled again as this one starts.
+module ScoutApm
+  class BackgroundReporter
+    MAX_ATTEMPTS = 5
+    RETRY_DELAY = 2 # seconds
+    MAX_RETRY_DELAY = 60
+
+    # How long stop waits for a post that's under way
+    STOP_TIMEOUT = 2
+
+    SPILL_PREFIX = "scout_outbox_"
+    SPILL_EXTENSION = ".payload"
+    SENDING_EXTENSION = ".sending"
+
+    Payload = Struct.new(:hosts, :body, :headers)
+
+    attr_reader :context
+
+    attr_reader :queue
+    attr_reader :thread
+    attr_reader :reporter
+
+    attr_reader :max_size
+    attr_reader :spill_limit
+
+    def initialize(context, reporter = nil)
+      @context = context
+      @reporter = reporter || Reporter.new(context, :checkin).keep_alive!
+      @max_size = [context.config.value('async_reporting_queue_size').to_i, 1].max
+      @spill_limit = [context.config.value('async_reporting_spill_limit').to_i, 0].max
+      @queue = SizedQueue.new(@max_size)
+      @pid = Process.pid
+      @stopping = false
+      @delivering = false
+      @spilled = 0
+    end
+
+    def logger
+      context.logger
+    end
+
+    def start
+      logger.info("Starting BackgroundReporter")
+      recover_abandoned
+      @thread = Thread.new(&method(:thread_func))
+      self
+    end
+
+    # Spills the waiting payloads, so they're sent once a process is reporting
+    # again. A post that's under way has STOP_TIMEOUT to finish, and one
+    # waiting to be retried is spilled.
+    def stop
+      @stopping = true
+      spill_queued
+      if @thread && @thread.alive?
+        queue.push(nil, true) rescue nil # ends thread_func once it's done
+        if @delivering
+          @thread.wakeup if @thread.status == "sleep"
+          @thread.join(STOP_TIMEOUT)
+        end
+        @thread.kill
+      end
+      reporter.finish_connections
+    end
+
+    # Queues the payload to be posted to each of the hosts. Never waits: if
+    # the queue is full, the payload is spilled instead.
+    def report(hosts, body, headers)
+      payload = Payload.new(hosts, body, headers)
+      reset_after_fork
+      start unless @thread && @thread.alive?
+
+      begin
+        queue.push(payload, true)
+      rescue ThreadError # full
+        logger.warn("BackgroundReporter: #{queue.size} payloads waiting to be sent, spilling this one to disk")
+        spill(payload)
+      end
+    end
+
+    def thread_func
+      while payload = queue.pop
+        @delivering = true
+        deliver(payload) && send_spilled
+        @delivering = false
+      end
+    end
+
+    # Posts the payload to its hosts, retrying the ones that fail. Spills what
+    # couldn't be delivered. Returns true if every host took it.
+    def deliver(payload)
+      remaining = payload.hosts
+      attempts = 0
+      loop do
+        remaining = remaining.reject { |host| post(host, payload) }
+        return true if remaining.empty?
+
+        attempts += 1
+        break if attempts >= MAX_ATTEMPTS
+
+        delay = retry_delay(attempts)
+        logger.debug("BackgroundReporter: retrying #{remaining.join(', ')} in #{delay}s")
+        sleep(delay)
+        break if @stopping
+      end
+
+      logger.warn("BackgroundReporter: giving up on #{remaining.join(', ')} after #{attempts} attempts, spilling the payload to disk")
+      spill(Payload.new(remaining, payload.body, payload.headers))
+      false
+    end
+
+    # Sends the spilled payloads, oldest first, until one fails.
+    def send_spilled
+      spilled_files.each do |file|
+        return false if @stopping
+
+        claimed, payload = claim(file)
+        next unless payload
+
+        remaining = payload.hosts.reject { |host| post(host, payload) }
+        if remaining.any?
+          unclaim(file, claimed, Payload.new(remaining, payload.body, payload.headers))
+          return false
+        end
+        File.unlink(claimed)
+        logger.debug("BackgroundReporter: sent spilled payload #{File.basename(file)}")
+      end
+      true
+    end
+
+    def retry_delay(attempt)
+      [RETRY_DELAY * (2 ** (attempt - 1)), MAX_RETRY_DELAY].min
+    end
+
+    def spilled_files
+      Dir[(directory + "#{SPILL_PREFIX}*#{SPILL_EXTENSION}").to_s].sort
+    end
+
+    # Spilled payloads that a process has claimed to send
+    def sending_files
+      Dir[(directory + "#{SPILL_PREFIX}*#{SPILL_EXTENSION}.*#{SENDING_EXTENSION}").to_s].sort
+    end
+
+    private
+
+    def post(host, payload)
+      context.agent_overhead.measure("Post") { reporter.post_to_host(host, payload.body, payload.headers) }
+    rescue => e
+      logger.warn("BackgroundReporter: error posting to #{host} - #{e.message}")
+      false
+    end
+
+    def spill_queued
+      loop do
+        spill(queue.pop(true))
+      end
+    rescue ThreadError # empty
+    end
+
+    # Writes the payload to a new file, and then deletes the oldest ones past
+    # the spill limit. Those being sent count towards it, but are left alone.
+    def spill(payload)
+      return if spill_limit == 0
+
+      @spilled += 1
+      name = "#{SPILL_PREFIX}#{Time.now.utc.strftime('%Y%m%d%H%M%S%L')}_#{Process.pid}_#{@spilled}#{SPILL_EXTENSION}"
+      path = (directory + name).to_s
+      write(path, payload)
+
+      files = spilled_files
+      files.first([files.size + sending_files.size - spill_limit, 0].max).each do |file|
+        logger.warn("BackgroundReporter: over #{spill_limit} spilled payloads, deleting #{File.basename(file)}")
+        File.unlink(file) rescue nil
+      end
+    rescue => e
+      logger.warn("BackgroundReporter: unable to spill payload - #{e.message}")
+    end
+
+    def write(path, payload)
+      File.open("#{path}.tmp", "wb") { |f| f.write(Marshal.dump(payload.to_a)) }
+      File.rename("#{path}.tmp", path)
+    end
+
+    # Takes a spilled payload, so another process doesn't send it too.
+    # Returns the file it's been moved to, and the payload. Or nil if another
+    # process already has it.
+    def claim(file)
+      claimed = "#{file}.#{Process.pid}#{SENDING_EXTENSION}"
+      File.rename(file, claimed)
+      [claimed, Payload.new(*Marshal.load(File.binread(claimed)))]
+    rescue Errno::ENOENT
+      nil
+    rescue => e
+      logger.warn("BackgroundReporter: unable to read spilled payload #{File.basename(file)} - #{e.message}")
+      File.unlink(claimed) rescue nil
+      nil
+    end
+
+    # Puts a claimed payload back, left with the hosts it's still to be sent to
+    def unclaim(file, claimed, payload)
+      File.unlink(claimed)
+      write(file, payload)
+    rescue => e
+      logger.warn("BackgroundReporter: unable to put back spilled payload #{File.basename(file)} - #{e.message}")
+    end
+
+    # Puts back the payloads claimed by processes that are gone, so they're
+    # sent again. This process isn't sending any yet: one of its own was left
+    # by a thread that was stopped.
+    def recover_abandoned
+      sending_files.each do |claimed|
+        next unless claimed =~ /\A(.+#{Regexp.escape(SPILL_EXTENSION)})\.(\d+)#{Regexp.escape(SENDING_EXTENSION)}\z/
+        file, pid = $1, $2.to_i
+        next if pid != Process.pid && process_alive?(pid)
+
+        logger.debug("BackgroundReporter: putting back spilled payload #{File.basename(file)} left by process #{pid}")
+        File.rename(claimed, file) rescue nil
+      end
+    rescue => e
+      logger.warn("BackgroundReporter: unable to put back abandoned payloads - #{e.message}")
+    end
+
+    def process_alive?(pid)
+      Process.kill(0, pid)
+      true
+    rescue Errno::ESRCH
+      false
+    rescue Errno::EPERM # someone else's
+      true
+    end
+
+    # A forked process starts out with its parent's queue, but not its
+    # thread. Those payloads are the parent's to send.
+    def reset_after_fork
+      return if @pid == Process.pid
+      @pid = Process.pid
+      @queue = SizedQueue.new(max_size)
+      @thread = nil
+    end
+
+    def directory
+      context.layaway.directory
+    end
+  end
+end
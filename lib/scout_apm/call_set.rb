@@ -12,7 +12,7 @@ module ScoutApm
       @grouped_items = Hash.new { |h, k| h[k] = [] } # items groups by their normalized name since multiple layers could have the same layer name.
       @call_count = 0
       @captured = false # cached for performance
-      @start_time = Time.now
+      @start_ns = ::Process.monotonic_ns
       @past_start_time = false # cached for performance
     end
 
@@ -30,7 +30,7 @@ module ScoutApm
     # Limit our workload if time across this set of calls is small.
     def past_time_threshold?
       return true if @past_time_threshold # no need to check again once past
-      @past_time_threshold = (Time.now-@start_time) >= N_PLUS_ONE_TIME_THRESHOLD
+      @past_time_threshold = (::Process.monotonic_ns - @start_ns) / 1_000_000_000.0 >= N_PLUS_ONE_TIME_THRESHOLD
     end
 
     # We're selective on capturing a backtrace for two reasons:
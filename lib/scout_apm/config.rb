@@ -9,7 +9,17 @@ require 'scout_apm/environment'
 # scout_apm itself. See the documentation at http://help.apm.scoutapp.com for
 # customer-focused documentation.
 #
+# allocation_sample_interval - count 1 in this many object allocations, scaled back up. 1 (default) counts every allocation
+# allocation_sites - true or false. Attribute sampled allocations to file:line and class, and report the top sites of slow transactions
+# allocation_tracking - 'enabled', 'disabled' or 'sampled'. Controls the object allocation tracepoint. See AllocationTracking
+# allocation_tracking_request_sample - in 'sampled' allocation tracking, record allocations for 1 in this many requests
 # application_root - override the detected directory of the application
+# async_recording_batch_size - with async_recording, how many requests the recording thread takes off its queue at a time. Default 50
+# async_recording_drop_policy - with async_recording, what happens to a request when the queue is full: 'drop_newest' (default), 'drop_oldest' or 'block'
+# async_recording_queue_size - with async_recording, how many requests can wait to be recorded. Default 1000
+# async_reporting  - true or false. Send checkins on their own thread, over a kept alive connection, retrying failures and spilling undelivered payloads to disk. See BackgroundReporter
+# async_reporting_queue_size - with async_reporting, how many payloads can wait to be sent. Default 5
+# async_reporting_spill_limit - with async_reporting, how many undelivered payloads to keep in the data_file directory. Default 60
 # compress_payload - true/false to enable gzipping of payload
 # data_file        - override the default temporary storage location. Must be a location in a writable directory
 # dev_trace        - true or false. Enables always-on tracing in development environmen only
@@ -18,14 +28,24 @@ require 'scout_apm/environment'
 # host             - configuration used in development
 # hostname         - override the default hostname detection. Default varies by environment - either system hostname, or PAAS hostname
 # key              - the account key with Scout APM. Found in Settings in the Web UI
+# layaway_format   - 'marshal' (default) or 'binary'. How reporting periods are written to layaway files. Files in either format are read. Older agents can't read binary files
 # log_file_path    - either a directory or "STDOUT".
 # log_level        - DEBUG / INFO / WARN as usual
+# max_traces       - how many slow request traces, and how many slow job traces, to keep each minute. Default 10. 0 keeps none
 # monitor          - true or false.  False prevents any instrumentation from starting
 # name             - override the name reported to APM. This is the name that shows in the Web UI
 # profile          - turn on/off scoutprof (only applicable in Gem versions including scoutprof)
 # proxy            - an http proxy
 # report_format    - 'json' or 'marshal'. Marshal is legacy and will be removed.
+# request_sample   - fully trace 1 in this many requests. The others only record their timing, errors and histograms. 1 (default) traces every request. See RequestSampling
+# request_sample_overhead_budget - percent of request time the agent may spend tracing. When set, the request_sample rises as needed to stay within it. 0 (default) is off
 # scm_subdirectory - if the app root lives in source management in a subdirectory. E.g. #{SCM_ROOT}/src
+# shared_memory_aggregation - true or false. Forked workers combine their metrics in memory shared with each other, instead of each writing them to its layaway file. Layaway files are still written and reported as usual, for everything else
+# shared_memory_slots - how many metrics (per minute) the shared memory holds, when shared_memory_aggregation is on. 16384 (default) uses 4MB
+# sql_cache_size   - how many sanitized SQL statements & metric names to keep for reuse. Default 1000, 0 disables the cache
+# stack_profiling  - true or false. Sample the call stacks of requests, and attach them to slow transactions. See StackProfiling
+# stack_profiling_interval - milliseconds of CPU time between stack samples, with stack_profiling on. Default 10
+# stream_payload   - true or false. Serialize and gzip the checkin payload while it is being sent, as a chunked request body. Requires a json report_format and compress_payload
 # uri_reporting    - 'path' or 'full_path' default is 'full_path', which reports URL params as well as the path.
 # remote_agent_host - Internal: What host to bind to, and also send messages to for remote. Default: 127.0.0.1.
 # remote_agent_port - What port to bind the remote webserver to
@@ -36,8 +56,18 @@ require 'scout_apm/environment'
 module ScoutApm
   class Config
     KNOWN_CONFIG_OPTIONS = [
+        'allocation_sample_interval',
+        'allocation_sites',
+        'allocation_tracking',
+        'allocation_tracking_request_sample',
         'application_root',
         'async_recording',
+        'async_recording_batch_size',
+        'async_recording_drop_policy',
+        'async_recording_queue_size',
+        'async_reporting',
+        'async_reporting_queue_size',
+        'async_reporting_spill_limit',
         'compress_payload',
         'config_file',
         'data_file',
@@ -52,11 +82,13 @@ module ScoutApm
         'hostname',
         'ignore',
         'key',
+        'layaway_format',
         'log_class',
         'log_file_path',
         'log_level',
         'log_stderr',
         'log_stdout',
+        'max_traces',
         'monitor',
         'name',
         'profile',
@@ -64,7 +96,15 @@ module ScoutApm
         'remote_agent_host',
         'remote_agent_port',
         'report_format',
+        'request_sample',
+        'request_sample_overhead_budget',
         'scm_subdirectory',
+        'shared_memory_aggregation',
+        'shared_memory_slots',
+        'sql_cache_size',
+        'stack_profiling',
+        'stack_profiling_interval',
+        'stream_payload',
         'uri_reporting',
         'instrument_http_url_length',
     ]
@@ -137,6 +177,12 @@ module ScoutApm
       end
     end
 
+    class FloatCoercion
+      def coerce(val)
+        val.to_f
+      end
+    end
+
     # Simply returns the passed in value, without change
     class NullCoercion
       def coerce(val)
@@ -146,12 +192,29 @@ module ScoutApm
 
 
     SETTING_COERCIONS = {
+      "allocation_sample_interval" => IntegerCoercion.new,
+      "allocation_sites"       => BooleanCoercion.new,
+      "allocation_tracking_request_sample" => IntegerCoercion.new,
       "async_recording"        => BooleanCoercion.new,
+      "async_recording_batch_size" => IntegerCoercion.new,
+      "async_recording_queue_size" => IntegerCoercion.new,
+      "async_reporting"        => BooleanCoercion.new,
+      "async_reporting_queue_size" => IntegerCoercion.new,
+      "async_reporting_spill_limit" => IntegerCoercion.new,
       "detailed_middleware"    => BooleanCoercion.new,
       "dev_trace"              => BooleanCoercion.new,
       "enable_background_jobs" => BooleanCoercion.new,
       "ignore"                 => JsonCoercion.new,
+      "max_traces"             => IntegerCoercion.new,
       "monitor"                => BooleanCoercion.new,
+      "request_sample"         => IntegerCoercion.new,
+      "request_sample_overhead_budget" => FloatCoercion.new,
+      "shared_memory_aggregation" => BooleanCoercion.new,
+      "shared_memory_slots"    => IntegerCoercion.new,
+      "sql_cache_size"         => IntegerCoercion.new,
+      "stack_profiling"        => BooleanCoercion.new,
+      "stack_profiling_interval" => IntegerCoercion.new,
+      "stream_payload"         => BooleanCoercion.new,
       'database_metric_limit'  => IntegerCoercion.new,
       'database_metric_report_limit' => IntegerCoercion.new,
       'instrument_http_url_length' => IntegerCoercion.new,
@@ -241,6 +304,16 @@ module ScoutApm
 
     class ConfigDefaults
       DEFAULTS = {
+        'allocation_sample_interval' => 1,
+        'allocation_sites'       => false,
+        'allocation_tracking'    => 'enabled',
+        'allocation_tracking_request_sample' => 10,
+        'async_recording_batch_size' => 50,
+        'async_recording_drop_policy' => 'drop_newest',
+        'async_recording_queue_size' => 1000,
+        'async_reporting'        => false,
+        'async_reporting_queue_size' => 5,
+        'async_reporting_spill_limit' => 60,
         'compress_payload'       => true,
         'detailed_middleware'    => false,
         'dev_trace'              => false,
@@ -249,10 +322,20 @@ module ScoutApm
         'enable_background_jobs' => true,
         'host'                   => 'https://checkin.scoutapp.com',
         'ignore'                 => [],
+        'layaway_format'         => 'marshal', # 'binary' once agents that can't read it are gone
         'log_level'              => 'info',
+        'max_traces'             => 10,
         'profile'                => true, # for scoutprof
         'report_format'          => 'json',
+        'request_sample'         => 1,
+        'request_sample_overhead_budget' => 0,
         'scm_subdirectory'       => '',
+        'shared_memory_aggregation' => false,
+        'shared_memory_slots'    => 16384,
+        'sql_cache_size'         => 1000,
+        'stack_profiling'        => false,
+        'stack_profiling_interval' => 10,
+        'stream_payload'         => false,
         'uri_reporting'          => 'full_path',
         'remote_agent_host'      => '127.0.0.1',
         'remote_agent_port'      => 7721, # picked at random
@@ -37,7 +37,7 @@ module ScoutApm
 
       # Should we have a histogram for timing, and one for rows_returned?
       # This histogram is for call_time
-      @histogram = NumericHistogram.new(DEFAULT_HISTOGRAM_SIZE)
+      @histogram = NativeNumericHistogram.new(DEFAULT_HISTOGRAM_SIZE)
       @histogram.add(call_time)
 
       @transaction_count = 0
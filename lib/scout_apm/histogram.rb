@@ -25,10 +25,15 @@ module ScoutApm
       @mutex = Mutex.new
     end
 
-    def add(new_value)
+    # Adds the value count times, as one bin. NaN is ignored, as it has no
+    # place among the sorted bins.
+    def add(new_value, count = 1)
+      value = new_value.to_f
+      return if value.nan? || count <= 0
+
       mutex.synchronize do
-        @total += 1
-        create_new_bin(new_value.to_f)
+        @total += count
+        create_new_bin(value, count)
         trim
       end
     end
@@ -87,18 +92,19 @@ module ScoutApm
       end
     end
 
+    # Other may also be a NativeNumericHistogram, which has no mutex (it is
+    # safe to read under the GVL), and returns a copy of its bins.
     def combine!(other)
       mutex.synchronize do
-        other.mutex.synchronize do
-          @bins = (other.bins + @bins).
-            group_by {|b| b.value }.
-            map {|val, bs| [val, bs.inject(0) {|sum, b| sum + b.count }] }.
-            map {|val, sum| HistogramBin.new(val,sum) }.
-            sort_by { |b| b.value }
-          @total += other.total
-          trim
-          self
-        end
+        other_bins, other_total = other_bins_and_total(other)
+        @bins = (other_bins + @bins).
+          group_by {|b| b.value }.
+          map {|val, bs| [val, bs.inject(0) {|sum, b| sum + b.count }] }.
+          map {|val, sum| HistogramBin.new(val,sum) }.
+          sort_by { |b| b.value }
+        @total += other_total
+        trim
+        self
       end
     end
 
@@ -115,26 +121,34 @@ module ScoutApm
 
     private
 
+    def other_bins_and_total(other)
+      if other.respond_to?(:mutex)
+        other.mutex.synchronize { [other.bins, other.total] }
+      else
+        [other.bins, other.total]
+      end
+    end
+
     # If we exactly match an existing bin, add to it, otherwise create a new bin holding a count for the new value.
-    def create_new_bin(new_value)
+    def create_new_bin(new_value, count = 1)
       bins.each_with_index do |bin, index|
         # If it matches exactly, increment the bin's count
         if bin.value == new_value
-          bin.count += 1
+          bin.count += count
           return
         end
 
         # We've gone one bin too far, so insert before the current bin.
         if bin.value > new_value
           # Insert at this index
-          new_bin = HistogramBin.new(new_value, 1)
+          new_bin = HistogramBin.new(new_value, count)
           bins.insert(index, new_bin)
           return
         end
       end
 
       # If we get to here, the bin needs to be added to the end.
-      bins << HistogramBin.new(new_value, 1)
+      bins << HistogramBin.new(new_value, count)
     end
 
     def trim
@@ -0,0 +1,45 @@
+module ScoutApm
+  module Instruments
+    # Reports the agent's own overhead each minute, see AgentOverhead:
+    #
+    # Agent/Overhead/<section>            - milliseconds spent in the section
+    # Agent/OverheadAllocations/<section> - objects it allocated, over the
+    #                                       measurements taken while
+    #                                       allocation tracking was on. Not
+    #                                       reported if there were none, so
+    #                                       it never reads a false 0
+    class AgentOverheadSampler
+      attr_reader :context
+
+      def initialize(context)
+        @context = context
+      end
+
+      def metric_type
+        "Agent"
+      end
+
+      def human_name
+        "Agent Overhead"
+      end
+
+      def metrics(timestamp, store)
+        sections = context.agent_overhead.stats!
+        return {} if sections.empty?
+
+        metrics = {}
+        sections.each do |section, (time, allocations)|
+          metrics[MetricMeta.new("#{metric_type}/Overhead/#{section}")] = time
+          metrics[MetricMeta.new("#{metric_type}/OverheadAllocations/#{section}")] = allocations if allocations.call_count > 0
+        end
+        logger.debug "#{human_name}: #{sections.map { |section, (time, _)| "#{section} #{time.total_call_time.round(1)}ms" }.join(', ')}"
+
+        store.track!(metrics, :timestamp => timestamp)
+      end
+
+      def logger
+        context.logger
+      end
+    end
+  end
+end
@@ -20,6 +20,9 @@ module ScoutApm
         if defined?(::Net) && defined?(::Net::HTTP)
           @installed = true
 
+          # Aliasing twice would leave request calling itself
+          return if ::Net::HTTP.method_defined?(:request_without_scout_instruments)
+
           logger.info "Instrumenting Net::HTTP"
 
           ::Net::HTTP.class_eval do
@@ -0,0 +1,103 @@
+module ScoutApm
+  module Instruments
+    module Process
+      # Reports how many objects the process allocated over the last minute,
+      # and how those allocations were spread over its threads. Reads the
+      # per-thread counters in ext/allocations without stopping any request
+      # threads.
+      #
+      # Only reported while every allocation is counted: not with allocation
+      # tracking disabled, when the counters don't move, or sampled, when they
+      # only count during the chosen requests. The counts are already scaled
+      # up by allocation_sample_interval.
+      class ProcessAllocations
+        attr_reader :context
+        attr_accessor :last_total, :last_thread_counts
+
+        def initialize(context)
+          @context = context
+          @last_total = ScoutApm::Instruments::Allocations.process_total
+          @last_thread_counts = ScoutApm::Instruments::Allocations.thread_counts
+        end
+
+        def metric_type
+          "Memory"
+        end
+
+        def metric_name
+          "Allocations"
+        end
+
+        def human_name
+          "Process Allocations"
+        end
+
+        def metrics(timestamp, store)
+          return {} unless ScoutApm::Instruments::Allocations::ENABLED
+
+          unless counting_every_allocation?
+            # So the next report starts from here, if that changes
+            save_counts(ScoutApm::Instruments::Allocations.process_total, ScoutApm::Instruments::Allocations.thread_counts)
+            return {}
+          end
+
+          result = run
+          if result
+            process_allocations, thread_allocations = result
+
+            meta = MetricMeta.new("#{metric_type}/#{metric_name}")
+            stat = MetricStats.new(false)
+            stat.update!(process_allocations)
+
+            # One sample per thread: call_count is the number of threads that
+            # allocated this minute, max_call_time the busiest of them.
+            thread_meta = MetricMeta.new("#{metric_type}/#{metric_name}PerThread")
+            thread_stat = MetricStats.new(false)
+            thread_allocations.each { |count| thread_stat.update!(count) }
+
+            store.track!({ meta => stat, thread_meta => thread_stat }, :timestamp => timestamp)
+          else
+            {}
+          end
+        end
+
+        def run
+          total = ScoutApm::Instruments::Allocations.process_total
+          thread_counts = ScoutApm::Instruments::Allocations.thread_counts
+
+          process_elapsed = total - last_total
+
+          # Counts reset when a forking web server starts a new worker.
+          if process_elapsed < 0
+            save_counts(total, thread_counts)
+            logger.debug "#{human_name}: Negative allocation count. This is normal to see when starting a forking web server."
+            return nil
+          end
+
+          thread_elapsed = thread_counts.map { |thread, count|
+            count - last_thread_counts.fetch(thread, 0)
+          }.select { |count| count > 0 }
+
+          save_counts(total, thread_counts)
+
+          logger.debug "#{human_name}: #{process_elapsed} [#{thread_elapsed.length} thread(s)]"
+
+          [process_elapsed, thread_elapsed]
+        end
+
+        def counting_every_allocation?
+          ScoutApm::Instruments::Allocations.enabled? && context.allocation_tracking.mode == 'enabled'
+        end
+
+        def save_counts(total, thread_counts)
+          self.last_total = total
+          self.last_thread_counts = thread_counts
+        end
+
+        def logger
+          context.logger
+        end
+      end
+    end
+  end
+end
@@ -11,10 +11,8 @@ module ScoutApm
 
           @num_processors = [context.environment.processors, 1].compact.max
 
-          t = ::Process.times
           @last_run = Time.now
-          @last_utime = t.utime
-          @last_stime = t.stime
+          @last_utime, @last_stime = ::Process.rusage_cpu_times
         end
 
         def metric_type
@@ -46,10 +44,8 @@ module ScoutApm
         def run
           res = nil
 
-          t = ::Process.times
           now = Time.now
-          utime = t.utime
-          stime = t.stime
+          utime, stime = ::Process.rusage_cpu_times
 
           wall_clock_elapsed  = now - last_run
           if wall_clock_elapsed < 0
@@ -0,0 +1,93 @@
+module ScoutApm
+  module Instruments
+    module Process
+      # Reports how long the process spent paused in GC over the last minute
+      # (in milliseconds), and how many collections it ran. Major GCs are also
+      # counted on their own, since they are the long pauses.
+      class ProcessGc
+        attr_reader :context
+        attr_accessor :last_time, :last_count, :last_major_count
+
+        def initialize(context)
+          @context = context
+          save_counts(*read_counts)
+        end
+
+        def metric_type
+          "GC"
+        end
+
+        def metric_name
+          "Time"
+        end
+
+        def human_name
+          "Process GC"
+        end
+
+        def metrics(timestamp, store)
+          return {} unless ScoutApm::Instruments::GarbageCollection::ENABLED
+
+          result = run
+          if result
+            time, count, major_count = result
+
+            metrics = {
+              MetricMeta.new("#{metric_type}/#{metric_name}") => time,
+              MetricMeta.new("#{metric_type}/Count") => count,
+              MetricMeta.new("#{metric_type}/MajorCount") => major_count,
+            }
+            metrics.each do |meta, value|
+              stat = MetricStats.new(false)
+              stat.update!(value)
+              metrics[meta] = stat
+            end
+
+            store.track!(metrics, :timestamp => timestamp)
+          else
+            {}
+          end
+        end
+
+        def run
+          time, count, major_count = read_counts
+
+          time_elapsed = time - last_time
+          count_elapsed = count - last_count
+          major_count_elapsed = major_count - last_major_count
+
+          save_counts(time, count, major_count)
+
+          # Counts reset when a forking web server starts a new worker.
+          if time_elapsed < 0 || count_elapsed < 0 || major_count_elapsed < 0
+            logger.debug "#{human_name}: Negative GC count. This is normal to see when starting a forking web server."
+            return nil
+          end
+
+          time_ms = time_elapsed / 1_000_000.0
+          logger.debug "#{human_name}: #{time_ms.round(2)}ms [#{count_elapsed} GC(s), #{major_count_elapsed} major]"
+
+          [time_ms, count_elapsed, major_count_elapsed]
+        end
+
+        def read_counts
+          [
+            ScoutApm::Instruments::GarbageCollection.process_time,
+            ScoutApm::Instruments::GarbageCollection.process_count,
+            ScoutApm::Instruments::GarbageCollection.process_major_count,
+          ]
+        end
+
+        def save_counts(time, count, major_count)
+          self.last_time = time
+          self.last_count = count
+          self.last_major_count = major_count
+        end
+
+        def logger
+          context.logger
+        end
+      end
+    end
+  end
+end
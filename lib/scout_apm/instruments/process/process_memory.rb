@@ -2,16 +2,23 @@ module ScoutApm
   module Instruments
     module Process
       class ProcessMemory
-        # Account for Darwin returning maxrss in bytes and Linux in KB. Used by
-        # the slow converters. Doesn't feel like this should go here
+        # Used by the slow converters. Doesn't feel like this should go here
         # though...more of a utility.
         def rss_to_mb(rss)
-          kilobyte_adjust = @context.environment.os == 'darwin' ? 1024 : 1
-          rss.to_f / 1024 / kilobyte_adjust
+          rss.to_f / 1024 / 1024
         end
 
+        # Current resident set size in bytes. Read natively on every request,
+        # without allocating. Where the current size can't be read, falls back
+        # to the peak size, which never goes down.
         def rss
-          ::Process.rusage.maxrss
+          ::Process.current_rss || max_rss
+        end
+
+        # Account for Darwin returning maxrss in bytes and Linux in KB.
+        def max_rss
+          kilobyte_adjust = @context.environment.os == 'darwin' ? 1 : 1024
+          ::Process.rusage_maxrss * kilobyte_adjust
         end
 
         def rss_in_mb
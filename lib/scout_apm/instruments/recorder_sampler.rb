@@ -0,0 +1,56 @@
+module ScoutApm
+  module Instruments
+    # Reports on the BackgroundRecorder's queue, when async_recording is on:
+    #
+    # Agent/RecorderQueueDepth - the most requests waiting at once in the minute
+    # Agent/RecorderDropped    - requests dropped because the queue was full
+    # Agent/RecorderLatency    - milliseconds from a request finishing to it being recorded
+    class RecorderSampler
+      attr_reader :context
+
+      def initialize(context)
+        @context = context
+      end
+
+      def metric_type
+        "Agent"
+      end
+
+      def human_name
+        "Recorder Queue"
+      end
+
+      def metrics(timestamp, store)
+        recorder = context.recorder
+        return {} unless recorder.respond_to?(:stats!)
+
+        stats = recorder.stats!
+        logger.debug "#{human_name}: depth #{stats[:max_depth]}, #{stats[:dropped]} dropped, #{stats[:latency].call_count} recorded"
+
+        metrics = {
+          meta("RecorderQueueDepth") => single(stats[:max_depth]),
+          meta("RecorderDropped") => single(stats[:dropped]),
+        }
+        metrics[meta("RecorderLatency")] = stats[:latency] if stats[:latency].call_count > 0
+
+        store.track!(metrics, :timestamp => timestamp)
+      end
+
+      def logger
+        context.logger
+      end
+
+      private
+
+      def meta(name)
+        MetricMeta.new("#{metric_type}/#{name}")
+      end
+
+      def single(value)
+        stat = MetricStats.new(false)
+        stat.update!(value)
+        stat
+      end
+    end
+  end
+end
@@ -4,7 +4,11 @@ module ScoutApm
       DEFAULT_SAMPLERS = [
         ScoutApm::Instruments::Process::ProcessCpu,
         ScoutApm::Instruments::Process::ProcessMemory,
+        ScoutApm::Instruments::Process::ProcessAllocations,
+        ScoutApm::Instruments::Process::ProcessGc,
         ScoutApm::Instruments::PercentileSampler,
+        ScoutApm::Instruments::RecorderSampler,
+        ScoutApm::Instruments::AgentOverheadSampler,
       ]
     end
   end
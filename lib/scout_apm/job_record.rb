@@ -14,15 +14,18 @@ module ScoutApm
     attr_reader :errors
     attr_reader :metric_set
 
-    def initialize(queue_name, job_name, total_time, exclusive_time, errors, metrics)
+    # exclusive_weight is how many runs the exclusive time stands for: 0 for
+    # an untraced run, whose exclusive time is all of its time, and the
+    # sample for a traced one. See RequestSampling
+    def initialize(queue_name, job_name, total_time, exclusive_time, errors, metrics, exclusive_weight = 1)
       @queue_name = queue_name
       @job_name = job_name
 
-      @total_time = NumericHistogram.new(50)
+      @total_time = NativeNumericHistogram.new(50)
       @total_time.add(total_time)
 
-      @exclusive_time = NumericHistogram.new(50)
-      @exclusive_time.add(exclusive_time)
+      @exclusive_time = NativeNumericHistogram.new(50)
+      @exclusive_time.add(exclusive_time, exclusive_weight)
 
       @errors = errors.to_i
 
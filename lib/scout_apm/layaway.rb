@@ -5,6 +5,8 @@
 #   Where timestamp is in the format:
 #   And PID is the process id of the running process
 #
+require 'pathname'
+
 module ScoutApm
   class Layaway
     # How long to let a stale file sit before deleting it.
@@ -98,7 +100,7 @@ module ScoutApm
             log_layaway_file_information
 
             files = all_files_for(timestamp).reject{|l| l.to_s == coordinator_file.to_s }
-            rps = files.map{ |layaway| LayawayFile.new(context, layaway).load }.compact
+            rps = context.agent_overhead.measure("LayawayLoad") { load_reporting_periods(files) }
             if rps.any?
               yield rps
 
@@ -128,6 +130,15 @@ module ScoutApm
       end
     end
 
+    # Binary layaway files are merged into one period as they're read. Any
+    # others are loaded one per file, to be merged by the caller.
+    def load_reporting_periods(files)
+      merged, others = LayawayFormat.merge(files)
+      logger.debug("Layaway: Merged #{files.length - others.length} binary layaway files") if merged
+
+      ([merged] + others.map { |layaway| LayawayFile.new(context, layaway).load }).compact
+    end
+
     def delete_files_for(timestamp)
       all_files_for(timestamp).each { |layaway|
         logger.debug("Layaway: Deleting file: #{layaway}")
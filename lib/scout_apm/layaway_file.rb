@@ -17,7 +17,7 @@ module ScoutApm
       data = File.open(path, "r") { |f| read_raw(f) }
       deserialize(data)
     rescue NameError, ArgumentError, TypeError => e
-      # Marshal error
+      # Marshal or binary format error
       logger.info("LayawayFile: Unable to load data")
       logger.debug("#{e.message}, #{e.backtrace.join("\n\t")}")
       nil
@@ -29,11 +29,11 @@ module ScoutApm
     end
 
     def serialize(data)
-      Marshal.dump(data)
+      LayawayFormat.dump(data, context.config.value('layaway_format'))
     end
 
     def deserialize(data)
-      Marshal.load(data)
+      LayawayFormat.load(data)
     end
 
     def read_raw(f)
@@ -0,0 +1,123 @@
+# Reads and writes layaway files. A StoreReportingPeriod is written in either
+# of two formats, picked with the layaway_format config setting:
+#
+# marshal - Marshal.dump of the whole period
+# binary  - The period's metrics packed by NativeLayawayFormat (see
+#           ext/layaway_format), with everything else Marshaled into one
+#           record alongside them
+#
+# The metric set is the bulk of a period, and packing it keeps each metric
+# name, scope and desc written once instead of once per metric. Either format
+# is read regardless of the setting, so files written before a change load.
+# Marshal stays the default for now: during a rolling deploy, older agents
+# share the layaway directory and can't read binary files.
+#
+# Binary files can also be merged without loading them, see merge.
+#
+# Older agents don't have NativeNumericHistogram either, so in both formats
+# the period's histograms are written as NumericHistograms, which have the
+# same Marshal layout. They're made native again as they're loaded.
+module ScoutApm
+  module LayawayFormat
+    def self.dump(period, format)
+      if format == 'binary' && period.is_a?(StoreReportingPeriod)
+        NativeLayawayFormat.dump(period.metric_set.metrics) do |leftovers|
+          Marshal.dump(with_histograms(without_metrics(period, leftovers), NumericHistogram))
+        end
+      else
+        Marshal.dump(with_histograms(period, NumericHistogram))
+      end
+    end
+
+    def self.load(data)
+      if NativeLayawayFormat.binary?(data)
+        metrics, rest = NativeLayawayFormat.load(data)
+        period = native_histograms(Marshal.load(rest))
+        period.metric_set.metrics.update(metrics)
+        period
+      else
+        native_histograms(Marshal.load(data))
+      end
+    end
+
+    # Merges the periods in the binary layaway files at paths into one. Their
+    # metrics are combined natively from the mapped files, so the Ruby objects
+    # made are those of the result, not those of every file.
+    #
+    # Returns [period, other_paths]: the merged period (nil if no file could
+    # be merged) and the paths that weren't, which must be loaded by
+    # themselves.
+    def self.merge(paths)
+      paths = paths.map(&:to_s)
+      return [nil, paths] unless NativeLayawayFormat.respond_to?(:merge)
+
+      metrics, merged_paths, rests = NativeLayawayFormat.merge(paths, MetricSet::KEPT_TYPES)
+      return [nil, paths] if merged_paths.empty?
+
+      period = rests.map { |rest| native_histograms(Marshal.load(rest)) }.inject { |memo, rp| memo.merge(rp) }
+
+      # Metrics that weren't packed were merged with the rest. Fold them in.
+      leftovers = period.metric_set.dup
+      period.metric_set.instance_variable_set(:@metrics, metrics)
+      period.metric_set.combine!(leftovers)
+
+      [period, paths - merged_paths]
+    rescue NameError, ArgumentError, TypeError
+      # A Marshal record that won't load. Leave it to loading file by file
+      [nil, paths]
+    end
+
+    # A shallow copy of the period, with a metric set holding only metrics
+    def self.without_metrics(period, metrics)
+      metric_set = period.metric_set.dup
+      metric_set.instance_variable_set(:@metrics, metrics)
+
+      period = period.dup
+      period.instance_variable_set(:@metric_set, metric_set)
+      period
+    end
+
+    def self.native_histograms(period)
+      period.is_a?(StoreReportingPeriod) ? with_histograms(period, NativeNumericHistogram) : period
+    end
+
+    # A shallow copy of the period, with the histograms of its percentiles,
+    # jobs and database queries as klass: NumericHistogram or
+    # NativeNumericHistogram.
+    def self.with_histograms(period, klass)
+      return period unless period.is_a?(StoreReportingPeriod)
+
+      histograms = period.histograms.map { |report| with_histogram(report, :@histogram, klass) }
+
+      jobs = {}
+      period.jobs.each do |job|
+        job = with_histogram(with_histogram(job, :@total_time, klass), :@exclusive_time, klass)
+        jobs[job] = job
+      end
+
+      db_query_metric_set = period.db_query_metric_set.dup
+      db_query_metrics = {}
+      db_query_metric_set.metrics.each { |key, stat| db_query_metrics[key] = with_histogram(stat, :@histogram, klass) }
+      db_query_metric_set.instance_variable_set(:@metrics, db_query_metrics)
+
+      period = period.dup
+      period.instance_variable_set(:@histograms, histograms)
+      period.instance_variable_set(:@jobs, jobs)
+      period.instance_variable_set(:@db_query_metric_set, db_query_metric_set)
+      period
+    end
+
+    # A shallow copy of object, with the histogram in ivar as klass. Both
+    # classes load each other's marshal_dump.
+    def self.with_histogram(object, ivar, klass)
+      histogram = object.instance_variable_get(ivar)
+      return object if histogram.nil? || histogram.instance_of?(klass)
+
+      converted = klass.allocate
+      converted.marshal_load(histogram.marshal_dump)
+      object = object.dup
+      object.instance_variable_set(ivar, converted)
+      object
+    end
+  end
+end
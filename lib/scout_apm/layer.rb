@@ -25,7 +25,9 @@ module ScoutApm
       @children || LayerChildrenSet.new
     end
 
-    # Time objects recording the start & stop times of this layer
+    # Time objects recording the start & stop times of this layer. Only the
+    # root layer keeps these (see #record_start_time!); they are nil on every
+    # other layer. Durations come from the monotonic clock instead.
     attr_reader :start_time, :stop_time
 
     # The description of this layer.  Will contain additional details specific to the type of layer.
@@ -35,7 +37,8 @@ module ScoutApm
     attr_reader :desc
 
     # If this layer took longer than a fixed amount of time, store the
-    # backtrace of where it occurred.
+    # backtrace of where it occurred. Only the app's frames are kept, as
+    # picked out by BacktraceParser.
     attr_reader :backtrace
 
     # As we go through a part of a request, instrumentation can store additional data
@@ -48,12 +51,24 @@ module ScoutApm
 
     BACKTRACE_CALLER_LIMIT = 50 # maximum number of lines to send thru for backtrace analysis
 
-    def initialize(type, name, start_time = Time.now)
+    # Nanoseconds between Process.monotonic_ns clock ticks
+    NANOSECONDS = 1_000_000_000.0
+
+    def initialize(type, name, start_time = nil)
       @type = type
       @name = name
+      @start_ns = ::Process.monotonic_ns
+      @stop_ns = nil
       @start_time = start_time
+      @stop_time = nil
       @allocations_start = ScoutApm::Instruments::Allocations.count
       @allocations_stop = 0
+      @gc_count_start = ScoutApm::Instruments::GarbageCollection.count
+      @gc_time_start = ScoutApm::Instruments::GarbageCollection.time
+      @gc_count_stop = nil
+      @gc_time_stop = nil
+      @cpu_start = ::Process.thread_cpu_time
+      @cpu_stop = nil
 
       # initialize these only on first use
       @children = nil
@@ -70,8 +85,16 @@ module ScoutApm
       @children << child
     end
 
-    def record_stop_time!(stop_time = Time.now)
-      @stop_time = stop_time
+    # Wall clock start time, for layers that need a timestamp to report.
+    # TrackedRequest only calls this on the root layer.
+    def record_start_time!(start_time = Time.now)
+      @start_time = start_time
+    end
+
+    # Wall clock stop time is only recorded if the start time was.
+    def record_stop_time!(stop_time = nil)
+      @stop_ns = ::Process.monotonic_ns
+      @stop_time = stop_time || (Time.now if @start_time)
     end
 
     # Fetch the current number of allocated objects. This will always increment - we fetch when initializing and when stopping the layer.
@@ -79,6 +102,19 @@ module ScoutApm
       @allocations_stop = ScoutApm::Instruments::Allocations.count
     end
 
+    # CPU time used by this thread, as opposed to the wall clock time between
+    # start & stop. Only meaningful where Process.thread_cpu_time_supported?
+    def record_cpu_time!
+      @cpu_stop = ::Process.thread_cpu_time
+    end
+
+    # Fetch the process' GC count & pause time, so the difference from the
+    # start is what overlapped this layer.
+    def record_gc!
+      @gc_count_stop = ScoutApm::Instruments::GarbageCollection.count
+      @gc_time_stop = ScoutApm::Instruments::GarbageCollection.time
+    end
+
     def desc=(desc)
       @desc = desc
     end
@@ -100,12 +136,20 @@ module ScoutApm
     # This is the old style name. This function is used for now, but should be
     # removed, and the new type & name split should be enforced through the
     # app.
+    #
+    # Converters ask for it repeatedly, as the scope of every layer under this
+    # one, so it's kept until the name changes.
     def legacy_metric_name
-      "#{type}/#{name}"
+      unless @legacy_metric_name && @legacy_metric_name_of.equal?(name)
+        @legacy_metric_name_of = name
+        @legacy_metric_name = "#{type}/#{name}".freeze
+      end
+      @legacy_metric_name
     end
 
     def capture_backtrace!
-      @backtrace = caller_array
+      @backtrace = ScoutApm::Utils::BacktraceParser.capture(2, BACKTRACE_CALLER_LIMIT - 3) ||
+        ScoutApm::Utils::BacktraceParser.new(caller_array).call
     end
 
     # In Ruby 2.0+, we can pass the range directly to the caller to reduce the memory footprint.
@@ -130,7 +174,7 @@ module ScoutApm
       self_string = total_exclusive_time == 0 ? nil : "Self: #{total_exclusive_time}"
       timing_string = [total_string, self_string].compact.join(", ")
 
-      time_clause = "(Start: #{start_time.iso8601} / Stop: #{stop_time.try(:iso8601)} [#{timing_string}])"
+      time_clause = "(Start: #{start_time.try(:iso8601)} / Stop: #{stop_time.try(:iso8601)} [#{timing_string}])"
       desc_clause = "Description: #{desc.inspect}"
       children_clause = "Children: #{children.length}"
 
@@ -142,21 +186,17 @@ module ScoutApm
     ######################################
 
     def total_call_time
-      if stop_time
-        stop_time - start_time
-      else
-        Time.now - start_time
-      end
+      ((@stop_ns || ::Process.monotonic_ns) - @start_ns) / NANOSECONDS
     end
 
     def total_exclusive_time
       total_call_time - child_time
     end
 
+    # Children are only added once they've stopped, so their times are
+    # summed up as they're added (see LayerChildrenSet#<<)
     def child_time
-      children.
-        map { |child| child.total_call_time }.
-        inject(0) { |sum, time| sum + time }
+      @children ? @children.total_call_time : 0
     end
     private :child_time
 
@@ -180,10 +220,40 @@ module ScoutApm
     end
 
     def child_allocations
-      children.
-        map { |child| child.total_allocations }.
-        inject(0) { |sum, obj| sum + obj }
+      @children ? @children.total_allocations : 0
     end
     private :child_allocations
+
+    ######################################
+    # CPU Calculations
+    ######################################
+
+    # Seconds of CPU this layer (and its children) used on its thread
+    def total_cpu_time
+      stop = @cpu_stop || ::Process.thread_cpu_time
+      time = stop - @cpu_start
+      time < 0 ? 0 : time
+    end
+
+    ######################################
+    # GC Calculations
+    ######################################
+
+    # A GC pause stops every thread, so these count the pauses that overlapped
+    # this layer's wall time, whichever thread triggered them. Includes
+    # children.
+
+    # Seconds spent paused in GC
+    def total_gc_time
+      stop = @gc_time_stop || ScoutApm::Instruments::GarbageCollection.time
+      time = (stop - @gc_time_start) / 1_000_000_000.0
+      time < 0 ? 0 : time
+    end
+
+    def total_gc_count
+      stop = @gc_count_stop || ScoutApm::Instruments::GarbageCollection.count
+      count = stop - @gc_count_start
+      count < 0 ? 0 : count
+    end
   end
 end
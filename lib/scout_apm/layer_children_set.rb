@@ -26,10 +26,18 @@ module ScoutApm
     attr_reader :children
     private :children
 
+    # Running totals of every child added, whether kept or absorbed into a
+    # LimitedLayer. These let Layer work out exclusive time & allocations
+    # without going back over its children.
+    attr_reader :total_call_time
+    attr_reader :total_allocations
+
     def initialize(unique_cutoff = DEFAULT_UNIQUE_CUTOFF)
       @children = Hash.new
       @limited_layers = nil # populated when needed
       @unique_cutoff = unique_cutoff
+      @total_call_time = 0
+      @total_allocations = 0
     end
 
     def child_set(metric_type)
@@ -42,6 +50,9 @@ module ScoutApm
     # into the created LimitedLayer, since it will "freeze" any current data for
     # total_call_time and similar methods.
     def <<(child)
+      @total_call_time += child.total_call_time
+      @total_allocations += child.total_allocations
+
       metric_type = child.type
       set = child_set(metric_type)
 
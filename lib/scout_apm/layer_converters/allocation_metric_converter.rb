@@ -3,7 +3,7 @@ module ScoutApm
     class AllocationMetricConverter < ConverterBase
       def record!
         return unless scope_layer
-        return unless ScoutApm::Instruments::Allocations::ENABLED
+        return unless request.track_allocations?
 
         meta = MetricMeta.new("ObjectAllocations", {:scope => scope_layer.legacy_metric_name})
         stat = MetricStats.new
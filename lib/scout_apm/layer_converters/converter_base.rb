@@ -22,35 +22,59 @@ module ScoutApm
         layer_finder.scope
       end
 
+      # An untraced request's Controller or Job has no children, so all of
+      # its time would count as exclusive. Only traced requests report the
+      # scope layer's exclusive time, scaled up by the requests they stand
+      # for. See RequestSampling
+      def scope_exclusive_time(exclusive_time)
+        request.sampled? ? exclusive_time * request.sample_weight : 0.0
+      end
+
       ################################################################################
-      # Subscoping
+      # Walking
       ################################################################################
       #
-      # Keep a list of subscopes, but only ever use the front one.  The rest
-      # get pushed/popped in cases when we have many levels of subscopable
-      # layers.  This lets us push/pop without otherwise keeping track very closely.
+      # Converters share a single DepthFirstWalker over the request's layers
+      # (see TrackedRequest#record!). It tracks subscopes, and caches each
+      # layer's times, in the Visit it's currently on.
       def register_hooks(walker)
-        @subscope_layers = []
+        @walker = walker
+      end
 
-        walker.before do |layer|
-          if layer.subscopable?
-            @subscope_layers.push(layer)
-          end
+      # The walker's Visit of this layer. Outside of a walk, this builds a
+      # one-off Visit of the layer.
+      def visit_of(layer)
+        current = @walker && @walker.current
+        if current && current.layer.equal?(layer)
+          current
+        else
+          DepthFirstWalker::Visit.new(layer, nil)
         end
+      end
 
-        walker.after do |layer|
-          if layer.subscopable?
-            @subscope_layers.pop
-          end
+      # Runs the block over every layer, with its Visit. Reuses the shared walk
+      # if it's already happened, rather than going over the tree again.
+      def each_visit(&block)
+        unless @walker && @walker.walked?
+          register_hooks(DepthFirstWalker.new(root_layer))
+          @walker.walk
         end
+        @walker.replay(&block)
       end
 
+      ################################################################################
+      # Subscoping
+      ################################################################################
+      #
+      # The walker keeps the list of subscopes. A layer is subscoped under the
+      # outermost subscopable layer it's nested in.
+
       def subscoped?(layer)
-        @subscope_layers.first && layer != @subscope_layers.first # Don't scope under ourself.
+        !!visit_of(layer).subscope
       end
 
-      def subscope_name
-        @subscope_layers.first.legacy_metric_name
+      def subscope_name(layer)
+        visit_of(layer).subscope.legacy_metric_name
       end
 
 
@@ -72,10 +96,8 @@ module ScoutApm
 
       # Call this as you are processing each layer. It will store off backtraces
       def store_backtrace(layer, meta)
-        return unless layer.backtrace
-
-        bt = ScoutApm::Utils::BacktraceParser.new(layer.backtrace).call
-        if bt.any?
+        bt = layer.backtrace
+        if bt && bt.any?
           meta.backtrace = bt
           @backtraces << meta
         end
@@ -131,7 +153,7 @@ module ScoutApm
         # Like: Controller -> View/users/show -> ActiveRecord/user/find
         #   in that example, the scope is the View/users/show
         if subscoped?(layer)
-          {:scope => subscope_name}
+          {:scope => subscope_name(layer)}
 
         # We don't scope the controller under itself
         elsif layer == scope_layer
@@ -156,6 +178,17 @@ module ScoutApm
       end
 
 
+      ################################################################################
+      # CPU Time
+      ################################################################################
+
+      # The CPU time a layer's thread used, or nil where per-thread CPU time
+      # isn't available (so traces don't claim a request used no CPU).
+      def cpu_time(layer)
+        return nil unless ::Process.thread_cpu_time_supported?
+        layer.total_cpu_time
+      end
+
       ################################################################################
       # Storing metrics into the hashes
       ################################################################################
@@ -165,6 +198,7 @@ module ScoutApm
         return false if over_metric_limit?(metric_hash)
 
         meta_options = make_meta_options(layer)
+        visit = visit_of(layer)
 
         meta = MetricMeta.new(layer.legacy_metric_name, meta_options)
         meta.extra.merge!(layer.annotations) if layer.annotations
@@ -176,11 +210,11 @@ module ScoutApm
 
         # timing
         stat = metric_hash[meta]
-        stat.update!(layer.total_call_time, layer.total_exclusive_time)
+        stat.update!(visit.total_call_time, visit.total_exclusive_time)
 
         # allocations
         stat = allocation_metric_hash[meta]
-        stat.update!(layer.total_allocations, layer.total_exclusive_allocations)
+        stat.update!(visit.total_allocations, visit.total_exclusive_allocations)
 
         if LimitedLayer === layer
           metric_hash[meta].call_count = layer.count
@@ -191,17 +225,18 @@ module ScoutApm
       # Merged Metric - no specifics, just sum up by type (ActiveRecord, View, HTTP, etc)
       def store_aggregate_metric(layer, metric_hash, allocation_metric_hash)
           meta = MetricMeta.new("#{layer.type}/all")
+          visit = visit_of(layer)
 
           metric_hash[meta] ||= MetricStats.new(false)
           allocation_metric_hash[meta] ||= MetricStats.new(false)
 
           # timing
           stat = metric_hash[meta]
-          stat.update!(layer.total_call_time, layer.total_exclusive_time)
+          stat.update!(visit.total_call_time, visit.total_exclusive_time)
 
           # allocations
           stat = allocation_metric_hash[meta]
-          stat.update!(layer.total_allocations, layer.total_exclusive_allocations)
+          stat.update!(visit.total_allocations, visit.total_exclusive_allocations)
       end
 
       ################################################################################
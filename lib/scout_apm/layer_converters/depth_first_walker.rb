@@ -1,14 +1,28 @@
 module ScoutApm
   module LayerConverters
+    # Walks a layer tree once on behalf of every converter registered on it.
+    #
+    # Each layer is visited with a Visit, which works out the layer's
+    # subscope and caches its exclusive time & allocations, so converters
+    # sharing the walk don't each recompute them. The visits are kept, letting
+    # a converter that only decides later that it wants the tree (see
+    # SlowRequestConverter) #replay them rather than walking it again.
     class DepthFirstWalker
       attr_reader :root_layer
 
+      # The Visit of the layer the callbacks are being run for
+      attr_reader :current
+
       def initialize(root_layer)
         @root_layer = root_layer
 
         @on_blocks = []
         @before_blocks = []
         @after_blocks = []
+
+        @subscope_layers = []
+        @visits = nil
+        @current = nil
       end
 
       def before(&block)
@@ -19,30 +33,99 @@ module ScoutApm
         @after_blocks << block
       end
 
+      # on blocks are called with the layer, and its Visit
       def on(&block)
         @on_blocks << block
       end
 
+      def walked?
+        !@visits.nil?
+      end
+
       def walk(layer=root_layer)
         # Need to run this for the root layer the first time through.
         if layer == root_layer
-          @before_blocks.each{|b| b.call(layer) }
-          @on_blocks.each{|b| b.call(layer) }
+          @visits = []
+          visit(layer)
         end
 
         layer.children.each do |child|
-          @before_blocks.each{|b| b.call(child) }
-          @on_blocks.each{|b| b.call(child) }
+          visit(child)
           walk(child)
-          @after_blocks.each{|b| b.call(child) }
+          leave(child)
         end
 
         if layer == root_layer
-          @after_blocks.each{|b| b.call(layer) }
+          leave(layer)
         end
 
         nil
       end
+
+      # Calls the block with each layer and its Visit, in the order they were
+      # walked, without walking the tree again.
+      def replay
+        @visits.each do |v|
+          @current = v
+          yield v.layer, v
+        end
+        @current = nil
+        nil
+      end
+
+      private
+
+      # Keep a list of subscopes, but only ever use the front one.  The rest
+      # get pushed/popped in cases when we have many levels of subscopable
+      # layers.  This lets us push/pop without otherwise keeping track very closely.
+      def visit(layer)
+        @subscope_layers.push(layer) if layer.subscopable?
+
+        subscope = @subscope_layers.first
+        subscope = nil if subscope == layer # Don't scope under ourself.
+
+        @current = Visit.new(layer, subscope)
+        @visits << @current
+
+        @before_blocks.each{|b| b.call(layer) }
+        @on_blocks.each{|b| b.call(layer, @current) }
+      end
+
+      def leave(layer)
+        @after_blocks.each{|b| b.call(layer) }
+        @subscope_layers.pop if layer.subscopable?
+        @current = nil
+      end
+
+      # What converters need to know about a layer at its place in the tree.
+      # Times & allocations are worked out on first use, then reused.
+      class Visit
+        attr_reader :layer
+
+        # The subscopable layer this one is nested under, if any
+        attr_reader :subscope
+
+        def initialize(layer, subscope)
+          @layer = layer
+          @subscope = subscope
+        end
+
+        def total_call_time
+          @total_call_time ||= layer.total_call_time
+        end
+
+        def total_exclusive_time
+          @total_exclusive_time ||= layer.total_exclusive_time
+        end
+
+        def total_allocations
+          @total_allocations ||= layer.total_allocations
+        end
+
+        def total_exclusive_allocations
+          @total_exclusive_allocations ||= layer.total_exclusive_allocations
+        end
+      end
     end
   end
 end
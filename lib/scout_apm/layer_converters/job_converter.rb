@@ -20,7 +20,7 @@ module ScoutApm
         @metrics = Hash.new
         @meta_options = {:scope => layer_finder.job.legacy_metric_name}
 
-        walker.on do |layer|
+        walker.on do |layer, visit|
           next if layer == layer_finder.job
           next if layer == layer_finder.queue
           next if skip_layer?(layer)
@@ -34,7 +34,7 @@ module ScoutApm
           @metrics[meta] ||= MetricStats.new( meta_options.has_key?(:scope) )
 
           stat = @metrics[meta]
-          stat.update!(layer.total_call_time, layer.total_exclusive_time)
+          stat.update!(visit.total_call_time, visit.total_exclusive_time)
         end
 
       end
@@ -43,6 +43,7 @@ module ScoutApm
         return unless request.job?
 
         errors = request.error? ? 1 : 0
+        scale_metrics! if request.sampled? && request.sample_weight > 1
         add_latency_metric!
 
         record = JobRecord.new(
@@ -51,12 +52,19 @@ module ScoutApm
           layer_finder.job.total_call_time,
           layer_finder.job.total_exclusive_time,
           errors,
-          @metrics
+          @metrics,
+          request.sampled? ? request.sample_weight : 0
         )
 
         @store.track_job!(record)
       end
 
+      # A traced job's metrics stand for those of the untraced jobs too, which
+      # have none. See RequestSampling
+      def scale_metrics!
+        @metrics.each_value { |stat| stat.scale!(request.sample_weight) }
+      end
+
       # This isn't stored as a specific layer, so grabbing it doesn't use the
       # walker callbacks
       def add_latency_metric!
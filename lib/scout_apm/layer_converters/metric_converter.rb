@@ -5,6 +5,11 @@
 # overview metrics, or stored permanently in a SlowTransaction
 # Some merging of metrics will happen here, so if a request calls the same
 # ActiveRecord or View repeatedly, it'll get merged.
+#
+# An untraced request (see RequestSampling) only reports the Controller or Job
+# metric. So a traced request's other metrics are scaled up by the number of
+# requests it stands for. So is the Controller or Job's exclusive time, which
+# untraced requests leave out.
 module ScoutApm
   module LayerConverters
     class MetricConverter < ConverterBase
@@ -15,8 +20,9 @@ module ScoutApm
 
         return unless scope_layer
 
-        walker.on do |layer|
+        walker.on do |layer, visit|
           next if skip_layer?(layer)
+          next unless layer == scope_layer || request.sampled?
 
           meta_options = if layer == scope_layer # We don't scope the controller under itself
                           {}
@@ -31,14 +37,24 @@ module ScoutApm
           meta = MetricMeta.new(metric_name, meta_options)
           @metrics[meta] ||= MetricStats.new( meta_options.has_key?(:scope) )
 
+          exclusive_time = visit.total_exclusive_time
+          exclusive_time = scope_exclusive_time(exclusive_time) if layer == scope_layer
+
           stat = @metrics[meta]
-          stat.update!(layer.total_call_time, layer.total_exclusive_time)
+          stat.update!(visit.total_call_time, exclusive_time)
         end
       end
 
       def record!
+        scale_metrics! if request.sampled? && request.sample_weight > 1
         @store.track!(@metrics)
       end
+
+      def scale_metrics!
+        @metrics.each do |meta, stat|
+          stat.scale!(request.sample_weight) if meta.scope
+        end
+      end
     end
   end
 end
@@ -36,8 +36,11 @@ module ScoutApm
 
         timing_metrics, allocation_metrics = create_metrics
 
-        unless ScoutApm::Instruments::Allocations::ENABLED
+        allocation_hotspots = request.allocation_hotspots
+
+        unless request.track_allocations?
           allocation_metrics = {}
+          allocation_hotspots = []
         end
 
         SlowJobRecord.new(
@@ -53,19 +56,20 @@ module ScoutApm
           mem_delta,
           job_layer.total_allocations,
           score,
-          limited?
+          limited?,
+          allocation_hotspots,
+          job_layer.total_gc_time,
+          job_layer.total_gc_count,
+          cpu_time(job_layer)
         )
       end
 
       def create_metrics
-        # Create a new walker, and wire up the subscope stuff
-        walker = LayerConverters::DepthFirstWalker.new(self.root_layer)
-        register_hooks(walker)
-
         metric_hash = Hash.new
         allocation_metric_hash = Hash.new
 
-        walker.on do |layer|
+        # Reuse the request's walk of its layers
+        each_visit do |layer|
           next if skip_layer?(layer)
 
           # The queue_layer is useful to capture for other reasons, but doesn't
@@ -76,9 +80,6 @@ module ScoutApm
           store_aggregate_metric(layer, metric_hash, allocation_metric_hash)
         end
 
-        # And now run through the walk we just defined
-        walker.walk
-
         metric_hash = attach_backtraces(metric_hash)
         allocation_metric_hash = attach_backtraces(allocation_metric_hash)
 
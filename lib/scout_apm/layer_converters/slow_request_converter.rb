@@ -34,8 +34,11 @@ module ScoutApm
 
         timing_metrics, allocation_metrics = create_metrics
 
-        unless ScoutApm::Instruments::Allocations::ENABLED
+        allocation_hotspots = request.allocation_hotspots
+
+        unless request.track_allocations?
           allocation_metrics = {}
+          allocation_hotspots = []
         end
 
         SlowTransaction.new(context,
@@ -46,11 +49,15 @@ module ScoutApm
                             allocation_metrics,
                             request.context,
                             root_layer.stop_time,
-                            [], # stackprof, now unused.
+                            context.stack_profiling.stacks(request.stack_profile),
                             mem_delta,
                             root_layer.total_allocations,
                             @points,
-                            limited?)
+                            limited?,
+                            allocation_hotspots,
+                            root_layer.total_gc_time,
+                            root_layer.total_gc_count,
+                            cpu_time(root_layer))
       end
 
       # Full metrics from this request. These get stored permanently in a SlowTransaction.
@@ -59,22 +66,16 @@ module ScoutApm
       #
       # This returns a 2-element of Metric Hashes (the first element is timing metrics, the second element is allocation metrics)
       def create_metrics
-        # Create a new walker, and wire up the subscope stuff
-        walker = LayerConverters::DepthFirstWalker.new(self.root_layer)
-        register_hooks(walker)
-
         metric_hash = Hash.new
         allocation_metric_hash = Hash.new
 
-        walker.on do |layer|
+        # Reuse the request's walk of its layers
+        each_visit do |layer|
           next if skip_layer?(layer)
           store_specific_metric(layer, metric_hash, allocation_metric_hash)
           store_aggregate_metric(layer, metric_hash, allocation_metric_hash)
         end
 
-        # And now run through the walk we just defined
-        walker.walk
-
         metric_hash = attach_backtraces(metric_hash)
         allocation_metric_hash = attach_backtraces(allocation_metric_hash)
 
@@ -103,6 +103,14 @@ module ScoutApm
       raise "Should never call record_allocations! on a limited_layer"
     end
 
+    def record_cpu_time!
+      raise "Should never call record_cpu_time! on a limited_layer"
+    end
+
+    def record_gc!
+      raise "Should never call record_gc! on a limited_layer"
+    end
+
     def desc=(*)
       raise "Should never call desc on a limited_layer"
     end
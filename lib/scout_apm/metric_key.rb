@@ -0,0 +1,111 @@
+# The identity of a metric, as MetricMeta compares them: its name (ignoring
+# case), scope and desc.
+#
+# Keys are frozen, and work out their hash and type/name split once, so a
+# MetricMeta with one doesn't downcase and rehash its strings each time it's
+# looked up in a metrics Hash. MetricKey.for interns them: the metrics of
+# every request a thread handles for an endpoint share the same keys, and
+# most lookups end at an identity check.
+#
+# Each thread interns into its own table, so there's nothing to lock. A table
+# is cleared if it grows past MAX_INTERNED keys. Keys with descs longer than
+# MAX_INTERNED_DESC (such as long SQL) aren't kept in it.
+#
+# A key's hash depends on the process' String#hash seed, so keys are Marshaled
+# as their strings, and interned again when loaded.
+module ScoutApm
+  class MetricKey
+    MAX_INTERNED = 10_000
+    MAX_INTERNED_DESC = 1024
+
+    # The thread variable holding a thread's table: [keys, size]
+    TABLE = :scout_apm_metric_keys
+
+    attr_reader :metric_name
+    attr_reader :scope
+    attr_reader :desc
+
+    # The halves of metric_name, see BucketNameSplitter
+    attr_reader :type
+    attr_reader :name
+
+    # "#{type}/all", the name of the aggregate metric for this one's type
+    attr_reader :aggregate_name
+
+    attr_reader :hash
+
+    def self.for(metric_name, scope, desc)
+      return new(metric_name, scope, desc) if desc.is_a?(String) && desc.bytesize > MAX_INTERNED_DESC
+
+      table = interned_table
+      by_desc = ((table[0][metric_name] ||= {})[scope] ||= {})
+      by_desc[desc] || begin
+        if table[1] >= MAX_INTERNED
+          table[0].clear
+          table[1] = 0
+          by_desc = ((table[0][metric_name] ||= {})[scope] ||= {})
+        end
+        table[1] += 1
+        by_desc[desc] = new(metric_name, scope, desc)
+      end
+    end
+
+    # How many keys this thread has interned
+    def self.interned
+      interned_table[1]
+    end
+
+    def self.interned_table
+      thread = Thread.current
+      thread.thread_variable_get(TABLE) || thread.thread_variable_set(TABLE, [{}, 0])
+    end
+
+    def initialize(metric_name, scope, desc)
+      @metric_name = frozen_copy(metric_name)
+      @scope = frozen_copy(scope)
+      @desc = frozen_copy(desc)
+      @downcased_name = metric_name.downcase.freeze
+
+      @type, @name = metric_name.to_s.split(/\//, 2)
+      @type.freeze
+      @name.freeze
+      @aggregate_name = "#{@type}/all".freeze
+
+      h = @downcased_name.hash
+      h ^= scope.downcase.hash unless scope.nil?
+      h ^= desc.downcase.hash unless desc.nil?
+      @hash = h
+
+      freeze
+    end
+
+    def eql?(o)
+      equal?(o) || (
+        o.class == MetricKey &&
+        hash == o.hash &&
+        downcased_name == o.downcased_name &&
+        scope == o.scope &&
+        desc == o.desc)
+    end
+
+    alias :== :eql?
+
+    def _dump(level)
+      Marshal.dump([metric_name, scope, desc])
+    end
+
+    def self._load(data)
+      self.for(*Marshal.load(data))
+    end
+
+    protected
+
+    attr_reader :downcased_name
+
+    private
+
+    def frozen_copy(str)
+      str.is_a?(String) && !str.frozen? ? str.dup.freeze : str
+    end
+  end
+end
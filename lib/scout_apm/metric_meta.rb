@@ -10,18 +10,46 @@ class MetricMeta
     @desc = options[:desc]
     @extra = {}
   end
-  attr_accessor :metric_id, :metric_name
-  attr_accessor :scope
+  attr_accessor :metric_id
   attr_accessor :client_id
-  attr_accessor :desc, :extra
+  attr_accessor :extra
+  attr_reader :metric_name, :scope, :desc
+
+  def metric_name=(metric_name)
+    @metric_name = metric_name
+    forget_metric_key
+  end
+
+  def scope=(scope)
+    @scope = scope
+    forget_metric_key
+  end
+
+  def desc=(desc)
+    @desc = desc
+    forget_metric_key
+  end
+
+  # Each meta's MetricKey, by identity. They're kept here rather than in an
+  # instance variable so Marshaled metas stay the same as before keys, and
+  # older agents can still load layaway files with them. A meta only ever
+  # reads its own entry, so this takes no lock.
+  METRIC_KEYS = defined?(ObjectSpace::WeakMap) ? ObjectSpace::WeakMap.new : nil
+
+  # The MetricKey of this meta's name, scope and desc. Hashing and comparing
+  # metas goes through it.
+  def metric_key
+    return MetricKey.for(metric_name, scope, desc) unless METRIC_KEYS
+    METRIC_KEYS[self] || (METRIC_KEYS[self] = MetricKey.for(metric_name, scope, desc))
+  end
 
   # Unsure if type or bucket is a better name.
   def type
-    bucket_type
+    metric_key.type
   end
 
   def name
-    bucket_name
+    metric_key.name
   end
 
   # A key metric is the "core" of a request - either the Rails controller reached, or the background Job executed
@@ -47,18 +75,13 @@ class MetricMeta
   end
 
   def hash
-    h = metric_name.downcase.hash
-    h ^= scope.downcase.hash unless scope.nil?
-    h ^= desc.downcase.hash unless desc.nil?
-    h
+    metric_key.hash
   end
 
   def eql?(o)
    self.class             == o.class                &&
-     metric_name.downcase == o.metric_name.downcase &&
-     scope                == o.scope                &&
      client_id            == o.client_id            &&
-     desc                 == o.desc
+     metric_key.eql?(o.metric_key)
   end
 
   def as_json
@@ -66,5 +89,12 @@ class MetricMeta
     # query, stack_trace
     ScoutApm::AttributeArranger.call(self, json_attributes)
   end
+
+  private
+
+  # WeakMap can't delete an entry on every Ruby, so a new key replaces it
+  def forget_metric_key
+    METRIC_KEYS[self] = MetricKey.for(metric_name, scope, desc) if METRIC_KEYS && METRIC_KEYS.key?(self)
+  end
 end
 end
@@ -4,7 +4,10 @@ module ScoutApm
     # Controller, and Percentiles so pass through these metrics directly
     #
     # TODO: Figure out a way to not have this duplicate what's in Samplers, and also on server's ingest
-    PASSTHROUGH_METRICS = ["CPU", "Memory", "Instance", "Controller", "SlowTransaction", "Percentile", "Job"]
+    PASSTHROUGH_METRICS = ["CPU", "Memory", "Instance", "Controller", "SlowTransaction", "Percentile", "Job", "Agent"]
+
+    # Types whose metrics combine! merges under their own meta
+    KEPT_TYPES = PASSTHROUGH_METRICS + ["Errors"]
 
     attr_reader :metrics
 
@@ -25,37 +28,51 @@ module ScoutApm
         @metrics[meta].combine!(stat)
 
       elsif meta.type == "Errors" # Sadly special cased, we want both raw and aggregate values
-        # When combining MetricSets between different 
-          @metrics[meta] ||= MetricStats.new
-          @metrics[meta].combine!(stat)
-
-        if !@combine_in_progress
-          agg_meta = MetricMeta.new("Errors/Request", :scope => meta.scope)
-          @metrics[agg_meta] ||= MetricStats.new
-          @metrics[agg_meta].combine!(stat)
-        end
+        @metrics[meta] ||= MetricStats.new
+        @metrics[meta].combine!(stat)
+
+        agg_meta = MetricMeta.new("Errors/Request", :scope => meta.scope)
+        @metrics[agg_meta] ||= MetricStats.new
+        @metrics[agg_meta].combine!(stat)
 
       else # Combine down to a single /all key
-        agg_meta = MetricMeta.new("#{meta.type}/all", :scope => meta.scope)
+        agg_meta = MetricMeta.new(meta.metric_key.aggregate_name, :scope => meta.scope)
         @metrics[agg_meta] ||= MetricStats.new
         @metrics[agg_meta].combine!(stat)
       end
     end
 
-    # Sets a combine_in_progress flag to prevent double-counting Error metrics.
-    # Without it, the Errors/Request number would be increasingly off as
-    # metric_sets get merged in.
+    # Merges in another MetricSet. Its metrics have been through absorb, so
+    # most combine straight into the metric with the same meta, without
+    # making an aggregate meta for each. Metrics that absorb would fold into
+    # another meta are absorbed again.
+    #
+    # Errors are kept as they are: absorbing them again would double count
+    # the Errors/Request number as metric_sets get merged in.
     def combine!(other)
-      @combine_in_progress = true
-      absorb_all(other.metrics)
-      @combine_in_progress = false
+      other.metrics.each do |meta, stat|
+        if absorbed?(meta)
+          (@metrics[meta] ||= MetricStats.new).combine!(stat)
+        else
+          absorb([meta, stat])
+        end
+      end
       self
     end
 
-
     def eql?(other)
       metrics == other.metrics
     end
     alias :== :eql?
+
+    private
+
+    # Whether absorb would keep this metric under its own meta: it's of a kept
+    # type, or already a "#{type}/all" aggregate.
+    def absorbed?(meta)
+      key = meta.metric_key
+      KEPT_TYPES.include?(key.type) ||
+        (key.desc.nil? && meta.client_id.nil? && key.metric_name == key.aggregate_name)
+    end
   end
 end
@@ -20,33 +20,52 @@ class MetricStats
     self.sum_of_squares = 0.0
   end
 
+  NO_EXTRA_METRICS = {}.freeze
+
   # Note, that you must include exclusive_time if you wish to set
   # extra_metrics. A two argument use of this method won't do that.
-  def update!(call_time, exclusive_time=call_time, extra_metrics={})
+  #
+  # This and combine! run for every metric of every request, and again as
+  # metrics are merged, so they use the instance variables directly.
+  def update!(call_time, exclusive_time=call_time, extra_metrics=NO_EXTRA_METRICS)
     # If this metric is scoped inside another, use exclusive time for min/max and sum_of_squares. Non-scoped metrics
     # (like controller actions) track the total call time.
     t = (@scoped ? exclusive_time : call_time)
-    self.min_call_time = t if self.call_count == 0 or t < min_call_time
-    self.max_call_time = t if self.call_count == 0 or t > max_call_time
-    self.call_count += 1
-    self.total_call_time += call_time
-    self.total_exclusive_time += exclusive_time
-    self.sum_of_squares += (t * t)
+    first = @call_count == 0
+    @min_call_time = t if first or t < @min_call_time
+    @max_call_time = t if first or t > @max_call_time
+    @call_count += 1
+    @total_call_time += call_time
+    @total_exclusive_time += exclusive_time
+    @sum_of_squares += (t * t)
     if extra_metrics
-      self.queue = extra_metrics[:queue] if extra_metrics[:queue]
-      self.latency = extra_metrics[:latency] if extra_metrics[:latency]
+      @queue = extra_metrics[:queue] if extra_metrics[:queue]
+      @latency = extra_metrics[:latency] if extra_metrics[:latency]
     end
     self
   end
 
   # combines data from another MetricStats object
   def combine!(other)
-    self.call_count += other.call_count
-    self.total_call_time += other.total_call_time
-    self.total_exclusive_time += other.total_exclusive_time
-    self.min_call_time = other.min_call_time if self.min_call_time.zero? or other.min_call_time < self.min_call_time
-    self.max_call_time = other.max_call_time if other.max_call_time > self.max_call_time
-    self.sum_of_squares += other.sum_of_squares
+    @call_count += other.call_count
+    @total_call_time += other.total_call_time
+    @total_exclusive_time += other.total_exclusive_time
+    other_min = other.min_call_time
+    @min_call_time = other_min if @min_call_time.zero? or other_min < @min_call_time
+    other_max = other.max_call_time
+    @max_call_time = other_max if other_max > @max_call_time
+    @sum_of_squares += other.sum_of_squares
+    self
+  end
+
+  # Makes these stats stand for n times as many calls, as when they come from
+  # 1 in n sampled requests. Min & max are left alone. n is an Integer, so
+  # call_count stays one.
+  def scale!(n)
+    @call_count *= n
+    @total_call_time *= n
+    @total_exclusive_time *= n
+    @sum_of_squares *= n
     self
   end
 
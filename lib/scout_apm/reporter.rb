@@ -5,6 +5,10 @@ module ScoutApm
     CA_FILE     = File.join( File.dirname(__FILE__), *%w[.. .. data cacert.pem] )
     VERIFY_MODE = OpenSSL::SSL::VERIFY_PEER | OpenSSL::SSL::VERIFY_FAIL_IF_NO_PEER_CERT
 
+    # How long a kept alive connection may sit idle and still be used. Longer
+    # than the minute between checkins.
+    KEEP_ALIVE_TIMEOUT = 90
+
     attr_reader :type
     attr_reader :context
     attr_reader :instant_key
@@ -13,6 +17,26 @@ module ScoutApm
       @context = context
       @type = type
       @instant_key = instant_key
+      @connections = nil
+    end
+
+    # Keeps a connection to each host open between posts, instead of making a
+    # new one (and TLS handshake) for every post. Only use a kept alive
+    # reporter from one thread.
+    def keep_alive!
+      @connections = {}
+      @connections_pid = Process.pid
+      self
+    end
+
+    def keep_alive?
+      !@connections.nil?
+    end
+
+    # Closes the kept alive connections
+    def finish_connections
+      return unless keep_alive?
+      @connections.keys.each { |key| close_connection(key) }
     end
 
     def config
@@ -29,7 +53,7 @@ module ScoutApm
       if config.value('compress_payload')
         original_payload_size = payload.length
 
-        payload, compression_headers = compress_payload(payload)
+        payload, compression_headers = context.agent_overhead.measure("Gzip") { compress_payload(payload) }
         headers.merge!(compression_headers)
 
         compress_payload_size = payload.length
@@ -39,6 +63,32 @@ module ScoutApm
       post_payload(hosts, payload, headers)
     end
 
+    # Are checkins handed to the BackgroundReporter, rather than sent inline?
+    def async?
+      type == :checkin && config.value('async_reporting')
+    end
+
+    # Can payloads be written while they are sent? See report_stream
+    # Not with async reporting, which may have to spill the payload to disk.
+    def stream_payload?
+      !async? &&
+        config.value('stream_payload') &&
+        config.value('compress_payload') &&
+        config.value('report_format') == 'json' &&
+        defined?(Fiber)
+    end
+
+    # Like report, but the block writes the payload to the IO it's given
+    # while the request is being sent. The payload is gzipped on the way, and
+    # sent as a chunked body, so it's never held in memory in full. The block
+    # is called once per host.
+    def report_stream(headers = {}, &writer)
+      hosts = determine_hosts
+      headers = headers.merge('Content-Encoding' => 'gzip', 'Transfer-Encoding' => 'chunked')
+
+      post_payload(hosts, lambda { ScoutApm::Utils::GzipStream.new(&writer) }, headers)
+    end
+
     def uri(host)
       encoded_app_name = CGI.escape(context.environment.application_name)
       key = config.value('key')
@@ -70,6 +120,22 @@ module ScoutApm
       end
     end
 
+    # Posts the payload to one host. payload is either the body itself, or a
+    # callable building a new body stream. Returns true if it was accepted.
+    def post_to_host(host, payload, headers)
+      full_uri = uri(host)
+      body = payload.respond_to?(:call) ? payload.call : payload
+      response = post(full_uri, body, headers)
+      if body.respond_to?(:bytes_written)
+        logger.debug("Streamed Size: #{body.bytes_written}")
+      end
+      unless response && response.is_a?(Net::HTTPSuccess)
+        logger.warn "Error on checkin to #{full_uri}: #{response.inspect}"
+        return false
+      end
+      true
+    end
+
     private
 
     def post(uri, body, headers = Hash.new)
@@ -78,7 +144,11 @@ module ScoutApm
         post = Net::HTTP::Post.new( uri.path +
                                     (uri.query ? ('?' + uri.query) : ''),
                                     default_http_headers.merge(headers) )
-        post.body = body
+        if body.respond_to?(:read)
+          post.body_stream = body
+        else
+          post.body = body
+        end
         response = connection.request(post)
       end
       response
@@ -86,7 +156,7 @@ module ScoutApm
 
     def request(uri, &connector)
       response           = nil
-      response           = http(uri).start(&connector)
+      response           = keep_alive? ? kept_alive(uri, &connector) : http(uri).start(&connector)
       logger.debug "got response: #{response.inspect}"
       case response
       when Net::HTTPSuccess, Net::HTTPNotModified
@@ -129,6 +199,47 @@ module ScoutApm
       http
     end
 
+    # Yields the open connection to the uri's host, opening it if needed. A
+    # connection the server has since closed is reopened before the request is
+    # written. One that fails once the request may have been sent isn't tried
+    # again, as the server could already have taken the payload.
+    def kept_alive(uri)
+      forget_connections_after_fork
+      key = [uri.host, uri.port]
+      close_connection(key) if closed_by_server?(@connections[key])
+      connection = (@connections[key] ||= http(uri).tap { |h| h.keep_alive_timeout = KEEP_ALIVE_TIMEOUT }.start)
+      yield connection
+    rescue Exception
+      close_connection(key)
+      raise
+    end
+
+    # Is the idle connection at EOF? Nothing is written to it between
+    # requests, so anything readable means the server closed it.
+    def closed_by_server?(connection)
+      return false unless connection && connection.started?
+      socket = connection.instance_variable_get(:@socket)
+      return true if socket.nil? || socket.closed?
+      IO.select([socket.io.to_io], nil, nil, 0) ? socket.eof? : false
+    rescue IOError, SystemCallError, OpenSSL::SSL::SSLError
+      true
+    end
+
+    def close_connection(key)
+      connection = @connections.delete(key)
+      connection.finish if connection && connection.started?
+    rescue IOError, SystemCallError, OpenSSL::SSL::SSLError
+      # Already gone
+    end
+
+    # A forked process shares its parent's sockets. They're left for the
+    # parent to use, rather than being closed.
+    def forget_connections_after_fork
+      return if @connections_pid == Process.pid
+      @connections = {}
+      @connections_pid = Process.pid
+    end
+
     def compress_payload(payload)
       [
         ScoutApm::Utils::GzipHelper.new.deflate(payload),
@@ -147,14 +258,18 @@ module ScoutApm
       end
     end
 
+    # payload is either the body itself, or a callable building a new body
+    # stream for each host. With async reporting, it's queued to be sent.
     def post_payload(hosts, payload, headers)
-      Array(hosts).each do |host|
-        full_uri = uri(host)
-        response = post(full_uri, payload, headers)
-        unless response && response.is_a?(Net::HTTPSuccess)
-          logger.warn "Error on checkin to #{full_uri}: #{response.inspect}"
-        end
+      if async?
+        context.background_reporter.report(Array(hosts), payload, headers)
+      else
+        context.agent_overhead.measure("Post") { post_to_hosts(hosts, payload, headers) }
       end
     end
+
+    def post_to_hosts(hosts, payload, headers)
+      Array(hosts).each { |host| post_to_host(host, payload, headers) }
+    end
   end
 end
@@ -46,7 +46,7 @@ module ScoutApm
         logger.debug("Succeeded claiming #{period_to_report.to_s}")
 
         begin
-          merged = rps.inject { |memo, rp| memo.merge(rp) }
+          merged = context.agent_overhead.measure("LayawayMerge") { rps.inject { |memo, rp| memo.merge(rp) } }
           logger.debug("Merged #{rps.length} reporting periods, delivering")
           deliver_period(merged)
           true
@@ -82,10 +82,19 @@ module ScoutApm
 
       log_deliver(metrics, slow_transactions, metadata, slow_jobs, histograms)
 
-      payload = ScoutApm::Serializers::PayloadSerializer.serialize(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
-      logger.debug("Sending payload w/ Headers: #{headers.inspect}")
+      if reporter.stream_payload?
+        logger.debug("Streaming payload w/ Headers: #{headers.inspect}")
+        reporter.report_stream(headers) do |io|
+          ScoutApm::Serializers::PayloadSerializer.serialize_to(io, metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+        end
+      else
+        payload = context.agent_overhead.measure("Serialize") do
+          ScoutApm::Serializers::PayloadSerializer.serialize(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+        end
+        logger.debug("Sending payload w/ Headers: #{headers.inspect}")
 
-      reporter.report(payload, headers)
+        reporter.report(payload, headers)
+      end
     rescue => e
       logger.warn "Error on checkin"
       logger.info e.message
@@ -44,7 +44,7 @@ module ScoutApm
     end
 
     def initialize_histograms_hash
-      @histograms = Hash.new { |h, k| h[k] = NumericHistogram.new(histogram_size) }
+      @histograms = Hash.new { |h, k| h[k] = NativeNumericHistogram.new(histogram_size) }
     end
   end
 end
@@ -0,0 +1,114 @@
+# Decides which requests are fully traced, based on the `request_sample` and
+# `request_sample_overhead_budget` config settings.
+#
+# 1 in `request_sample` requests are traced as usual. The rest only track
+# their layers down to the Controller or Job, and only record what needs
+# those: the request's own metric, errors, queue time, and histograms. So
+# throughput, response times and error rates stay exact, while the metrics of
+# the layers under the Controller or Job come from the traced requests,
+# scaled up by the sample (see MetricStats#scale!). Slow transactions, and
+# database & allocation metrics, only come from traced requests.
+#
+# With a `request_sample_overhead_budget`, the sample adapts to keep the agent's
+# own time (tracking layers and converting them) within that percent of
+# request time. Every ADAPT_INTERVAL it's recalculated from the overhead traced
+# and untraced requests had, between `request_sample` and MAX_SAMPLE.
+module ScoutApm
+  class RequestSampling
+    MAX_SAMPLE = 100
+
+    ADAPT_INTERVAL = 10 # seconds
+
+    NANOSECONDS_PER_SECOND = 1_000_000_000.0
+
+    attr_reader :context
+
+    def initialize(context)
+      @context = context
+      @mutex = Mutex.new
+      @sample = nil
+      reset_observations
+    end
+
+    def configured_sample
+      [context.config.value('request_sample'), 1].max
+    end
+
+    # As a fraction of request time
+    def overhead_budget
+      context.config.value('request_sample_overhead_budget').to_f / 100
+    end
+
+    def adaptive?
+      overhead_budget > 0
+    end
+
+    # 1 in how many requests are currently traced
+    def sample
+      @sample ||= configured_sample
+    end
+
+    # Called as a request starts. Returns the number of requests it stands for
+    # if it's traced, or nil if it only records its timing. Dev trace traces
+    # every request.
+    def start_request
+      n = sample
+      return 1 if n == 1 || context.dev_trace_enabled?
+
+      rand(n) == 0 ? n : nil
+    end
+
+    # Called once a request is recorded, with the agent's time spent on it and
+    # the request's duration. With an overhead budget, adapts the sample.
+    def observe(traced, overhead_ns, duration)
+      return unless adaptive?
+
+      @mutex.synchronize do
+        observed = traced ? @traced : @untraced
+        observed[0] += overhead_ns / NANOSECONDS_PER_SECOND
+        observed[1] += duration
+
+        adapt! if adapt_interval_passed?
+      end
+    end
+
+    private
+
+    def adapt_interval_passed?
+      ::Process.monotonic_ns - @observed_since > ADAPT_INTERVAL * NANOSECONDS_PER_SECOND
+    end
+
+    # With a traced request costing traced_overhead of its time, and an
+    # untraced one untraced_overhead, tracing 1 in n requests costs
+    # untraced_overhead + (traced_overhead - untraced_overhead) / n, which is
+    # kept within the budget.
+    def adapt!
+      traced_overhead, traced_time = @traced
+      untraced_overhead, untraced_time = @untraced
+      reset_observations
+      return if traced_time <= 0
+
+      traced_overhead /= traced_time
+      untraced_overhead = untraced_time > 0 ? untraced_overhead / untraced_time : 0.0
+
+      needed = if untraced_overhead >= overhead_budget
+                 MAX_SAMPLE
+               else
+                 ((traced_overhead - untraced_overhead) / (overhead_budget - untraced_overhead)).ceil
+               end
+      adapted = [[needed, configured_sample].max, MAX_SAMPLE].min
+
+      if adapted != sample
+        context.logger.debug("Request sampling: tracing 1 in #{adapted} requests, was 1 in #{sample}. Overhead traced #{(traced_overhead * 100).round(2)}%, untraced #{(untraced_overhead * 100).round(2)}%")
+        @sample = adapted
+      end
+    end
+
+    # [overhead, request time], in seconds
+    def reset_observations
+      @traced = [0.0, 0.0]
+      @untraced = [0.0, 0.0]
+      @observed_since = ::Process.monotonic_ns
+    end
+  end
+end
@@ -4,13 +4,19 @@
 #   #call to get the storable item
 #   #name to get a unique identifier of the storable
 #   #score to get a numeric score, where higher is better
+#
+# Beside the items, the set keeps a min-heap of their names by score, and
+# each name's slot in it. The lowest score is always at the top, so deciding
+# whether a new item gets in is O(1), and storing, replacing or evicting one
+# is O(log n). That keeps large max sizes cheap on the request path.
+#
+# Ties on the lowest score evict the item that was stored first, as the scan
+# over the items this replaced did, so each name also keeps the order it
+# came in.
 module ScoutApm
   class ScoredItemSet
     include Enumerable
 
-    # A number larger than any score we will actually get.
-    ARBITRARILY_LARGE = 100000000
-
     # Without otherwise saying, default the size to this
     DEFAULT_MAX_SIZE = 10
 
@@ -19,7 +25,11 @@ module ScoutApm
 
     def initialize(max_size = DEFAULT_MAX_SIZE)
       @items = {}
-      @max_size = max_size
+      @max_size = [max_size.to_i, 0].max
+      @heap = []
+      @slots = {}
+      @order = {}
+      @stored = 0
     end
 
     def each
@@ -31,6 +41,8 @@ module ScoutApm
     # This function is a large if statement, with a few branches. See inline comments for each branch.
     def <<(new_item)
       return if new_item.name == :unknown
+      return if max_size <= 0
+      index! if @order.nil?
 
       # If we have this item in the hash already, compare the new & old ones, and store
       # the new one only if it's higher score.
@@ -43,16 +55,8 @@ module ScoutApm
       # If the set is full, then we have to see if we evict anything to store
       # this one
       elsif full?
-        smallest_name, smallest_score = items.inject([nil, ARBITRARILY_LARGE]) do |(memo_name, memo_score), (name, (stored_score, _))|
-          if stored_score < memo_score
-            [name, stored_score]
-          else
-            [memo_name, memo_score]
-          end
-        end
-
-        if smallest_score < new_item.score
-          items.delete(smallest_name)
+        if score_at(0) < new_item.score
+          evict_lowest!
           store!(new_item)
         end
 
@@ -73,14 +77,89 @@ module ScoutApm
     private
 
     def full?
-      items.size >= max_size
+      items.size >= max_size && @heap.any?
     end
 
     def store!(new_item)
-      if !new_item.name.nil? # Never store a nil name.
-        items[new_item.name] = [new_item.score, new_item.call]
+      name = new_item.name
+      return if name.nil? # Never store a nil name.
+
+      items[name] = [new_item.score, new_item.call]
+
+      if (slot = @slots[name])
+        sift_down(slot) # Only ever replaced by a higher score
+      else
+        @order[name] = (@stored += 1)
+        @heap << name
+        @slots[name] = @heap.size - 1
+        sift_up(@heap.size - 1)
+      end
+    end
+
+    def evict_lowest!
+      name = @heap.first
+      last = @heap.pop
+      if @heap.any?
+        @heap[0] = last
+        @slots[last] = 0
+        sift_down(0)
       end
+      @slots.delete(name)
+      @order.delete(name)
+      items.delete(name)
+    end
+
+    def score_at(slot)
+      items[@heap[slot]].first
     end
 
+    # Lower score first, then the one stored first
+    def before?(a, b)
+      score_a, score_b = score_at(a), score_at(b)
+      score_a < score_b || (score_a == score_b && @order[@heap[a]] < @order[@heap[b]])
+    end
+
+    def sift_up(slot)
+      while slot > 0
+        parent = (slot - 1) / 2
+        break unless before?(slot, parent)
+        swap(slot, parent)
+        slot = parent
+      end
+    end
+
+    def sift_down(slot)
+      loop do
+        lowest = slot
+        left = 2 * slot + 1
+        right = left + 1
+        lowest = left if left < @heap.size && before?(left, lowest)
+        lowest = right if right < @heap.size && before?(right, lowest)
+        break if lowest == slot
+        swap(slot, lowest)
+        slot = lowest
+      end
+    end
+
+    def swap(a, b)
+      @heap[a], @heap[b] = @heap[b], @heap[a]
+      @slots[@heap[a]] = a
+      @slots[@heap[b]] = b
+    end
+
+    # Sets read from layaway files written before the heap was kept only
+    # have their items. Build it from them, in the order they were stored.
+    def index!
+      @heap = []
+      @slots = {}
+      @order = {}
+      @stored = 0
+      items.each_key do |name|
+        @order[name] = (@stored += 1)
+        @heap << name
+        @slots[name] = @heap.size - 1
+        sift_up(@heap.size - 1)
+      end
+    end
   end
 end
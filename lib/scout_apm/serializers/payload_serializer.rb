@@ -26,6 +26,11 @@ module ScoutApm
         end
       end
 
+      # Writes the payload to io as it's serialized. JSON only.
+      def self.serialize_to(io, metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+        ScoutApm::Serializers::PayloadSerializerToJson.serialize_to(io, metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+      end
+
       def self.deserialize(data)
         Marshal.load(data)
       end
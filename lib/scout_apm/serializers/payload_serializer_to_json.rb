@@ -3,9 +3,18 @@ module ScoutApm
     module PayloadSerializerToJson
       class << self
         def serialize(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+          jsonify_hash(payload_hash(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics))
+        end
+
+        # Writes the same JSON as serialize to io, a chunk at a time.
+        def serialize_to(io, metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
+          NativePayloadJson.jsonify_hash(payload_hash(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics), io)
+        end
+
+        def payload_hash(metadata, metrics, slow_transactions, jobs, slow_jobs, histograms, db_query_metrics)
           metadata.merge!({:payload_version => 2})
 
-          jsonify_hash({:metadata => metadata,
+          {:metadata => metadata,
                         :metrics => rearrange_the_metrics(metrics),
                         :slow_transactions => rearrange_the_slow_transactions(slow_transactions),
                         :jobs => JobsSerializerToJson.new(jobs).as_json,
@@ -14,7 +23,7 @@ module ScoutApm
                         :db_metrics => {
                           :query => DbQuerySerializerToJson.new(db_query_metrics).as_json,
                         },
-          })
+          }
         end
 
         # For the old style of metric serializing.
@@ -34,7 +43,13 @@ module ScoutApm
           slow_t.as_json.merge(:metrics => rearrange_the_metrics(slow_t.metrics), :allocation_metrics => rearrange_the_metrics(slow_t.allocation_metrics))
         end
 
+        # Encoded natively by ext/payload_json, which writes the same bytes as
+        # ruby_jsonify_hash below. The Ruby version is kept as the reference.
         def jsonify_hash(hash)
+          NativePayloadJson.jsonify_hash(hash)
+        end
+
+        def ruby_jsonify_hash(hash)
           str_parts = []
           hash.each do |key, value|
             formatted_key = format_by_type(key)
@@ -61,7 +76,7 @@ module ScoutApm
         def format_by_type(formatee)
           case formatee
           when Hash
-            jsonify_hash(formatee)
+            ruby_jsonify_hash(formatee)
           when Array
             all_the_elements = formatee.map {|value_guy| format_by_type(value_guy)}
             "[#{all_the_elements.join(",")}]"
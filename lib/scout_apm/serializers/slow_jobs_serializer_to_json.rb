@@ -19,6 +19,11 @@ module ScoutApm
             "exclusive_time" => job.exclusive_time,
             "mem_delta" => job.mem_delta,
             "allocations" => job.allocations,
+            "allocation_hotspots" => job.allocation_hotspots,
+            "gc_time" => job.gc_time,
+            "gc_count" => job.gc_count,
+            "non_gc_time" => job.non_gc_time,
+            "cpu_time" => job.cpu_time,
             "seconds_since_startup" => job.seconds_since_startup,
             "hostname" => job.hostname,
             "git_sha" => job.git_sha,
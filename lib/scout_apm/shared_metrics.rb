@@ -0,0 +1,65 @@
+# Metrics kept in memory shared by forked app server workers, rather than in
+# each worker's Store. Turned on with shared_memory_aggregation.
+#
+# The table is made in the process that forks the workers, so that they all
+# inherit it (see NativeSharedMetrics). Each worker adds the metrics it
+# tracks, already absorbed, into the slot for their key and minute. When a
+# minute is over, whichever workers write their layaway files first harvest
+# it, each keeping the metrics they took in the period they write.
+#
+# So the metrics of a minute are in one or two layaway files, rather than in
+# every worker's. Traces, histograms and jobs still go through each worker's
+# file, as does any metric the table hands back: one that can't be kept in a
+# slot, or that has no slot left for it.
+#
+# This only takes metrics out of the layaway files. The reporter still reads
+# the files, claiming each minute with Layaway#with_claim, since everything
+# else in a period only exists in its worker's memory. Reading the table
+# directly would also leave out the metrics that didn't fit in it, and the
+# workers of other masters sharing the data directory.
+module ScoutApm
+  class SharedMetrics
+    def self.available?
+      defined?(ScoutApm::NativeSharedMetrics) ? true : false
+    end
+
+    def initialize(slots)
+      @table = NativeSharedMetrics.new(slots)
+    end
+
+    # The table is only shared by processes forked from the one that made it.
+    # In that one, there's nothing to share with.
+    def shared?
+      @table.owner_pid != ::Process.pid
+    end
+
+    # Adds the metrics of a MetricSet for the timestamp. Returns a MetricSet
+    # of those the table couldn't take.
+    def add(timestamp, metric_set)
+      leftovers = MetricSet.new
+      leftovers.metrics.update(@table.add(timestamp.timestamp, metric_set.metrics))
+      leftovers
+    end
+
+    # Takes the metrics for every minute before the timestamp. Returns a Hash
+    # of StoreReportingPeriodTimestamp => MetricSet.
+    def harvest(before)
+      result = {}
+      @table.harvest(before.timestamp).each do |minute, metrics|
+        metric_set = MetricSet.new
+        metric_set.metrics.update(metrics)
+        result[StoreReportingPeriodTimestamp.new(Time.at(minute))] = metric_set
+      end
+      result
+    end
+
+    def slots
+      @table.slots
+    end
+
+    # How many metrics, across all processes, the table couldn't take
+    def overflows
+      @table.overflows
+    end
+  end
+end
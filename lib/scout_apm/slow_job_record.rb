@@ -17,13 +17,15 @@ module ScoutApm
     attr_reader :allocation_metrics
     attr_reader :mem_delta
     attr_reader :allocations
+    attr_reader :gc_count
+    attr_reader :cpu_time
     attr_reader :hostname
     attr_reader :seconds_since_startup
     attr_reader :score
     attr_reader :git_sha
     attr_reader :truncated_metrics
 
-    def initialize(agent_context, queue_name, job_name, time, total_time, exclusive_time, context, metrics, allocation_metrics, mem_delta, allocations, score, truncated_metrics)
+    def initialize(agent_context, queue_name, job_name, time, total_time, exclusive_time, context, metrics, allocation_metrics, mem_delta, allocations, score, truncated_metrics, allocation_hotspots=[], gc_time=0, gc_count=0, cpu_time=nil)
       @queue_name = queue_name
       @job_name = job_name
       @time = time
@@ -39,10 +41,29 @@ module ScoutApm
       @git_sha = agent_context.environment.git_revision.sha
       @score = score
       @truncated_metrics = truncated_metrics
+      @allocation_hotspots = allocation_hotspots
+      @gc_time = gc_time
+      @gc_count = gc_count
+      @cpu_time = cpu_time
 
       agent_context.logger.debug { "Slow Job [#{metric_name}] - Call Time: #{total_call_time} Mem Delta: #{mem_delta}"}
     end
 
+    # The busiest allocation sites of this job. See AllocationTracking#hotspots
+    # Empty unless `allocation_sites` is enabled.
+    def allocation_hotspots
+      @allocation_hotspots || []
+    end
+
+    # Seconds this job's thread spent paused in GC, and the rest of its time
+    def gc_time
+      @gc_time || 0
+    end
+
+    def non_gc_time
+      total_time - gc_time
+    end
+
     def metric_name
       "Job/#{queue_name}/#{job_name}"
     end
@@ -10,16 +10,18 @@ module ScoutApm
     attr_reader :uri
     attr_reader :context
     attr_reader :time
-    attr_reader :prof
+    attr_reader :prof # Sampled call stacks, see StackProfiling#stacks
     attr_reader :mem_delta
     attr_reader :allocations
+    attr_reader :gc_count
+    attr_reader :cpu_time
     attr_accessor :hostname # hack - we need to reset these server side.
     attr_accessor :seconds_since_startup # hack - we need to reset these server side.
     attr_accessor :git_sha # hack - we need to reset these server side.
 
     attr_reader :truncated_metrics # True/False that says if we had to truncate the metrics of this trace
 
-    def initialize(agent_context, uri, metric_name, total_call_time, metrics, allocation_metrics, context, time, raw_stackprof, mem_delta, allocations, score, truncated_metrics)
+    def initialize(agent_context, uri, metric_name, total_call_time, metrics, allocation_metrics, context, time, raw_stackprof, mem_delta, allocations, score, truncated_metrics, allocation_hotspots=[], gc_time=0, gc_count=0, cpu_time=nil)
       @uri = uri
       @metric_name = metric_name
       @total_call_time = total_call_time
@@ -27,7 +29,7 @@ module ScoutApm
       @allocation_metrics = allocation_metrics
       @context = context
       @time = time || Time.now
-      @prof = []
+      @prof = raw_stackprof || []
       @mem_delta = mem_delta
       @allocations = allocations
       @seconds_since_startup = (Time.now - agent_context.process_start_time)
@@ -35,6 +37,10 @@ module ScoutApm
       @score = score
       @git_sha = agent_context.environment.git_revision.sha
       @truncated_metrics = truncated_metrics
+      @allocation_hotspots = allocation_hotspots
+      @gc_time = gc_time
+      @gc_count = gc_count
+      @cpu_time = cpu_time
 
       agent_context.logger.debug { "Slow Request [#{uri}] - Call Time: #{total_call_time} Mem Delta: #{mem_delta} Score: #{score}"}
     end
@@ -59,6 +65,11 @@ module ScoutApm
                          :prof,
                          :mem_delta,
                          :allocations,
+                         :allocation_hotspots,
+                         :gc_time,
+                         :gc_count,
+                         :non_gc_time,
+                         :cpu_time,
                          :seconds_since_startup,
                          :hostname,
                          :git_sha,
@@ -66,6 +77,21 @@ module ScoutApm
       ScoutApm::AttributeArranger.call(self, json_attributes)
     end
 
+    # The busiest allocation sites of this request. See AllocationTracking#hotspots
+    # Empty unless `allocation_sites` is enabled.
+    def allocation_hotspots
+      @allocation_hotspots || []
+    end
+
+    # Seconds this request's thread spent paused in GC, and the rest of its time
+    def gc_time
+      @gc_time || 0
+    end
+
+    def non_gc_time
+      total_call_time - gc_time
+    end
+
     def context_hash
       context.to_hash
     end
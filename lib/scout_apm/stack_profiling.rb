@@ -0,0 +1,110 @@
+# Samples the call stacks of requests with ext/stack_profile, when the
+# `stack_profiling` config setting is on, so slow transactions show where time
+# went in code that no instrument covers.
+#
+# Every `stack_profiling_interval` milliseconds of CPU time, a SIGPROF timer
+# has the thread that was running Ruby record its frames, if it's running a
+# request. Each request samples into a NativeStackProfile, a ring buffer
+# holding its last MAX_SAMPLES stacks. Frames are only turned into strings by
+# #stacks, when SlowRequestConverter keeps the request as a slow transaction.
+#
+# Profiles are reused from one request to the next, as their buffers are
+# allocated up front.
+#
+# The timer takes over SIGPROF, so this doesn't mix with other profilers
+# using it, like stackprof.
+module ScoutApm
+  class StackProfiling
+    MAX_SAMPLES = 200
+    MAX_DEPTH = 64
+
+    # Profiles kept for reuse, at most
+    MAX_POOLED = 16
+
+    attr_reader :context
+
+    def initialize(context)
+      @context = context
+      @mutex = Mutex.new
+      @pool = []
+      @timer_pid = nil
+    end
+
+    def enabled?
+      !!context.config.value('stack_profiling') && defined?(ScoutApm::NativeStackProfile) == 'constant'
+    end
+
+    def interval_ms
+      [context.config.value('stack_profiling_interval').to_i, 1].max
+    end
+
+    # Called as a request starts. Returns a profile sampling the current
+    # thread, which must be given to stop_request, or nil if not profiling.
+    def start_request
+      return nil unless enabled?
+
+      start_timer
+      profile = checkout
+      return profile if profile.start
+
+      release(profile)
+      nil
+    end
+
+    def stop_request(profile)
+      profile.stop if profile
+    end
+
+    # Hands back a stopped profile for a later request to use.
+    def release(profile)
+      return unless profile
+      profile.stop
+
+      @mutex.synchronize do
+        @pool << profile if @pool.size < MAX_POOLED
+      end
+    end
+
+    # The profile's samples, fit for SlowTransaction#prof: an Array of
+    # {:stack, :samples, :time} hashes, one per distinct stack, the most
+    # sampled first. Stacks list frames outermost first, with paths under the
+    # application root made relative to it. Time is in seconds of CPU.
+    def stacks(profile)
+      return [] unless profile
+
+      root = "#{context.environment.root}/"
+      interval = interval_ms / 1000.0
+      relative = Hash.new do |h, frame|
+        h[frame] = frame.start_with?(root) ? frame[root.length..-1] : frame
+      end
+
+      profile.stacks.sort_by { |_, count| -count }.map do |frames, count|
+        {
+          :stack => frames.map { |frame| relative[frame] },
+          :samples => count,
+          :time => count * interval,
+        }
+      end
+    end
+
+    private
+
+    def checkout
+      @mutex.synchronize { @pool.pop } || ScoutApm::NativeStackProfile.new(MAX_SAMPLES, MAX_DEPTH)
+    end
+
+    # The timer is process-wide. It's started by the first profiled request,
+    # and again in a forked child, which doesn't inherit it.
+    def start_timer
+      return if @timer_pid == Process.pid
+
+      @mutex.synchronize do
+        return if @timer_pid == Process.pid
+
+        ScoutApm::NativeStackProfile.start_timer(interval_ms * 1000)
+        @timer_pid = Process.pid
+        context.logger.debug("Stack profiling: sampling every #{interval_ms}ms of CPU time")
+      end
+    end
+  end
+end
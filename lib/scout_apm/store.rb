@@ -1,6 +1,11 @@
 # Stores one or more minute's worth of Metrics/SlowTransactions in local ram.
 # When informed to by the background worker, it pushes the in-ram metrics off to
 # the layaway file for cross-process aggregation.
+#
+# Metrics, histograms and db query metrics, tracked on every request, are
+# first kept in a StoreThreadBuffer of the tracking thread, and only merged
+# into their reporting periods when those are written. So request threads
+# don't wait on each other, or on a period being written, to track them.
 module ScoutApm
   class Store
     def initialize(context)
@@ -8,6 +13,10 @@ module ScoutApm
       @mutex = Mutex.new
       @reporting_periods = Hash.new { |h,k| h[k] = StoreReportingPeriod.new(k, @context) }
       @samplers = []
+
+      @thread_buffers = []
+      @thread_buffers_mutex = Mutex.new
+      @thread_buffer_key = :"scout_apm_store_buffer_#{object_id}"
     end
 
     def current_timestamp
@@ -19,35 +28,33 @@ module ScoutApm
     end
     private :current_period
 
-    def find_period(timestamp = nil)
-      if timestamp
-        @reporting_periods[timestamp]
-      else
-        current_period
-      end
-    end
-    private :find_period
-
     # Save newly collected metrics
     def track!(metrics, options={})
-      @mutex.synchronize {
-        period = find_period(options[:timestamp])
-        period.absorb_metrics!(metrics)
-      }
+      @context.agent_overhead.measure("StoreTrack") do
+        timestamp = options[:timestamp] || current_timestamp
+        ensure_period(timestamp)
+
+        if (shared = shared_metrics)
+          absorbed = MetricSet.new
+          absorbed.absorb_all(metrics)
+          leftovers = shared.add(timestamp, absorbed)
+          thread_buffer.merge_metrics!(timestamp, leftovers) if leftovers.metrics.any?
+        else
+          thread_buffer.absorb_metrics!(timestamp, metrics)
+        end
+      end
     end
 
     def track_histograms!(histograms, options={})
-      @mutex.synchronize {
-        period = find_period(options[:timestamp])
-        period.merge_histograms!(histograms)
-      }
+      timestamp = options[:timestamp] || current_timestamp
+      ensure_period(timestamp)
+      thread_buffer.merge_histograms!(timestamp, histograms)
     end
 
     def track_db_query_metrics!(db_query_metric_set, options={})
-      @mutex.synchronize {
-        period = find_period(options[:timestamp])
-        period.merge_db_query_metrics!(db_query_metric_set)
-      }
+      timestamp = options[:timestamp] || current_timestamp
+      ensure_period(timestamp)
+      thread_buffer.merge_db_query_metrics!(timestamp, db_query_metric_set)
     end
 
     def track_one!(type, name, value, options={})
@@ -87,8 +94,15 @@ module ScoutApm
     def write_to_layaway(layaway, force=false)
       logger.debug("Writing to layaway#{" (Forced)" if force}")
 
-      @reporting_periods.select { |time, rp| force || (time.timestamp < current_timestamp.timestamp) }.
-                         each   { |time, rp| write_reporting_period(layaway, time, rp) }
+      @context.agent_overhead.measure("WriteToLayaway") do
+        harvest_shared_metrics(force)
+        drain_thread_buffers
+
+        periods = @mutex.synchronize {
+          @reporting_periods.select { |time, rp| force || (time.timestamp < current_timestamp.timestamp) }.to_a
+        }
+        periods.each { |time, rp| write_reporting_period(layaway, time, rp) }
+      end
     end
 
     # For each tick (minute), be sure we have a reporting period, and that samplers are run for it.
@@ -97,19 +111,92 @@ module ScoutApm
       collect_samplers(rp)
     end
 
+    # The SharedMetrics table, if this process shares one with others
+    def shared_metrics
+      shared = @context.shared_metrics
+      shared if shared && shared.shared?
+    end
+    private :shared_metrics
+
+    # Takes finished minutes' metrics out of the shared table, to be written
+    # with the rest of their periods. Forced takes the current minute too.
+    def harvest_shared_metrics(force)
+      shared = shared_metrics
+      return unless shared
+
+      before = force ? StoreReportingPeriodTimestamp.new(Time.now + 60) : current_timestamp
+      @mutex.synchronize {
+        shared.harvest(before).each { |time, metric_set| @reporting_periods[time].merge_metrics!(metric_set) }
+      }
+      logger.debug("Harvested shared metrics. Overflowed metrics so far: #{shared.overflows}")
+    rescue => e
+      logger.warn("Failed harvesting shared metrics: #{e.message} / #{e.backtrace}")
+    end
+    private :harvest_shared_metrics
+
+    # The period is taken out of the store before it's written, so that
+    # nothing tracked meanwhile waits on it being serialized.
     def write_reporting_period(layaway, time, rp)
       @mutex.synchronize {
-        layaway.write_reporting_period(rp)
+        logger.debug("Before delete, reporting periods length: #{@reporting_periods.size}")
+        deleted_items = @reporting_periods.delete(time)
+        logger.debug("After delete, reporting periods length: #{@reporting_periods.size}. Did delete #{deleted_items}")
       }
+      layaway.write_reporting_period(rp)
     rescue => e
       logger.warn("Failed writing data to layaway file: #{e.message} / #{e.backtrace}")
-    ensure
-      logger.debug("Before delete, reporting periods length: #{@reporting_periods.size}")
-      deleted_items = @reporting_periods.delete(time)
-      logger.debug("After delete, reporting periods length: #{@reporting_periods.size}. Did delete #{deleted_items}")
     end
     private :write_reporting_period
 
+    # Makes sure there's a period for the timestamp, for what's tracked in
+    # thread buffers to be merged into. Only the first thread to track
+    # something for a minute takes the lock.
+    def ensure_period(timestamp)
+      return if @reporting_periods.key?(timestamp)
+      @mutex.synchronize { @reporting_periods[timestamp] }
+    end
+    private :ensure_period
+
+    # The calling thread's buffer, registered on first use
+    def thread_buffer
+      thread = Thread.current
+      buffer = if thread.respond_to?(:thread_variable_get)
+                 thread.thread_variable_get(@thread_buffer_key)
+               else
+                 thread[@thread_buffer_key]
+               end
+      return buffer if buffer
+
+      buffer = StoreThreadBuffer.new(@context)
+      @thread_buffers_mutex.synchronize { @thread_buffers << buffer }
+      if thread.respond_to?(:thread_variable_set)
+        thread.thread_variable_set(@thread_buffer_key, buffer)
+      else
+        thread[@thread_buffer_key] = buffer
+      end
+      buffer
+    end
+    private :thread_buffer
+
+    # Merges everything the thread buffers hold into their periods. The
+    # buffers of threads that had already died are dropped after.
+    def drain_thread_buffers
+      buffers = @thread_buffers_mutex.synchronize { @thread_buffers.dup }
+      dead = buffers.reject { |buffer| buffer.alive? }
+
+      buffers.each do |buffer|
+        metric_sets, histograms, db_query_metric_sets = buffer.drain!
+        @mutex.synchronize {
+          metric_sets.each { |time, metric_set| @reporting_periods[time].merge_metrics!(metric_set) }
+          histograms.each { |time, list| @reporting_periods[time].merge_histograms!(list) }
+          db_query_metric_sets.each { |time, set| @reporting_periods[time].merge_db_query_metrics!(set) }
+        }
+      end
+
+      @thread_buffers_mutex.synchronize { @thread_buffers -= dead } if dead.any?
+    end
+    private :drain_thread_buffers
+
     ######################################
     # Sampler support
     def add_sampler(sampler_klass)
@@ -134,6 +221,63 @@ module ScoutApm
     private :logger
   end
 
+  # What one thread has tracked since its Store last drained it, by
+  # timestamp. Only that thread adds to it, and only the Store's drain! takes
+  # from it, so its lock is almost never contended.
+  class StoreThreadBuffer
+    def initialize(context)
+      @context = context
+      @thread = Thread.current
+      @mutex = Mutex.new
+      reset
+    end
+
+    def alive?
+      @thread.alive?
+    end
+
+    def absorb_metrics!(timestamp, metrics)
+      @mutex.synchronize { metric_set(timestamp).absorb_all(metrics) }
+    end
+
+    # For a MetricSet that's already been absorbed
+    def merge_metrics!(timestamp, other_metric_set)
+      @mutex.synchronize { metric_set(timestamp).combine!(other_metric_set) }
+    end
+
+    def merge_histograms!(timestamp, histograms)
+      @mutex.synchronize { (@histograms[timestamp] ||= []).concat(Array(histograms)) }
+    end
+
+    def merge_db_query_metrics!(timestamp, db_query_metric_set)
+      @mutex.synchronize {
+        (@db_query_metric_sets[timestamp] ||= DbQueryMetricSet.new(@context)).combine!(db_query_metric_set)
+      }
+    end
+
+    # Returns [metric_sets, histograms, db_query_metric_sets], each a Hash by
+    # timestamp, and empties the buffer.
+    def drain!
+      @mutex.synchronize {
+        drained = [@metric_sets, @histograms, @db_query_metric_sets]
+        reset
+        drained
+      }
+    end
+
+    private
+
+    def reset
+      @metric_sets = {}
+      @histograms = {}
+      @db_query_metric_sets = {}
+    end
+
+    def metric_set(timestamp)
+      @metric_sets[timestamp] ||= MetricSet.new
+    end
+  end
+
   # A timestamp, normalized to the beginning of a minute. Used as a hash key to
   # bucket metrics into per-minute groups
   class StoreReportingPeriodTimestamp
@@ -205,8 +349,9 @@ module ScoutApm
     def initialize(timestamp, context)
       @timestamp = timestamp
 
-      @request_traces = ScoredItemSet.new
-      @job_traces = ScoredItemSet.new
+      max_traces = [context.config.value('max_traces') || ScoredItemSet::DEFAULT_MAX_SIZE, 0].max
+      @request_traces = ScoredItemSet.new(max_traces)
+      @job_traces = ScoredItemSet.new(max_traces)
 
       @histograms = []
 
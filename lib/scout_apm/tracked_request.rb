@@ -33,11 +33,23 @@ module ScoutApm
 
     # if there's an instant_key, pass the transaction trace on for immediate reporting (in addition to the usual background aggregation)
     # this is set in the controller instumentation (ActionControllerRails3Rails4 according)
-    attr_accessor :instant_key
+    attr_reader :instant_key
 
     # An object that responds to `record!(TrackedRequest)` to store this tracked request
     attr_reader :recorder
 
+    # The busiest allocation sites of this request, when `allocation_sites` is enabled.
+    # An array of hashes: {:file, :line, :class, :allocations}
+    attr_reader :allocation_hotspots
+
+    # Samples of this request's call stack, when `stack_profiling` is enabled.
+    # A NativeStackProfile, see StackProfiling
+    attr_reader :stack_profile
+
+    # How many requests this one stands for, when it's 1 in N fully traced
+    # requests. nil when it isn't traced, see RequestSampling
+    attr_reader :sample_weight
+
     def initialize(agent_context, store)
       @agent_context = agent_context
       @store = store #this is passed in so we can use a real store (normal operation) or fake store (instant mode only)
@@ -51,6 +63,13 @@ module ScoutApm
       @stopping = false
       @instant_key = nil
       @mem_start = mem_usage
+      @track_allocations = false
+      @allocation_hotspots = []
+      @stack_profile = nil
+      @sample_weight = 1
+      @skipped_layers = 0
+      @overhead_ns = 0
+      @overhead_allocations = 0
       @recorder = agent_context.recorder
 
       ignore_request! if @recorder.nil?
@@ -64,8 +83,15 @@ module ScoutApm
 
       return ignoring_start_layer if ignoring_request?
 
+      return @skipped_layers += 1 if skip_child_layer?
+
+      start_ns = ::Process.monotonic_ns
+      start_allocations = ScoutApm::Instruments::Allocations.count
+
       start_request(layer) unless @root_layer
       @layers.push(layer)
+
+      add_overhead(start_ns, start_allocations)
     end
 
     def stop_layer
@@ -76,6 +102,11 @@ module ScoutApm
 
       return ignoring_stop_layer if ignoring_request?
 
+      return @skipped_layers -= 1 if @skipped_layers > 0
+
+      start_ns = ::Process.monotonic_ns
+      start_allocations = ScoutApm::Instruments::Allocations.count
+
       layer = @layers.pop
 
       # Safeguard against a mismatch in the layer tracking in an instrument.
@@ -89,7 +120,9 @@ module ScoutApm
       end
 
       layer.record_stop_time!
+      layer.record_cpu_time!
       layer.record_allocations!
+      layer.record_gc!
 
       @layers[-1].add_child(layer) if @layers.any?
 
@@ -100,6 +133,8 @@ module ScoutApm
         layer.capture_backtrace!
       end
 
+      add_overhead(start_ns, start_allocations)
+
       if finalized?
         stop_request
       end
@@ -112,11 +147,25 @@ module ScoutApm
     # actual SQL generated).
     #
     # Returns nil in the case there is no current layer. That would be normal
-    # for a completed TrackedRequest
+    # for a completed TrackedRequest, or inside an untraced request's
+    # Controller or Job
     def current_layer
+      return nil if @skipped_layers > 0
+
       @layers.last
     end
 
+    # An untraced request only tracks its layers down to the Controller or
+    # Job. Anything under that is skipped, only counting how deep it goes.
+    SCOPE_LAYER_TYPES = ["Controller", "Job"]
+    def skip_child_layer?
+      return true if @skipped_layers > 0
+      return false if sampled?
+
+      current = @layers.last
+      current && SCOPE_LAYER_TYPES.include?(current.type)
+    end
+
     BACKTRACE_BLACKLIST = ["Controller", "Job"]
     def capture_backtrace?(layer)
       return if ignoring_request?
@@ -150,6 +199,13 @@ module ScoutApm
       @agent_context.dev_trace_enabled? ? 0.05 : 0.5 # the minimum threshold in seconds to record the backtrace for a metric.
     end
 
+    # Sums the agent's own time & allocations in start_layer and stop_layer,
+    # added to the AgentOverhead once as the request stops.
+    def add_overhead(start_ns, start_allocations)
+      @overhead_ns += ::Process.monotonic_ns - start_ns
+      @overhead_allocations += ScoutApm::Instruments::Allocations.count - start_allocations
+    end
+
     # This may be in bytes or KB based on the OSX. We store this as-is here and only do conversion to MB in Layer Converters.
     # XXX: Move this to environment?
     def mem_usage
@@ -172,9 +228,32 @@ module ScoutApm
 
     # Run at the beginning of the whole request
     #
-    # * Capture the first layer as the root_layer
+    # * Capture the first layer as the root_layer, and stamp its wall clock start time
+    # * Decide if this request is fully traced. Instant traces always are
+    # * If so, decide if it records object allocations, and start sampling its
+    #   call stack, if stack profiling
     def start_request(layer)
-      @root_layer = layer unless @root_layer # capture root layer
+      unless @root_layer # capture root layer
+        @root_layer = layer
+        @root_layer.record_start_time!
+      end
+      @sample_weight = @instant_key ? 1 : @agent_context.request_sampling.start_request
+      return unless sampled?
+
+      @track_allocations = @holding_allocation_tracking = @agent_context.allocation_tracking.start_request
+      @stack_profile = @agent_context.stack_profiling.start_request
+    end
+
+    # The key is only known once the Controller is reached, which is often
+    # after a Middleware root layer has started, and the request been left
+    # untraced. It's traced from here on then. Allocations aren't recorded, as
+    # the layers above already started without them.
+    def instant_key=(key)
+      @instant_key = key
+      return unless key && @root_layer && !sampled?
+
+      @sample_weight = 1
+      @stack_profile = @agent_context.stack_profiling.start_request
     end
 
     # Run at the end of the whole request
@@ -182,9 +261,14 @@ module ScoutApm
     # * Send the request off to be stored
     def stop_request
       @stopping = true
+      stop_tracking_allocations
+      @agent_context.stack_profiling.stop_request(@stack_profile)
+      @agent_context.agent_overhead.add("Layers", @overhead_ns, (@overhead_allocations if track_allocations?))
 
       if recorder
-        recorder.record!(self)
+        @agent_context.agent_overhead.measure("Recorder") { recorder.record!(self) }
+      else
+        release_stack_profile
       end
     end
 
@@ -192,6 +276,35 @@ module ScoutApm
       @stopping
     end
 
+    # Is this request fully traced? If not, it only has the layers down to its
+    # Controller or Job, and only records their timing. See RequestSampling
+    def sampled?
+      !@sample_weight.nil?
+    end
+
+    # Did this request record object allocations? If not, the allocation
+    # counts on its layers are meaningless, and allocation metrics are skipped.
+    def track_allocations?
+      @track_allocations
+    end
+
+    # Once recorded, the stack samples are either in a slow transaction or not
+    # wanted. Their profile can go to another request.
+    def release_stack_profile
+      return unless @stack_profile
+      @agent_context.stack_profiling.release(@stack_profile)
+      @stack_profile = nil
+    end
+
+    # Lets the allocation tracepoint turn off once no tracked request needs it.
+    # The layers have already captured their final counts.
+    def stop_tracking_allocations
+      return unless @holding_allocation_tracking
+      started, @holding_allocation_tracking = @holding_allocation_tracking, false
+      @allocation_hotspots = @agent_context.allocation_tracking.hotspots unless ignoring_request?
+      @agent_context.allocation_tracking.stop_request(started)
+    end
+
     ###################################
     # Annotations
     ###################################
@@ -230,6 +343,7 @@ module ScoutApm
 
     def instant?
       return false if ignoring_request?
+      return false unless sampled?
 
       instant_key
     end
@@ -256,27 +370,43 @@ module ScoutApm
       # Bail out early if the user asked us to ignore this uri
       return if @agent_context.ignored_uris.ignore?(annotations[:uri])
 
-      converters = [
-        LayerConverters::Histograms,
-        LayerConverters::MetricConverter,
-        LayerConverters::ErrorConverter,
-        LayerConverters::AllocationMetricConverter,
-        LayerConverters::RequestQueueTimeConverter,
-        LayerConverters::JobConverter,
-        LayerConverters::DatabaseConverter,
-
-        LayerConverters::SlowJobConverter,
-        LayerConverters::SlowRequestConverter,
-      ]
-
-      walker = LayerConverters::DepthFirstWalker.new(self.root_layer)
-      converters = converters.map do |klass|
-        instance = klass.new(@agent_context, self, layer_finder, @store)
-        instance.register_hooks(walker)
-        instance
+      converters = if sampled?
+                     [
+                       LayerConverters::Histograms,
+                       LayerConverters::MetricConverter,
+                       LayerConverters::ErrorConverter,
+                       LayerConverters::AllocationMetricConverter,
+                       LayerConverters::RequestQueueTimeConverter,
+                       LayerConverters::JobConverter,
+                       LayerConverters::DatabaseConverter,
+
+                       LayerConverters::SlowJobConverter,
+                       LayerConverters::SlowRequestConverter,
+                     ]
+                   else
+                     # Only the converters that work from the Controller or
+                     # Job, and the layers above it
+                     [
+                       LayerConverters::Histograms,
+                       LayerConverters::MetricConverter,
+                       LayerConverters::ErrorConverter,
+                       LayerConverters::RequestQueueTimeConverter,
+                       LayerConverters::JobConverter,
+                     ]
+                   end
+
+      start_ns = ::Process.monotonic_ns
+      converters = @agent_context.agent_overhead.measure("Converters") do
+        walker = LayerConverters::DepthFirstWalker.new(self.root_layer)
+        instances = converters.map do |klass|
+          instance = klass.new(@agent_context, self, layer_finder, @store)
+          instance.register_hooks(walker)
+          instance
+        end
+        walker.walk
+        instances.each {|i| i.record! }
       end
-      walker.walk
-      converters.each {|i| i.record! }
+      @agent_context.request_sampling.observe(sampled?, @overhead_ns + ::Process.monotonic_ns - start_ns, root_layer.total_call_time)
 
       # If there's an instant_key, it means we need to report this right away
       if web? && instant?
@@ -288,6 +418,8 @@ module ScoutApm
       if web? || job?
         ensure_background_worker
       end
+    ensure
+      release_stack_profile
     end
 
     def layer_finder
@@ -387,12 +519,14 @@ module ScoutApm
 
       # Set instance variable
       @ignoring_request = true
+      stop_tracking_allocations
 
       # Store data we'll need
-      @ignoring_depth = @layers.length
+      @ignoring_depth = @layers.length + @skipped_layers
 
       # Clear data
       @layers = []
+      @skipped_layers = 0
       @root_layer = nil
       @call_set = nil
       @annotations = {}
@@ -427,6 +561,7 @@ module ScoutApm
     # Clean up any cleverness in objects.
     # Makes this object ready to be Marshal Dumped (or otherwise serialized)
     def prepare_to_dump!
+      release_stack_profile
       @call_set = nil
       @store = nil
       @recorder = nil
@@ -16,12 +16,15 @@ module ScoutApm
       # name: Place Load
       # metric_name: Place/find
       def to_s
-        parsed = parse_operation
-        if parsed
-          "#{model}/#{parsed}"
-        else
-          regex_name(sql)
-        end
+        @to_s ||=
+          begin
+            parsed = parse_operation
+            if parsed
+              "#{model}/#{parsed}"
+            else
+              cached_regex_name(sql)
+            end
+          end
       end
 
       def model
@@ -56,7 +59,7 @@ module ScoutApm
       end
 
       def parts
-        name.split(" ")
+        @parts ||= name.split(" ")
       end
 
       # Returns nil if no match
@@ -99,6 +102,13 @@ module ScoutApm
       DELETE_LABEL = 'destroy'.freeze
       UNKNOWN_LABEL = 'SQL/other'.freeze
 
+      # Statements without a name repeat as much as any, so share the names
+      # worked out for them through the agent's SqlCache.
+      def cached_regex_name(sql)
+        return UNKNOWN_LABEL unless UNKNOWN_LABEL.respond_to?(:classify)
+        ScoutApm::Agent.instance.context.sql_cache.fetch(:metric_name, sql) { regex_name(sql) }
+      end
+
       # Attempt to do some basic parsing of SQL via regexes to extract the SQL
       # verb (select, update, etc) and the table being operated on.
       #
@@ -3,6 +3,9 @@ require 'scout_apm/environment'
 # Given a call stack Array, grabs the first +APP_FRAMES+ callers within the
 # application root directory.
 #
+# BacktraceParser.capture does the same for the current stack, without
+# making the call stack Array, using the backtrace_frames extension.
+#
 module ScoutApm
   module Utils
     class BacktraceParser
@@ -11,6 +14,16 @@ module ScoutApm
 
       attr_reader :call_stack
 
+      # Returns the app frames among +limit+ frames of the current stack,
+      # skipping the first +skip+ as caller(skip) would in the method calling
+      # this. Returns nil if the native extension isn't available.
+      def self.capture(skip, limit, root=ScoutApm::Agent.instance.context.environment.root)
+        return nil unless defined?(ScoutApm::NativeBacktraceFrames.capture)
+
+        frames = ScoutApm::NativeBacktraceFrames.capture(root.to_s, skip + 1, limit, APP_FRAMES)
+        frames.map! { |frame| ScoutApm::Utils::Scm.relative_scm_path(frame) }
+      end
+
       def initialize(call_stack, root=ScoutApm::Agent.instance.context.environment.root)
         @call_stack = call_stack
         # We can't use a constant as it'd be too early to fetch environment info
@@ -0,0 +1,92 @@
+module ScoutApm
+  module Utils
+    # A gzipped request body that's written while it's being sent. Hand it to
+    # Net::HTTP as a body_stream: each #read resumes the writer block just long
+    # enough to fill one chunk, so neither the uncompressed nor the compressed
+    # body is ever held in full.
+    #
+    # The block is called once, with an IO-like object to #write to, and runs
+    # in a Fiber that pauses whenever CHUNK_SIZE compressed bytes are waiting.
+    class GzipStream
+      CHUNK_SIZE = 16 * 1024
+
+      attr_reader :bytes_written
+
+      def initialize(level = GzipHelper::DEFAULT_GZIP_LEVEL, &writer)
+        @level = level
+        @writer = writer
+        @buffer = ""
+        @buffer.force_encoding(Encoding::BINARY) if @buffer.respond_to?(:force_encoding)
+        @bytes_written = 0
+        @fiber = nil
+        @done = false
+      end
+
+      # IO#read semantics: nil at EOF when a length is given, "" otherwise.
+      def read(length = nil, outbuf = nil)
+        fill(length)
+
+        data = if length.nil?
+                 @buffer.slice!(0, @buffer.bytesize)
+               elsif @buffer.empty?
+                 nil
+               else
+                 @buffer.slice!(0, length)
+               end
+
+        if outbuf
+          outbuf.replace(data || "")
+          data && outbuf
+        else
+          data
+        end
+      end
+
+      def eof?
+        fill(1)
+        @buffer.empty?
+      end
+
+      # Called by GzipWriter, from inside the writer Fiber
+      def write(data)
+        @buffer << data
+        Fiber.yield if @buffer.bytesize >= CHUNK_SIZE
+        data.bytesize
+      end
+
+      private
+
+      def fill(length)
+        until @done || (length && @buffer.bytesize >= length)
+          fiber.resume
+        end
+      end
+
+      def fiber
+        @fiber ||= Fiber.new do
+          gz = Zlib::GzipWriter.new(self, @level)
+          uncompressed = Sink.new(gz)
+          @writer.call(uncompressed)
+          gz.finish
+          @bytes_written = uncompressed.bytes_written
+          @done = true
+        end
+      end
+
+      # What the writer block writes to: counts bytes on their way into gzip.
+      class Sink
+        attr_reader :bytes_written
+
+        def initialize(gz)
+          @gz = gz
+          @bytes_written = 0
+        end
+
+        def write(data)
+          @bytes_written += data.bytesize
+          @gz.write(data)
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,94 @@
+# A bounded, thread-safe LRU cache of work done on raw SQL: its sanitized
+# form (see SqlSanitizer) and the metric name guessed from it (see
+# ActiveRecordMetricName). An app runs the same few hundred statements over
+# and over, so most lookups should hit.
+#
+# Entries are keyed by the hash of the SQL and what's being cached for it,
+# and keep the SQL to check against, so a hash collision is only a miss.
+# The cache holds at most max_entries, and max_bytes of SQL & results,
+# evicting the least recently used. Statements over MAX_SQL_LENGTH aren't
+# cached.
+#
+# hits and misses count lookups since the cache was made, for sizing it with
+# the sql_cache_size setting.
+module ScoutApm
+  module Utils
+    class SqlCache
+      DEFAULT_MAX_BYTES = 4 * 1024 * 1024
+
+      Entry = Struct.new(:kind, :sql, :value, :bytes)
+
+      attr_reader :max_entries
+      attr_reader :max_bytes
+
+      attr_reader :hits
+      attr_reader :misses
+      attr_reader :bytes
+
+      def initialize(max_entries, max_bytes = DEFAULT_MAX_BYTES)
+        @max_entries = max_entries
+        @max_bytes = max_bytes
+
+        @entries = {}
+        @mutex = Mutex.new
+        @hits = 0
+        @misses = 0
+        @bytes = 0
+      end
+
+      # Returns the cached value for this kind of work on sql, or the block's
+      # result, which is frozen and cached.
+      def fetch(kind, sql)
+        return yield if !sql.is_a?(String) || sql.length > SqlSanitizer::MAX_SQL_LENGTH || max_entries <= 0
+
+        key = sql.hash ^ kind.hash
+
+        @mutex.synchronize do
+          entry = @entries.delete(key)
+          if entry && entry.kind == kind && entry.sql == sql
+            @entries[key] = entry # Most recently used goes at the end
+            @hits += 1
+            return entry.value
+          end
+          @bytes -= entry.bytes if entry
+          @misses += 1
+        end
+
+        # Do the work outside the lock. Two threads may both miss on the same
+        # statement, and the second just replaces the first's entry.
+        value = yield
+        value = value.dup.freeze if value.is_a?(String) && !value.frozen?
+        store(key, Entry.new(kind, sql.frozen? ? sql : sql.dup.freeze, value, sql.bytesize + value.to_s.bytesize))
+        value
+      end
+
+      def size
+        @mutex.synchronize { @entries.size }
+      end
+
+      def clear
+        @mutex.synchronize do
+          @entries.clear
+          @bytes = 0
+        end
+      end
+
+      private
+
+      def store(key, entry)
+        @mutex.synchronize do
+          existing = @entries.delete(key)
+          @bytes -= existing.bytes if existing
+
+          @entries[key] = entry
+          @bytes += entry.bytes
+
+          while @entries.size > max_entries || (@bytes > max_bytes && @entries.size > 1)
+            _, evicted = @entries.shift
+            @bytes -= evicted.bytes
+          end
+        end
+      end
+    end
+  end
+end
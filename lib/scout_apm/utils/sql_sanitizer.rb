@@ -31,14 +31,28 @@ module ScoutApm
           @sanitized = true
         end
         case database_engine
-        when :postgres then to_s_postgres
-        when :mysql    then to_s_mysql
-        when :sqlite   then to_s_sqlite
+        when :postgres then cached { native_to_s || to_s_postgres }
+        when :mysql    then cached { native_to_s || to_s_mysql }
+        when :sqlite   then cached { native_to_s || to_s_sqlite }
         end
       end
 
       private
 
+      # The same statements are sanitized over and over, so the result is
+      # shared through the agent's SqlCache.
+      def cached(&block)
+        @to_s ||= ScoutApm::Agent.instance.context.sql_cache.fetch(database_engine, @raw_sql, &block)
+      end
+
+      # NativeSqlSanitizer gives the same result as the regex passes below, in
+      # one scan. It returns nil for SQL in an encoding it can't scan, which
+      # is left to the regexes.
+      def native_to_s
+        return nil unless defined?(ScoutApm::NativeSqlSanitizer.sanitize)
+        @native_to_s ||= ScoutApm::NativeSqlSanitizer.sanitize(@sql || scrubbed(@raw_sql), database_engine)
+      end
+
       def to_s_postgres
         sql.gsub!(PSQL_PLACEHOLDER, '?')
         sql.gsub!(PSQL_VAR_INTERPOLATION, '')
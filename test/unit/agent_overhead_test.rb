@@ -0,0 +1,117 @@
+require 'test_helper'
+
+require 'scout_apm/agent_overhead'
+require 'scout_apm/instruments/agent_overhead_sampler'
+
+class AgentOverheadTest < Minitest::Test
+  class MetricsStore
+    attr_reader :metrics
+
+    def initialize
+      @metrics = {}
+    end
+
+    def track!(metrics, options = {})
+      @metrics.merge!(metrics)
+    end
+  end
+
+  class DiscardingRecorder
+    def record!(request)
+    end
+  end
+
+  def test_measure_records_time_and_allocations
+    overhead = ScoutApm::AgentOverhead.new
+    result = overhead.measure("Serialize") { sleep 0.002; "payload" }
+    overhead.measure("Serialize") {}
+
+    assert_equal "payload", result
+    time, allocations = overhead.stats!["Serialize"]
+    assert_equal 2, time.call_count
+    assert time.max_call_time >= 2.0
+    assert time.total_call_time < 1000
+    assert_equal 2, allocations.call_count
+  end
+
+  def test_measure_records_when_raising
+    overhead = ScoutApm::AgentOverhead.new
+    assert_raises(RuntimeError) { overhead.measure("Post") { raise "refused" } }
+
+    assert_equal 1, overhead.stats!["Post"].first.call_count
+  end
+
+  def test_stats_resets
+    overhead = ScoutApm::AgentOverhead.new
+    overhead.add("Layers", 1_000_000, 10)
+
+    assert_equal ["Layers"], overhead.stats!.keys
+    assert_equal({}, overhead.stats!)
+  end
+
+  def test_stats_combines_threads
+    overhead = ScoutApm::AgentOverhead.new
+    overhead.add("StoreTrack", 1_000_000, 10)
+    Thread.new { overhead.add("StoreTrack", 3_000_000, 30) }.join
+
+    time, allocations = overhead.stats!["StoreTrack"]
+    assert_equal 2, time.call_count
+    assert_in_delta 4.0, time.total_call_time, 1e-9
+    assert_equal 40, allocations.total_call_time
+    assert_equal({}, overhead.stats!)
+  end
+
+  def test_measure_without_allocation_tracking_counts_no_allocations
+    skip "Allocation tracking not available" unless ScoutApm::Instruments::Allocations::ENABLED
+    overhead = ScoutApm::AgentOverhead.new
+    begin
+      ScoutApm::Instruments::Allocations.disable!
+      overhead.measure("Serialize") { Object.new }
+    ensure
+      ScoutApm::Instruments::Allocations.enable!
+    end
+
+    time, allocations = overhead.stats!["Serialize"]
+    assert_equal 1, time.call_count
+    assert_equal 0, allocations.call_count
+  end
+
+  def test_sampler_leaves_out_uncounted_allocations
+    context = ScoutApm::AgentContext.new
+    context.agent_overhead.add("Layers", 2_500_000, nil)
+    store = MetricsStore.new
+
+    ScoutApm::Instruments::AgentOverheadSampler.new(context).metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store)
+
+    assert_equal ["Agent/Overhead/Layers"], store.metrics.keys.map(&:metric_name)
+  end
+
+  def test_sampler_reports_agent_metrics
+    context = ScoutApm::AgentContext.new
+    context.agent_overhead.add("Layers", 2_500_000, 40)
+    store = MetricsStore.new
+
+    ScoutApm::Instruments::AgentOverheadSampler.new(context).metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store)
+
+    metrics = store.metrics.map { |meta, stat| [meta.metric_name, stat.total_call_time] }.sort
+    assert_equal [["Agent/Overhead/Layers", 2.5], ["Agent/OverheadAllocations/Layers", 40]], metrics
+    assert ScoutApm::MetricSet::PASSTHROUGH_METRICS.include?(store.metrics.keys.first.type)
+  end
+
+  def test_tracked_request_measures_layers_and_recorder
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config({})
+    context.recorder = DiscardingRecorder.new
+
+    req = ScoutApm::TrackedRequest.new(context, ScoutApm::FakeStore.new)
+    req.start_layer(ScoutApm::Layer.new("Controller", "users/index"))
+    req.start_layer(ScoutApm::Layer.new("ActiveRecord", "User#find"))
+    req.stop_layer
+    req.stop_layer
+
+    sections = context.agent_overhead.stats!
+    assert_equal ["Layers", "Recorder"], sections.keys.sort
+    assert_equal 1, sections["Layers"].first.call_count
+    assert sections["Layers"].first.total_call_time > 0
+  end
+end
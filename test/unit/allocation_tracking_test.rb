@@ -0,0 +1,186 @@
+require 'test_helper'
+
+require 'scout_apm/allocation_tracking'
+
+class AllocationTrackingTest < Minitest::Test
+  Allocations = ScoutApm::Instruments::Allocations
+
+  def setup
+    super
+    skip "Allocation tracking not available" unless Allocations::ENABLED
+  end
+
+  def teardown
+    if Allocations::ENABLED
+      Allocations.enable!
+      Allocations.sample_interval = 1
+      Allocations.track_sites = false
+    end
+    super
+  end
+
+  def test_enable_and_disable_are_idempotent
+    Allocations.enable!
+    Allocations.enable!
+    assert Allocations.enabled?
+
+    before = Allocations.count
+    Object.new
+    assert Allocations.count > before
+
+    Allocations.disable!
+    Allocations.disable!
+    assert_false Allocations.enabled?
+  end
+
+  def test_disabled_counts_stand_still
+    Allocations.disable!
+    before = Allocations.count
+    100.times { Object.new }
+    after = Allocations.count
+    Allocations.enable!
+
+    assert_equal before, after
+  end
+
+  def test_sampled_counts_are_scaled_up
+    Allocations.sample_interval = 10
+    before = Allocations.count
+    1000.times { Object.new }
+    delta = Allocations.count - before
+
+    assert_equal 0, delta % 10
+    assert_in_delta 1000, delta, 30
+  end
+
+  def test_sample_interval_is_at_least_one
+    Allocations.sample_interval = 0
+    assert_equal 1, Allocations.sample_interval
+  end
+
+  def test_install_sets_sample_interval
+    tracking = ScoutApm::AllocationTracking.new(context_with('allocation_sample_interval' => 4))
+    tracking.install!
+
+    assert_equal 4, Allocations.sample_interval
+  end
+
+  def test_top_sites_attributes_allocations_to_file_and_line
+    Allocations.track_sites = true
+    Allocations.reset_sites!
+    line = __LINE__; 500.times { Object.new }
+    sites = Allocations.top_sites(3)
+    Allocations.track_sites = false
+
+    assert sites.length <= 3
+    assert_includes sites, [__FILE__, line, "Object", 500]
+  end
+
+  def test_reset_sites_forgets_earlier_allocations
+    Allocations.track_sites = true
+    100.times { Object.new }
+    Allocations.reset_sites!
+    sites = Allocations.top_sites(10)
+    Allocations.track_sites = false
+
+    assert sites.none? { |_, _, _, count| count >= 100 }
+  end
+
+  def test_hotspots_relative_to_app_root
+    context = context_with('allocation_sites' => true)
+    context.environment = make_fake_environment(:root => File.dirname(__FILE__))
+    tracking = ScoutApm::AllocationTracking.new(context)
+    tracking.install!
+
+    started = tracking.start_request
+    assert started
+    line = __LINE__; 500.times { Object.new }
+    hotspots = tracking.hotspots
+    tracking.stop_request(started)
+
+    assert_includes hotspots, {:file => File.basename(__FILE__), :line => line, :class => "Object", :allocations => 500}
+  end
+
+  def test_hotspots_empty_without_allocation_sites
+    tracking = ScoutApm::AllocationTracking.new(context_with({}))
+    assert_equal [], tracking.hotspots
+  end
+
+  def test_defaults_to_enabled
+    tracking = ScoutApm::AllocationTracking.new(context_with({}))
+    tracking.install!
+
+    assert_equal 'enabled', tracking.mode
+    assert Allocations.enabled?
+    assert tracking.start_request
+  end
+
+  def test_unknown_mode_is_enabled
+    tracking = ScoutApm::AllocationTracking.new(context_with('allocation_tracking' => 'sometimes'))
+    assert_equal 'enabled', tracking.mode
+  end
+
+  def test_disabled_mode_turns_off_tracepoint
+    tracking = ScoutApm::AllocationTracking.new(context_with('allocation_tracking' => 'disabled'))
+    tracking.install!
+
+    assert_false Allocations.enabled?
+    assert_false tracking.start_request
+  end
+
+  def test_sampled_mode_enables_only_while_sampled_requests_run
+    tracking = ScoutApm::AllocationTracking.new(context_with('allocation_tracking' => 'sampled', 'allocation_tracking_request_sample' => 1))
+    tracking.install!
+    assert_false Allocations.enabled?
+
+    first = tracking.start_request
+    second = tracking.start_request
+    assert first
+    assert second
+    assert Allocations.enabled?
+
+    tracking.stop_request(first)
+    assert Allocations.enabled?
+
+    tracking.stop_request(second)
+    assert_false Allocations.enabled?
+  end
+
+  def test_reloading_config_keeps_running_sampled_requests
+    context = context_with('allocation_tracking' => 'sampled', 'allocation_tracking_request_sample' => 1)
+    tracking = context.allocation_tracking
+    tracking.install!
+    started = tracking.start_request
+
+    context.config = make_fake_config('allocation_tracking' => 'disabled')
+    assert_same tracking, context.allocation_tracking
+    assert_equal 'disabled', tracking.mode
+    assert Allocations.enabled?
+
+    tracking.stop_request(started)
+    assert_false Allocations.enabled?
+  end
+
+  def test_reloading_config_from_enabled_to_sampled
+    context = context_with({})
+    tracking = context.allocation_tracking
+    tracking.install!
+    started = tracking.start_request
+
+    context.config = make_fake_config('allocation_tracking' => 'sampled', 'allocation_tracking_request_sample' => 1)
+    assert_false Allocations.enabled?
+
+    sampled = tracking.start_request
+    tracking.stop_request(started)
+    assert Allocations.enabled?
+
+    tracking.stop_request(sampled)
+    assert_false Allocations.enabled?
+  end
+
+  def context_with(config)
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config(config)
+    context
+  end
+end
@@ -0,0 +1,111 @@
+require 'test_helper'
+
+require 'scout_apm/background_recorder'
+
+class BackgroundRecorderTest < Minitest::Test
+  # Holds up the recording thread on its first request until released
+  class GatedRequest
+    attr_reader :name
+
+    def initialize(name, gate = nil)
+      @name = name
+      @gate = gate
+    end
+
+    def record!
+      @gate.pop if @gate
+      RECORDED << name
+    end
+  end
+
+  RECORDED = Queue.new
+
+  class RecordingLayaway
+    attr_reader :rps_written
+    def write_reporting_period(rp)
+      @rps_written ||= []
+      @rps_written << rp
+    end
+  end
+
+  def setup
+    RECORDED.clear
+    @gate = Queue.new
+  end
+
+  def teardown
+    @recorder.stop if @recorder && @recorder.thread
+  end
+
+  def test_drop_newest_keeps_the_queued_requests
+    @recorder = stalled_recorder('drop_newest')
+    [:a, :b, :c].each { |name| @recorder.record!(GatedRequest.new(name)) }
+
+    assert_equal [:first, :a, :b], release_and_collect(3)
+    assert_equal 1, @recorder.stats![:dropped]
+  end
+
+  def test_drop_oldest_makes_room_for_new_requests
+    @recorder = stalled_recorder('drop_oldest')
+    [:a, :b, :c].each { |name| @recorder.record!(GatedRequest.new(name)) }
+
+    assert_equal [:first, :b, :c], release_and_collect(3)
+    assert_equal 1, @recorder.stats![:dropped]
+  end
+
+  def test_records_in_batches_and_reports_latency
+    @recorder = stalled_recorder('drop_newest')
+    [:a, :b].each { |name| @recorder.record!(GatedRequest.new(name)) }
+    release_and_collect(3)
+
+    stats = @recorder.stats!
+    assert_equal 2, stats[:max_depth]
+    assert_equal 3, stats[:latency].call_count
+    assert stats[:latency].min_call_time >= 0
+
+    assert_equal 0, @recorder.stats![:latency].call_count
+  end
+
+  def test_sampler_tracks_recorder_health
+    @recorder = stalled_recorder('drop_newest')
+    [:a, :b, :c].each { |name| @recorder.record!(GatedRequest.new(name)) }
+    release_and_collect(3)
+
+    context = ScoutApm::AgentContext.new
+    context.recorder = @recorder
+    store = ScoutApm::Store.new(context)
+    ScoutApm::Instruments::RecorderSampler.new(context).metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store)
+
+    layaway = RecordingLayaway.new
+    store.write_to_layaway(layaway, true)
+
+    metrics = layaway.rps_written.first.metrics_payload
+    assert_equal 1, metrics[ScoutApm::MetricMeta.new("Agent/RecorderDropped")].total_call_time
+    assert_equal 3, metrics[ScoutApm::MetricMeta.new("Agent/RecorderLatency")].call_count
+  end
+
+  # A recorder with room for two requests, whose thread is stuck on a first one
+  def stalled_recorder(policy)
+    recorder = ScoutApm::BackgroundRecorder.new(context_with(
+      'async_recording_queue_size' => 2,
+      'async_recording_batch_size' => 2,
+      'async_recording_drop_policy' => policy,
+    ))
+    recorder.record!(GatedRequest.new(:first, @gate))
+    Thread.pass until recorder.queue.empty? && recorder.thread.status == 'sleep'
+    recorder
+  end
+
+  # Lets the recording thread go, waiting until it's recorded count requests
+  # and gone back to waiting on the queue
+  def release_and_collect(count)
+    @gate << true
+    recorded = (0...count).map { RECORDED.pop }
+    Thread.pass until @recorder.queue.empty? && @recorder.thread.status == 'sleep'
+    recorded
+  end
+
+  def context_with(values)
+    ScoutApm::AgentContext.new.tap { |c| c.config = make_fake_config(values) }
+  end
+end
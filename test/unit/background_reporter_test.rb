@@ -0,0 +1,181 @@
+require 'test_helper'
+
+require 'tmpdir'
+require 'scout_apm/background_reporter'
+
+class BackgroundReporterTest < Minitest::Test
+  # Fails each host for as many posts as given, then accepts them
+  class FlakyReporter
+    attr_reader :posts
+
+    def initialize(failures = {})
+      @failures = failures
+      @posts = Queue.new
+    end
+
+    def post_to_host(host, body, headers)
+      @posts << [host, body]
+      return true unless @failures[host].to_i > 0
+      @failures[host] -= 1
+      false
+    end
+
+    def fail!(host, times)
+      @failures[host] = times
+    end
+
+    def finish_connections
+    end
+  end
+
+  def setup
+    super
+    @dir = Dir.mktmpdir("scout_background_reporter")
+  end
+
+  def teardown
+    @background_reporter.stop if @background_reporter
+    FileUtils.rm_rf(@dir)
+  end
+
+  def test_sends_on_its_own_thread
+    reporter = FlakyReporter.new
+    @background_reporter = background_reporter(reporter)
+    @background_reporter.report(["a"], "payload", {})
+
+    assert_equal ["a", "payload"], reporter.posts.pop
+    assert @background_reporter.thread.alive?
+  end
+
+  def test_retries_failing_hosts
+    reporter = FlakyReporter.new("b" => 2)
+    @background_reporter = retrying_immediately(background_reporter(reporter))
+
+    assert @background_reporter.deliver(payload(["a", "b"], "1"))
+    assert_equal ["a", "b", "b", "b"], posted_hosts(reporter)
+    assert_equal [], @background_reporter.spilled_files
+  end
+
+  def test_backs_off_exponentially
+    @background_reporter = background_reporter(FlakyReporter.new)
+
+    assert_equal [2, 4, 8, 16, 32, 60, 60], (1..7).map { |attempt| @background_reporter.retry_delay(attempt) }
+  end
+
+  def test_spills_payloads_it_gives_up_on
+    reporter = FlakyReporter.new("b" => 100)
+    @background_reporter = retrying_immediately(background_reporter(reporter))
+
+    assert !@background_reporter.deliver(payload(["a", "b"], "1"))
+    assert_equal ScoutApm::BackgroundReporter::MAX_ATTEMPTS + 1, posted_hosts(reporter).length
+    assert_equal [[["b"], "1", {}]], spilled
+  end
+
+  def test_sends_spilled_payloads_once_posting_works
+    reporter = FlakyReporter.new("a" => 100)
+    @background_reporter = retrying_immediately(background_reporter(reporter))
+    @background_reporter.deliver(payload(["a"], "1"))
+    @background_reporter.deliver(payload(["a"], "2"))
+    assert_equal 2, spilled.length
+
+    reporter.fail!("a", 0)
+    assert @background_reporter.deliver(payload(["a"], "3"))
+    assert @background_reporter.send_spilled
+    assert_equal [], spilled
+    assert_equal ["3", "1", "2"], posted_bodies(reporter).last(3)
+  end
+
+  def test_puts_back_spilled_payloads_that_fail_again
+    reporter = FlakyReporter.new("a" => 100)
+    @background_reporter = retrying_immediately(background_reporter(reporter))
+    @background_reporter.deliver(payload(["a"], "1"))
+
+    assert !@background_reporter.send_spilled
+    assert_equal [[["a"], "1", {}]], spilled
+  end
+
+  def test_spills_when_the_queue_is_full
+    @background_reporter = background_reporter(FlakyReporter.new, 'async_reporting_queue_size' => 1, 'async_reporting_spill_limit' => 2)
+    @background_reporter.stubs(:start)
+    %w(1 2 3 4).each { |body| @background_reporter.report(["a"], body, {}) }
+
+    assert_equal 1, @background_reporter.queue.size
+    assert_equal ["3", "4"], spilled.map { |_, body, _| body }
+  end
+
+  def test_stop_spills_the_queued_payloads
+    @background_reporter = background_reporter(FlakyReporter.new)
+    @background_reporter.stubs(:start)
+    @background_reporter.report(["a"], "1", {})
+    @background_reporter.stop
+
+    assert_equal [[["a"], "1", {}]], spilled
+  end
+
+  def test_start_puts_back_payloads_left_by_dead_processes
+    @background_reporter = background_reporter(FlakyReporter.new)
+    dead = Process.spawn("true")
+    Process.wait(dead)
+    claimed(dead, "1", 1)
+    claimed(Process.ppid, "2", 2)
+
+    @background_reporter.start
+    assert_equal [[["a"], "1", {}]], spilled
+    assert_equal 1, @background_reporter.sending_files.length
+  end
+
+  def test_payloads_being_sent_count_towards_the_spill_limit
+    @background_reporter = background_reporter(FlakyReporter.new, 'async_reporting_spill_limit' => 2)
+    claimed(Process.ppid, "1", 1)
+    @background_reporter.send(:spill, payload(["a"], "2"))
+    @background_reporter.send(:spill, payload(["a"], "3"))
+
+    assert_equal ["3"], spilled.map { |_, body, _| body }
+    assert_equal 1, @background_reporter.sending_files.length
+  end
+
+  private
+
+  # Writes a payload as if the process had claimed it to send
+  def claimed(pid, body, n)
+    file = File.join(@dir, "#{ScoutApm::BackgroundReporter::SPILL_PREFIX}20260101000000000_#{pid}_#{n}#{ScoutApm::BackgroundReporter::SPILL_EXTENSION}")
+    File.binwrite("#{file}.#{pid}#{ScoutApm::BackgroundReporter::SENDING_EXTENSION}", Marshal.dump([["a"], body, {}]))
+  end
+
+  def background_reporter(reporter, values = {})
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config({
+      'data_file' => @dir,
+      'async_reporting_queue_size' => 5,
+      'async_reporting_spill_limit' => 10,
+    }.merge(values))
+    ScoutApm::BackgroundReporter.new(context, reporter)
+  end
+
+  def retrying_immediately(background_reporter)
+    background_reporter.stubs(:retry_delay).returns(0)
+    background_reporter
+  end
+
+  def payload(hosts, body)
+    ScoutApm::BackgroundReporter::Payload.new(hosts, body, {})
+  end
+
+  def spilled
+    @background_reporter.spilled_files.map { |file| Marshal.load(File.binread(file)) }
+  end
+
+  def posts(reporter)
+    @posts ||= []
+    @posts << reporter.posts.pop until reporter.posts.empty?
+    @posts
+  end
+
+  def posted_hosts(reporter)
+    posts(reporter).map(&:first)
+  end
+
+  def posted_bodies(reporter)
+    posts(reporter).map(&:last)
+  end
+end
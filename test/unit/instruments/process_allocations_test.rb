@@ -0,0 +1,98 @@
+require 'test_helper'
+
+require 'scout_apm/instruments/process/process_allocations'
+
+class ProcessAllocationsTest < Minitest::Test
+  Allocations = ScoutApm::Instruments::Allocations
+  ProcessAllocations = ScoutApm::Instruments::Process::ProcessAllocations
+
+  def setup
+    super
+    skip "Allocation tracking not available" unless Allocations::ENABLED
+    @context = ScoutApm::AgentContext.new
+  end
+
+  def test_count_for_reads_another_threads_counter
+    ready = Queue.new
+    done = Queue.new
+    thread = Thread.new do
+      1000.times { Object.new }
+      ready << Allocations.count
+      done.pop
+    end
+
+    own_count = ready.pop
+    assert Allocations.count_for(thread) >= own_count
+    assert own_count >= 1000
+  ensure
+    done << true if done
+    thread.join if thread
+  end
+
+  def test_count_for_unknown_thread_is_zero
+    assert_equal 0, Allocations.count_for(Object.new)
+  end
+
+  def test_process_total_includes_every_thread
+    before = Allocations.process_total
+    Thread.new { 1000.times { Object.new } }.join
+    assert Allocations.process_total - before >= 1000
+  end
+
+  def test_thread_counts_includes_current_thread
+    Object.new
+    assert Allocations.thread_counts.key?(Thread.current)
+  end
+
+  def test_run_reports_allocations_since_last_run
+    sampler = ProcessAllocations.new(@context)
+    Thread.new { 1000.times { Object.new } }.join
+
+    process_allocations, thread_allocations = sampler.run
+    assert process_allocations >= 1000
+    assert thread_allocations.all? { |count| count > 0 }
+  end
+
+  def test_reports_nothing_with_tracking_disabled
+    @context.config = make_fake_config('allocation_tracking' => 'disabled')
+    sampler = ProcessAllocations.new(@context)
+    store = mock
+    store.expects(:track!).never
+
+    was_enabled = Allocations.enabled?
+    Allocations.disable!
+    assert_equal({}, sampler.metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store))
+  ensure
+    Allocations.enable! if was_enabled
+  end
+
+  def test_reports_nothing_when_sampling_requests
+    @context.config = make_fake_config('allocation_tracking' => 'sampled')
+    sampler = ProcessAllocations.new(@context)
+    store = mock
+    store.expects(:track!).never
+
+    was_enabled = Allocations.enabled?
+    Allocations.enable! # as while a sampled request runs
+    assert_equal({}, sampler.metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store))
+  ensure
+    Allocations.disable! unless was_enabled
+  end
+
+  def test_reports_with_tracking_enabled
+    @context.config = make_fake_config('allocation_tracking' => 'enabled')
+    sampler = ProcessAllocations.new(@context)
+    store = mock
+    store.expects(:track!).once
+
+    Thread.new { 1000.times { Object.new } }.join
+    sampler.metrics(ScoutApm::StoreReportingPeriodTimestamp.new, store)
+  end
+
+  def test_run_skips_negative_counts
+    sampler = ProcessAllocations.new(@context)
+    sampler.last_total = Allocations.process_total + 1_000_000_000
+
+    assert_nil sampler.run
+  end
+end
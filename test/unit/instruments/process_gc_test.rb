@@ -0,0 +1,76 @@
+require 'test_helper'
+
+require 'scout_apm/instruments/process/process_gc'
+
+class ProcessGcTest < Minitest::Test
+  GarbageCollection = ScoutApm::Instruments::GarbageCollection
+  ProcessGc = ScoutApm::Instruments::Process::ProcessGc
+
+  def setup
+    super
+    skip "GC tracking not available" unless GarbageCollection::ENABLED
+    @context = ScoutApm::AgentContext.new
+  end
+
+  def test_counts_gc
+    count, major_count, time = GarbageCollection.count, GarbageCollection.major_count, GarbageCollection.time
+    GC.start
+
+    assert_equal count + 1, GarbageCollection.count
+    assert_equal major_count + 1, GarbageCollection.major_count
+    assert GarbageCollection.time > time
+  end
+
+  def test_minor_gc_is_not_major
+    skip "GC.start(full_mark: false) not available" unless RUBY_VERSION >= "2.1"
+    major_count = GarbageCollection.major_count
+    GC.start(:full_mark => false)
+
+    assert_equal major_count, GarbageCollection.major_count
+  end
+
+  def test_counts_other_threads_gc
+    count = GarbageCollection.count
+    Thread.new { GC.start }.join
+
+    assert_equal count + 1, GarbageCollection.count
+    assert_equal GarbageCollection.count, GarbageCollection.process_count
+  end
+
+  def test_layer_records_gc_delta
+    layer = ScoutApm::Layer.new("Controller", "users/index")
+    GC.start
+    layer.record_gc!
+    GC.start
+
+    assert_equal 1, layer.total_gc_count
+    assert layer.total_gc_time > 0
+    assert layer.total_gc_time < layer.total_call_time
+  end
+
+  def test_layer_records_gc_triggered_by_another_thread
+    layer = ScoutApm::Layer.new("Controller", "users/index")
+    Thread.new { GC.start }.join
+    layer.record_gc!
+
+    assert_equal 1, layer.total_gc_count
+    assert layer.total_gc_time > 0
+  end
+
+  def test_run_reports_gc_since_last_run
+    sampler = ProcessGc.new(@context)
+    GC.start
+
+    time, count, major_count = sampler.run
+    assert time > 0
+    assert count >= 1
+    assert major_count >= 1
+  end
+
+  def test_run_skips_negative_counts
+    sampler = ProcessGc.new(@context)
+    sampler.last_count = GarbageCollection.process_count + 1_000
+
+    assert_nil sampler.run
+  end
+end
@@ -0,0 +1,194 @@
+require 'test_helper'
+require 'scout_apm/metric_meta'
+require 'scout_apm/metric_stats'
+require 'scout_apm/context'
+require 'scout_apm/store'
+
+class LayawayFormatTest < Minitest::Test
+  LayawayFormat = ScoutApm::LayawayFormat
+
+  def test_binary_round_trips_metrics
+    period = build_period
+    loaded = LayawayFormat.load(LayawayFormat.dump(period, 'binary'))
+
+    assert_metrics_equal period.metric_set.metrics, loaded.metric_set.metrics
+    assert_equal period.timestamp, loaded.timestamp
+  end
+
+  def test_binary_is_smaller_than_marshal
+    period = build_period
+
+    assert LayawayFormat.dump(period, 'binary').bytesize < LayawayFormat.dump(period, 'marshal').bytesize
+  end
+
+  def test_binary_shares_repeated_strings
+    period = build_period
+    loaded = LayawayFormat.load(LayawayFormat.dump(period, 'binary'))
+    scopes = loaded.metric_set.metrics.keys.map(&:scope).compact.uniq(&:object_id)
+
+    assert_equal 1, scopes.size
+    assert scopes.first.frozen?
+  end
+
+  def test_binary_keeps_metrics_it_cant_pack
+    period = build_period
+    with_extra = ScoutApm::MetricMeta.new("SlowTransaction/Controller/users/index")
+    with_extra.extra[:backtrace] = ["app/models/user.rb:10"]
+    with_queue = ScoutApm::MetricMeta.new("QueueTime/Request")
+    period.metric_set.metrics[with_extra] = stats(1)
+    period.metric_set.metrics[with_queue] = stats(2).update!(0.1, 0.1, :queue => "default")
+
+    loaded = LayawayFormat.load(LayawayFormat.dump(period, 'binary'))
+
+    assert_metrics_equal period.metric_set.metrics, loaded.metric_set.metrics
+    assert_equal ["app/models/user.rb:10"], loaded.metric_set.metrics.keys.find { |m| m == with_extra }.backtrace
+    assert_equal "default", loaded.metric_set.metrics[with_queue].queue
+  end
+
+  def test_loads_marshal_regardless_of_format
+    period = build_period
+    loaded = LayawayFormat.load(Marshal.dump(period))
+
+    assert_metrics_equal period.metric_set.metrics, loaded.metric_set.metrics
+  end
+
+  # Older agents don't have NativeNumericHistogram. They load the histograms
+  # as NumericHistograms, and this agent makes them native again.
+  def test_histograms_are_written_as_numeric_histograms
+    period = build_period_with_histograms
+
+    %w(marshal binary).each do |format|
+      data = LayawayFormat.dump(period, format)
+      refute_includes data, "NativeNumericHistogram", format
+
+      loaded = LayawayFormat.load(data)
+      job = loaded.jobs.first
+      [loaded.histograms.first.histogram, job.total_time, job.exclusive_time, loaded.db_query_metric_set.metrics.values.first.histogram].each do |histogram|
+        assert_instance_of ScoutApm::NativeNumericHistogram, histogram, format
+      end
+      assert_equal [[0.1, 1], [0.2, 2]], loaded.histograms.first.histogram.as_json, format
+      assert_equal 3, job.run_count, format
+    end
+
+    old = Marshal.load(LayawayFormat.dump(period, 'marshal'))
+    assert_instance_of ScoutApm::NumericHistogram, old.histograms.first.histogram
+    assert_equal [[0.1, 1], [0.2, 2]], old.histograms.first.histogram.as_json
+    assert_instance_of ScoutApm::NativeNumericHistogram, period.histograms.first.histogram
+  end
+
+  def test_rejects_truncated_binary
+    data = LayawayFormat.dump(build_period, 'binary')
+
+    assert_raises(ArgumentError) { LayawayFormat.load(data[0, data.bytesize - 10]) }
+    assert_raises(ArgumentError) { LayawayFormat.load(data[0, 20]) }
+  end
+
+  def test_layaway_file_writes_configured_format
+    path = "/tmp/scout_apm_test/layaway_format"
+    FileUtils.mkdir_p File.dirname(path)
+    context = ScoutApm::AgentContext.new.tap { |c| c.config = make_fake_config("layaway_format" => "binary") }
+    file = ScoutApm::LayawayFile.new(context, path)
+    period = build_period
+
+    file.write(period)
+    assert ScoutApm::NativeLayawayFormat.binary?(File.read(path))
+    assert_metrics_equal period.metric_set.metrics, file.load.metric_set.metrics
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+
+  # So agents that can't read binary files can still share the directory
+  def test_layaway_file_defaults_to_marshal
+    path = "/tmp/scout_apm_test/layaway_format_default"
+    FileUtils.mkdir_p File.dirname(path)
+    context = ScoutApm::AgentContext.new
+    context.config = ScoutApm::Config.without_file(context)
+    period = build_period
+
+    ScoutApm::LayawayFile.new(context, path).write(period)
+    assert_metrics_equal period.metric_set.metrics, Marshal.load(File.binread(path)).metric_set.metrics
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+
+  def test_merge_matches_merging_loaded_periods
+    periods = (0...4).map { |i| build_period(i) }
+    paths = periods.each_with_index.map { |period, i| write_file("merge_#{i}", LayawayFormat.dump(period, 'binary')) }
+
+    merged, others = LayawayFormat.merge(paths)
+    expected = paths.map { |path| LayawayFormat.load(File.read(path)) }.inject { |memo, rp| memo.merge(rp) }
+
+    assert_equal [], others
+    assert_metrics_equal expected.metric_set.metrics, merged.metric_set.metrics
+  ensure
+    paths.each { |path| File.unlink(path) }
+  end
+
+  def test_merge_leaves_out_files_it_cant_read
+    binary = write_file("merge_binary", LayawayFormat.dump(build_period, 'binary'))
+    marshal = write_file("merge_marshal", Marshal.dump(build_period))
+    truncated = write_file("merge_truncated", LayawayFormat.dump(build_period, 'binary')[0, 100])
+    missing = "/tmp/scout_apm_test/merge_missing"
+
+    merged, others = LayawayFormat.merge([binary, marshal, truncated, missing])
+
+    assert_metrics_equal build_period.metric_set.metrics, merged.metric_set.metrics
+    assert_equal [marshal, truncated, missing], others
+  ensure
+    [binary, marshal, truncated].each { |path| File.unlink(path) }
+  end
+
+  def write_file(name, data)
+    FileUtils.mkdir_p "/tmp/scout_apm_test"
+    path = "/tmp/scout_apm_test/#{name}"
+    File.open(path, "wb") { |f| f.write(data) }
+    path
+  end
+
+  # Metrics as recorded, and some as they'd be in another process's file
+  def build_period(worker = 0)
+    period = ScoutApm::StoreReportingPeriod.new(ScoutApm::StoreReportingPeriodTimestamp.new, ScoutApm::AgentContext.new)
+    metrics = {}
+    20.times do |i|
+      metrics[ScoutApm::MetricMeta.new("ActiveRecord/User#find_#{i}", :scope => "Controller/users/index")] = stats(i + worker)
+      metrics[ScoutApm::MetricMeta.new("View/users/_row_#{i}", :scope => "Controller/users/index", :desc => "render")] = stats(i)
+    end
+    metrics[ScoutApm::MetricMeta.new("Controller/users/index")] = stats(3, false)
+    metrics[ScoutApm::MetricMeta.new("Errors/Controller/users/index")] = stats(worker)
+    period.absorb_metrics!(metrics)
+
+    period.metric_set.metrics[ScoutApm::MetricMeta.new("Controller/Users/Index")] = stats(worker, false) if worker > 1
+    period.metric_set.metrics[ScoutApm::MetricMeta.new("HTTP/get", :desc => "example.com")] = stats(worker)
+    period
+  end
+
+  def build_period_with_histograms
+    period = build_period
+    histogram = ScoutApm::NativeNumericHistogram.new(10)
+    [0.1, 0.2, 0.2].each { |v| histogram.add(v) }
+    period.merge_histograms!([ScoutApm::Instruments::HistogramReport.new("Controller/users/index", histogram)])
+    job = ScoutApm::JobRecord.new("default", "MailJob", 1.0, 0.5, 0, {})
+    2.times { job.combine!(ScoutApm::JobRecord.new("default", "MailJob", 2.0, 1.0, 0, {})) }
+    period.merge_jobs!([job])
+    period.merge_db_query_metrics!(ScoutApm::DbQueryMetricSet.new(ScoutApm::AgentContext.new).tap { |set| set << ScoutApm::DbQueryMetricStats.new("User", "find", "Controller/users/index", 1, 0.01, 1) })
+    period
+  end
+
+  def stats(n, scoped = true)
+    stat = ScoutApm::MetricStats.new(scoped)
+    (n + 1).times { |i| stat.update!(0.001 * (i + 1), 0.0005 * (i + 1)) }
+    stat
+  end
+
+  def assert_metrics_equal(expected, actual)
+    assert_equal expected.size, actual.size
+    expected.each do |meta, stat|
+      loaded = actual[meta]
+      assert loaded, "missing #{meta.metric_name}"
+      [:call_count, :min_call_time, :max_call_time, :total_call_time, :total_exclusive_time, :sum_of_squares].each do |attr|
+        assert_equal stat.send(attr), loaded.send(attr), "#{meta.metric_name} #{attr}"
+      end
+      assert_equal stat.instance_variable_get(:@scoped), loaded.instance_variable_get(:@scoped)
+    end
+  end
+end
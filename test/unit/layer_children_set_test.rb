@@ -71,6 +71,38 @@ class LayerChildrenSetTest < Minitest::Test
     limited_layers.each { |ml| assert_equal 5, ml.count }
   end
 
+  def test_totals_include_limited_children
+    s = SET.new(5)
+
+    10.times do
+      layer = make_layer("LayerType", "LayerName")
+      layer.record_stop_time!
+      layer.record_allocations!
+      s << layer
+    end
+
+    assert_in_delta s.to_a.map(&:total_call_time).inject(:+), s.total_call_time, 1e-12
+    assert_equal s.to_a.map(&:total_allocations).inject(:+), s.total_allocations
+  end
+
+  def test_layer_exclusive_time_uses_totals
+    parent = make_layer("Controller", "users/index")
+    3.times do
+      child = make_layer("View", "users/_row")
+      child.record_stop_time!
+      child.record_allocations!
+      parent.add_child(child)
+    end
+    parent.record_stop_time!
+    parent.record_allocations!
+
+    children = parent.children.to_a
+    def parent.children; raise "summed children again"; end
+
+    assert_in_delta parent.total_call_time - children.map(&:total_call_time).inject(:+), parent.total_exclusive_time, 1e-12
+    assert_equal parent.total_allocations - children.map(&:total_allocations).inject(:+), parent.total_exclusive_allocations
+  end
+
   #############
   #  Helpers  #
   #############
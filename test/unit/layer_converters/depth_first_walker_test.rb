@@ -62,5 +62,58 @@ class DepthFirstWalkerTest < Minitest::Test
       "A after"
     ], calls
   end
+
+  def test_visits_know_their_subscope
+    a = Layer.new("Controller", "x")
+    b = Layer.new("View", "outer")
+    c = Layer.new("View", "inner")
+    d = Layer.new("ActiveRecord", "find")
+    b.subscopable!
+    c.subscopable!
+    a.add_child(b)
+    b.add_child(c)
+    c.add_child(d)
+
+    subscopes = {}
+    walker = LayerConverters::DepthFirstWalker.new(a)
+    walker.on { |l, visit| subscopes[l.name] = visit.subscope }
+    walker.walk
+
+    assert_nil subscopes["x"]
+    assert_nil subscopes["outer"] # Not under itself
+    assert_equal b, subscopes["inner"]
+    assert_equal b, subscopes["find"]
+    assert_nil walker.current
+  end
+
+  def test_replay_revisits_without_walking_the_tree
+    a = Layer.new("A", "x")
+    b = Layer.new("B", "x")
+    a.add_child(b)
+
+    walker = LayerConverters::DepthFirstWalker.new(a)
+    walked = []
+    walker.on { |l, visit| walked << visit }
+    walker.walk
+
+    def a.children; raise "walked again"; end
+    replayed = []
+    walker.replay { |l, visit| replayed << [l, visit, walker.current] }
+
+    assert_equal [a, b], replayed.map(&:first)
+    assert_equal walked, replayed.map { |r| r[1] }
+    assert_equal walked, replayed.map { |r| r[2] }
+  end
+
+  def test_visit_works_out_times_once
+    a = Layer.new("A", "x")
+    calls = 0
+    a.define_singleton_method(:total_exclusive_time) { calls += 1; 1.5 }
+    visit = LayerConverters::DepthFirstWalker::Visit.new(a, nil)
+
+    assert_equal 1.5, visit.total_exclusive_time
+    assert_equal 1.5, visit.total_exclusive_time
+    assert_equal 1, calls
+  end
 end
 end
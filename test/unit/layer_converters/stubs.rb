@@ -4,19 +4,12 @@
 module ScoutApm
   module LayerConverters
     module Stubs
-      def faux_walker(subscope_stubs: true)
+      def faux_walker
         @w ||= stub
-
-        if subscope_stubs && !@w_set_subscope_stubs
-          @w_set_subscope_stubs = true
-          @w.expects(:before)
-          @w.expects(:after)
-        end
-        @w
       end
 
       def faux_request
-        @req ||= stub(:root_layer => stub)
+        @req ||= stub(:root_layer => stub, :sampled? => true, :sample_weight => 1)
       end
 
       def faux_layer_finder
@@ -0,0 +1,79 @@
+require 'test_helper'
+
+require 'scout_apm/metric_key'
+
+class MetricKeyTest < Minitest::Test
+  MetricKey = ScoutApm::MetricKey
+  MetricMeta = ScoutApm::MetricMeta
+
+  def test_interns_keys
+    key = MetricKey.for("Controller/users/index", nil, nil)
+
+    assert_same key, MetricKey.for("Controller/users/index", nil, nil)
+    assert_same key, MetricMeta.new("Controller/users/index").metric_key
+    refute_same key, MetricKey.for("Controller/users/index", "Controller/users/show", nil)
+    assert key.frozen?
+  end
+
+  def test_metas_keep_their_key
+    meta = MetricMeta.new("Controller/users/index")
+
+    assert_same meta.metric_key, meta.metric_key
+  end
+
+  def test_each_thread_interns_its_own_keys
+    key = MetricKey.for("Controller/users/index", nil, nil)
+    other = Thread.new { MetricKey.for("Controller/users/index", nil, nil) }.value
+
+    refute_same key, other
+    assert key.eql?(other)
+  end
+
+  def test_long_descs_are_not_interned
+    desc = "x" * (MetricKey::MAX_INTERNED_DESC + 1)
+    key = MetricKey.for("SQL/other", nil, desc)
+
+    refute_same key, MetricKey.for("SQL/other", nil, desc)
+    assert key.eql?(MetricKey.for("SQL/other", nil, desc))
+  end
+
+  def test_splits_type_and_name
+    key = MetricKey.for("ActiveRecord/User/find", nil, nil)
+
+    assert_equal "ActiveRecord", key.type
+    assert_equal "User/find", key.name
+    assert_equal "ActiveRecord/all", key.aggregate_name
+  end
+
+  def test_metas_compare_names_ignoring_case
+    upper = MetricMeta.new("View/Users/Index", :scope => "Controller/users/index")
+    lower = MetricMeta.new("view/users/index", :scope => "Controller/users/index")
+
+    assert_equal upper.hash, lower.hash
+    assert upper.eql?(lower)
+    assert_equal 1, {upper => 1, lower => 2}.size
+    refute MetricMeta.new("View/users/index", :scope => "Controller/Users/Index").eql?(lower)
+    refute MetricMeta.new("View/users/index", :scope => "Controller/users/index", :desc => "x").eql?(lower)
+  end
+
+  def test_setters_find_a_new_key
+    meta = MetricMeta.new("ActiveRecord/User/find")
+    before = meta.metric_key
+    meta.desc = "SELECT * FROM users"
+
+    refute_same before, meta.metric_key
+    assert_equal "SELECT * FROM users", meta.metric_key.desc
+  end
+
+  # Older agents don't have MetricKey, and must still load Marshaled metas
+  def test_marshaled_metas_leave_out_their_key
+    meta = MetricMeta.new("Controller/users/index", :scope => "Middleware/all")
+    meta.metric_key
+    data = Marshal.dump(meta)
+
+    refute_includes data, "MetricKey"
+    loaded = Marshal.load(data)
+    assert loaded.eql?(meta)
+    assert_same meta.metric_key, loaded.metric_key
+  end
+end
@@ -88,6 +88,19 @@ module ScoutApm
       assert_equal 2, metrics[3][1].call_count
     end
 
+    def test_combine_aggregates_metrics_kept_as_is
+      @other_set = ScoutApm::MetricSet.new
+      @other_set.metrics[MetricMeta.new("HTTP/get", :desc => "example.com")] = make_fake_stat("HTTP/get", 1).last
+      @other_set.metrics[MetricMeta.new("HTTP/all")] = make_fake_stat("HTTP/all", 1).last
+      @metric_set.absorb(make_fake_stat("HTTP/post", 1))
+
+      @metric_set.combine!(@other_set)
+
+      assert_equal 1, @metric_set.metrics.length
+      assert_equal "HTTP/all", @metric_set.metrics.first.first.metric_name
+      assert_equal 3, @metric_set.metrics.first.last.call_count
+    end
+
     ############################################################
     # Test helper functions
     ############################################################
@@ -0,0 +1,78 @@
+require 'test_helper'
+
+require 'scout_apm/metric_stats'
+
+class MetricStatsTest < Minitest::Test
+  MetricStats = ScoutApm::MetricStats
+
+  def test_update_tracks_call_time
+    stats = MetricStats.new.update!(0.5, 0.25).update!(0.125, 0.1).update!(2.0, 1.0)
+
+    assert_equal 3, stats.call_count
+    assert_equal 0.125, stats.min_call_time
+    assert_equal 2.0, stats.max_call_time
+    assert_in_delta 2.625, stats.total_call_time, 0.000001
+    assert_in_delta 1.35, stats.total_exclusive_time, 0.000001
+    assert_in_delta 0.5 ** 2 + 0.125 ** 2 + 2.0 ** 2, stats.sum_of_squares, 0.000001
+  end
+
+  def test_scoped_update_tracks_exclusive_time
+    stats = MetricStats.new(true).update!(0.5, 0.25).update!(0.125, 0.1)
+
+    assert_equal 0.1, stats.min_call_time
+    assert_equal 0.25, stats.max_call_time
+    assert_in_delta 0.25 ** 2 + 0.1 ** 2, stats.sum_of_squares, 0.000001
+  end
+
+  def test_update_keeps_integer_times
+    stats = MetricStats.new.update!(7, 3).update!(5, 2)
+
+    assert_equal 5, stats.min_call_time
+    assert_kind_of Integer, stats.min_call_time
+    assert_kind_of Integer, stats.max_call_time
+    assert_equal 74.0, stats.sum_of_squares
+  end
+
+  def test_scale_multiplies_counts_and_totals
+    stats = MetricStats.new(true).update!(0.5, 0.25).update!(0.125, 0.1).scale!(4)
+
+    assert_equal 8, stats.call_count
+    assert_kind_of Integer, stats.call_count
+    assert_in_delta 2.5, stats.total_call_time, 0.000001
+    assert_in_delta 1.4, stats.total_exclusive_time, 0.000001
+    assert_in_delta 4 * (0.25 ** 2 + 0.1 ** 2), stats.sum_of_squares, 0.000001
+    assert_equal 0.1, stats.min_call_time
+    assert_equal 0.25, stats.max_call_time
+  end
+
+  def test_update_sets_extra_metrics
+    stats = MetricStats.new.update!(1.0, 1.0, :queue => "default", :latency => 0.5)
+
+    assert_equal "default", stats.queue
+    assert_equal 0.5, stats.latency
+  end
+
+  def test_combine
+    stats = MetricStats.new.update!(0.5)
+    stats.combine!(MetricStats.new.update!(0.25).update!(3.0))
+
+    assert_equal 3, stats.call_count
+    assert_equal 0.25, stats.min_call_time
+    assert_equal 3.0, stats.max_call_time
+    assert_equal 3.75, stats.total_call_time
+  end
+
+  def test_combine_into_empty_takes_the_others_min
+    stats = MetricStats.new.combine!(MetricStats.new.update!(0.5))
+
+    assert_equal 0.5, stats.min_call_time
+  end
+
+  # Layaway files and the native extensions depend on these
+  def test_instance_variables_are_unchanged
+    stats = MetricStats.new(true).update!(1.5, 0.5)
+
+    assert_equal [:@scoped, :@call_count, :@total_call_time, :@total_exclusive_time, :@min_call_time, :@max_call_time, :@sum_of_squares],
+      stats.instance_variables
+  end
+end
@@ -0,0 +1,201 @@
+require 'test_helper'
+
+require 'scout_apm/histogram'
+require 'numeric_histogram'
+
+# The native histogram must make exactly the same merge decisions as the Ruby
+# NumericHistogram, so most of these compare the two side by side.
+class NativeNumericHistogramTest < Minitest::Test
+  def test_histogram_min_and_max_with_big_enough_histogram
+    hist = ScoutApm::NativeNumericHistogram.new(10)
+
+    10.times {
+      (1..10).to_a.each do |i|
+        hist.add(i)
+      end
+    }
+
+    assert_equal 1, hist.quantile(0)
+    assert_equal 10, hist.quantile(100)
+  end
+
+  def test_histogram_min_and_max_with_fewer_buckets
+    hist = ScoutApm::NativeNumericHistogram.new(5)
+
+    10.times {
+      (1..10).to_a.each do |i|
+        hist.add(i)
+      end
+    }
+
+    assert_equal 1.5, hist.quantile(0).round(1)
+    assert_equal 9.5, hist.quantile(100).round(1)
+  end
+
+  def test_empty_histogram
+    hist = ScoutApm::NativeNumericHistogram.new(5)
+
+    assert_equal 0, hist.quantile(50)
+    assert_equal 0, hist.mean
+    assert_equal 100, hist.approximate_quantile_of_value(1)
+    assert_equal [], hist.as_json
+  end
+
+  def test_matches_ruby_histogram
+    [5, 20, 50].each do |max_bins|
+      native = ScoutApm::NativeNumericHistogram.new(max_bins)
+      ruby = ScoutApm::NumericHistogram.new(max_bins)
+      rng = Random.new(max_bins)
+
+      2000.times do
+        value = (rng.rand * 1000).round(rng.rand(3))
+        native.add(value)
+        ruby.add(value)
+      end
+
+      assert_same_histogram ruby, native
+      [0, 10, 50, 90, 99, 100].each do |q|
+        assert_equal ruby.quantile(q), native.quantile(q)
+      end
+      [0, 250, 500.5, 1000].each do |v|
+        assert_equal ruby.approximate_quantile_of_value(v), native.approximate_quantile_of_value(v)
+      end
+      assert_in_delta ruby.mean, native.mean, 0.0001
+      assert_equal ruby.as_json, native.as_json
+    end
+  end
+
+  def test_combine_matches_ruby_histogram
+    native1 = ScoutApm::NativeNumericHistogram.new(10)
+    native2 = ScoutApm::NativeNumericHistogram.new(20)
+    ruby1 = ScoutApm::NumericHistogram.new(10)
+    ruby2 = ScoutApm::NumericHistogram.new(20)
+
+    300.times do |i|
+      native1.add(i % 47)
+      ruby1.add(i % 47)
+      native2.add(i % 13 + 40)
+      ruby2.add(i % 13 + 40)
+    end
+
+    native1.combine!(native2)
+    ruby1.combine!(ruby2)
+
+    assert_equal 600, native1.total
+    assert_same_histogram ruby1, native1
+  end
+
+  def test_combine_dedups_identicals
+    hist1 = ScoutApm::NativeNumericHistogram.new(5)
+    hist2 = ScoutApm::NativeNumericHistogram.new(5)
+    hist1.add(1)
+    hist1.add(2)
+    hist2.add(2)
+    hist2.add(3)
+
+    combined = hist1.combine!(hist2)
+    assert_equal 4, combined.total
+    assert_equal [[1, 1], [2, 2], [1, 3]],
+      combined.bins.map{|bin| [bin.count, bin.value.to_i] }
+  end
+
+  def test_combines_with_ruby_histogram_in_either_direction
+    native = ScoutApm::NativeNumericHistogram.new(5)
+    ruby = ScoutApm::NumericHistogram.new(5)
+    native.add(1)
+    ruby.add(2)
+
+    native.combine!(ruby)
+    assert_equal [[1, 1], [1, 2]], native.bins.map{|bin| [bin.count, bin.value.to_i] }
+
+    ruby.combine!(native)
+    assert_equal 3, ruby.total
+    assert_equal [[1, 1], [2, 2]], ruby.bins.map{|bin| [bin.count, bin.value.to_i] }
+  end
+
+  def test_ignores_nan
+    native = ScoutApm::NativeNumericHistogram.new(3)
+    ruby = ScoutApm::NumericHistogram.new(3)
+    [1, Float::NAN, 2, 3, Float::NAN, 4, 5].each { |v| native.add(v); ruby.add(v) }
+
+    assert_equal 5, native.total
+    assert_equal ruby.marshal_dump, native.marshal_dump
+  end
+
+  def test_adds_a_value_count_times
+    native = ScoutApm::NativeNumericHistogram.new(3)
+    ruby = ScoutApm::NumericHistogram.new(3)
+    [[1, 4], [2, 1], [5, 0], [3, 2], [9, 3], [2, 2]].each { |v, count| native.add(v, count); ruby.add(v, count) }
+
+    assert_equal 12, native.total
+    assert_equal ruby.marshal_dump, native.marshal_dump
+  end
+
+  def test_drops_nan_bins_it_is_given
+    native = ScoutApm::NativeNumericHistogram.new(2)
+    ruby = ScoutApm::NumericHistogram.new(5)
+    ruby.add(1)
+    ruby.add(2)
+    ruby.bins << ScoutApm::HistogramBin.new(Float::NAN, 3)
+    ruby.total += 3
+
+    native.add(10)
+    native.combine!(ruby)
+    assert_equal 3, native.total
+    assert_equal 2, native.bins.length
+    assert native.bins.none? { |bin| bin.value.nan? }
+
+    loaded = ScoutApm::NativeNumericHistogram.allocate
+    loaded.marshal_load([5, ruby.bins, ruby.total])
+    assert_equal 2, loaded.total
+    assert_equal [1.0, 2.0], loaded.bins.map(&:value)
+  end
+
+  def test_combine_raises_on_unreadable_bins
+    native = ScoutApm::NativeNumericHistogram.new(5)
+    native.add(1)
+    other = Struct.new(:bins, :total).new([ScoutApm::HistogramBin.new(1.0, "many")], 1)
+
+    assert_raises(TypeError) { native.combine!(other) }
+    assert_equal 1, native.total
+  end
+
+  def test_marshal_round_trip
+    hist = ScoutApm::NativeNumericHistogram.new(5)
+    (1..10).each { |i| hist.add(i) }
+
+    loaded = Marshal.load(Marshal.dump(hist))
+    assert_equal 5, loaded.max_bins
+    assert_equal 10, loaded.total
+    assert_equal hist.as_json, loaded.as_json
+
+    loaded.add(11)
+    assert_equal 11, loaded.total
+    assert_equal 5, loaded.bins.length
+  end
+
+  def test_marshal_dump_matches_ruby_histogram
+    native = ScoutApm::NativeNumericHistogram.new(5)
+    ruby = ScoutApm::NumericHistogram.new(5)
+    (1..10).each { |i| native.add(i); ruby.add(i) }
+
+    assert_equal ruby.marshal_dump, native.marshal_dump
+  end
+
+  def test_mean
+    hist = ScoutApm::NativeNumericHistogram.new(5)
+    10.times {
+      (1..10).to_a.each do |i|
+        hist.add(i)
+      end
+    }
+
+    assert_equal 5.5, hist.mean
+  end
+
+  def assert_same_histogram(expected, actual)
+    assert_equal expected.total, actual.total
+    assert_equal expected.bins.map { |b| [b.value, b.count] },
+      actual.bins.map { |b| [b.value, b.count] }
+  end
+end
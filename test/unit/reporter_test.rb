@@ -0,0 +1,127 @@
+require 'test_helper'
+
+require 'socket'
+require 'scout_apm/reporter'
+
+class ReporterTest < Minitest::Test
+  # Answers every request with a 200, counting the connections it accepts
+  class KeepAliveServer
+    attr_reader :connections, :requests
+
+    def initialize
+      @server = TCPServer.new("127.0.0.1", 0)
+      @connections = 0
+      @requests = 0
+      @thread = Thread.new { loop { serve(@server.accept) } }
+    end
+
+    def host
+      "http://127.0.0.1:#{@server.addr[1]}"
+    end
+
+    def close_client_connections!
+      @clients.each(&:close)
+    end
+
+    # The next request is read, but its connection closed without a response
+    def drop_next_request!
+      @drop_next = true
+    end
+
+    def stop
+      @thread.kill
+      @server.close
+    end
+
+    private
+
+    def serve(client)
+      @connections += 1
+      (@clients ||= []) << client
+      Thread.new do
+        begin
+          while (line = client.gets) && line != "\r\n"
+            length = 0
+            while (header = client.gets) != "\r\n"
+              length = header.split(":").last.to_i if header =~ /\AContent-Length:/i
+            end
+            client.read(length)
+            @requests += 1
+            if @drop_next
+              @drop_next = false
+              client.close
+              break
+            end
+            client.write("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+          end
+        rescue IOError, SystemCallError
+        end
+      end
+    end
+  end
+
+  def setup
+    super
+    @server = KeepAliveServer.new
+    @context = ScoutApm::AgentContext.new
+    @context.config = make_fake_config('key' => 'abc', 'host' => @server.host)
+  end
+
+  def teardown
+    @server.stop
+  end
+
+  def test_connects_for_each_post
+    reporter = ScoutApm::Reporter.new(@context, :checkin)
+
+    assert reporter.post_to_host(@server.host, "1", {})
+    assert reporter.post_to_host(@server.host, "2", {})
+    assert_equal 2, @server.connections
+  end
+
+  def test_keep_alive_reuses_the_connection
+    reporter = ScoutApm::Reporter.new(@context, :checkin).keep_alive!
+
+    3.times { |i| assert reporter.post_to_host(@server.host, i.to_s, {}) }
+    assert_equal 1, @server.connections
+    assert_equal 3, @server.requests
+  ensure
+    reporter.finish_connections
+  end
+
+  def test_keep_alive_reconnects_when_the_server_closed_the_connection
+    reporter = ScoutApm::Reporter.new(@context, :checkin).keep_alive!
+    assert reporter.post_to_host(@server.host, "1", {})
+
+    @server.close_client_connections!
+    assert reporter.post_to_host(@server.host, "2", {})
+    assert_equal 2, @server.connections
+  ensure
+    reporter.finish_connections
+  end
+
+  def test_keep_alive_does_not_send_again_after_the_request_was_sent
+    reporter = ScoutApm::Reporter.new(@context, :checkin).keep_alive!
+    assert reporter.post_to_host(@server.host, "1", {})
+
+    @server.drop_next_request!
+    refute reporter.post_to_host(@server.host, "2", {})
+    assert_equal 2, @server.requests
+
+    assert reporter.post_to_host(@server.host, "3", {})
+    assert_equal 2, @server.connections
+  ensure
+    reporter.finish_connections
+  end
+
+  def test_async_checkins_go_to_the_background_reporter
+    @context.config = make_fake_config('key' => 'abc', 'host' => @server.host, 'async_reporting' => true, 'compress_payload' => false)
+    reporter = ScoutApm::Reporter.new(@context, :checkin)
+    @context.background_reporter.expects(:report).with([@server.host], "payload", {})
+
+    assert reporter.async?
+    assert !reporter.stream_payload?
+    reporter.report("payload")
+    assert_equal 0, @server.connections
+  end
+end
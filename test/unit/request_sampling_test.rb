@@ -0,0 +1,242 @@
+require 'test_helper'
+
+require 'scout_apm/request_sampling'
+
+class RequestSamplingTest < Minitest::Test
+  class TrackingStore < ScoutApm::FakeStore
+    attr_reader :metrics, :jobs
+
+    def initialize
+      @metrics = {}
+      @jobs = []
+    end
+
+    def track!(metrics, options = {})
+      metrics.each { |meta, stat| (@metrics[meta] ||= ScoutApm::MetricStats.new(stat.instance_variable_get(:@scoped))).combine!(stat) }
+    end
+
+    def track_job!(job)
+      @jobs << job
+    end
+
+    def stat(name, scope = nil)
+      @metrics.find { |meta, _| meta.metric_name == name && meta.scope == scope }.last
+    end
+  end
+
+  class RecordingRecorder
+    def record!(request)
+      request.record!
+    end
+  end
+
+  # Starts and stops at fixed times, in milliseconds
+  class TimedLayer < ScoutApm::Layer
+    def initialize(type, name, start_ms, stop_ms)
+      super(type, name)
+      @start_ns = start_ms * 1_000_000
+      @stop_at_ns = stop_ms * 1_000_000
+    end
+
+    def record_stop_time!(stop_time = nil)
+      super
+      @stop_ns = @stop_at_ns
+    end
+  end
+
+  def setup
+    super
+    @context = ScoutApm::AgentContext.new
+  end
+
+  def test_traces_every_request_by_default
+    @context.config = make_fake_config({})
+
+    assert_equal 1, @context.request_sampling.sample
+    assert_equal [1], 10.times.map { @context.request_sampling.start_request }.uniq
+  end
+
+  def test_traces_one_in_sample
+    @context.config = make_fake_config('request_sample' => 5)
+    sampling = @context.request_sampling
+
+    weights = 500.times.map { sampling.start_request }
+    assert_equal [5, nil], weights.uniq.sort_by(&:to_i).reverse
+    assert_in_delta 100, weights.compact.length, 50
+  end
+
+  def test_adapts_sample_to_overhead_budget
+    @context.config = make_fake_config('request_sample_overhead_budget' => 2)
+    sampling = @context.request_sampling
+
+    # Traced requests cost 10% of their time, untraced ones 0.5%
+    100.times { sampling.observe(true, 10_000_000, 0.1) }
+    100.times { sampling.observe(false, 500_000, 0.1) }
+    assert_equal 1, sampling.sample
+
+    sampling.stubs(:adapt_interval_passed?).returns(true)
+    sampling.observe(false, 500_000, 0.1)
+
+    # 0.5% + 9.5% / 7 is within 2%, 0.5% + 9.5% / 6 isn't
+    assert_equal 7, sampling.sample
+  end
+
+  def test_adapting_stays_within_configured_sample_and_max
+    @context.config = make_fake_config('request_sample' => 3, 'request_sample_overhead_budget' => 50)
+    sampling = @context.request_sampling
+    sampling.stubs(:adapt_interval_passed?).returns(true)
+
+    sampling.observe(true, 1_000_000, 1.0)
+    assert_equal 3, sampling.sample
+
+    sampling.stubs(:adapt_interval_passed?).returns(false)
+    sampling.observe(false, 600_000_000, 1.0)
+    sampling.stubs(:adapt_interval_passed?).returns(true)
+    sampling.observe(true, 900_000_000, 1.0)
+    assert_equal ScoutApm::RequestSampling::MAX_SAMPLE, sampling.sample
+  end
+
+  def test_untraced_request_skips_layers_under_the_controller
+    req = request_sampled_at(nil)
+    req.start_layer(ScoutApm::Layer.new("Middleware", "Rack"))
+    req.start_layer(controller = ScoutApm::Layer.new("Controller", "users/index"))
+    req.start_layer(ScoutApm::Layer.new("ActiveRecord", "User#find"))
+
+    assert_nil req.current_layer
+    req.start_layer(ScoutApm::Layer.new("View", "users/index"))
+    req.stop_layer
+    req.stop_layer
+    assert_equal controller, req.current_layer
+    assert_equal [], controller.children.to_a
+    req.stop_layer
+    req.stop_layer
+
+    assert req.recorded?
+    assert !req.sampled?
+  end
+
+  def test_untraced_request_records_only_the_controller_metric
+    store = TrackingStore.new
+    req = request_sampled_at(nil, store)
+    web_request(req)
+
+    assert_equal ["Controller/users/index"], store.metrics.keys.map(&:metric_name)
+    assert_equal 1, store.stat("Controller/users/index").call_count
+  end
+
+  def test_traced_request_scales_metrics_under_the_controller
+    store = TrackingStore.new
+    req = request_sampled_at(4, store)
+    web_request(req)
+
+    assert_equal 1, store.stat("Controller/users/index").call_count
+    assert_equal 8, store.stat("ActiveRecord", "Controller/users/index").call_count
+    assert_equal 4, store.stat("View", "Controller/users/index").call_count
+  end
+
+  # With 1 in 4 traced, the breakdown of 4 requests comes out as it does with
+  # every one traced. Untraced requests don't count all of their time as the
+  # Controller's own.
+  def test_breakdown_matches_tracing_every_request
+    every = TrackingStore.new
+    4.times { timed_web_request(request_sampled_at(1, every)) }
+
+    sampled = TrackingStore.new
+    timed_web_request(request_sampled_at(4, sampled))
+    3.times { timed_web_request(request_sampled_at(nil, sampled)) }
+
+    [["Controller/users/index", nil], ["ActiveRecord", "Controller/users/index"], ["View", "Controller/users/index"]].each do |name, scope|
+      expected, actual = every.stat(name, scope), sampled.stat(name, scope)
+      assert_equal expected.call_count, actual.call_count, name
+      assert_in_delta expected.total_call_time, actual.total_call_time, 1e-9, name
+      assert_in_delta expected.total_exclusive_time, actual.total_exclusive_time, 1e-9, name
+    end
+    assert_in_delta 0.16, sampled.stat("Controller/users/index").total_exclusive_time, 1e-9
+  end
+
+  def test_untraced_jobs_leave_out_their_exclusive_time
+    store = TrackingStore.new
+    job_request(request_sampled_at(nil, store))
+    job_request(request_sampled_at(2, store))
+
+    assert_equal [0, 2], store.jobs.map { |job| job.exclusive_time.total }
+  end
+
+  def test_traced_job_scales_its_metrics
+    store = TrackingStore.new
+    req = request_sampled_at(4, store)
+    req.annotate_request(:queue_latency => 1.5)
+    req.start_layer(ScoutApm::Layer.new("Queue", "default"))
+    req.start_layer(ScoutApm::Layer.new("Job", "InvoiceMailer"))
+    req.start_layer(ScoutApm::Layer.new("ActiveRecord", "Invoice#find"))
+    req.stop_layer
+    req.stop_layer
+    req.stop_layer
+
+    job = store.jobs.first
+    assert_equal 1, job.run_count
+    assert_equal 4, job.metric_set.metrics.find { |meta, _| meta.metric_name == "ActiveRecord/all" }.last.call_count
+    assert_equal 1, job.metric_set.metrics.find { |meta, _| meta.metric_name == "Latency/all" }.last.call_count
+  end
+
+  def test_instant_requests_are_always_traced
+    req = request_sampled_at(nil)
+    req.instant_key = "abc"
+    req.start_layer(ScoutApm::Layer.new("Controller", "users/index"))
+
+    assert req.sampled?
+  end
+
+  def test_instant_requests_are_traced_once_the_key_is_known
+    req = request_sampled_at(nil)
+    req.start_layer(ScoutApm::Layer.new("Middleware", "Summary"))
+    refute req.sampled?
+
+    req.instant_key = "abc"
+    req.start_layer(ScoutApm::Layer.new("Controller", "users/index"))
+    req.start_layer(ScoutApm::Layer.new("ActiveRecord", "User#find"))
+
+    assert req.sampled?
+    assert_equal 1, req.sample_weight
+    assert_equal "ActiveRecord", req.current_layer.type
+  end
+
+  private
+
+  def request_sampled_at(weight, store = ScoutApm::FakeStore.new)
+    @context.config = make_fake_config({})
+    @context.recorder = RecordingRecorder.new
+    @context.request_sampling.stubs(:start_request).returns(weight)
+    ScoutApm::TrackedRequest.new(@context, store)
+  end
+
+  # A 100ms request, 40ms of it in the Controller itself
+  def timed_web_request(req)
+    req.start_layer(TimedLayer.new("Controller", "users/index", 0, 100))
+    [[10, 30], [40, 50]].each do |start_ms, stop_ms|
+      req.start_layer(TimedLayer.new("ActiveRecord", "User#find", start_ms, stop_ms))
+      req.stop_layer
+    end
+    req.start_layer(TimedLayer.new("View", "users/index", 60, 90))
+    req.stop_layer
+    req.stop_layer
+  end
+
+  def job_request(req)
+    req.start_layer(ScoutApm::Layer.new("Queue", "default"))
+    req.start_layer(ScoutApm::Layer.new("Job", "InvoiceMailer"))
+    req.stop_layer
+    req.stop_layer
+  end
+
+  def web_request(req)
+    req.start_layer(ScoutApm::Layer.new("Controller", "users/index"))
+    2.times do
+      req.start_layer(ScoutApm::Layer.new("ActiveRecord", "User#find"))
+      req.stop_layer
+    end
+    req.start_layer(ScoutApm::Layer.new("View", "users/index"))
+    req.stop_layer
+    req.stop_layer
+  end
+end
@@ -0,0 +1,90 @@
+require 'test_helper'
+
+class RusageTest < Minitest::Test
+  def test_maxrss_matches_rusage
+    assert_in_delta ::Process.rusage.maxrss, ::Process.rusage_maxrss, 1024
+    assert ::Process.rusage_maxrss > 0
+  end
+
+  def test_current_rss_goes_down_when_memory_is_released
+    skip "Current RSS not supported" unless ::Process.current_rss
+
+    before = ::Process.current_rss
+    buffer = "a" * 50_000_000
+    grown = ::Process.current_rss
+    buffer = nil
+    GC.start
+
+    assert grown - before >= 40_000_000
+    assert ::Process.current_rss < grown
+  end
+
+  def test_memory_delta_can_be_negative
+    skip "Current RSS not supported" unless ::Process.current_rss
+
+    memory = ScoutApm::Instruments::Process::ProcessMemory.new(ScoutApm::AgentContext.new)
+    buffer = "a" * 50_000_000
+    before = memory.rss
+    buffer = nil
+    GC.start
+
+    assert memory.rss_to_mb(memory.rss - before) < -40
+  end
+
+  def test_cpu_times
+    utime, stime = ::Process.rusage_cpu_times
+    usage = ::Process.rusage
+
+    assert_kind_of Float, utime
+    assert_kind_of Float, stime
+    assert utime <= usage.utime
+    assert stime <= usage.stime
+  end
+
+  def test_rusage_into_fills_existing_struct
+    buffer = ::Process.rusage
+    buffer.maxrss = 0
+    buffer.utime = -1.0
+
+    assert_same buffer, ::Process.rusage_into(buffer)
+    assert buffer.maxrss > 0
+    assert buffer.utime >= 0
+  end
+
+  def test_rusage_into_rejects_other_objects
+    assert_raises(TypeError) { ::Process.rusage_into(Object.new) }
+  end
+
+  def test_thread_cpu_time_is_per_thread
+    skip "Per-thread CPU time not supported" unless ::Process.thread_cpu_time_supported?
+
+    before = ::Process.thread_cpu_time
+    busy = Thread.new { spin(0.05); ::Process.thread_cpu_time }.value
+
+    assert busy >= 0.04
+    assert ::Process.thread_cpu_time - before < busy
+  end
+
+  def test_thread_rusage
+    skip "RUSAGE_THREAD not supported" unless ::Process.respond_to?(:thread_rusage)
+
+    assert ::Process.thread_rusage.utime <= ::Process.rusage.utime
+  end
+
+  def test_layer_cpu_time_excludes_sleep
+    skip "Per-thread CPU time not supported" unless ::Process.thread_cpu_time_supported?
+
+    layer = ScoutApm::Layer.new("Controller", "users/index")
+    sleep 0.05
+    layer.record_stop_time!
+    layer.record_cpu_time!
+
+    assert layer.total_cpu_time < 0.04
+    assert layer.total_call_time >= 0.05
+  end
+
+  def spin(seconds)
+    stop = ::Process.thread_cpu_time + seconds
+    nil while ::Process.thread_cpu_time < stop
+  end
+end
@@ -62,4 +62,72 @@ class ScoredItemSetTest < Minitest::Test
     assert set.to_a.include?("called_12_posts/index"),  "Expected to see posts/index in #{set.to_a.inspect}"
     assert set.to_a.include?("called_13_posts/move"),   "Expected to see posts/move in #{set.to_a.inspect}"
   end
+
+  def test_replaced_items_move_up_the_heap
+    set = ScoutApm::ScoredItemSet.new(2)
+    set << FakeScoredItem.new("users/index", 1)
+    set << FakeScoredItem.new("users/show", 5)
+    set << FakeScoredItem.new("users/index", 10)
+    set << FakeScoredItem.new("posts/index", 6)
+
+    assert_equal ["called_10_users/index", "called_6_posts/index"], set.to_a
+  end
+
+  def test_matches_scanning_for_the_lowest_score
+    set = ScoutApm::ScoredItemSet.new(10)
+    expected = {}
+    rng = Random.new(42)
+
+    (1..2000).to_a.shuffle(:random => rng).each do |score|
+      item = FakeScoredItem.new("endpoint_#{rng.rand(50)}", score)
+      set << item
+
+      if expected.has_key?(item.name)
+        expected[item.name] = score if score > expected[item.name]
+      elsif expected.size >= 10
+        lowest_name, lowest_score = expected.min_by { |_, s| s }
+        if lowest_score < score
+          expected.delete(lowest_name)
+          expected[item.name] = score
+        end
+      else
+        expected[item.name] = score
+      end
+    end
+
+    assert_equal expected.map { |name, score| "called_#{score}_#{name}" }.sort, set.to_a.sort
+  end
+
+  def test_size_zero_keeps_nothing
+    set = ScoutApm::ScoredItemSet.new(0)
+    set << FakeScoredItem.new("users/index", 10)
+    assert_equal [], set.to_a
+
+    assert_equal 0, ScoutApm::ScoredItemSet.new(-5).max_size
+  end
+
+  def test_ties_evict_the_item_stored_first
+    set = ScoutApm::ScoredItemSet.new(3)
+    set << FakeScoredItem.new("users/index", 1)
+    set << FakeScoredItem.new("users/show", 1)
+    set << FakeScoredItem.new("posts/index", 1)
+    set << FakeScoredItem.new("posts/show", 2)
+    set << FakeScoredItem.new("posts/move", 2)
+
+    assert_equal ["called_1_posts/index", "called_2_posts/show", "called_2_posts/move"], set.to_a
+  end
+
+  def test_rebuilds_heap_of_sets_loaded_with_only_items
+    set = ScoutApm::ScoredItemSet.new(2)
+    set << FakeScoredItem.new("users/index", 10)
+    set << FakeScoredItem.new("users/show", 11)
+    set.remove_instance_variable(:@heap)
+    set.remove_instance_variable(:@slots)
+    set.remove_instance_variable(:@order)
+    set.remove_instance_variable(:@stored)
+
+    set << FakeScoredItem.new("posts/index", 12)
+
+    assert_equal ["called_11_users/show", "called_12_posts/index"], set.to_a
+  end
 end
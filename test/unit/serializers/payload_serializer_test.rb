@@ -1,5 +1,6 @@
 require 'test_helper'
 require 'json' # to deserialize what has been manually serialized by the production code
+require 'stringio'
 
 class PayloadSerializerTest < Minitest::Test
   def test_serializes_metadata_as_json
@@ -107,4 +108,35 @@ class PayloadSerializerTest < Minitest::Test
     json = { "foo" => "\bbar\nbaz\r" }
     assert_equal json, JSON.parse(ScoutApm::Serializers::PayloadSerializerToJson.jsonify_hash(json))
   end
+
+  def test_native_encoder_matches_ruby_encoder
+    hash = {
+      :string => "plain",
+      "escapes" => "\b \t \n \f \r \" \\ \x01 and a much longer run of text before the end\"",
+      :unicode => "caf\u00e9 \u2603",
+      :numbers => [0, -12, 2**70, 1.5, 1.0e-05, Float::INFINITY, Rational(1, 3)],
+      :time => Time.at(1_500_000_000).utc,
+      :nested => { 1 => [nil, true, false, :sym, []], nil => {} },
+      :object => Object,
+    }
+    serializer = ScoutApm::Serializers::PayloadSerializerToJson
+
+    assert_equal serializer.ruby_jsonify_hash(hash), serializer.jsonify_hash(hash)
+    assert_equal Encoding::UTF_8, serializer.jsonify_hash(hash).encoding
+  end
+
+  # Converted values are only held by the encoder while it writes them out,
+  # which can flush to the io and run GC.
+  def test_native_encoder_keeps_converted_values_under_gc_stress
+    hash = { :numbers => Array.new(50) { |i| 2**70 + i }, :time => Time.at(1_500_000_000).utc, :object => Object }
+    io = StringIO.new
+    begin
+      GC.stress = true
+      ScoutApm::Serializers::NativePayloadJson.jsonify_hash(hash, io)
+    ensure
+      GC.stress = false
+    end
+
+    assert_equal ScoutApm::Serializers::PayloadSerializerToJson.ruby_jsonify_hash(hash), io.string
+  end
 end
@@ -0,0 +1,206 @@
+require 'test_helper'
+
+require 'scout_apm/metric_meta'
+require 'scout_apm/metric_stats'
+require 'scout_apm/metric_set'
+require 'scout_apm/store'
+require 'scout_apm/shared_metrics'
+
+class SharedMetricsTest < Minitest::Test
+  SharedMetrics = ScoutApm::SharedMetrics
+
+  class RecordingLayaway
+    attr_reader :rps_written
+    def write_reporting_period(rp)
+      @rps_written ||= []
+      @rps_written << rp
+    end
+  end
+
+  def setup
+    skip "no shared memory" unless SharedMetrics.available? && Process.respond_to?(:fork)
+    @now = ScoutApm::StoreReportingPeriodTimestamp.new
+    @last_minute = ScoutApm::StoreReportingPeriodTimestamp.minutes_ago(1)
+  end
+
+  def test_forked_workers_combine_into_one_view
+    table = SharedMetrics.new(1024)
+    workers = in_children(4) do |worker|
+      500.times { table.add(@last_minute, metric_set("Controller/users/index" => [0.01 * (worker + 1)])) }
+    end
+
+    harvested = table.harvest(@now)
+    stat = harvested[@last_minute].metrics[meta("Controller/users/index")]
+
+    assert_equal [0, 0, 0, 0], workers
+    assert_equal 2000, stat.call_count
+    assert_in_delta 500 * (0.01 + 0.02 + 0.03 + 0.04), stat.total_call_time, 1e-9
+    assert_in_delta 0.01, stat.min_call_time, 1e-9
+    assert_in_delta 0.04, stat.max_call_time, 1e-9
+  end
+
+  # Harvesting while workers add, with few enough slots that they're reused
+  # for other keys, loses and misplaces nothing.
+  def test_harvest_racing_adds_keeps_every_call
+    table = SharedMetrics.new(8)
+    reader, writer = IO.pipe
+    pids = (0...4).map do |worker|
+      fork do
+        reader.close
+        left = 0
+        2000.times do |i|
+          leftovers = table.add(@last_minute, metric_set("Controller/k#{(i + worker) % 12}" => [1.0]))
+          left += leftovers.metrics.values.map(&:call_count).inject(0, :+)
+        end
+        writer.puts(left)
+        exit!(0)
+      end
+    end
+    writer.close
+
+    harvested = Hash.new(0)
+    collect = lambda do
+      table.harvest(@now).each_value do |set|
+        set.metrics.each { |m, stat| harvested[m.metric_name] += stat.call_count }
+      end
+    end
+    until pids.empty?
+      collect.call
+      pids.reject! { |pid| Process.waitpid(pid, Process::WNOHANG) }
+    end
+    collect.call
+    left = reader.read.split.map(&:to_i).inject(0, :+)
+
+    assert_equal 8000, harvested.values.inject(0, :+) + left
+    assert harvested.keys.all? { |name| name =~ /\AController\/k\d+\z/ }
+  ensure
+    reader.close if reader && !reader.closed?
+  end
+
+  # A writer that's stopped partway through adding is waited for, rather than
+  # taken for a dead one and harvested half written.
+  def test_harvest_waits_for_stopped_writers
+    table = SharedMetrics.new(8)
+    pid = fork do
+      5000.times { table.add(@last_minute, metric_set("Controller/users/index" => [1.0])) }
+      exit!(0)
+    end
+
+    stats = []
+    until Process.waitpid(pid, Process::WNOHANG)
+      Process.kill(:STOP, pid) rescue break
+      # harvest holds the GVL while it waits, so the writer's continued from
+      # another process
+      cont = Process.spawn("sleep 0.01; kill -CONT #{pid}")
+      stats.concat(table.harvest(@now).values.map { |set| set.metrics.values }.flatten)
+      Process.wait(cont)
+    end
+    stats.concat(table.harvest(@now).values.map { |set| set.metrics.values }.flatten)
+
+    assert_equal 5000, stats.map(&:call_count).inject(0, :+)
+    stats.each { |stat| assert_in_delta stat.call_count, stat.total_call_time, 1e-9 }
+  end
+
+  def test_matches_keys_as_metric_meta_does
+    table = SharedMetrics.new(64)
+    table.add(@last_minute, metric_set("Controller/Users/Index" => [1.0]))
+    table.add(@last_minute, metric_set("controller/users/index" => [2.0]))
+    table.add(@last_minute, metric_set(["ActiveRecord/all", "Controller/users/index"] => [3.0]))
+
+    metrics = table.harvest(@now)[@last_minute].metrics
+
+    assert_equal 2, metrics.size
+    assert_equal 2, metrics[meta("Controller/users/index")].call_count
+    assert_equal "Controller/users/index", metrics.keys.find { |m| m.scope }.scope
+  end
+
+  def test_harvest_takes_only_earlier_minutes_once
+    table = SharedMetrics.new(64)
+    table.add(@last_minute, metric_set("Controller/a" => [1.0]))
+    table.add(@now, metric_set("Controller/b" => [1.0]))
+
+    assert_equal [@last_minute], table.harvest(@now).keys
+    assert_equal({}, table.harvest(@now))
+    assert_equal [@now], table.harvest(ScoutApm::StoreReportingPeriodTimestamp.new(Time.now + 60)).keys
+  end
+
+  def test_hands_back_what_it_cant_keep
+    table = SharedMetrics.new(1)
+    with_extra = meta("SlowTransaction/Controller/users/index")
+    with_extra.extra[:backtrace] = ["app/models/user.rb:10"]
+    set = metric_set("Controller/a" => [1.0], "Controller/b" => [1.0], "Controller/#{'x' * 200}" => [1.0])
+    set.metrics[with_extra] = stats(1.0)
+
+    leftovers = table.add(@last_minute, set)
+
+    assert_equal ["Controller/b", "Controller/#{'x' * 200}", "SlowTransaction/Controller/users/index"].sort, leftovers.metrics.keys.map(&:metric_name).sort
+    assert_equal 3, table.overflows
+  end
+
+  def test_store_keeps_metrics_in_the_table_and_harvests_them_when_writing
+    table = SharedMetrics.new(1024)
+
+    tracked = in_children(1) do
+      store = store_with(table)
+      store.track_one!("Controller", "users/index", 0.5, :timestamp => @last_minute)
+      exit!(store.instance_variable_get(:@reporting_periods)[@last_minute].metrics_payload.empty? ? 0 : 1)
+    end
+
+    written = in_children(1) do
+      layaway = RecordingLayaway.new
+      store_with(table).write_to_layaway(layaway)
+      metrics = layaway.rps_written.first.metrics_payload
+      exit!(metrics[meta("Controller/users/index")].call_count == 1 ? 0 : 1)
+    end
+
+    assert_equal [0], tracked
+    assert_equal [0], written
+  end
+
+  def test_store_ignores_a_table_it_made
+    table = SharedMetrics.new(16)
+    store = store_with(table)
+    store.track_one!("Controller", "users/index", 0.5)
+
+    assert_equal({}, table.harvest(ScoutApm::StoreReportingPeriodTimestamp.new(Time.now + 60)))
+  end
+
+  # Runs the block in count children at once, returning their exit statuses
+  def in_children(count)
+    pids = (0...count).map do |i|
+      fork do
+        begin
+          yield i
+          exit!(0)
+        rescue Exception
+          exit!(2)
+        end
+      end
+    end
+    pids.map { |pid| Process.wait(pid); $?.exitstatus }
+  end
+
+  def store_with(table)
+    context = ScoutApm::AgentContext.new
+    context.shared_metrics = table
+    ScoutApm::Store.new(context)
+  end
+
+  def meta(name, scope = nil)
+    ScoutApm::MetricMeta.new(name, :scope => scope)
+  end
+
+  def stats(*times)
+    stat = ScoutApm::MetricStats.new
+    times.each { |t| stat.update!(t) }
+    stat
+  end
+
+  def metric_set(metrics)
+    set = ScoutApm::MetricSet.new
+    metrics.each do |(name, scope), times|
+      set.metrics[meta(name, scope)] = stats(*times)
+    end
+    set
+  end
+end
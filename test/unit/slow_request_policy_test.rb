@@ -7,12 +7,13 @@ class FakeRequest
   def initialize(name)
     @name = name
     @root_layer = ScoutApm::Layer.new("Controller", name)
-    @root_layer.instance_variable_set("@stop_time", Time.now)
+    @root_layer.record_stop_time!
   end
   def unique_name; "Controller/foo/bar"; end
   def root_layer; @root_layer; end
   def set_duration(seconds)
-    @root_layer.instance_variable_set("@start_time", Time.now - seconds)
+    stop_ns = @root_layer.instance_variable_get("@stop_ns")
+    @root_layer.instance_variable_set("@start_ns", stop_ns - (seconds * 1_000_000_000).to_i)
   end
 end
 
@@ -93,6 +93,51 @@ module ScoutApm
         assert_equal %q|SELECT `blogs`.* FROM `blogs` WHERE (title = ?)|, ss.to_s
       end
 
+      # Cases where the order of the regex passes matters
+      TRICKY_SQL = [
+        %q{SELECT * FROM "t" WHERE a = 'it''s' AND b = 'x'||'y' LIMIT 5 OFFSET 10},
+        %q|SELECT * FROM t WHERE a = 'unclosed AND b = 1|,
+        %q|SELECT * FROM t WHERE a = "say 'hi'" AND b = 'a "quoted" word'|,
+        %q|SELECT * FROM t WHERE a = 'b\\'c' AND d = "e\\"f" AND g = "it's|,
+        %q|SELECT * FROM t WHERE a IN ('x)', 2, $1) AND b IN (?, ?) AND c JOIN (?)|,
+        %q|SELECT * FROM t1 WHERE x2 = 3y AND _4 = 5_ AND 6 = '7'8|,
+        %Q|SELECT *\n  FROM t\t WHERE a = $12 [[x]]\n\n  AND b = 1 [["a", 1]]  \n|,
+        %q|SELECT [[a]] b]] FROM t [[ WHERE a = 1|,
+        %q|  ?,?,? IN  (?,?) ?,?,x  |,
+        "SELECT * FROM t WHERE name = 'caf\u00e9' AND \u00e91 = 2 LIMIT 3",
+      ]
+
+      def test_native_sanitizer_matches_regexes
+        TRICKY_SQL.each do |sql|
+          [:postgres, :mysql, :sqlite].each do |engine|
+            expected = SqlSanitizer.new(sql.dup).tap{ |it| it.database_engine = engine }.send("to_s_#{engine}")
+            assert_equal expected, NativeSqlSanitizer.sanitize(sql, engine), "#{engine}: #{sql}"
+          end
+        end
+      end
+
+      def test_native_sanitizer_leaves_other_encodings_to_regexes
+        assert_nil NativeSqlSanitizer.sanitize("SELECT 1".encode('UTF-16LE'), :postgres)
+        assert_equal "SELECT ?", NativeSqlSanitizer.sanitize("SELECT 1".encode('ISO-8859-1'), :postgres)
+      end
+
+      def test_shares_sanitized_sql_between_instances
+        context = ScoutApm::Agent.instance.context
+        previous = context.instance_variable_get(:@sql_cache)
+        context.instance_variable_set(:@sql_cache, SqlCache.new(10))
+
+        sql = %q|SELECT "users".* FROM "users" WHERE "users"."id" = 42|
+        first = SqlSanitizer.new(sql).tap{ |it| it.database_engine = :postgres }.to_s
+        second = SqlSanitizer.new(sql.dup).tap{ |it| it.database_engine = :postgres }.to_s
+
+        assert_equal %q|SELECT "users".* FROM "users" WHERE "users"."id" = ?|, second
+        assert_same first, second
+        assert_equal %q|SELECT `users`.* FROM `users` WHERE `users`.`id` = ?|, SqlSanitizer.new(sql.tr('"', '`')).tap{ |it| it.database_engine = :mysql }.to_s
+        assert_equal 1, context.sql_cache.hits
+      ensure
+        context.instance_variable_set(:@sql_cache, previous)
+      end
+
       def assert_faster_than(target_seconds)
         t1 = ::Time.now
         yield
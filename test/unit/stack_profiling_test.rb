@@ -0,0 +1,138 @@
+require 'test_helper'
+
+require 'scout_apm/stack_profiling'
+
+class StackProfilingTest < Minitest::Test
+  def setup
+    super
+    skip "Stack profiling not available" unless defined?(ScoutApm::NativeStackProfile)
+  end
+
+  def teardown
+    ScoutApm::NativeStackProfile.stop_timer if defined?(ScoutApm::NativeStackProfile)
+    super
+  end
+
+  def test_disabled_by_default
+    profiling = ScoutApm::StackProfiling.new(context_with({}))
+
+    assert_false profiling.enabled?
+    assert_nil profiling.start_request
+    assert_equal [], profiling.stacks(nil)
+  end
+
+  def test_samples_only_the_request_thread
+    profiling = ScoutApm::StackProfiling.new(profiling_context)
+    profile = profiling.start_request
+    assert profile.started?
+
+    sample_in_nested_method
+    Thread.new { ScoutApm::NativeStackProfile.sample }.join
+    profiling.stop_request(profile)
+    ScoutApm::NativeStackProfile.sample
+
+    assert_false profile.started?
+    assert_equal 1, profile.taken
+  end
+
+  def test_stacks_are_relative_to_app_root_and_outermost_first
+    profiling = ScoutApm::StackProfiling.new(profiling_context)
+    profile = profiling.start_request
+    2.times { sample_in_nested_method }
+    profiling.stop_request(profile)
+
+    stacks = profiling.stacks(profile)
+    assert_equal 1, stacks.length
+    assert_equal 2, stacks[0][:samples]
+    assert_in_delta 120.0, stacks[0][:time], 0.0001
+
+    frames = stacks[0][:stack]
+    outer = frames.index { |f| f =~ /\A#{File.basename(__FILE__)}:\d+:in .*sample_in_nested_method/ }
+    inner = frames.index { |f| f =~ /\A#{File.basename(__FILE__)}:\d+:in .*nested_sample/ }
+    assert outer && inner
+    assert outer < inner
+  end
+
+  def test_keeps_the_latest_samples_once_full
+    profile = ScoutApm::NativeStackProfile.new(3, 8)
+    profile.start
+    5.times { ScoutApm::NativeStackProfile.sample }
+    profile.stop
+
+    assert_equal 5, profile.taken
+    assert_equal 3, profile.stacks.map { |_, count| count }.inject(:+)
+  end
+
+  def test_start_drops_earlier_samples
+    profile = ScoutApm::NativeStackProfile.new(3, 8)
+    profile.start
+    ScoutApm::NativeStackProfile.sample
+    profile.stop
+    profile.start
+    profile.stop
+
+    assert_equal 0, profile.taken
+    assert_equal [], profile.stacks
+  end
+
+  def test_reuses_released_profiles
+    profiling = ScoutApm::StackProfiling.new(profiling_context)
+    profile = profiling.start_request
+    profiling.stop_request(profile)
+    profiling.release(profile)
+
+    assert_same profile, profiling.start_request
+    profiling.stop_request(profile)
+  end
+
+  def test_a_thread_samples_into_its_latest_profile
+    first = ScoutApm::NativeStackProfile.new(3, 8)
+    second = ScoutApm::NativeStackProfile.new(3, 8)
+    first.start
+    second.start
+    ScoutApm::NativeStackProfile.sample
+    second.stop
+
+    assert_false first.started?
+    assert_equal 0, first.taken
+    assert_equal 1, second.taken
+  end
+
+  def test_timed_samples_land_in_the_profile
+    profiling = ScoutApm::StackProfiling.new(profiling_context('stack_profiling_interval' => 1))
+    profile = profiling.start_request
+
+    stop_at = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 2
+    spin while profile.taken == 0 && Process.clock_gettime(Process::CLOCK_MONOTONIC) < stop_at
+    profiling.stop_request(profile)
+
+    assert profile.taken > 0
+  end
+
+  private
+
+  def sample_in_nested_method
+    nested_sample
+  end
+
+  def nested_sample
+    ScoutApm::NativeStackProfile.sample
+  end
+
+  def spin
+    1000.times { |i| i * i }
+  end
+
+  # A long interval, so only the samples taken by hand are seen
+  def profiling_context(config = {})
+    context = context_with({'stack_profiling' => true, 'stack_profiling_interval' => 60_000}.merge(config))
+    context.environment = make_fake_environment(:root => File.dirname(__FILE__))
+    context
+  end
+
+  def context_with(config)
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config(config)
+    context
+  end
+end
@@ -38,6 +38,29 @@ class StoreTest < Minitest::Test
 
     assert_equal({}, s.instance_variable_get('@reporting_periods'))
   end
+
+  def test_metrics_tracked_by_many_threads_are_merged_when_written
+    s = ScoutApm::Store.new(ScoutApm::AgentContext.new)
+    threads = (1..8).map { Thread.new { 100.times { s.track_one!("Controller", "user/show", 1) } } }
+    threads.each(&:join)
+    layaway = FakeFailingLayaway.new
+
+    s.write_to_layaway(layaway, true)
+
+    meta = ScoutApm::MetricMeta.new("Controller/user/show")
+    assert_equal 800, layaway.rps_written.map { |rp| rp.metrics_payload[meta].call_count }.inject(:+)
+  end
+
+  def test_writing_drops_buffers_of_dead_threads
+    s = ScoutApm::Store.new(ScoutApm::AgentContext.new)
+    Thread.new { s.track_one!("Controller", "user/show", 1) }.join
+    s.track_one!("Controller", "user/index", 1)
+    assert_equal 2, s.instance_variable_get('@thread_buffers').size
+
+    s.write_to_layaway(FakeFailingLayaway.new, true)
+
+    assert_equal 1, s.instance_variable_get('@thread_buffers').size
+  end
 end
 
 class StoreReportingPeriodTest < Minitest::Test
@@ -57,6 +80,23 @@ class StoreReportingPeriodTest < Minitest::Test
     assert_equal ScoutApm::MetricSet.new, subject.metric_set
   end
 
+  def test_trace_limit_from_config
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config('max_traces' => 25)
+    period = ScoutApm::StoreReportingPeriod.new(ScoutApm::StoreReportingPeriodTimestamp.new(Time.now), context)
+
+    assert_equal 25, period.request_traces.max_size
+    assert_equal 25, period.job_traces.max_size
+  end
+
+  def test_negative_trace_limit_keeps_no_traces
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config('max_traces' => -1)
+    period = ScoutApm::StoreReportingPeriod.new(ScoutApm::StoreReportingPeriodTimestamp.new(Time.now), context)
+
+    assert_equal 0, period.request_traces.max_size
+  end
+
   def test_merge_histograms
     histogramFoo1 = histogram
     histogramFoo2 = histogram
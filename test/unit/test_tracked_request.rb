@@ -48,4 +48,66 @@ class TrackedRequestLayerManipulationTest < Minitest::Test
 
     assert_equal "Controller", tr.current_layer.type
   end
+
+  def test_only_root_layer_keeps_wall_clock_times
+    controller_layer = ScoutApm::Layer.new("Controller", "users/index")
+    ar_layer = ScoutApm::Layer.new("ActiveRecord", "Users#find")
+
+    tr = ScoutApm::TrackedRequest.new(ScoutApm::AgentContext.new, ScoutApm::FakeStore.new)
+    tr.start_layer(controller_layer)
+    tr.start_layer(ar_layer)
+    tr.stop_layer
+
+    assert_kind_of Time, controller_layer.start_time
+    assert_nil ar_layer.start_time
+    assert_nil ar_layer.stop_time
+    assert ar_layer.total_call_time >= 0
+    assert ar_layer.total_call_time <= controller_layer.total_call_time
+  end
+end
+
+class TrackedRequestStackProfilingTest < Minitest::Test
+  # Builds the request's slow transaction as it's recorded
+  class SlowTransactionRecorder
+    attr_reader :trace
+
+    def initialize(context)
+      @context = context
+    end
+
+    def record!(request)
+      converter = ScoutApm::LayerConverters::SlowRequestConverter.new(@context, request, request.layer_finder, ScoutApm::FakeStore.new)
+      @trace = converter.call
+      request.record!
+    end
+  end
+
+  def setup
+    super
+    skip "Stack profiling not available" unless defined?(ScoutApm::NativeStackProfile)
+  end
+
+  def teardown
+    ScoutApm::NativeStackProfile.stop_timer if defined?(ScoutApm::NativeStackProfile)
+    super
+  end
+
+  def test_slow_transaction_carries_the_stack_samples
+    context = ScoutApm::AgentContext.new
+    context.config = make_fake_config('stack_profiling' => true, 'stack_profiling_interval' => 60_000)
+    context.recorder = recorder = SlowTransactionRecorder.new(context)
+
+    tr = ScoutApm::TrackedRequest.new(context, ScoutApm::FakeStore.new)
+    tr.start_layer(ScoutApm::Layer.new("Controller", "users/index"))
+    profile = tr.stack_profile
+    ScoutApm::NativeStackProfile.sample
+    tr.stop_layer
+
+    assert_equal 1, recorder.trace.prof.length
+    assert recorder.trace.prof[0][:stack].any? { |f| f.include?("#{File.basename(__FILE__)}:") }
+
+    # Back in the pool once recorded
+    assert_nil tr.stack_profile
+    assert_same profile, context.stack_profiling.start_request
+  end
 end
@@ -1,5 +1,6 @@
 require_relative '../../test_helper'
 require 'scout_apm/utils/backtrace_parser'
+require 'tmpdir'
 
 class BacktraceParserTest < Minitest::Test
 
@@ -14,6 +15,41 @@ class BacktraceParserTest < Minitest::Test
     count.times.map {|i| "#{root}/app/controllers/best_#{i}_controller.rb"}
   end
 
+  FIXTURE = <<-RUBY
+    module BacktraceFixture
+      def self.outer(depth, &block)
+        depth > 0 ? outer(depth - 1, &block) : inner(&block)
+      end
+
+      def self.inner
+        [1].map { yield }.first
+      end
+    end
+  RUBY
+
+  # Loads BacktraceFixture from app/models under a new app root
+  def with_fixture_app
+    skip "backtrace_frames extension isn't built" unless defined?(ScoutApm::NativeBacktraceFrames.capture)
+
+    Dir.mktmpdir do |dir|
+      app_root = File.realpath(dir)
+      FileUtils.mkdir_p("#{app_root}/app/models")
+      File.write("#{app_root}/app/models/backtrace_fixture.rb", FIXTURE)
+      load "#{app_root}/app/models/backtrace_fixture.rb"
+      yield app_root
+    end
+  end
+
+  # Skips this method's own frame, as BacktraceParser.capture does
+  def capture(app_root, skip, limit)
+    ScoutApm::NativeBacktraceFrames.capture(app_root, skip + 1, limit, ScoutApm::Utils::BacktraceParser::APP_FRAMES)
+  end
+
+  # path:line, leaving out the label, which differs for blocks
+  def locations(frames)
+    frames.map { |f| f[/\A[^:]+:\d+/] }
+  end
+
   ################################################################################
   # Tests
 
@@ -68,4 +104,53 @@ class BacktraceParserTest < Minitest::Test
     assert_equal false, (result[0] =~ %r|app/controllers/users_controller.rb|).nil?
     assert_equal false, (result[1] =~ %r|config/initializers/inject_something.rb|).nil?
   end
+
+  def test_capture_matches_parsing_caller
+    with_fixture_app do |app_root|
+      captured = parsed = nil
+      BacktraceFixture.outer(2) do
+        captured, parsed = capture(app_root, 0, 50), caller(0...50)
+      end
+      parsed = parsed.grep(%r|\A#{app_root}/app/|).map { |c| c.sub("#{app_root}/", "") }
+
+      assert_equal 6, captured.length
+      assert_equal locations(parsed), locations(captured)
+      assert captured.any? { |f| f =~ %r|\Aapp/models/backtrace_fixture.rb:\d+:in .map'\z| }
+    end
+  end
+
+  def test_capture_maxes_at_APP_FRAMES
+    with_fixture_app do |app_root|
+      captured = BacktraceFixture.outer(20) { capture(app_root, 0, 50) }
+
+      assert_equal ScoutApm::Utils::BacktraceParser::APP_FRAMES, captured.length
+    end
+  end
+
+  def test_capture_honors_limit
+    with_fixture_app do |app_root|
+      captured, expected = BacktraceFixture.outer(20) { [capture(app_root, 0, 4), caller(0...4)] }
+
+      assert_equal expected.grep(%r|\A#{app_root}/app/|).length, captured.length
+      assert captured.length < ScoutApm::Utils::BacktraceParser::APP_FRAMES
+    end
+  end
+
+  def test_capture_with_no_in_app_frames
+    with_fixture_app do |app_root|
+      captured = BacktraceFixture.outer(2) { capture("#{app_root}/other", 0, 50) }
+
+      assert_equal [], captured
+    end
+  end
+
+  def test_capture_reuses_frames_from_the_same_call_site
+    with_fixture_app do |app_root|
+      first, second = 2.times.map { BacktraceFixture.outer(2) { capture(app_root, 0, 50) } }
+
+      assert_equal first, second
+      first.zip(second).each { |a, b| assert_same a, b }
+      assert first.all?(&:frozen?)
+    end
+  end
 end
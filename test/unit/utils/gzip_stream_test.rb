@@ -0,0 +1,81 @@
+require 'test_helper'
+
+require 'zlib'
+require 'stringio'
+require 'scout_apm/utils/gzip_helper'
+require 'scout_apm/utils/gzip_stream'
+
+class GzipStreamTest < Minitest::Test
+  GzipStream = ScoutApm::Utils::GzipStream
+
+  def test_reads_gzip_of_what_was_written
+    stream = GzipStream.new { |io| 1000.times { |i| io.write("line #{i}\n") } }
+    compressed = read_all(stream, 1024)
+
+    assert_equal (0...1000).map { |i| "line #{i}\n" }.join, gunzip(compressed)
+    assert_equal 8890, stream.bytes_written
+  end
+
+  def test_writer_only_runs_as_far_as_reads_need
+    written = 0
+    stream = GzipStream.new do |io|
+      1000.times do
+        chunk = Random.new(written).bytes(1024) # incompressible
+        written += chunk.bytesize
+        io.write(chunk)
+      end
+    end
+
+    stream.read(1024)
+    assert written < 100 * 1024
+
+    read_all(stream, 1024)
+    assert_equal 1000 * 1024, written
+  end
+
+  def test_read_follows_io_semantics
+    stream = GzipStream.new { |io| io.write("hello") }
+    buffer = ""
+    data = stream.read(nil)
+
+    assert_equal "hello", gunzip(data)
+    assert_equal "", stream.read
+    assert_nil stream.read(10, buffer)
+    assert_equal "", buffer
+    assert stream.eof?
+  end
+
+  def test_serialize_to_streams_the_same_payload
+    metadata = { :app_root => "/srv/app", :agent_time => "now" }
+    serializer = ScoutApm::Serializers::PayloadSerializerToJson
+    expected = serializer.serialize(metadata.dup, {}, {}, [], [], [], {})
+
+    stream = GzipStream.new { |io| serializer.serialize_to(io, metadata.dup, {}, {}, [], [], [], {}) }
+    assert_equal expected, gunzip(read_all(stream, 1024))
+  end
+
+  def test_native_encoder_writes_in_chunks
+    hash = { :metrics => (1..5000).map { |i| { :name => "User#find #{i}" } } }
+    io = StringIO.new
+    writes = 0
+    io.define_singleton_method(:write) { |data| writes += 1; super(data) }
+
+    ScoutApm::Serializers::NativePayloadJson.jsonify_hash(hash, io)
+
+    assert_equal ScoutApm::Serializers::PayloadSerializerToJson.jsonify_hash(hash), io.string
+    assert writes > 1
+  end
+
+  def read_all(stream, length)
+    data = ""
+    data.force_encoding(Encoding::BINARY)
+    while (chunk = stream.read(length))
+      data << chunk
+    end
+    data
+  end
+
+  def gunzip(data)
+    Zlib::GzipReader.new(StringIO.new(data)).read
+  end
+end
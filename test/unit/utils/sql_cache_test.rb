@@ -0,0 +1,65 @@
+require_relative '../../test_helper'
+require 'scout_apm/utils/sql_cache'
+
+class SqlCacheTest < Minitest::Test
+  SqlCache = ScoutApm::Utils::SqlCache
+
+  def test_reuses_results_and_counts_lookups
+    cache = SqlCache.new(10)
+    calls = 0
+
+    3.times { cache.fetch(:postgres, "SELECT 1") { calls += 1; "SELECT ?" } }
+
+    assert_equal 1, calls
+    assert_equal 2, cache.hits
+    assert_equal 1, cache.misses
+    assert cache.fetch(:postgres, "SELECT 1") { flunk }.frozen?
+  end
+
+  def test_keeps_kinds_apart
+    cache = SqlCache.new(10)
+
+    assert_equal "SELECT ?", cache.fetch(:postgres, "SELECT 1") { "SELECT ?" }
+    assert_equal "SQL/other", cache.fetch(:metric_name, "SELECT 1") { "SQL/other" }
+    assert_equal 2, cache.misses
+  end
+
+  def test_evicts_least_recently_used
+    cache = SqlCache.new(2)
+    cache.fetch(:mysql, "a") { "1" }
+    cache.fetch(:mysql, "b") { "2" }
+    cache.fetch(:mysql, "a") { flunk }
+    cache.fetch(:mysql, "c") { "3" }
+
+    assert_equal 2, cache.size
+    assert_equal "1", cache.fetch(:mysql, "a") { flunk }
+    assert_equal "new", cache.fetch(:mysql, "b") { "new" }
+  end
+
+  def test_caps_memory
+    cache = SqlCache.new(100, 1000)
+    20.times { |i| cache.fetch(:mysql, "#{i}" * 50) { "?" } }
+
+    assert cache.bytes <= 1000
+    assert cache.size < 20
+  end
+
+  def test_skips_long_statements
+    cache = SqlCache.new(10)
+    sql = "x" * (ScoutApm::Utils::SqlSanitizer::MAX_SQL_LENGTH + 1)
+    2.times { cache.fetch(:mysql, sql) { "" } }
+
+    assert_equal 0, cache.size
+    assert_equal 0, cache.misses
+  end
+
+  def test_copes_with_mutated_sql
+    cache = SqlCache.new(10)
+    sql = "SELECT 1"
+    cache.fetch(:mysql, sql) { "SELECT ?" }
+    sql << "0"
+
+    assert_equal "changed", cache.fetch(:mysql, sql) { "changed" }
+    assert_equal "SELECT ?", cache.fetch(:mysql, "SELECT 1") { flunk }
+  end
+end